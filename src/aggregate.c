@@ -0,0 +1,332 @@
+#include "aggregate.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AGG_X86 1
+#include <immintrin.h>
+#define AGG_SSE42 __attribute__((target("sse4.2")))
+#define AGG_AVX2  __attribute__((target("avx2")))
+#endif
+
+// Number of timestamps counted at once looking for the end of a bucket run
+#define AGG_RUN_BLOCK 64
+
+typedef struct agg_kernels {
+    const char *isa;
+    size_t (*argmin)(const double_t *values, size_t n);
+    size_t (*argmax)(const double_t *values, size_t n);
+    double_t (*sum)(const double_t *values, size_t n);
+    size_t (*count)(const uint64_t *timestamps, size_t n, uint64_t t0,
+                    uint64_t t1);
+} agg_kernels_t;
+
+/*
+ * Scalar kernels
+ */
+
+static size_t argmin_scalar(const double_t *values, size_t n)
+{
+    size_t at = 0;
+    for (size_t i = 1; i < n; ++i)
+        if (values[i] < values[at])
+            at = i;
+    return at;
+}
+
+static size_t argmax_scalar(const double_t *values, size_t n)
+{
+    size_t at = 0;
+    for (size_t i = 1; i < n; ++i)
+        if (values[i] > values[at])
+            at = i;
+    return at;
+}
+
+static double_t sum_scalar(const double_t *values, size_t n)
+{
+    double_t sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        sum += values[i];
+    return sum;
+}
+
+static size_t count_scalar(const uint64_t *timestamps, size_t n, uint64_t t0,
+                           uint64_t t1)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+        count += timestamps[i] >= t0 && timestamps[i] <= t1;
+    return count;
+}
+
+static const agg_kernels_t scalar_kernels = {.isa    = "scalar",
+                                             .argmin = argmin_scalar,
+                                             .argmax = argmax_scalar,
+                                             .sum    = sum_scalar,
+                                             .count  = count_scalar};
+
+#ifdef AGG_X86
+
+/*
+ * The extremes are found in two passes, the vector one for the value, then a
+ * lookup for its first occurrence, which usually stops early.
+ */
+#define AGG_EXTREME_SSE42(name, op, cmp)                                       \
+    AGG_SSE42 static size_t name(const double_t *values, size_t n)             \
+    {                                                                          \
+        double_t m = values[0];                                                \
+        size_t i   = 0;                                                        \
+        if (n >= 4) {                                                          \
+            __m128d a = _mm_loadu_pd(values);                                  \
+            __m128d b = _mm_loadu_pd(values + 2);                              \
+            for (i = 4; i + 4 <= n; i += 4) {                                  \
+                a = op(_mm_loadu_pd(values + i), a);                           \
+                b = op(_mm_loadu_pd(values + i + 2), b);                       \
+            }                                                                  \
+            a = op(a, b);                                                      \
+            a = op(a, _mm_unpackhi_pd(a, a));                                  \
+            m = _mm_cvtsd_f64(a);                                              \
+        }                                                                      \
+        for (; i < n; ++i)                                                     \
+            if (values[i] cmp m)                                               \
+                m = values[i];                                                 \
+        __m128d t = _mm_set1_pd(m);                                            \
+        for (i = 0; i + 2 <= n; i += 2) {                                      \
+            int mask =                                                         \
+                _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(values + i), t));    \
+            if (mask)                                                          \
+                return i + __builtin_ctz(mask);                                \
+        }                                                                      \
+        for (; i < n; ++i)                                                     \
+            if (values[i] == m)                                                \
+                return i;                                                      \
+        return 0;                                                              \
+    }
+
+#define AGG_EXTREME_AVX2(name, op, op256, cmp)                                 \
+    AGG_AVX2 static size_t name(const double_t *values, size_t n)              \
+    {                                                                          \
+        double_t m = values[0];                                                \
+        size_t i   = 0;                                                        \
+        if (n >= 8) {                                                          \
+            __m256d a = _mm256_loadu_pd(values);                               \
+            __m256d b = _mm256_loadu_pd(values + 4);                           \
+            for (i = 8; i + 8 <= n; i += 8) {                                  \
+                a = op256(_mm256_loadu_pd(values + i), a);                     \
+                b = op256(_mm256_loadu_pd(values + i + 4), b);                 \
+            }                                                                  \
+            a         = op256(a, b);                                           \
+            __m128d c = op(_mm256_castpd256_pd128(a),                          \
+                           _mm256_extractf128_pd(a, 1));                       \
+            c         = op(c, _mm_unpackhi_pd(c, c));                          \
+            m         = _mm_cvtsd_f64(c);                                      \
+        }                                                                      \
+        for (; i < n; ++i)                                                     \
+            if (values[i] cmp m)                                               \
+                m = values[i];                                                 \
+        __m256d t = _mm256_set1_pd(m);                                         \
+        for (i = 0; i + 4 <= n; i += 4) {                                      \
+            int mask = _mm256_movemask_pd(                                     \
+                _mm256_cmp_pd(_mm256_loadu_pd(values + i), t, _CMP_EQ_OQ));    \
+            if (mask)                                                          \
+                return i + __builtin_ctz(mask);                                \
+        }                                                                      \
+        for (; i < n; ++i)                                                     \
+            if (values[i] == m)                                                \
+                return i;                                                      \
+        return 0;                                                              \
+    }
+
+AGG_EXTREME_SSE42(argmin_sse42, _mm_min_pd, <)
+AGG_EXTREME_SSE42(argmax_sse42, _mm_max_pd, >)
+AGG_EXTREME_AVX2(argmin_avx2, _mm_min_pd, _mm256_min_pd, <)
+AGG_EXTREME_AVX2(argmax_avx2, _mm_max_pd, _mm256_max_pd, >)
+
+AGG_SSE42 static double_t sum_sse42(const double_t *values, size_t n)
+{
+    __m128d a = _mm_setzero_pd();
+    __m128d b = _mm_setzero_pd();
+    size_t i  = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_add_pd(a, _mm_loadu_pd(values + i));
+        b = _mm_add_pd(b, _mm_loadu_pd(values + i + 2));
+    }
+
+    a            = _mm_add_pd(a, b);
+    double_t sum = _mm_cvtsd_f64(_mm_add_pd(a, _mm_unpackhi_pd(a, a)));
+    for (; i < n; ++i)
+        sum += values[i];
+
+    return sum;
+}
+
+AGG_AVX2 static double_t sum_avx2(const double_t *values, size_t n)
+{
+    __m256d a = _mm256_setzero_pd();
+    __m256d b = _mm256_setzero_pd();
+    size_t i  = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        a = _mm256_add_pd(a, _mm256_loadu_pd(values + i));
+        b = _mm256_add_pd(b, _mm256_loadu_pd(values + i + 4));
+    }
+
+    a = _mm256_add_pd(a, b);
+    __m128d c =
+        _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+    double_t sum = _mm_cvtsd_f64(_mm_add_pd(c, _mm_unpackhi_pd(c, c)));
+    for (; i < n; ++i)
+        sum += values[i];
+
+    return sum;
+}
+
+/*
+ * There is no unsigned 64 bit comparison, flipping the sign bit maps the
+ * unsigned order onto the signed one.
+ */
+#define AGG_SIGN ((long long)(1ULL << 63))
+
+AGG_SSE42 static size_t count_sse42(const uint64_t *timestamps, size_t n,
+                                    uint64_t t0, uint64_t t1)
+{
+    const __m128i sign = _mm_set1_epi64x(AGG_SIGN);
+    const __m128i lo   = _mm_xor_si128(_mm_set1_epi64x((long long)t0), sign);
+    const __m128i hi   = _mm_xor_si128(_mm_set1_epi64x((long long)t1), sign);
+    size_t outside     = 0;
+    size_t i           = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(timestamps + i)), sign);
+        __m128i out =
+            _mm_or_si128(_mm_cmpgt_epi64(lo, x), _mm_cmpgt_epi64(x, hi));
+        outside += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(out)));
+    }
+
+    return i - outside + count_scalar(timestamps + i, n - i, t0, t1);
+}
+
+AGG_AVX2 static size_t count_avx2(const uint64_t *timestamps, size_t n,
+                                  uint64_t t0, uint64_t t1)
+{
+    const __m256i sign = _mm256_set1_epi64x(AGG_SIGN);
+    const __m256i lo =
+        _mm256_xor_si256(_mm256_set1_epi64x((long long)t0), sign);
+    const __m256i hi =
+        _mm256_xor_si256(_mm256_set1_epi64x((long long)t1), sign);
+    size_t outside = 0;
+    size_t i       = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)(timestamps + i)), sign);
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(lo, x),
+                                      _mm256_cmpgt_epi64(x, hi));
+        outside +=
+            __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(out)));
+    }
+
+    return i - outside + count_scalar(timestamps + i, n - i, t0, t1);
+}
+
+static const agg_kernels_t sse42_kernels = {.isa    = "sse4.2",
+                                            .argmin = argmin_sse42,
+                                            .argmax = argmax_sse42,
+                                            .sum    = sum_sse42,
+                                            .count  = count_sse42};
+
+static const agg_kernels_t avx2_kernels  = {.isa    = "avx2",
+                                            .argmin = argmin_avx2,
+                                            .argmax = argmax_avx2,
+                                            .sum    = sum_avx2,
+                                            .count  = count_avx2};
+
+#endif
+
+static const agg_kernels_t *kernels = &scalar_kernels;
+static pthread_once_t kernels_once  = PTHREAD_ONCE_INIT;
+
+static void kernels_select(void)
+{
+#ifdef AGG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse4.2"))
+        kernels = &sse42_kernels;
+#endif
+}
+
+static inline const agg_kernels_t *agg_kernels(void)
+{
+    pthread_once(&kernels_once, kernels_select);
+    return kernels;
+}
+
+const char *agg_isa(void) { return agg_kernels()->isa; }
+
+size_t agg_argmin(const double_t *values, size_t n)
+{
+    return agg_kernels()->argmin(values, n);
+}
+
+size_t agg_argmax(const double_t *values, size_t n)
+{
+    return agg_kernels()->argmax(values, n);
+}
+
+double_t agg_sum(const double_t *values, size_t n)
+{
+    return agg_kernels()->sum(values, n);
+}
+
+size_t agg_count(const uint64_t *timestamps, size_t n, uint64_t t0,
+                 uint64_t t1)
+{
+    return agg_kernels()->count(timestamps, n, t0, t1);
+}
+
+/*
+ * Points are sorted, those not past last are a prefix, counted a block at a
+ * time until one falls short.
+ */
+size_t agg_run(const uint64_t *timestamps, size_t n, uint64_t last)
+{
+    const agg_kernels_t *k = agg_kernels();
+    size_t run             = 0;
+
+    for (size_t c = AGG_RUN_BLOCK; c == AGG_RUN_BLOCK && run < n;) {
+        size_t len = n - run < AGG_RUN_BLOCK ? n - run : AGG_RUN_BLOCK;
+        c          = k->count(timestamps + run, len, 0, last);
+        run += c;
+    }
+
+    return run;
+}
+
+size_t agg_bucket(const uint64_t *timestamps, const double_t *values,
+                  size_t n, uint64_t start, uint64_t interval,
+                  agg_bucket_t *b)
+{
+    size_t i = 0;
+
+    *b       = (agg_bucket_t){0};
+
+    while (i < n && (timestamps[i] <= start ||
+                     (timestamps[i] - start) % interval == 0))
+        ++i;
+
+    if (i == n)
+        return n;
+
+    b->end = start + ((timestamps[i] - start) / interval + 1) * interval;
+
+    size_t run = agg_run(timestamps + i, n - i, b->end - 1);
+
+    b->sum     = agg_sum(values + i, run);
+    b->count   = run;
+
+    return i + run;
+}
@@ -0,0 +1,58 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Aggregation kernels over contiguous timestamp and value columns.
+ *
+ * Each kernel comes in a scalar, an SSE4.2 and an AVX2 flavour, the widest
+ * one supported by the CPU is picked at runtime on the first call, the
+ * scalar one being the fallback on any other architecture.
+ *
+ * Vector sums add up the values in a different order than a plain loop, the
+ * results may differ in the last bits.
+ */
+
+/*
+ * Running sum and count of a sampling bucket, labelled with its end, as
+ * ts_avg_sample, each bucket spans the open interval (end - interval, end).
+ */
+typedef struct agg_bucket {
+    uint64_t end;
+    double_t sum;
+    size_t count;
+} agg_bucket_t;
+
+// Returns the name of the instruction set picked, "avx2", "sse4.2" or
+// "scalar"
+const char *agg_isa(void);
+
+// Returns the index of the first minimum value, n must be positive
+size_t agg_argmin(const double_t *values, size_t n);
+
+// Returns the index of the first maximum value, n must be positive
+size_t agg_argmax(const double_t *values, size_t n);
+
+// Returns the sum of the values, 0.0 if n is 0
+double_t agg_sum(const double_t *values, size_t n);
+
+// Returns the number of timestamps within the closed interval [t0, t1]
+size_t agg_count(const uint64_t *timestamps, size_t n, uint64_t t0,
+                 uint64_t t1);
+
+// Returns the length of the leading run of a sorted column not past last
+size_t agg_run(const uint64_t *timestamps, size_t n, uint64_t last);
+
+// Sums and counts in b the leading run of a sorted column falling in the
+// bucket of its first point, buckets being delimited by the multiples of
+// interval past start. Points on a boundary (or before start) belong to no
+// bucket and are skipped. Returns the number of points consumed, b->count is
+// 0 if they were all skipped
+size_t agg_bucket(const uint64_t *timestamps, const double_t *values,
+                  size_t n, uint64_t start, uint64_t interval,
+                  agg_bucket_t *b);
+
+#endif
@@ -0,0 +1,143 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGNMENT     alignof(max_align_t)
+#define ALIGN_UP(n)   (((n) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+static _Thread_local arena_t scratch       = {0};
+static _Thread_local size_t scratch_users  = 0;
+
+void arena_init(arena_t *a, size_t block_size)
+{
+    a->head       = NULL;
+    a->curr       = NULL;
+    a->block_size = block_size == 0 ? ARENA_BLOCK_SIZE : block_size;
+    a->size       = 0;
+}
+
+static arena_block_t *arena_block_make(size_t size)
+{
+    arena_block_t *block = malloc(sizeof(*block) + size);
+    if (!block)
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+    if (a->block_size == 0)
+        a->block_size = ARENA_BLOCK_SIZE;
+
+    size = ALIGN_UP(size);
+
+    if (a->curr && a->curr->size - a->curr->used >= size) {
+        void *ptr = a->curr->data + a->curr->used;
+        a->curr->used += size;
+        return ptr;
+    }
+
+    // Reuse the next block if it was kept by a reset and it's big enough,
+    // otherwise link a new one right after the current
+    arena_block_t *next = a->curr ? a->curr->next : a->head;
+    if (!next || next->size < size) {
+        size_t block_size = size > a->block_size ? size : a->block_size;
+        arena_block_t *block = arena_block_make(block_size);
+        if (!block)
+            return NULL;
+
+        block->next = next;
+        if (a->curr)
+            a->curr->next = block;
+        else
+            a->head = block;
+
+        a->size += block_size;
+        next = block;
+    }
+
+    a->curr    = next;
+    next->used = size;
+
+    return next->data;
+}
+
+void *arena_realloc(arena_t *a, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+        return arena_alloc(a, new_size);
+
+    old_size = ALIGN_UP(old_size);
+    new_size = ALIGN_UP(new_size);
+
+    if (new_size <= old_size)
+        return ptr;
+
+    // Last allocation of the current block, just bump it
+    arena_block_t *curr = a->curr;
+    if (curr && (uint8_t *)ptr + old_size == curr->data + curr->used &&
+        curr->size - curr->used >= new_size - old_size) {
+        curr->used += new_size - old_size;
+        return ptr;
+    }
+
+    void *new_ptr = arena_alloc(a, new_size);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size);
+
+    return new_ptr;
+}
+
+void arena_reset(arena_t *a)
+{
+    for (arena_block_t *b = a->head; b; b = b->next)
+        b->used = 0;
+
+    a->curr = NULL;
+}
+
+void arena_release(arena_t *a)
+{
+    arena_block_t *b = a->head;
+    while (b) {
+        arena_block_t *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    a->head = NULL;
+    a->curr = NULL;
+    a->size = 0;
+}
+
+arena_t *arena_scratch_acquire(void)
+{
+    scratch_users++;
+    return &scratch;
+}
+
+void arena_scratch_release(void)
+{
+    if (scratch_users == 0 || --scratch_users > 0)
+        return;
+
+    // Don't hold on the memory of an unusually large request
+    if (scratch.size > ARENA_SCRATCH_MAX)
+        arena_release(&scratch);
+    else
+        arena_reset(&scratch);
+}
+
+void arena_scratch_free(void)
+{
+    if (scratch_users == 0)
+        arena_release(&scratch);
+}
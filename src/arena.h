@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_BLOCK_SIZE   (1 << 14)
+#define ARENA_SCRATCH_MAX  (1 << 22)
+
+/*
+ * Simple region allocator, memory is carved out of a list of blocks by
+ * bumping a pointer and it's given back all at once, there is no per
+ * allocation free.
+ *
+ * Resetting an arena keeps its blocks around to be reused by the next
+ * allocations, which makes a reset arena allocation free until it grows past
+ * its high-water mark.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t *head;
+    arena_block_t *curr;
+    size_t block_size;
+    size_t size;
+} arena_t;
+
+// Initializes an empty arena, no memory is allocated until the first
+// allocation
+void arena_init(arena_t *a, size_t block_size);
+
+// Allocates size bytes, aligned to max_align_t, NULL on error
+void *arena_alloc(arena_t *a, size_t size);
+
+// Grows an allocation, in place if it's the last one done and there is room
+// left in its block, otherwise the content is copied to a new allocation
+void *arena_realloc(arena_t *a, void *ptr, size_t old_size, size_t new_size);
+
+// Rewinds the arena, keeping the blocks for later allocations
+void arena_reset(arena_t *a);
+
+// Frees all the blocks of the arena
+void arena_release(arena_t *a);
+
+// Returns the per-thread scratch arena, meant for transient allocations
+// living just for the duration of a request. Each acquire must be paired
+// with a release, the arena is reset once the outermost user releases it
+arena_t *arena_scratch_acquire(void);
+
+void arena_scratch_release(void);
+
+// Frees the blocks of the scratch arena of the calling thread, unless it's in
+// use, to be called by short-lived threads before they exit
+void arena_scratch_free(void);
+
+#endif
@@ -0,0 +1,267 @@
+#include "blockcache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_CACHE_BUCKETS 256
+
+/*
+ * A cached block, chained in its hash bucket and linked in the recency list,
+ * the timestamps followed by the values in a single allocation.
+ */
+typedef struct block_entry {
+    uint64_t owner;
+    uint64_t offset;
+    size_t size;
+    size_t n;
+    struct block_entry *chain;
+    struct block_entry *newer;
+    struct block_entry *older;
+    uint64_t columns[];
+} block_entry_t;
+
+/*
+ * The recency list goes from the most recently used block, the newest, to
+ * the least recently used one, the oldest, evicted first.
+ */
+static struct {
+    pthread_mutex_t lock;
+    block_entry_t **buckets;
+    size_t buckets_nr;
+    block_entry_t *newest;
+    block_entry_t *oldest;
+    uint64_t next_owner;
+    block_cache_stats_t stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .stats = {.budget = BLOCK_CACHE_BUDGET}};
+
+static inline size_t entry_cost(size_t n)
+{
+    return sizeof(block_entry_t) + n * (sizeof(uint64_t) + sizeof(double_t));
+}
+
+static inline const double_t *entry_values(const block_entry_t *e)
+{
+    return (const double_t *)(e->columns + e->n);
+}
+
+static inline size_t bucket_of(uint64_t owner, uint64_t offset,
+                               size_t buckets_nr)
+{
+    // splitmix64 finalizer over both parts of the key
+    uint64_t h = owner * 0x9e3779b97f4a7c15ULL ^ offset;
+    h          = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h          = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h & (buckets_nr - 1);
+}
+
+static block_entry_t **bucket_find(uint64_t owner, uint64_t offset)
+{
+    if (cache.buckets_nr == 0)
+        return NULL;
+
+    block_entry_t **e =
+        &cache.buckets[bucket_of(owner, offset, cache.buckets_nr)];
+    while (*e && ((*e)->owner != owner || (*e)->offset != offset))
+        e = &(*e)->chain;
+
+    return e;
+}
+
+static void lru_unlink(block_entry_t *e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        cache.newest = e->older;
+
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        cache.oldest = e->newer;
+
+    e->newer = e->older = NULL;
+}
+
+static void lru_push(block_entry_t *e)
+{
+    e->newer = NULL;
+    e->older = cache.newest;
+    if (cache.newest)
+        cache.newest->newer = e;
+    cache.newest = e;
+    if (!cache.oldest)
+        cache.oldest = e;
+}
+
+static void entry_remove(block_entry_t **link)
+{
+    block_entry_t *e = *link;
+
+    *link            = e->chain;
+    lru_unlink(e);
+    cache.stats.used -= entry_cost(e->n);
+    cache.stats.blocks--;
+    free(e);
+}
+
+static void evict_to(size_t budget)
+{
+    while (cache.oldest && cache.stats.used > budget) {
+        block_entry_t *e = cache.oldest;
+        entry_remove(bucket_find(e->owner, e->offset));
+        cache.stats.evictions++;
+    }
+}
+
+/*
+ * Double the buckets once there are more blocks than buckets, rehashing the
+ * chains, a failed allocation just leaves the chains longer.
+ */
+static void buckets_grow(void)
+{
+    if (cache.stats.blocks < cache.buckets_nr)
+        return;
+
+    size_t nr = cache.buckets_nr == 0 ? BLOCK_CACHE_BUCKETS
+                                      : cache.buckets_nr * 2;
+    block_entry_t **buckets = calloc(nr, sizeof(*buckets));
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < cache.buckets_nr; ++i) {
+        block_entry_t *e = cache.buckets[i];
+        while (e) {
+            block_entry_t *chain = e->chain;
+            size_t b             = bucket_of(e->owner, e->offset, nr);
+            e->chain             = buckets[b];
+            buckets[b]           = e;
+            e                    = chain;
+        }
+    }
+
+    free(cache.buckets);
+    cache.buckets    = buckets;
+    cache.buckets_nr = nr;
+}
+
+void block_cache_set_budget(size_t budget)
+{
+    pthread_mutex_lock(&cache.lock);
+    cache.stats.budget = budget;
+    evict_to(budget);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+uint64_t block_cache_owner(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    uint64_t owner = ++cache.next_owner;
+    pthread_mutex_unlock(&cache.lock);
+
+    return owner;
+}
+
+int block_cache_get(uint64_t owner, uint64_t offset, size_t size,
+                    block_cache_fn fn, void *userdata)
+{
+    pthread_mutex_lock(&cache.lock);
+
+    block_entry_t **link = bucket_find(owner, offset);
+    block_entry_t *e     = link ? *link : NULL;
+
+    // A block found with another size has been rewritten
+    if (e && e->size != size) {
+        entry_remove(link);
+        e = NULL;
+    }
+
+    if (!e) {
+        cache.stats.misses++;
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+
+    cache.stats.hits++;
+    lru_unlink(e);
+    lru_push(e);
+
+    fn(e->columns, entry_values(e), e->n, userdata);
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return 1;
+}
+
+int block_cache_put(uint64_t owner, uint64_t offset, size_t size,
+                    const uint64_t *timestamps, const double_t *values,
+                    size_t n)
+{
+    size_t cost = entry_cost(n);
+
+    pthread_mutex_lock(&cache.lock);
+
+    if (cost > cache.stats.budget) {
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+
+    block_entry_t *e = malloc(cost);
+    if (!e) {
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+
+    *e = (block_entry_t){
+        .owner = owner, .offset = offset, .size = size, .n = n};
+    memcpy(e->columns, timestamps, n * sizeof(*timestamps));
+    memcpy((double_t *)entry_values(e), values, n * sizeof(*values));
+
+    block_entry_t **link = bucket_find(owner, offset);
+    if (link && *link)
+        entry_remove(link);
+
+    evict_to(cache.stats.budget - cost);
+    buckets_grow();
+
+    link = bucket_find(owner, offset);
+    if (!link) {
+        pthread_mutex_unlock(&cache.lock);
+        free(e);
+        return -1;
+    }
+
+    e->chain = *link;
+    *link    = e;
+    lru_push(e);
+    cache.stats.used += cost;
+    cache.stats.blocks++;
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return 0;
+}
+
+void block_cache_stats(block_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void block_cache_reset(void)
+{
+    pthread_mutex_lock(&cache.lock);
+
+    while (cache.oldest)
+        entry_remove(bucket_find(cache.oldest->owner, cache.oldest->offset));
+
+    free(cache.buckets);
+    cache.buckets    = NULL;
+    cache.buckets_nr = 0;
+    cache.stats      = (block_cache_stats_t){.budget = cache.stats.budget};
+
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,59 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_BUDGET (64 << 20)
+
+/*
+ * Process wide cache of decoded partition blocks, shared by all the series.
+ *
+ * Blocks are keyed by the partition they belong to and their offset in its
+ * commit log, along with their size, so a block found with another size is
+ * stale and gets replaced. Each partition opened gets an owner id never
+ * reused, the blocks of a partition closed or rewritten by a compaction are
+ * never looked up again and just age out.
+ *
+ * The memory taken by the decoded columns is kept within a budget, the least
+ * recently used blocks evicted to make room. All the calls are thread safe,
+ * a cached block is handed over to the reader while holding the cache lock.
+ */
+typedef struct block_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t blocks;
+    size_t used;
+    size_t budget;
+} block_cache_stats_t;
+
+typedef void (*block_cache_fn)(const uint64_t *timestamps,
+                               const double_t *values, size_t n,
+                               void *userdata);
+
+// Sets the memory budget in bytes, evicting blocks past it, 0 disables the
+// cache
+void block_cache_set_budget(size_t budget);
+
+// Returns a new owner id, to key the blocks of a partition
+uint64_t block_cache_owner(void);
+
+// Calls fn on the columns of the block cached at offset, returns 1 if it was
+// found, 0 on a miss
+int block_cache_get(uint64_t owner, uint64_t offset, size_t size,
+                    block_cache_fn fn, void *userdata);
+
+// Caches a copy of the columns of a block, replacing any previous one,
+// returns -1 if it can't be cached
+int block_cache_put(uint64_t owner, uint64_t offset, size_t size,
+                    const uint64_t *timestamps, const double_t *values,
+                    size_t n);
+
+void block_cache_stats(block_cache_stats_t *stats);
+
+// Drops all the blocks and zeroes the counters, the budget is kept
+void block_cache_reset(void);
+
+#endif
@@ -1,25 +1,170 @@
 #include "commitlog.h"
 #include "binary.h"
-#include "buffer.h"
+#include "gorilla.h"
+#include "hash.h"
 #include "logger.h"
 #include "storage.h"
 #include "timeseries.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// Magic u32 + version u8 + padding, as the index header
+static const uint8_t META_HEADER[] = {'T', 'S', 'C', 'M', 0x01, 0, 0, 0};
+
+// Header + log size, points and blocks counts, first and last timestamps,
+// base nanoseconds and the checksum of all the previous bytes, u64 each
+#define META_SIZE (sizeof(META_HEADER) + sizeof(uint64_t) * 7)
+
+static void meta_path(char *buf, size_t size, const char *path, uint64_t base)
+{
+    snprintf(buf, size, "%s/m-%.20" PRIu64 ".meta", path, base);
+}
+
+// The meta file of an open log sits next to it, wherever it was moved
+static void meta_path_of(char *buf, size_t size, const commitlog_t *cl)
+{
+    const char *log = cl->fh.path;
+    const char *dir = strrchr(log, '/');
+    int len         = dir ? (int)(dir - log) : 1;
+
+    snprintf(buf, size, "%.*s/m-%.20" PRIu64 ".meta", len, dir ? log : ".",
+             cl->base_timestamp);
+}
+
+static void cl_reset(commitlog_t *cl, uint64_t base)
+{
+    cl->map               = (segmap_t){0};
+    cl->size              = 0;
+    cl->points            = 0;
+    cl->blocks            = 0;
+    cl->base_timestamp    = base;
+    cl->base_ns           = 0;
+    cl->first_timestamp   = 0;
+    cl->current_timestamp = base;
+}
+
 int cl_init(commitlog_t *cl, const char *path, uint64_t base)
 {
     char path_buf[PATHBUF_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64 ".log", path, base);
 
-    cl->fp = fopen(path_buf, "w+");
-    if (!cl->fp)
+    if (fdcache_open(&cl->fh, path_buf, O_RDWR | O_CREAT | O_TRUNC) < 0)
         return -1;
 
-    cl->base_timestamp    = base;
-    cl->base_ns           = 0;
-    cl->current_timestamp = base;
-    cl->size              = 0;
+    // The log starts over, so does its meta
+    meta_path(path_buf, sizeof(path_buf), path, base);
+    unlink(path_buf);
+
+    cl_reset(cl, base);
+
+    return 0;
+}
+
+int cl_close(commitlog_t *cl)
+{
+    segmap_close(&cl->map);
+    fdcache_close(&cl->fh);
+    return 0;
+}
+
+int cl_remove(const char *path, uint64_t base)
+{
+    char path_buf[PATHBUF_SIZE];
+    meta_path(path_buf, sizeof(path_buf), path, base);
+    unlink(path_buf);
+
+    snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64 ".log", path, base);
+
+    return unlink(path_buf);
+}
+
+/*
+ * Moves the log along with its meta, a log moved without one must not be
+ * paired with the meta of the log it replaces.
+ */
+int cl_rename(const char *from, const char *to, uint64_t base)
+{
+    char from_buf[PATHBUF_SIZE], to_buf[PATHBUF_SIZE];
+    meta_path(from_buf, sizeof(from_buf), from, base);
+    meta_path(to_buf, sizeof(to_buf), to, base);
+    if (rename(from_buf, to_buf) < 0 && errno == ENOENT)
+        unlink(to_buf);
+
+    snprintf(from_buf, sizeof(from_buf), "%s/c-%.20" PRIu64 ".log", from, base);
+    snprintf(to_buf, sizeof(to_buf), "%s/c-%.20" PRIu64 ".log", to, base);
+
+    return rename(from_buf, to_buf);
+}
+
+/*
+ * The meta file is not synced, its pwrite is enough: it's written once the log
+ * is on disk, and a meta lost or torn by a crash either doesn't match the size
+ * of the log or fails its checksum, the log is then scanned.
+ */
+int cl_seal(const commitlog_t *cl)
+{
+    uint8_t buf[META_SIZE];
+    uint8_t *ptr = buf;
+
+    memcpy(ptr, META_HEADER, sizeof(META_HEADER));
+    ptr += sizeof(META_HEADER);
+    ptr += write_i64(ptr, cl->size);
+    ptr += write_i64(ptr, cl->points);
+    ptr += write_i64(ptr, cl->blocks);
+    ptr += write_i64(ptr, cl->first_timestamp);
+    ptr += write_i64(ptr, cl->current_timestamp);
+    ptr += write_i64(ptr, cl->base_ns);
+    write_i64(ptr, fnv1a_hash(buf, ptr - buf));
+
+    char path_buf[PATHBUF_SIZE];
+    meta_path_of(path_buf, sizeof(path_buf), cl);
+
+    int fd = open(path_buf, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = pwrite(fd, buf, META_SIZE, 0);
+    close(fd);
+
+    return n == (ssize_t)META_SIZE ? 0 : -1;
+}
+
+/*
+ * Sets the state of the log from its meta, if it's intact and covers the
+ * whole log, returns -1 otherwise.
+ */
+static int cl_meta_read(commitlog_t *cl, const char *path)
+{
+    char path_buf[PATHBUF_SIZE];
+    meta_path(path_buf, sizeof(path_buf), path, cl->base_timestamp);
+
+    int fd = open(path_buf, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    uint8_t buf[META_SIZE];
+    ssize_t n = pread(fd, buf, META_SIZE, 0);
+    close(fd);
+
+    if (n != (ssize_t)META_SIZE ||
+        memcmp(buf, META_HEADER, sizeof(META_HEADER)) != 0)
+        return -1;
+
+    const uint8_t *ptr = buf + sizeof(META_HEADER);
+    const uint8_t *sum = buf + META_SIZE - sizeof(uint64_t);
+    if ((uint64_t)read_i64(sum) != fnv1a_hash(buf, sum - buf) ||
+        (size_t)read_i64(ptr) != cl->size)
+        return -1;
+
+    cl->points            = read_i64(ptr + 8);
+    cl->blocks            = read_i64(ptr + 16);
+    cl->first_timestamp   = read_i64(ptr + 24);
+    cl->current_timestamp = read_i64(ptr + 32);
+    cl->base_ns           = read_i64(ptr + 40);
 
     return 0;
 }
@@ -31,50 +176,98 @@ int cl_load(commitlog_t *cl, const char *path, uint64_t base)
     char path_buf[PATHBUF_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64 ".log", path, base);
 
-    cl->fp = fopen(path_buf, "w+");
-    if (!cl->fp)
+    if (fdcache_open(&cl->fh, path_buf, O_RDWR) < 0)
         return -1;
 
-    cl->base_timestamp   = base;
+    cl_reset(cl, base);
 
-    uint64_t record_size = 0;
+    struct stat st;
+    int fd = fdcache_acquire(&cl->fh);
+    if (fd < 0)
+        return -1;
 
-    buffer_t buffer;
-    if (buffer_read_file(cl->fp, &buffer) < 0)
+    int err = fstat(fd, &st);
+    fdcache_release(&cl->fh);
+    if (err < 0)
         return -1;
 
-    size_t size  = buffer.size;
-    uint8_t *buf = buffer.data;
-    cl->size     = buffer.size;
+    ssize_t size = st.st_size;
+    cl->size     = size;
 
-    if (size > 0) {
-        while (size > 0) {
-            record_size = read_i64(buf);
-            size -= record_size;
-            buf += record_size;
-        }
+    if (size == 0 || cl_meta_read(cl, path) == 0)
+        return 0;
 
-        uint64_t first_ts     = ts_record_timestamp(buffer.data);
-        uint64_t latest_ts    = ts_record_timestamp(buf - record_size);
+    // No meta to trust, walk the frames straight from the mapped file
+    const uint8_t *start = NULL;
+    if (cl_read_at(cl, &start, 0, cl->size) < 0)
+        return -1;
+
+    const uint8_t *buf = start;
+    cl_frame_t frame;
+    ssize_t frame_size = 0;
+    uint64_t first_ts  = 0;
+
+    while (size > 0) {
+        frame_size = cl_frame_read(buf, size, &frame);
+        if (frame_size < 0)
+            break;
+
+        if (buf == start)
+            first_ts = frame.first_ts;
 
-        cl->current_timestamp = latest_ts;
-        cl->base_ns           = first_ts % (uint64_t)1e9;
+        cl->current_timestamp = frame.last_ts;
+        cl->points += frame.count;
+        cl->blocks++;
+        size -= frame_size;
+        buf += frame_size;
     }
 
-    free(buffer.data);
+    cl_release(cl);
 
-    return 0;
+    cl->first_timestamp = first_ts;
+    cl->base_ns         = first_ts % (uint64_t)1e9;
+
+    if (size == 0)
+        return 0;
+
+    // A crash in the middle of a flush leaves a torn frame, the log is cut
+    // at the last complete one, the points lost are still in the WAL
+    log_warning("Torn commit log %s, truncated at offset %zu", path_buf,
+                cl->size - size);
+    cl->size -= size;
+    segmap_close(&cl->map);
+
+    fd = fdcache_acquire(&cl->fh);
+    if (fd < 0)
+        return -1;
+
+    err = ftruncate(fd, cl->size);
+    fdcache_release(&cl->fh);
+    if (err < 0 || cl_seal(cl) < 0)
+        return -1;
+
+    return 1;
 }
 
 int cl_append_data(commitlog_t *cl, const uint8_t *data, size_t len)
 {
-    int bytes = pwrite(fileno(cl->fp), data, len, cl->size);
+    int fd = fdcache_acquire(&cl->fh);
+    if (fd < 0)
+        return -1;
+
+    int bytes = pwrite(fd, data, len, cl->size);
+    fdcache_release(&cl->fh);
     if (bytes < 0) {
         perror("write_at");
         return -1;
     }
 
+    if (cl->size == 0)
+        cl->first_timestamp = ts_record_timestamp(data);
+
     cl->size += bytes;
+    cl->points++;
+    cl->blocks++;
     cl->current_timestamp = ts_record_timestamp(data);
 
     return 0;
@@ -82,48 +275,181 @@ int cl_append_data(commitlog_t *cl, const uint8_t *data, size_t len)
 
 int cl_append_batch(commitlog_t *cl, const uint8_t *batch, size_t len)
 {
-    cl->current_timestamp = ts_record_timestamp(batch);
-    size_t start_offset   = sizeof(uint64_t) * 2;
+    cl_frame_t block;
+    if (cl_frame_read(batch, len, &block) < 0)
+        return -1;
 
     // If not set before, set the base nanoseconds from the first timestamp of
-    // the batch, which is located at the first record of the batch, after the
-    // batch size and last timestamp of the batch
-    if (cl->base_ns == 0) {
-        uint64_t first_timestamp = ts_record_timestamp(batch + start_offset);
-        cl->base_ns              = first_timestamp % (uint64_t)1e9;
-    }
+    // the block
+    if (cl->base_ns == 0)
+        cl->base_ns = block.first_ts % (uint64_t)1e9;
 
-    int n = pwrite(fileno(cl->fp), batch + start_offset, len, cl->size);
-    if (n < 0) {
-        perror("write_at");
+    if (cl_write_at(cl, batch, len, cl->size) < 0)
         return -1;
-    }
+
+    if (cl->size == 0)
+        cl->first_timestamp = block.first_ts;
 
     cl->size += len;
+    cl->points += block.count;
+    cl->blocks++;
+    cl->current_timestamp = block.last_ts;
 
     return 0;
 }
 
-int cl_read_at(const commitlog_t *cl, uint8_t **buf, size_t offset, size_t len)
+int cl_write_at(commitlog_t *cl, const uint8_t *batch, size_t len,
+                size_t offset)
 {
-    return pread(fileno(cl->fp), *buf, len, offset);
+    int fd = fdcache_acquire(&cl->fh);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = pwrite(fd, batch, len, offset);
+    fdcache_release(&cl->fh);
+    if (n < 0 || (size_t)n < len) {
+        perror("write_at");
+        return -1;
+    }
+
+    return 0;
+}
+
+int cl_move(commitlog_t *cl, const char *to)
+{
+    char path_buf[PATHBUF_SIZE];
+    snprintf(path_buf, sizeof(path_buf), "%s/c-%.20" PRIu64 ".log", to,
+             cl->base_timestamp);
+
+    return fdcache_rename(&cl->fh, path_buf);
+}
+
+/*
+ * Points buf to the requested region of the commit log, served straight from
+ * a read-only memory mapping of the file, no copies involved. The mapping
+ * itself is handled by the segments LRU, which is the reason for the mutable
+ * access on a const commit log. A descriptor is only needed to map the file,
+ * a mapping still covering the log is used as is.
+ *
+ * Returns the number of bytes available at buf, possibly less than len if the
+ * region spans over the end of the log, or -1 on error. The mapping is pinned
+ * if any, it stays valid until cl_release, whatever the other threads map.
+ */
+ssize_t cl_read_at(const commitlog_t *cl, const uint8_t **buf, size_t offset,
+                   size_t len)
+{
+    if (offset >= cl->size)
+        return 0;
+
+    segmap_t *map       = (segmap_t *)&cl->map;
+    const uint8_t *addr = segmap_peek(map, cl->size);
+    if (!addr) {
+        fdhandle_t *fh = (fdhandle_t *)&cl->fh;
+        int fd         = fdcache_acquire(fh);
+        if (fd < 0)
+            return -1;
+        addr = segmap_acquire(map, fd, cl->size);
+        fdcache_release(fh);
+    }
+
+    if (!addr)
+        return -1;
+
+    *buf = addr + offset;
+
+    return offset + len > cl->size ? cl->size - offset : len;
+}
+
+void cl_release(const commitlog_t *cl)
+{
+    segmap_release((segmap_t *)&cl->map);
+}
+
+size_t cl_block_header_write(uint8_t *buf, const cl_frame_t *frame)
+{
+    write_u8(buf, CL_BLOCK_V1);
+    buf += sizeof(uint8_t);
+    write_u32(buf, frame->count);
+    buf += sizeof(uint32_t);
+    write_u32(buf, frame->payload_size);
+    buf += sizeof(uint32_t);
+    write_i64(buf, frame->first_ts);
+    buf += sizeof(uint64_t);
+    write_i64(buf, frame->last_ts);
+    return CL_BLOCK_HEADER_SIZE;
+}
+
+ssize_t cl_frame_read(const uint8_t *buf, size_t len, cl_frame_t *frame)
+{
+    if (len == 0)
+        return -1;
+
+    switch (buf[0]) {
+    case CL_FRAME_V0: {
+        // Legacy record, fixed size, a block of a single point
+        if (len < sizeof(uint64_t) * 3)
+            return -1;
+        size_t record_size = read_i64(buf);
+        if (record_size < sizeof(uint64_t) * 3 || record_size > len)
+            return -1;
+        frame->version      = CL_FRAME_V0;
+        frame->count        = 1;
+        frame->first_ts     = read_i64(buf + sizeof(uint64_t));
+        frame->last_ts      = frame->first_ts;
+        frame->payload      = buf + sizeof(uint64_t) * 2;
+        frame->payload_size = sizeof(double_t);
+        return record_size;
+    }
+    case CL_BLOCK_V1: {
+        if (len < CL_BLOCK_HEADER_SIZE)
+            return -1;
+        const uint8_t *ptr = buf + sizeof(uint8_t);
+        frame->version     = CL_BLOCK_V1;
+        frame->count       = read_u32(ptr);
+        ptr += sizeof(uint32_t);
+        frame->payload_size = read_u32(ptr);
+        ptr += sizeof(uint32_t);
+        frame->first_ts = read_i64(ptr);
+        ptr += sizeof(uint64_t);
+        frame->last_ts = read_i64(ptr);
+        ptr += sizeof(uint64_t);
+        frame->payload = ptr;
+        if (CL_BLOCK_HEADER_SIZE + frame->payload_size > len)
+            return -1;
+        return CL_BLOCK_HEADER_SIZE + frame->payload_size;
+    }
+    default:
+        // Unknown version
+        return -1;
+    }
 }
 
 void cl_print(const commitlog_t *cl)
 {
-    if (cl->size == 0)
+    const uint8_t *p = NULL;
+    ssize_t len      = cl_read_at(cl, &p, 0, cl->size);
+    if (len <= 0)
         return;
-    uint8_t buf[4096];
-    uint8_t *p     = &buf[0];
-    ssize_t read   = 0;
-    uint64_t ts    = 0;
-    double_t value = 0.0;
-    ssize_t len    = read_file(cl->fp, buf);
-    while (read < len) {
-        ts    = read_i64(p + sizeof(uint64_t));
-        value = read_f64(p + sizeof(uint64_t) * 2);
-        read += sizeof(uint64_t) * 2 + sizeof(double_t);
-        p += sizeof(uint64_t) * 2 + sizeof(double_t);
-        log_info("%" PRIu64 "-> %.02f", ts, value);
+
+    ssize_t frame_size = 0;
+    uint64_t ts        = 0;
+    double_t value     = 0.0;
+    cl_frame_t frame;
+    gorilla_decoder_t decoder;
+
+    while (len > 0 && (frame_size = cl_frame_read(p, len, &frame)) > 0) {
+        if (frame.version == CL_FRAME_V0) {
+            log_info("%" PRIu64 "-> %.02f", frame.first_ts,
+                     read_f64(frame.payload));
+        } else {
+            gorilla_decoder_init(&decoder, frame.payload, frame.payload_size,
+                                 frame.count);
+            while (gorilla_decoder_next(&decoder, &ts, &value) == 0)
+                log_info("%" PRIu64 "-> %.02f", ts, value);
+        }
+        p += frame_size;
+        len -= frame_size;
     }
+
+    cl_release(cl);
 }
@@ -3,27 +3,99 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "fdcache.h"
+#include "segmap.h"
 #include <stdio.h>
+#include <sys/types.h>
 
+/*
+ * Commit log frames versions, a commit log is a sequence of frames, either
+ * legacy fixed size records or compressed blocks of points.
+ *
+ * - V0 legacy record, 8 bytes length + 8 bytes timestamp + 8 bytes value; the
+ *   length is big-endian encoded, so the first byte is always 0x00
+ * - V1 gorilla compressed block, delta-of-delta timestamps and XOR values
+ */
+#define CL_FRAME_V0 0x00
+#define CL_BLOCK_V1 0x01
+
+// Version u8 + points count u32 + payload size u32 + first ts u64 + last ts u64
+#define CL_BLOCK_HEADER_SIZE                                                   \
+    (sizeof(uint8_t) + (sizeof(uint32_t) * 2) + (sizeof(uint64_t) * 2))
+
+/*
+ * Describes a single frame read from a commit log, a legacy record is seen as
+ * a block of a single point, with the raw value as payload.
+ */
+typedef struct cl_frame {
+    uint8_t version;
+    uint32_t count;
+    uint64_t first_ts;
+    uint64_t last_ts;
+    const uint8_t *payload;
+    size_t payload_size;
+} cl_frame_t;
+
+// Writes the header of a V1 block, returns the number of bytes written
+size_t cl_block_header_write(uint8_t *buf, const cl_frame_t *frame);
+
+// Reads a frame from buf, returns the size of the frame or -1 on error
+ssize_t cl_frame_read(const uint8_t *buf, size_t len, cl_frame_t *frame);
+
+/*
+ * A commit log is paired with a small fixed size meta file, m-<base>.meta,
+ * rewritten each time the log is synced, summing it up: the size of the log
+ * it covers, the number of points and blocks, the first and last timestamps
+ * and the base nanoseconds, checksummed. A log is loaded from its meta alone
+ * when it still covers the whole log, scanned otherwise, as for a log appended
+ * to after its last sync.
+ */
 typedef struct commitlog {
-    FILE *fp;
+    fdhandle_t fh;
+    segmap_t map;
     size_t size;
+    size_t points;
+    size_t blocks;
     uint64_t base_timestamp;
     uint64_t base_ns;
+    uint64_t first_timestamp;
     uint64_t current_timestamp;
 } commitlog_t;
 
 int cl_init(commitlog_t *cl, const char *path, uint64_t base);
 
+// Loads a log from disk, a torn frame at its tail is cut off, returns 1 if
+// so, -1 on error
 int cl_load(commitlog_t *cl, const char *path, uint64_t base);
 
+int cl_close(commitlog_t *cl);
+
+int cl_remove(const char *path, uint64_t base);
+
+int cl_rename(const char *from, const char *to, uint64_t base);
+
 void cl_set_base_ns(commitlog_t *cl, uint64_t ns);
 
+// Writes the meta file of the log, to be called once the log is synced
+int cl_seal(const commitlog_t *cl);
+
 int cl_append_data(commitlog_t *cl, const uint8_t *data, size_t len);
 
 int cl_append_batch(commitlog_t *cl, const uint8_t *batch, size_t len);
 
-int cl_read_at(const commitlog_t *cl, uint8_t **buf, size_t offset, size_t len);
+// Writes a block at offset, past the end of the log, leaving the log as it is
+// until the block is published
+int cl_write_at(commitlog_t *cl, const uint8_t *batch, size_t len,
+                size_t offset);
+
+// Points the commit log to its new directory, once its file is moved there
+int cl_move(commitlog_t *cl, const char *to);
+
+ssize_t cl_read_at(const commitlog_t *cl, const uint8_t **buf, size_t offset,
+                   size_t len);
+
+// Unpins the region of a cl_read_at returning any bytes
+void cl_release(const commitlog_t *cl);
 
 void cl_print(const commitlog_t *cl);
 
@@ -15,6 +15,10 @@
 #define SHARD_LEADERS     "127.0.0.1:8777 127.0.0.1:8877 127.0.0.1:8977"
 #define RAFT_REPLICAS     "127.0.0.1:9777 127.0.0.1:9778"
 #define RAFT_HEARTBEAT_MS "150"
+#define BLOCK_CACHE_MB    "64"
+#define FD_CACHE_SIZE     "512"
+#define RECOVERY_WORKERS  "0"
+#define WAL_SEGMENT_MB    "0"
 
 static config_entry_t *config_map[BUCKET_SIZE] = {0};
 
@@ -52,6 +56,10 @@ void config_set_default(void)
     config_set("shard_leaders", SHARD_LEADERS);
     config_set("raft_replicas", RAFT_REPLICAS);
     config_set("raft_heartbeat_ms", RAFT_HEARTBEAT_MS);
+    config_set("block_cache_mb", BLOCK_CACHE_MB);
+    config_set("fd_cache_size", FD_CACHE_SIZE);
+    config_set("recovery_workers", RECOVERY_WORKERS);
+    config_set("wal_segment_mb", WAL_SEGMENT_MB);
 }
 
 const char *config_get(const char *key)
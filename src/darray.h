@@ -1,6 +1,7 @@
 #ifndef DARRAY_H
 #define DARRAY_H
 
+#include "arena.h"
 #include "logger.h"
 #include <assert.h>
 
@@ -17,17 +18,38 @@
 
 #define da_reset(da) (da)->length = 0
 
-#define da_extend(da)                                                          \
+/*
+ * Growing macros accept an optional arena_t to allocate the items from, NULL
+ * meaning the heap. Arrays backed by an arena must not be freed with da_free,
+ * their memory is given back by resetting or releasing the arena.
+ */
+#define da_extend_in(da, arena)                                                \
     do {                                                                       \
+        size_t old_size = (da)->capacity * sizeof(*(da)->items);               \
         (da)->capacity += 1;                                                   \
         (da)->capacity *= 2;                                                   \
-        (da)->items =                                                          \
-            realloc((da)->items, (da)->capacity * sizeof(*(da)->items));       \
+        if ((arena))                                                           \
+            (da)->items =                                                      \
+                arena_realloc((arena), (da)->items, old_size,                  \
+                              (da)->capacity * sizeof(*(da)->items));          \
+        else                                                                   \
+            (da)->items = realloc((da)->items,                                 \
+                                  (da)->capacity * sizeof(*(da)->items));      \
         if (!(da)->items) {                                                    \
             log_critical("DA realloc failed");                                 \
         }                                                                      \
     } while (0)
 
+#define da_extend(da) da_extend_in((da), (arena_t *)NULL)
+
+#define da_append_in(da, arena, item)                                          \
+    do {                                                                       \
+        assert((da));                                                          \
+        if ((da)->length + 1 >= (da)->capacity)                                \
+            da_extend_in((da), (arena));                                       \
+        (da)->items[(da)->length++] = (item);                                  \
+    } while (0)
+
 #define da_append(da, item)                                                    \
     do {                                                                       \
         assert((da));                                                          \
@@ -1,17 +1,10 @@
 #include "dbcontext.h"
-#include "hash.h"
 #include <dirent.h>
 
 const size_t DBCTX_BASESIZE = 64;
 
 tsdb_ht_t *tsdb_ht          = NULL;
 
-static size_t hash_dbname(const char *name, size_t mapsize)
-{
-    uint32_t hash = murmur3_hash((const uint8_t *)name, 0);
-    return hash % mapsize;
-}
-
 int dbcontext_init(size_t size)
 {
     int count = 0;
@@ -25,11 +18,9 @@ int dbcontext_init(size_t size)
         return -1;
     }
 
-    tsdb_ht->buckets = calloc(size, sizeof(tsdb_ht_entry_t *));
-    if (!tsdb_ht->buckets)
+    if (hashmap_init(&tsdb_ht->dbs, size) < 0)
         goto exit;
 
-    tsdb_ht->size      = size;
     tsdb_ht->active_db = NULL;
 
     // Scan the main data directory for already existing databases and add them
@@ -60,24 +51,51 @@ exit:
     return -1;
 }
 
+static void db_close(const char *name, size_t name_len, void *db,
+                     void *userdata)
+{
+    tsdb_close(db);
+}
+
+typedef struct {
+    size_t workers;
+    int queued;
+} db_recovery_t;
+
+static void db_recover(const char *name, size_t name_len, void *db,
+                       void *userdata)
+{
+    db_recovery_t *r = userdata;
+    int queued       = tsdb_recover(db, r->workers);
+    if (queued > 0)
+        r->queued += queued;
+}
+
+/*
+ * Recover the series of every database in the background, returns the
+ * number of series queued.
+ */
+int dbcontext_recover(size_t workers)
+{
+    if (!tsdb_ht)
+        return 0;
+
+    db_recovery_t r = {.workers = workers};
+    hashmap_foreach(&tsdb_ht->dbs, db_recover, &r);
+
+    return r.queued;
+}
+
 void dbcontext_free(void)
 {
     if (!tsdb_ht) {
         return;
     }
 
-    // Free all entries and their associated databases
-    for (size_t i = 0; i < tsdb_ht->size; i++) {
-        tsdb_ht_entry_t *entry = tsdb_ht->buckets[i];
-        while (entry) {
-            tsdb_ht_entry_t *next = entry->next;
-            tsdb_close(entry->db);
-            free(entry);
-            entry = next;
-        }
-    }
+    // Free all the associated databases
+    hashmap_foreach(&tsdb_ht->dbs, db_close, NULL);
 
-    free(tsdb_ht->buckets);
+    hashmap_free(&tsdb_ht->dbs);
     free(tsdb_ht);
     tsdb_ht = NULL;
 }
@@ -90,39 +108,23 @@ timeseries_db_t *dbcontext_add(const char *name)
         }
     }
 
-    size_t bucket          = hash_dbname(name, tsdb_ht->size);
-
     // Check if database already exists
-    tsdb_ht_entry_t *entry = tsdb_ht->buckets[bucket];
-    while (entry) {
-        if (strcmp(entry->name, name) == 0) {
-            // Database already exists, return it
-            return entry->db;
-        }
-        entry = entry->next;
-    }
+    timeseries_db_t *db = dbcontext_get(name);
+    if (db)
+        return db;
 
-    // Create new database
+    // Create new database, keyed by its own datapath
     timeseries_db_t *new_db = tsdb_create(name);
     if (!new_db) {
         return NULL;
     }
 
-    // Create and populate new entry
-    entry = malloc(sizeof(tsdb_ht_entry_t));
-    if (!entry) {
-        free(new_db);
+    if (hashmap_put(&tsdb_ht->dbs, new_db->datapath, strlen(new_db->datapath),
+                    new_db) < 0) {
+        tsdb_close(new_db);
         return NULL;
     }
 
-    strncpy(entry->name, name, DATAPATH_SIZE - 1);
-    entry->name[DATAPATH_SIZE - 1] = '\0';
-    entry->db                      = new_db;
-
-    // Add to hashtable
-    entry->next                    = tsdb_ht->buckets[bucket];
-    tsdb_ht->buckets[bucket]       = entry;
-
     // Set as active if no active database
     if (!tsdb_ht->active_db) {
         tsdb_ht->active_db = new_db;
@@ -137,17 +139,7 @@ timeseries_db_t *dbcontext_get(const char *name)
         return NULL;
     }
 
-    size_t bucket          = hash_dbname(name, tsdb_ht->size);
-    tsdb_ht_entry_t *entry = tsdb_ht->buckets[bucket];
-
-    while (entry) {
-        if (strcmp(entry->name, name) == 0) {
-            return entry->db;
-        }
-        entry = entry->next;
-    }
-
-    return NULL;
+    return hashmap_get(&tsdb_ht->dbs, name, strlen(name));
 }
 
 int dbcontext_setactive(const char *name)
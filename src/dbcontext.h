@@ -7,15 +7,11 @@
 
 extern const size_t DBCTX_BASESIZE;
 
-typedef struct db_ht_entry {
-    char name[DATAPATH_SIZE];
-    timeseries_db_t *db;
-    struct db_ht_entry *next;
-} tsdb_ht_entry_t;
-
+/*
+ * Databases by name, the key of each one being its datapath.
+ */
 typedef struct db_ht {
-    tsdb_ht_entry_t **buckets;
-    size_t size;
+    hashmap_t dbs;
     timeseries_db_t *active_db; // Track the currently active database
 } tsdb_ht_t;
 
@@ -23,6 +19,7 @@ extern tsdb_ht_t *tsdb_ht;
 
 int dbcontext_init(size_t size);
 void dbcontext_free(void);
+int dbcontext_recover(size_t workers);
 timeseries_db_t *dbcontext_add(const char *name);
 timeseries_db_t *dbcontext_get(const char *name);
 int dbcontext_setactive(const char *name);
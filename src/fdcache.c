@@ -0,0 +1,210 @@
+#include "fdcache.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct {
+    fdhandle_t *head;
+    fdhandle_t *tail;
+    size_t limit;
+    fdcache_stats_t stats;
+    pthread_mutex_t lock;
+} lru = {NULL, NULL, FDCACHE_DEFAULT_LIMIT, {0}, PTHREAD_MUTEX_INITIALIZER};
+
+static void lru_unlink(fdhandle_t *h)
+{
+    if (h->prev)
+        h->prev->next = h->next;
+    else
+        lru.head = h->next;
+
+    if (h->next)
+        h->next->prev = h->prev;
+    else
+        lru.tail = h->prev;
+
+    h->prev = NULL;
+    h->next = NULL;
+}
+
+static void lru_push_front(fdhandle_t *h)
+{
+    h->prev = NULL;
+    h->next = lru.head;
+    if (lru.head)
+        lru.head->prev = h;
+    lru.head = h;
+    if (!lru.tail)
+        lru.tail = h;
+}
+
+static void fdcache_shut(fdhandle_t *h)
+{
+    close(h->fd);
+    h->fd = -1;
+    lru_unlink(h);
+    lru.stats.open--;
+    lru.stats.closes++;
+}
+
+// Closes the least recently used descriptors not pinned, until below limit
+static void fdcache_evict(size_t limit)
+{
+    fdhandle_t *h = lru.tail;
+    while (lru.stats.open > limit && h) {
+        fdhandle_t *prev = h->prev;
+        if (h->pins == 0)
+            fdcache_shut(h);
+        h = prev;
+    }
+}
+
+static int fdcache_open_locked(fdhandle_t *h, int flags)
+{
+    fdcache_evict(lru.limit - 1);
+
+    h->fd = open(h->path, flags, 0644);
+    if (h->fd < 0) {
+        log_error("open %s failed: %s", h->path, strerror(errno));
+        return -1;
+    }
+
+    lru_push_front(h);
+    lru.stats.open++;
+    lru.stats.opens++;
+
+    return 0;
+}
+
+void fdcache_set_limit(size_t limit)
+{
+    pthread_mutex_lock(&lru.lock);
+    lru.limit = limit < 2 ? 2 : limit;
+    fdcache_evict(lru.limit);
+    pthread_mutex_unlock(&lru.lock);
+}
+
+int fdcache_open(fdhandle_t *h, const char *path, int flags)
+{
+    *h = (fdhandle_t){.fd = -1};
+
+    h->path = strdup(path);
+    if (!h->path)
+        return -1;
+
+    pthread_mutex_lock(&lru.lock);
+    int err = fdcache_open_locked(h, flags);
+    pthread_mutex_unlock(&lru.lock);
+
+    if (err < 0) {
+        free(h->path);
+        h->path = NULL;
+    }
+
+    return err;
+}
+
+int fdcache_acquire(fdhandle_t *h)
+{
+    pthread_mutex_lock(&lru.lock);
+
+    int err = 0;
+    if (h->fd >= 0) {
+        if (lru.head != h) {
+            lru_unlink(h);
+            lru_push_front(h);
+        }
+        lru.stats.hits++;
+    } else {
+        lru.stats.misses++;
+        err = fdcache_open_locked(h, O_RDWR);
+    }
+
+    if (err == 0)
+        h->pins++;
+
+    int fd = h->fd;
+
+    pthread_mutex_unlock(&lru.lock);
+
+    return err < 0 ? -1 : fd;
+}
+
+void fdcache_release(fdhandle_t *h)
+{
+    pthread_mutex_lock(&lru.lock);
+    if (h->pins > 0)
+        h->pins--;
+    // Pinned handles may have pushed the count past the limit
+    if (h->pins == 0 && lru.stats.open > lru.limit)
+        fdcache_evict(lru.limit);
+    pthread_mutex_unlock(&lru.lock);
+}
+
+/*
+ * The data written through a descriptor closed meanwhile still belongs to the
+ * file, syncing any descriptor open on it is enough.
+ */
+int fdcache_sync(fdhandle_t *h)
+{
+    int fd = fdcache_acquire(h);
+    if (fd < 0)
+        return -1;
+
+#ifdef __APPLE__
+    int err = fsync(fd);
+#else
+    int err = fdatasync(fd);
+#endif
+
+    fdcache_release(h);
+
+    return err;
+}
+
+int fdcache_rename(fdhandle_t *h, const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return -1;
+
+    pthread_mutex_lock(&lru.lock);
+    free(h->path);
+    h->path = copy;
+    pthread_mutex_unlock(&lru.lock);
+
+    return 0;
+}
+
+void fdcache_close(fdhandle_t *h)
+{
+    pthread_mutex_lock(&lru.lock);
+    if (h->fd >= 0)
+        fdcache_shut(h);
+    h->pins = 0;
+    pthread_mutex_unlock(&lru.lock);
+
+    free(h->path);
+    h->path = NULL;
+}
+
+void fdcache_stats(fdcache_stats_t *stats)
+{
+    pthread_mutex_lock(&lru.lock);
+    *stats       = lru.stats;
+    stats->limit = lru.limit;
+    pthread_mutex_unlock(&lru.lock);
+}
+
+void fdcache_reset_stats(void)
+{
+    pthread_mutex_lock(&lru.lock);
+    size_t open = lru.stats.open;
+    lru.stats   = (fdcache_stats_t){.open = open};
+    pthread_mutex_unlock(&lru.lock);
+}
@@ -0,0 +1,68 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FDCACHE_DEFAULT_LIMIT 512
+
+/*
+ * File descriptor of a segment file (commit log or index), opened on demand
+ * and tracked by a process-wide LRU list which caps the number of descriptors
+ * open, closing the least recently used ones. A handle closed that way keeps
+ * its path and is reopened transparently on the next access.
+ *
+ * A handle is pinned while in use, a pinned descriptor is never closed by the
+ * LRU, the limit is exceeded if every open handle is pinned. Hot files, like
+ * the partition flushed into, are kept pinned to stay open.
+ *
+ * The LRU list is guarded by a lock, handles are acquired by the background
+ * flusher while queries acquire others.
+ */
+typedef struct fdhandle {
+    char *path;
+    int fd;
+    size_t pins;
+    struct fdhandle *prev;
+    struct fdhandle *next;
+} fdhandle_t;
+
+typedef struct fdcache_stats {
+    size_t hits;
+    size_t misses;
+    size_t opens;
+    size_t closes;
+    size_t open;
+    size_t limit;
+} fdcache_stats_t;
+
+// Sets the maximum number of descriptors open, at least 2 to allow for a
+// commit log and its index to be open at the same time
+void fdcache_set_limit(size_t limit);
+
+// Opens the file at path with the given open(2) flags, O_RDWR plus O_CREAT
+// or O_TRUNC, reopened with O_RDWR alone later on, returns -1 on error
+int fdcache_open(fdhandle_t *h, const char *path, int flags);
+
+// Returns the descriptor of the file, reopened if it was closed, pinned until
+// released, -1 on error
+int fdcache_acquire(fdhandle_t *h);
+
+// Unpins a handle acquired
+void fdcache_release(fdhandle_t *h);
+
+// Flushes the data written to the file to disk, returns -1 on error
+int fdcache_sync(fdhandle_t *h);
+
+// Points the handle to the new path of its file, once moved
+int fdcache_rename(fdhandle_t *h, const char *path);
+
+// Closes the descriptor, whatever its pins, and frees the handle path
+void fdcache_close(fdhandle_t *h);
+
+void fdcache_stats(fdcache_stats_t *stats);
+
+// Zeroes the counters, the descriptors open are kept
+void fdcache_reset_stats(void);
+
+#endif
@@ -0,0 +1,261 @@
+#include "gorilla.h"
+#include <string.h>
+
+// Delta-of-delta buckets, each one selected by a prefix of 1s terminated by a
+// 0, the last one (five 1s) carries the full 64 bits value
+static const int DOD_BUCKETS[]     = {7, 9, 12, 32};
+static const size_t DOD_BUCKETS_NR = sizeof(DOD_BUCKETS) / sizeof(int);
+
+static inline uint64_t f64_bits(double_t value)
+{
+    double v = value;
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+static inline double_t bits_f64(uint64_t bits)
+{
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static void bits_write(gorilla_encoder_t *e, uint64_t value, int nbits)
+{
+    while (nbits > 0) {
+        size_t byte   = e->bitpos >> 3;
+        int offset    = e->bitpos & 7;
+        int free_bits = 8 - offset;
+        int n         = nbits < free_bits ? nbits : free_bits;
+        uint8_t chunk = (value >> (nbits - n)) & ((1u << n) - 1);
+
+        // Every new byte is cleared first, no need to zero the buffer
+        if (offset == 0)
+            e->buf[byte] = 0;
+
+        e->buf[byte] |= chunk << (free_bits - n);
+        e->bitpos += n;
+        nbits -= n;
+    }
+}
+
+static int bits_read(gorilla_decoder_t *d, int nbits, uint64_t *out)
+{
+    if (d->bitpos + nbits > d->size * 8)
+        return -1;
+
+    uint64_t value = 0;
+    while (nbits > 0) {
+        size_t byte   = d->bitpos >> 3;
+        int offset    = d->bitpos & 7;
+        int free_bits = 8 - offset;
+        int n         = nbits < free_bits ? nbits : free_bits;
+        uint8_t chunk = (d->buf[byte] >> (free_bits - n)) & ((1u << n) - 1);
+
+        value         = (value << n) | chunk;
+        d->bitpos += n;
+        nbits -= n;
+    }
+
+    *out = value;
+    return 0;
+}
+
+static inline int fits_signed(int64_t value, int nbits)
+{
+    int64_t limit = (int64_t)1 << (nbits - 1);
+    return value >= -limit && value < limit;
+}
+
+static void dod_write(gorilla_encoder_t *e, int64_t dod)
+{
+    if (dod == 0) {
+        bits_write(e, 0, 1);
+        return;
+    }
+
+    for (size_t i = 0; i < DOD_BUCKETS_NR; ++i) {
+        if (fits_signed(dod, DOD_BUCKETS[i])) {
+            // i + 1 ones followed by a zero
+            bits_write(e, ((1ULL << (i + 1)) - 1) << 1, i + 2);
+            bits_write(e, (uint64_t)dod, DOD_BUCKETS[i]);
+            return;
+        }
+    }
+
+    bits_write(e, 0x1F, 5);
+    bits_write(e, (uint64_t)dod, 64);
+}
+
+static int dod_read(gorilla_decoder_t *d, int64_t *dod)
+{
+    uint64_t bit = 0;
+    size_t ones  = 0;
+
+    // Count the prefix 1s, up to the widest bucket
+    while (ones <= DOD_BUCKETS_NR) {
+        if (bits_read(d, 1, &bit) < 0)
+            return -1;
+        if (bit == 0)
+            break;
+        ones++;
+    }
+
+    if (ones == 0) {
+        *dod = 0;
+        return 0;
+    }
+
+    int nbits    = ones > DOD_BUCKETS_NR ? 64 : DOD_BUCKETS[ones - 1];
+    uint64_t raw = 0;
+    if (bits_read(d, nbits, &raw) < 0)
+        return -1;
+
+    // Sign extend
+    *dod = nbits == 64 ? (int64_t)raw
+                       : (int64_t)(raw << (64 - nbits)) >> (64 - nbits);
+    return 0;
+}
+
+static void xor_write(gorilla_encoder_t *e, uint64_t value)
+{
+    uint64_t xor = value ^ e->prev_value;
+
+    if (xor == 0) {
+        bits_write(e, 0, 1);
+        return;
+    }
+
+    int leading  = __builtin_clzll(xor);
+    int trailing = __builtin_ctzll(xor);
+
+    // 5 bits to store the leading zeros count
+    if (leading > 31)
+        leading = 31;
+
+    if (e->prev_leading >= 0 && leading >= e->prev_leading &&
+        trailing >= e->prev_trailing) {
+        // Fits in the previous window, reuse it
+        int meaningful = 64 - e->prev_leading - e->prev_trailing;
+        bits_write(e, 0x2, 2);
+        bits_write(e, xor >> e->prev_trailing, meaningful);
+        return;
+    }
+
+    int meaningful = 64 - leading - trailing;
+    bits_write(e, 0x3, 2);
+    bits_write(e, leading, 5);
+    // Meaningful bits are in the range [1, 64], store them as length - 1
+    bits_write(e, meaningful - 1, 6);
+    bits_write(e, xor >> trailing, meaningful);
+
+    e->prev_leading  = leading;
+    e->prev_trailing = trailing;
+}
+
+static int xor_read(gorilla_decoder_t *d, uint64_t *value)
+{
+    uint64_t bit = 0;
+    if (bits_read(d, 1, &bit) < 0)
+        return -1;
+
+    if (bit == 0) {
+        *value = d->prev_value;
+        return 0;
+    }
+
+    if (bits_read(d, 1, &bit) < 0)
+        return -1;
+
+    if (bit == 1) {
+        uint64_t leading = 0, meaningful = 0;
+        if (bits_read(d, 5, &leading) < 0 || bits_read(d, 6, &meaningful) < 0)
+            return -1;
+        d->prev_leading  = leading;
+        d->prev_trailing = 64 - leading - (meaningful + 1);
+        if (d->prev_trailing < 0)
+            return -1;
+    } else if (d->prev_leading < 0) {
+        // Previous window reused before being ever set
+        return -1;
+    }
+
+    int meaningful = 64 - d->prev_leading - d->prev_trailing;
+    uint64_t xor   = 0;
+    if (bits_read(d, meaningful, &xor) < 0)
+        return -1;
+
+    *value = d->prev_value ^ (xor << d->prev_trailing);
+    return 0;
+}
+
+void gorilla_encoder_init(gorilla_encoder_t *e, uint8_t *buf)
+{
+    *e               = (gorilla_encoder_t){0};
+    e->buf           = buf;
+    e->prev_leading  = -1;
+    e->prev_trailing = -1;
+}
+
+void gorilla_encoder_append(gorilla_encoder_t *e, uint64_t ts, double_t value)
+{
+    uint64_t bits = f64_bits(value);
+
+    if (e->count == 0) {
+        bits_write(e, ts, 64);
+        bits_write(e, bits, 64);
+    } else {
+        int64_t delta = (int64_t)(ts - e->prev_ts);
+        dod_write(e, delta - e->prev_delta);
+        xor_write(e, bits);
+        e->prev_delta = delta;
+    }
+
+    e->prev_ts    = ts;
+    e->prev_value = bits;
+    e->count++;
+}
+
+size_t gorilla_encoder_size(const gorilla_encoder_t *e)
+{
+    return (e->bitpos + 7) / 8;
+}
+
+void gorilla_decoder_init(gorilla_decoder_t *d, const uint8_t *buf, size_t size,
+                          size_t count)
+{
+    *d               = (gorilla_decoder_t){0};
+    d->buf           = buf;
+    d->size          = size;
+    d->count         = count;
+    d->prev_leading  = -1;
+    d->prev_trailing = -1;
+}
+
+int gorilla_decoder_next(gorilla_decoder_t *d, uint64_t *ts, double_t *value)
+{
+    if (d->index >= d->count)
+        return -1;
+
+    uint64_t bits = 0;
+
+    if (d->index == 0) {
+        if (bits_read(d, 64, &d->prev_ts) < 0 || bits_read(d, 64, &bits) < 0)
+            return -1;
+    } else {
+        int64_t dod = 0;
+        if (dod_read(d, &dod) < 0 || xor_read(d, &bits) < 0)
+            return -1;
+        d->prev_delta += dod;
+        d->prev_ts += d->prev_delta;
+    }
+
+    d->prev_value = bits;
+    d->index++;
+
+    *ts           = d->prev_ts;
+    *value        = bits_f64(bits);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Upper bound of bits required to encode a single point, the worst case is
+ * represented by a delta-of-delta falling into the widest bucket (5 bits
+ * control + 64 bits) and a XOR value with a new window (2 bits control + 5
+ * bits leading zeros + 6 bits length + 64 bits).
+ */
+#define GORILLA_MAX_POINT_BITS 146
+
+// Upper bound in bytes for a stream of `count` points
+#define GORILLA_MAX_SIZE(count)                                                \
+    ((((count) * GORILLA_MAX_POINT_BITS) + 7) / 8)
+
+/**
+ ** Gorilla-style compression for (timestamp, value) streams, as described in
+ ** "Gorilla: A Fast, Scalable, In-Memory Time Series Database" (Pelkonen et
+ ** al., VLDB 2015).
+ **
+ ** - Timestamps are stored as delta-of-delta, zero for regular intervals,
+ **   using a variable length prefix to select the size of the bucket
+ ** - Values are XOR'ed with the previous one, storing only the meaningful
+ **   bits, slowly changing series usually collapse to a single bit per point
+ **
+ ** The first point of the stream is stored raw (64 bits timestamp and 64 bits
+ ** value), which makes each stream self-contained and decodable on its own.
+ **/
+
+typedef struct gorilla_encoder {
+    uint8_t *buf;
+    size_t bitpos;
+    size_t count;
+    uint64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;
+    int prev_leading;
+    int prev_trailing;
+} gorilla_encoder_t;
+
+typedef struct gorilla_decoder {
+    const uint8_t *buf;
+    size_t size;
+    size_t bitpos;
+    size_t count;
+    size_t index;
+    uint64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;
+    int prev_leading;
+    int prev_trailing;
+} gorilla_decoder_t;
+
+// Initializes an encoder writing into buf, expected to be big enough to hold
+// GORILLA_MAX_SIZE(n) bytes for the n points that will be appended
+void gorilla_encoder_init(gorilla_encoder_t *e, uint8_t *buf);
+
+// Appends a point to the stream
+void gorilla_encoder_append(gorilla_encoder_t *e, uint64_t ts, double_t value);
+
+// Returns the number of bytes written so far, including the padding of the
+// last byte
+size_t gorilla_encoder_size(const gorilla_encoder_t *e);
+
+// Initializes a decoder reading count points from a buffer of size bytes
+void gorilla_decoder_init(gorilla_decoder_t *d, const uint8_t *buf, size_t size,
+                          size_t count);
+
+// Decodes the next point of the stream, returns 0 on success, -1 when the
+// stream is exhausted or malformed
+int gorilla_decoder_next(gorilla_decoder_t *d, uint64_t *ts, double_t *value);
+
+#endif
@@ -24,6 +24,23 @@ uint32_t murmur3_hash(const uint8_t *in, uint32_t seed)
     return h;
 }
 
+/*
+ * 64 bit FNV-1a over len bytes, finished with a multiply-shift mix so that
+ * the low bits, used to pick a slot, depend on the whole key.
+ */
+uint64_t fnv1a_hash(const uint8_t *in, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= in[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
 int32_t sha256_hash(const uint8_t *in, size_t len, uint8_t out[SHA256_SIZE])
 {
     return lonesha256(out, in, len);
@@ -8,6 +8,7 @@
 
 uint32_t simple_hash(const uint8_t *in);
 uint32_t murmur3_hash(const uint8_t *in, uint32_t seed);
+uint64_t fnv1a_hash(const uint8_t *in, size_t len);
 int32_t sha256_hash(const uint8_t *in, size_t len, uint8_t out[SHA256_SIZE]);
 
 #endif
@@ -0,0 +1,211 @@
+#include "hashmap.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Old slots moved to the new table on each write while resizing
+#define HASHMAP_MIGRATE_STEP 64
+
+// Marks a slot emptied by a removal, probes go past it
+static const char tombstone[1];
+
+static inline int slot_live(const hashmap_slot_t *s)
+{
+    return s->key && s->key != tombstone;
+}
+
+static int table_init(hashmap_table_t *t, size_t capacity)
+{
+    *t       = (hashmap_table_t){0};
+    t->slots = calloc(capacity, sizeof(*t->slots));
+    if (!t->slots)
+        return -1;
+
+    t->capacity = capacity;
+
+    return 0;
+}
+
+static void table_free(hashmap_table_t *t)
+{
+    free(t->slots);
+    *t = (hashmap_table_t){0};
+}
+
+static hashmap_slot_t *table_find(const hashmap_table_t *t, const char *key,
+                                  size_t key_len, uint64_t hash)
+{
+    if (t->length == 0)
+        return NULL;
+
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        hashmap_slot_t *s = &t->slots[i];
+        if (!s->key)
+            return NULL;
+        if (s->hash == hash && s->key_len == key_len && s->key != tombstone &&
+            memcmp(s->key, key, key_len) == 0)
+            return s;
+    }
+}
+
+// Stores an entry known to be missing, the table must have room for it
+static void table_insert(hashmap_table_t *t, const hashmap_slot_t *entry)
+{
+    size_t mask = t->capacity - 1;
+    size_t i    = entry->hash & mask;
+
+    while (slot_live(&t->slots[i]))
+        i = (i + 1) & mask;
+
+    if (t->slots[i].key == tombstone)
+        t->tombstones--;
+
+    t->slots[i] = *entry;
+    t->length++;
+}
+
+static void table_remove(hashmap_table_t *t, hashmap_slot_t *s)
+{
+    *s = (hashmap_slot_t){.key = tombstone};
+    t->length--;
+    t->tombstones++;
+}
+
+/*
+ * Move up to n slots of the old table to the new one, a slot moved becomes a
+ * tombstone so that the probes of the old table still reach the entries not
+ * moved yet.
+ */
+static void hashmap_migrate(hashmap_t *hm, size_t n)
+{
+    if (!hm->old.slots)
+        return;
+
+    for (; n > 0 && hm->migrated < hm->old.capacity; --n, ++hm->migrated) {
+        hashmap_slot_t *s = &hm->old.slots[hm->migrated];
+        if (!slot_live(s))
+            continue;
+        table_insert(&hm->table, s);
+        table_remove(&hm->old, s);
+    }
+
+    if (hm->migrated == hm->old.capacity)
+        table_free(&hm->old);
+}
+
+/*
+ * Start moving to a new table once the current one is three quarters full,
+ * tombstones included, twice as large unless it's mostly tombstones. The
+ * entries of a previous resize still pending go straight to the new table.
+ */
+static int hashmap_grow(hashmap_t *hm)
+{
+    hashmap_table_t *t = &hm->table;
+    if ((t->length + t->tombstones + 1) * 4 <= t->capacity * 3)
+        return 0;
+
+    size_t capacity = t->capacity;
+    while ((hashmap_length(hm) + 1) * 2 > capacity)
+        capacity *= 2;
+
+    hashmap_table_t fresh;
+    if (table_init(&fresh, capacity) < 0)
+        return -1;
+
+    for (size_t i = hm->migrated; i < hm->old.capacity; ++i)
+        if (slot_live(&hm->old.slots[i]))
+            table_insert(&fresh, &hm->old.slots[i]);
+
+    table_free(&hm->old);
+    hm->old      = *t;
+    hm->table    = fresh;
+    hm->migrated = 0;
+
+    return 0;
+}
+
+int hashmap_init(hashmap_t *hm, size_t capacity)
+{
+    size_t size = 8;
+    while (size * 3 < (capacity ? capacity : HASHMAP_BASESIZE) * 4)
+        size *= 2;
+
+    hm->old      = (hashmap_table_t){0};
+    hm->migrated = 0;
+
+    return table_init(&hm->table, size);
+}
+
+void hashmap_free(hashmap_t *hm)
+{
+    table_free(&hm->table);
+    table_free(&hm->old);
+    hm->migrated = 0;
+}
+
+void *hashmap_get(const hashmap_t *hm, const char *key, size_t key_len)
+{
+    uint64_t hash     = fnv1a_hash((const uint8_t *)key, key_len);
+    hashmap_slot_t *s = table_find(&hm->table, key, key_len, hash);
+    if (!s && hm->old.slots)
+        s = table_find(&hm->old, key, key_len, hash);
+
+    return s ? s->value : NULL;
+}
+
+int hashmap_put(hashmap_t *hm, const char *key, size_t key_len, void *value)
+{
+    uint64_t hash = fnv1a_hash((const uint8_t *)key, key_len);
+    if (table_find(&hm->table, key, key_len, hash) ||
+        (hm->old.slots && table_find(&hm->old, key, key_len, hash)))
+        return 0;
+
+    hashmap_migrate(hm, HASHMAP_MIGRATE_STEP);
+
+    if (hashmap_grow(hm) < 0)
+        return -1;
+
+    hashmap_slot_t entry = {
+        .key = key, .key_len = key_len, .hash = hash, .value = value};
+    table_insert(&hm->table, &entry);
+
+    return 1;
+}
+
+void *hashmap_del(hashmap_t *hm, const char *key, size_t key_len)
+{
+    uint64_t hash          = fnv1a_hash((const uint8_t *)key, key_len);
+    hashmap_table_t *t     = &hm->table;
+    hashmap_slot_t *s      = table_find(t, key, key_len, hash);
+    if (!s && hm->old.slots) {
+        t = &hm->old;
+        s = table_find(t, key, key_len, hash);
+    }
+
+    if (!s)
+        return NULL;
+
+    void *value = s->value;
+    table_remove(t, s);
+
+    return value;
+}
+
+size_t hashmap_length(const hashmap_t *hm)
+{
+    return hm->table.length + hm->old.length;
+}
+
+void hashmap_foreach(const hashmap_t *hm, hashmap_fn fn, void *userdata)
+{
+    const hashmap_table_t *tables[2] = {&hm->old, &hm->table};
+
+    for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < tables[i]->capacity; ++j) {
+            const hashmap_slot_t *s = &tables[i]->slots[j];
+            if (slot_live(s))
+                fn(s->key, s->key_len, s->value, userdata);
+        }
+    }
+}
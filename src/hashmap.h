@@ -0,0 +1,66 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASHMAP_BASESIZE 64
+
+/*
+ * Open addressing hash table of string keys, probed linearly, each slot
+ * caching the hash and the length of its key so that probes only compare the
+ * bytes of keys that are likely equal. Keys are not copied, they must live as
+ * long as their entry, usually as a field of the value itself.
+ *
+ * The table doubles once three quarters full, the entries are moved to the
+ * new one incrementally, a few slots on each write, lookups probing both
+ * tables until the old one is drained. Entries removed leave a tombstone,
+ * swept by the next resize.
+ */
+typedef struct hashmap_slot {
+    const char *key;
+    size_t key_len;
+    uint64_t hash;
+    void *value;
+} hashmap_slot_t;
+
+typedef struct hashmap_table {
+    hashmap_slot_t *slots;
+    size_t capacity;
+    size_t length;
+    size_t tombstones;
+} hashmap_table_t;
+
+typedef struct hashmap {
+    hashmap_table_t table;
+    hashmap_table_t old;
+    size_t migrated;
+} hashmap_t;
+
+typedef void (*hashmap_fn)(const char *key, size_t key_len, void *value,
+                           void *userdata);
+
+// Initializes an empty table sized for capacity entries, 0 to use the default
+int hashmap_init(hashmap_t *hm, size_t capacity);
+
+// Frees the slots, keys and values are left to the caller
+void hashmap_free(hashmap_t *hm);
+
+// Returns the value of key, NULL if missing
+void *hashmap_get(const hashmap_t *hm, const char *key, size_t key_len);
+
+// Adds a key, returns 1 if added, 0 if it's already there, its value left
+// untouched, -1 on error
+int hashmap_put(hashmap_t *hm, const char *key, size_t key_len, void *value);
+
+// Removes a key, returns its value, NULL if missing
+void *hashmap_del(hashmap_t *hm, const char *key, size_t key_len);
+
+// Number of entries
+size_t hashmap_length(const hashmap_t *hm);
+
+// Calls fn on each entry, in no particular order, the table must not be
+// written meanwhile
+void hashmap_foreach(const hashmap_t *hm, hashmap_fn fn, void *userdata);
+
+#endif
@@ -1,13 +1,103 @@
 #include "index.h"
 #include "binary.h"
+#include "darray.h"
 #include "logger.h"
 #include "storage.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// Magic u32 + version u8 + padding, to keep the entries 8 bytes aligned
+static const uint8_t HEADER[]   = {'T', 'S', 'I', 'X', INDEX_V1, 0, 0, 0};
+static const size_t HEADER_SIZE = sizeof(HEADER);
+
 // relative timestamp -> main segment offset position in the file
-static const size_t ENTRY_SIZE = sizeof(uint64_t) * 2;
-static const size_t INDEX_SIZE = 1 << 12;
+static const size_t ENTRY_V0_SIZE = sizeof(uint64_t) * 2;
+
+// V0 entry + relative last, min and max timestamps + count u64 + sum, min,
+// max, first and last values f64
+static const size_t ENTRY_V1_SIZE = sizeof(uint64_t) * 11;
+
+static size_t entry_size(const index_t *pi)
+{
+    return pi->version == INDEX_V1 ? ENTRY_V1_SIZE : ENTRY_V0_SIZE;
+}
+
+static size_t entry_write(const index_t *pi, uint8_t *buf,
+                          const index_entry_t *entry)
+{
+    uint64_t base_ts = pi->base_timestamp * (uint64_t)1e9;
+
+    write_i64(buf, entry->relative_ts);
+    write_i64(buf + 8, entry->offset);
+    if (pi->version == INDEX_V0)
+        return ENTRY_V0_SIZE;
+
+    const index_summary_t *s = &entry->summary;
+    write_i64(buf + 16, s->last_ts - base_ts);
+    write_i64(buf + 24, s->count);
+    write_i64(buf + 32, s->min_ts - base_ts);
+    write_i64(buf + 40, s->max_ts - base_ts);
+    write_f64(buf + 48, s->sum);
+    write_f64(buf + 56, s->min);
+    write_f64(buf + 64, s->max);
+    write_f64(buf + 72, s->first);
+    write_f64(buf + 80, s->last);
+
+    return ENTRY_V1_SIZE;
+}
+
+static void entry_read(const index_t *pi, const uint8_t *buf,
+                       index_entry_t *entry)
+{
+    uint64_t base_ts = pi->base_timestamp * (uint64_t)1e9;
+
+    entry->relative_ts = read_i64(buf);
+    entry->offset      = read_i64(buf + 8);
+    entry->summary     = (index_summary_t){0};
+    if (pi->version == INDEX_V0)
+        return;
+
+    index_summary_t *s = &entry->summary;
+    s->first_ts        = entry->relative_ts + base_ts;
+    s->last_ts         = read_i64(buf + 16) + base_ts;
+    s->count           = read_i64(buf + 24);
+    s->min_ts          = read_i64(buf + 32) + base_ts;
+    s->max_ts          = read_i64(buf + 40) + base_ts;
+    s->sum             = read_f64(buf + 48);
+    s->min             = read_f64(buf + 56);
+    s->max             = read_f64(buf + 64);
+    s->first           = read_f64(buf + 72);
+    s->last            = read_f64(buf + 80);
+}
+
+static int index_write(index_t *pi, const uint8_t *buf, size_t len,
+                       size_t offset)
+{
+    int fd = fdcache_acquire(&pi->fh);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = pwrite(fd, buf, len, offset);
+    fdcache_release(&pi->fh);
+
+    return n < 0 || (size_t)n < len ? -1 : 0;
+}
+
+static int header_write(index_t *pi)
+{
+    if (index_write(pi, HEADER, HEADER_SIZE, 0) < 0)
+        return -1;
+
+    pi->size    = HEADER_SIZE;
+    pi->version = INDEX_V1;
+
+    return 0;
+}
 
 int index_init(index_t *pi, const char *path, uint64_t base)
 {
@@ -15,111 +105,276 @@ int index_init(index_t *pi, const char *path, uint64_t base)
     snprintf(path_buf, sizeof(path_buf), "%s/i-%.20" PRIu64 ".index", path,
              base);
 
-    pi->fp = fopen(path_buf, "w+");
-    if (!pi->fp)
+    if (fdcache_open(&pi->fh, path_buf, O_RDWR | O_CREAT | O_TRUNC) < 0)
         return -1;
 
+    pi->entries        = (index_entry_array_t){0};
     pi->size           = 0;
     pi->base_timestamp = base;
+    pi->loaded         = 1;
+
+    return header_write(pi);
+}
 
+int index_close(index_t *pi)
+{
+    da_free(&pi->entries);
+    fdcache_close(&pi->fh);
     return 0;
 }
 
-int index_close(index_t *pi) { return fclose(pi->fp); }
+int index_remove(const char *path, uint64_t base)
+{
+    char path_buf[PATHBUF_SIZE];
+    snprintf(path_buf, sizeof(path_buf), "%s/i-%.20" PRIu64 ".index", path,
+             base);
 
-int index_load(index_t *pi, const char *path, uint64_t base)
+    return unlink(path_buf);
+}
+
+int index_rename(const char *from, const char *to, uint64_t base)
+{
+    char from_buf[PATHBUF_SIZE], to_buf[PATHBUF_SIZE];
+    snprintf(from_buf, sizeof(from_buf), "%s/i-%.20" PRIu64 ".index", from,
+             base);
+    snprintf(to_buf, sizeof(to_buf), "%s/i-%.20" PRIu64 ".index", to, base);
+
+    return rename(from_buf, to_buf);
+}
+
+int index_move(index_t *pi, const char *to)
+{
+    char path_buf[PATHBUF_SIZE];
+    snprintf(path_buf, sizeof(path_buf), "%s/i-%.20" PRIu64 ".index", to,
+             pi->base_timestamp);
+
+    return fdcache_rename(&pi->fh, path_buf);
+}
+
+/*
+ * Opens the index without reading its entries, just its header, the size is
+ * trimmed to whole entries, a trailing partial one is the result of a torn
+ * write and is dropped.
+ */
+int index_open(index_t *pi, const char *path, uint64_t base)
 {
     char path_buf[PATHBUF_SIZE];
     snprintf(path_buf, sizeof(path_buf), "%s/i-%.20" PRIu64 ".index", path,
              base);
 
-    pi->fp = fopen(path_buf, "r");
-    if (!pi->fp)
+    if (fdcache_open(&pi->fh, path_buf, O_RDWR) < 0)
+        return -1;
+
+    struct stat st;
+    uint8_t header[HEADER_SIZE];
+    int fd = fdcache_acquire(&pi->fh);
+    if (fd < 0)
+        return -1;
+
+    int err = fstat(fd, &st);
+    ssize_t n =
+        err < 0 || st.st_size == 0 ? 0 : pread(fd, header, HEADER_SIZE, 0);
+    fdcache_release(&pi->fh);
+    if (err < 0 || n < 0)
         return -1;
 
-    pi->size           = filesize(pi->fp, 0);
+    pi->entries        = (index_entry_array_t){0};
+    pi->size           = st.st_size;
     pi->base_timestamp = base;
+    pi->loaded         = 1;
+
+    if (pi->size == 0)
+        return header_write(pi);
+
+    size_t header_size = 0;
+    pi->version        = INDEX_V0;
+    if (n == (ssize_t)HEADER_SIZE && memcmp(header, HEADER, HEADER_SIZE) == 0) {
+        header_size = HEADER_SIZE;
+        pi->version = INDEX_V1;
+    }
+
+    size_t size = entry_size(pi);
+    pi->size    = header_size + (pi->size - header_size) / size * size;
+    pi->loaded  = pi->size == header_size;
 
     return 0;
 }
 
-int index_append(index_t *pi, uint64_t ts, uint64_t offset)
+/*
+ * Read the whole index in memory once, it's mapped on its own just for the
+ * time needed to decode it, out of the segments LRU.
+ */
+int index_entries_load(index_t *pi)
 {
-    uint64_t relative_ts = ts - (pi->base_timestamp * (uint64_t)1e9);
+    if (pi->loaded)
+        return 0;
 
-    // Serialize the position into integer 64bits
-    uint8_t buf[ENTRY_SIZE];
-    write_i64(buf, relative_ts);
-    write_i64(buf + sizeof(uint64_t), offset);
+    int fd = fdcache_acquire(&pi->fh);
+    if (fd < 0)
+        return -1;
 
-    if (pwrite(fileno(pi->fp), buf, ENTRY_SIZE, pi->size) < 0) {
-        perror("pwrite");
+    void *addr = mmap(NULL, pi->size, PROT_READ, MAP_SHARED, fd, 0);
+    fdcache_release(&pi->fh);
+    if (addr == MAP_FAILED) {
+        log_error("index mmap failed: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t header     = pi->version == INDEX_V1 ? HEADER_SIZE : 0;
+    size_t size       = entry_size(pi);
+    size_t nr_entries = (pi->size - header) / size;
+    pi->entries.items = malloc(nr_entries * sizeof(index_entry_t));
+    if (!pi->entries.items) {
+        munmap(addr, pi->size);
         return -1;
     }
+    pi->entries.capacity = nr_entries;
+
+    const uint8_t *ptr = (const uint8_t *)addr + header;
+    for (size_t i = 0; i < nr_entries; ++i) {
+        entry_read(pi, ptr, &pi->entries.items[pi->entries.length++]);
+        ptr += size;
+    }
 
-    pi->size += ENTRY_SIZE;
+    munmap(addr, pi->size);
+    pi->loaded = 1;
 
     return 0;
 }
 
-int index_find(const index_t *pi, uint64_t ts, range_t *r)
+int index_trim(index_t *pi, uint64_t offset)
 {
-    if (pi->size == 0) {
-        *r = (range_t){0, 0};
+    if (index_entries_load(pi) < 0)
+        return -1;
+
+    size_t i = pi->entries.length;
+    while (i > 0 && pi->entries.items[i - 1].offset >= offset)
+        i--;
+
+    if (i == pi->entries.length)
         return 0;
+
+    size_t header      = pi->version == INDEX_V1 ? HEADER_SIZE : 0;
+    pi->entries.length = i;
+    pi->size           = header + i * entry_size(pi);
+
+    int fd = fdcache_acquire(&pi->fh);
+    if (fd < 0)
+        return -1;
+
+    int err = ftruncate(fd, pi->size);
+    fdcache_release(&pi->fh);
+
+    return err;
+}
+
+int index_load(index_t *pi, const char *path, uint64_t base)
+{
+    if (index_open(pi, path, base) < 0)
+        return -1;
+
+    return index_entries_load(pi);
+}
+
+// Entries are read on first use, queries see the index as const
+static const index_t *index_ensure(const index_t *pi)
+{
+    if (!pi->loaded && index_entries_load((index_t *)pi) < 0)
+        log_error("Failed to read index %s", pi->fh.path);
+
+    return pi;
+}
+
+ssize_t index_write_at(index_t *pi, uint64_t ts, uint64_t offset,
+                       const index_summary_t *summary, size_t at,
+                       index_entry_t *entry)
+{
+    *entry = (index_entry_t){
+        .relative_ts = ts - (pi->base_timestamp * (uint64_t)1e9),
+        .offset      = offset,
+    };
+
+    // Appends to a V0 index stay V0, the summary is just dropped
+    if (summary && pi->version == INDEX_V1)
+        entry->summary = *summary;
+
+    // Serialize the entry into integers and floats 64bits
+    uint8_t buf[ENTRY_V1_SIZE];
+    size_t len = entry_write(pi, buf, entry);
+
+    if (index_write(pi, buf, len, at) < 0) {
+        perror("pwrite");
+        return -1;
     }
 
-    uint64_t base_ts = pi->base_timestamp * (uint64_t)1e9;
+    return len;
+}
 
-    // 1st simple approach, read the entire file and look for the offset
-    // linearly
-    uint8_t buf[INDEX_SIZE];
-    ssize_t len = read_file(pi->fp, buf);
+int index_append(index_t *pi, uint64_t ts, uint64_t offset,
+                 const index_summary_t *summary)
+{
+    if (index_entries_load(pi) < 0)
+        return -1;
+
+    index_entry_t entry;
+    ssize_t len = index_write_at(pi, ts, offset, summary, pi->size, &entry);
     if (len < 0)
         return -1;
 
-    uint8_t *ptr        = &buf[0];
-    int64_t prev_offset = 0, offset = 0;
-    uint64_t timestamp = 0, entry_ts = 0;
-    while (len > 0) {
-        // Decode from binary
-        timestamp = read_i64(ptr);
-        offset    = read_i64(ptr + sizeof(uint64_t));
-        entry_ts  = timestamp + base_ts;
-        // We went too forward
-        if (entry_ts > ts)
-            break;
-        // Remember the just read offset
-        prev_offset = offset;
-        // Forward the pointer and subtract the total length
-        ptr += ENTRY_SIZE;
-        len -= ENTRY_SIZE;
-        // Found exact match
-        if (entry_ts == ts)
-            break;
+    pi->size += len;
+
+    da_append(&pi->entries, entry);
+
+    return 0;
+}
+
+/*
+ * Returns the position of the first entry with a timestamp greater than ts,
+ * entries are appended in timestamp order, which allows a simple binary
+ * search.
+ */
+size_t index_upper_bound(const index_t *pi, uint64_t ts)
+{
+    pi               = index_ensure(pi);
+    uint64_t base_ts = pi->base_timestamp * (uint64_t)1e9;
+    size_t left = 0, right = pi->entries.length, middle = 0;
+
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (pi->entries.items[middle].relative_ts + base_ts > ts)
+            right = middle;
+        else
+            left = middle + 1;
+    }
+
+    return left;
+}
+
+int index_find(const index_t *pi, uint64_t ts, range_t *r)
+{
+    if (index_ensure(pi)->entries.length == 0) {
+        *r = (range_t){0, 0};
+        return 0;
     }
 
-    // -1 as end only in the case where we read the entire index and we didn't
-    // find anything close to the request timestamp, which means it must be
-    // at the end of the log
-    r->start = prev_offset;
-    r->end   = len == 0 ? -1 : offset;
+    size_t i = index_upper_bound(pi, ts);
+
+    // The range spans from the last entry not greater than the requested
+    // timestamp up to the next one, an exact match still needs to include the
+    // whole block starting at the matched offset.
+    // -1 as end only in the case where all the entries are not greater than
+    // the requested timestamp, which means it must be at the end of the log
+    r->start = i == 0 ? 0 : pi->entries.items[i - 1].offset;
+    r->end   = i == pi->entries.length ? -1
+                                       : (int64_t)pi->entries.items[i].offset;
 
     return 0;
 }
 
 void index_print(const index_t *pi)
 {
-    uint8_t buf[INDEX_SIZE];
-    uint8_t *p   = &buf[0];
-    ssize_t read = 0;
-    uint64_t ts = 0, value = 0;
-    ssize_t len = read_file(pi->fp, buf);
-    while (read < len) {
-        ts    = read_i64(p);
-        value = read_i64(p + sizeof(uint64_t));
-        read += ENTRY_SIZE;
-        p += ENTRY_SIZE;
-        log_info("%" PRIu64 " -> %" PRIu64, ts, value);
-    }
+    index_ensure(pi);
+    for (size_t i = 0; i < pi->entries.length; ++i)
+        log_info("%" PRIu64 " -> %" PRIu64, pi->entries.items[i].relative_ts,
+                 pi->entries.items[i].offset);
 }
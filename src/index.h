@@ -1,18 +1,73 @@
 #ifndef INDEX_H
 #define INDEX_H
 
+#include "fdcache.h"
+#include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Index files versions, a V1 index starts with a header and its entries carry
+ * the summary of their block, a legacy V0 index has no header and bare
+ * entries. The first byte of a V0 entry is the big-endian encoded relative
+ * timestamp, always 0x00, which tells the two apart.
+ */
+#define INDEX_V0 0x00
+#define INDEX_V1 0x01
+
+/*
+ * Summary of the points of a block, kept with its index entry to answer
+ * aggregates over whole blocks without decoding them. Timestamps are
+ * absolute, min_ts and max_ts are the first ones holding the min and the max.
+ * A count of 0 means no summary, as for the entries of a V0 index.
+ */
+typedef struct index_summary {
+    uint64_t first_ts;
+    uint64_t last_ts;
+    uint64_t count;
+    uint64_t min_ts;
+    uint64_t max_ts;
+    double_t sum;
+    double_t min;
+    double_t max;
+    double_t first;
+    double_t last;
+} index_summary_t;
+
+/*
+ * Single index entry, a timestamp relative to the base of the partition and
+ * the offset of the commit log block starting with it, with its summary.
+ */
+typedef struct index_entry {
+    uint64_t relative_ts;
+    uint64_t offset;
+    index_summary_t summary;
+} index_entry_t;
+
+typedef struct index_entry_array {
+    size_t length;
+    size_t capacity;
+    index_entry_t *items;
+} index_entry_array_t;
 
 /*
  * Keeps the state for an index file on disk, updated every interval values
  * to make it easier to read data efficiently from the main segment storage
  * on disk.
+ *
+ * The whole index is also kept in memory as an array of entries sorted by
+ * timestamp, read once on first use and kept in sync by every append, lookups
+ * are binary searches on it with no I/O involved.
  */
 typedef struct index {
-    FILE *fp;
+    fdhandle_t fh;
+    index_entry_array_t entries;
     size_t size;
     uint64_t base_timestamp;
+    int version;
+    int loaded;
 } index_t;
 
 /*
@@ -30,12 +85,42 @@ int index_init(index_t *pi, const char *path, uint64_t base);
 // Closes the index file associated with a index_t structure
 int index_close(index_t *pi);
 
+// Removes the index file of the given base from disk
+int index_remove(const char *path, uint64_t base);
+
+// Moves the index file of the given base to another directory
+int index_rename(const char *from, const char *to, uint64_t base);
+
+// Points the index to its new directory, once its file is moved there
+int index_move(index_t *pi, const char *to);
+
 // Loads a index_t structure from disk
 int index_load(index_t *pi, const char *path, uint64_t base);
 
+// Opens an index from disk, its entries read on first use
+int index_open(index_t *pi, const char *path, uint64_t base);
+
+// Reads the entries of an index opened, if not already done
+int index_entries_load(index_t *pi);
+
+// Drops the entries of the blocks at or past offset of the commit log, left
+// over by a log cut short
+int index_trim(index_t *pi, uint64_t offset);
+
 // Appends an offset to the index file associated with a index_t
-// structure
-int index_append(index_t *pi, uint64_t ts, uint64_t offset);
+// structure, along with the summary of the block if any
+int index_append(index_t *pi, uint64_t ts, uint64_t offset,
+                 const index_summary_t *summary);
+
+// Writes the entry of a block at the given position of the file, past its
+// end, leaving the index as it is until the entry is published. Returns the
+// size of the entry, -1 on error
+ssize_t index_write_at(index_t *pi, uint64_t ts, uint64_t offset,
+                       const index_summary_t *summary, size_t at,
+                       index_entry_t *entry);
+
+// Position of the first entry with a timestamp greater than ts
+size_t index_upper_bound(const index_t *pi, uint64_t ts);
 
 // Finds the offset range for a given timestamp in the index file
 int index_find(const index_t *pi, uint64_t ts, range_t *r);
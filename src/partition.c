@@ -1,15 +1,20 @@
 #include "partition.h"
+#include "aggregate.h"
 #include "binary.h"
+#include "blockcache.h"
 #include "commitlog.h"
 #include "darray.h"
+#include "fdcache.h"
+#include "gorilla.h"
 #include "index.h"
 #include "logger.h"
 #include "timeseries.h"
 #include <errno.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
 
 static const size_t BATCH_SIZE = 1 << 6;
-static const size_t BLOCK_SIZE = 1 << 12;
 
 int partition_init(partition_t *p, const char *path, uint64_t base)
 {
@@ -23,6 +28,8 @@ int partition_init(partition_t *p, const char *path, uint64_t base)
 
     p->start_ts    = 0;
     p->end_ts      = 0;
+    p->cache_id    = block_cache_owner();
+    p->pinned      = 0;
     p->initialized = 1;
 
     return 0;
@@ -30,188 +37,775 @@ int partition_init(partition_t *p, const char *path, uint64_t base)
 
 int partition_load(partition_t *p, const char *path, uint64_t base)
 {
-    int err = cl_load(&p->clog, path, base);
-    if (err < 0)
+    int torn = cl_load(&p->clog, path, base);
+    if (torn < 0)
         return -1;
 
-    err = index_load(&p->index, path, base);
-    if (err < 0)
+    // Both the commit log meta and the index header are O(1) to read, the
+    // index entries are read on first use, unless the log was cut short
+    int err = index_open(&p->index, path, base);
+    if (err < 0 || (torn && index_trim(&p->index, p->clog.size) < 0))
         return -1;
 
-    p->start_ts = p->clog.base_timestamp * (uint64_t)1e9 + p->clog.base_ns;
-    p->end_ts   = p->clog.current_timestamp;
+    p->start_ts    = p->clog.base_timestamp * (uint64_t)1e9 + p->clog.base_ns;
+    p->end_ts      = p->clog.current_timestamp;
+    p->cache_id    = block_cache_owner();
+    p->pinned      = 0;
+    p->initialized = 1;
 
     return 0;
 }
 
-static int commit_records_to_log(partition_t *p, const uint8_t *buf, size_t len)
+void partition_close(partition_t *p)
 {
-    int err = cl_append_batch(&p->clog, buf, len);
-    if (err < 0)
+    if (!p->initialized)
+        return;
+
+    cl_close(&p->clog);
+    index_close(&p->index);
+
+    p->pinned      = 0;
+    p->initialized = 0;
+}
+
+/*
+ * Closes the partition and removes both its files, the commit log and the
+ * index go together, a partition is never partially dropped.
+ */
+int partition_remove(partition_t *p, const char *path)
+{
+    uint64_t base = p->clog.base_timestamp;
+
+    partition_close(p);
+
+    int err = cl_remove(path, base);
+    if (index_remove(path, base) < 0)
+        err = -1;
+
+    return err;
+}
+
+/*
+ * Moves the files of the partition with the given base to another directory,
+ * the index first, the commit log it's paired with then.
+ */
+int partition_rename(const char *from, const char *to, uint64_t base)
+{
+    if (index_rename(from, to, base) < 0 && errno != ENOENT)
         return -1;
 
-    size_t commit_log_size = p->clog.size;
-    err                    = index_append(&p->index, ts_record_timestamp(buf),
-                                          commit_log_size - TS_BATCH_OFFSET);
-    if (err < 0)
+    if (cl_rename(from, to, base) < 0 && errno != ENOENT)
         return -1;
 
     return 0;
 }
 
-int partition_flush_chunk(partition_t *p, const ts_chunk_t *tc,
-                          size_t flushsize)
+int partition_move(partition_t *p, const char *from, const char *to)
 {
+    if (partition_rename(from, to, p->clog.base_timestamp) < 0)
+        return -1;
 
-    // Temporary array
-    darray(const record_t *) records = {0};
+    if (index_move(&p->index, to) < 0 || cl_move(&p->clog, to) < 0)
+        return -1;
 
-    size_t total_records             = 0;
-    size_t batch_size                = 0;
-    uint8_t *buf                     = malloc(flushsize * 4);
-    if (!buf)
+    return 0;
+}
+
+/*
+ * Keep the descriptors of the partition open, out of reach of the LRU of the
+ * descriptors cache, until unpinned.
+ */
+static void partition_pin(partition_t *p)
+{
+    if (p->pinned)
+        return;
+
+    if (fdcache_acquire(&p->clog.fh) < 0)
+        return;
+
+    if (fdcache_acquire(&p->index.fh) < 0) {
+        fdcache_release(&p->clog.fh);
+        return;
+    }
+
+    p->pinned = 1;
+}
+
+static void partition_unpin(partition_t *p)
+{
+    if (!p->pinned)
+        return;
+
+    fdcache_release(&p->clog.fh);
+    fdcache_release(&p->index.fh);
+    p->pinned = 0;
+}
+
+static void summarize(const uint64_t *timestamps, const double_t *values,
+                      size_t n, index_summary_t *s)
+{
+    size_t min = agg_argmin(values, n);
+    size_t max = agg_argmax(values, n);
+
+    *s         = (index_summary_t){.first_ts = timestamps[0],
+                                   .last_ts  = timestamps[n - 1],
+                                   .count    = n,
+                                   .min_ts   = timestamps[min],
+                                   .max_ts   = timestamps[max],
+                                   .sum      = agg_sum(values, n),
+                                   .min      = values[min],
+                                   .max      = values[max],
+                                   .first    = values[0],
+                                   .last     = values[n - 1]};
+}
+
+void partition_mark(const partition_t *p, partition_mark_t *m)
+{
+    *m = (partition_mark_t){.clog_size         = p->clog.size,
+                            .points            = p->clog.points,
+                            .blocks            = p->clog.blocks,
+                            .first_timestamp   = p->clog.first_timestamp,
+                            .current_timestamp = p->clog.current_timestamp,
+                            .index_size        = p->index.size,
+                            .entries           = p->index.entries.length,
+                            .loaded            = p->index.loaded,
+                            .start_ts          = p->start_ts,
+                            .end_ts            = p->end_ts};
+}
+
+static int truncate_handle(fdhandle_t *fh, size_t size)
+{
+    int fd = fdcache_acquire(fh);
+    if (fd < 0)
         return -1;
 
-    uint8_t *bufptr = buf;
-    int err         = 0;
+    int err = ftruncate(fd, size);
+    fdcache_release(fh);
 
-    for (size_t i = 0; i < TS_CHUNK_SIZE; ++i) {
-        if (tc->points[i].length == 0)
-            continue;
+    return err;
+}
 
-        for (size_t j = 0; j < tc->points[i].length; ++j, ++total_records) {
-            da_append(&records, &tc->points[i].items[j]);
-
-            if (++batch_size == BATCH_SIZE) {
-                // Poor man slice
-                ssize_t len = ts_record_batch_write(
-                    (records.items + (total_records - BATCH_SIZE)), bufptr,
-                    BATCH_SIZE);
-                err = commit_records_to_log(p, bufptr, len);
-                if (err < 0)
-                    log_error("batch write failed: %s", strerror(errno));
-                bufptr += len;
-                batch_size = 0;
-            }
-        }
+static int truncate_files(partition_t *p, const partition_mark_t *m)
+{
+    if (truncate_handle(&p->clog.fh, m->clog_size) < 0 ||
+        truncate_handle(&p->index.fh, m->index_size) < 0) {
+        log_error("partition rewind: %s", strerror(errno));
+        return -1;
     }
 
-    // Finish up any remaining record
-    ssize_t remaining_records = total_records % BATCH_SIZE;
-    if (remaining_records != 0) {
-        size_t len = ts_record_batch_write(
-            (records.items + (total_records - remaining_records)), bufptr,
-            remaining_records);
-        err = commit_records_to_log(p, bufptr, len);
-        if (err < 0)
-            log_error("Error writing remaining records to commit log: %s",
-                      strerror(errno));
+    return 0;
+}
+
+// Sets the end of the partition to the mark, the index entries aside
+static void partition_set_end(partition_t *p, const partition_mark_t *m)
+{
+    p->clog.size              = m->clog_size;
+    p->clog.points            = m->points;
+    p->clog.blocks            = m->blocks;
+    p->clog.first_timestamp   = m->first_timestamp;
+    p->clog.current_timestamp = m->current_timestamp;
+    p->index.size             = m->index_size;
+    p->start_ts               = m->start_ts;
+    p->end_ts                 = m->end_ts;
+}
+
+/*
+ * Roll back a failed flush, the blocks past the mark are dropped from both
+ * the files and the in-memory state, so that a retry doesn't duplicate them.
+ * Entries not read yet at the time of the mark are read again from the index
+ * truncated.
+ */
+int partition_rewind(partition_t *p, const partition_mark_t *m)
+{
+    partition_set_end(p, m);
+
+    if (m->loaded) {
+        p->index.entries.length = m->entries;
+    } else if (p->index.loaded) {
+        da_free(&p->index.entries);
+        p->index.entries = (index_entry_array_t){0};
+        p->index.loaded  = 0;
     }
 
-    // Set base nanoseconds for the commit log
-    if (p->start_ts == 0) {
-        uint64_t base_ns = tc->start_ts % (uint64_t)1e9;
-        cl_set_base_ns(&p->clog, base_ns);
+    return truncate_files(p, m);
+}
+
+void partition_stage_init(const partition_t *p, partition_stage_t *st)
+{
+    partition_mark(p, &st->end);
+    st->base_ns = p->clog.base_ns;
+    st->entries = (index_entry_array_t){0};
+}
+
+/*
+ * Write a block past the end of the stage, to the commit log first, then its
+ * index entry, kept aside to be added once published.
+ */
+static int stage_block(partition_t *p, partition_stage_t *st,
+                       const uint8_t *buf, size_t len,
+                       const index_summary_t *summary)
+{
+    partition_mark_t *end = &st->end;
+    index_entry_t entry;
+    cl_frame_t block;
+
+    if (cl_frame_read(buf, len, &block) < 0 ||
+        cl_write_at(&p->clog, buf, len, end->clog_size) < 0)
+        return -1;
+
+    // The index points to the start of each block, keyed by its first
+    // timestamp
+    ssize_t n = index_write_at(&p->index, block.first_ts, end->clog_size,
+                               summary, end->index_size, &entry);
+    if (n < 0)
+        return -1;
+
+    if (end->clog_size == 0)
+        end->first_timestamp = block.first_ts;
+
+    end->clog_size += len;
+    end->points += block.count;
+    end->blocks++;
+    end->current_timestamp = block.last_ts;
+    end->index_size += n;
+    da_append(&st->entries, entry);
+
+    return 0;
+}
+
+/*
+ * Write a sorted run of points past the end of the stage, the columns are
+ * sliced in batches, each written as a compressed block, summarized in the
+ * index. The first batch failing stops the write, the blocks already written
+ * by the run are truncated away.
+ */
+int partition_stage_columns(partition_t *p, partition_stage_t *st,
+                            const uint64_t *timestamps, const double_t *values,
+                            size_t n)
+{
+    if (n == 0)
+        return 0;
+
+    size_t block_size = CL_BLOCK_HEADER_SIZE + GORILLA_MAX_SIZE(BATCH_SIZE);
+    uint8_t *buf      = malloc(block_size);
+    if (!buf)
+        return -1;
+
+    partition_mark_t end = st->end;
+    size_t entries       = st->entries.length;
+    index_summary_t summary;
+
+    for (size_t i = 0; i < n; i += BATCH_SIZE) {
+        size_t count = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+        size_t len =
+            ts_record_batch_write(timestamps + i, values + i, buf, count);
+        summarize(timestamps + i, values + i, count, &summary);
+        if (stage_block(p, st, buf, len, &summary) < 0) {
+            log_error("batch write failed: %s", strerror(errno));
+            st->end            = end;
+            st->entries.length = entries;
+            truncate_files(p, &end);
+            free(buf);
+            return -1;
+        }
     }
 
+    // Set base nanoseconds for the commit log
+    if (st->end.start_ts == 0)
+        st->base_ns = timestamps[0] % (uint64_t)1e9;
+
     // Update timestamps
-    p->start_ts = p->start_ts != 0 ? p->start_ts : tc->base_offset;
-    p->end_ts   = records.length == 0 ? 0 : da_back(&records)->timestamp;
+    if (st->end.start_ts == 0 || timestamps[0] < st->end.start_ts)
+        st->end.start_ts = timestamps[0];
+    if (timestamps[n - 1] > st->end.end_ts)
+        st->end.end_ts = timestamps[n - 1];
 
     free(buf);
-    da_free(&records);
 
     return 0;
 }
 
-static uint64_t end_offset(const partition_t *p, const range_t *r)
+/*
+ * Entries read from the index after the stage was started already hold the
+ * ones staged, as the index is read up to its size, they're only added to
+ * entries read before.
+ */
+void partition_publish(partition_t *p, partition_stage_t *st)
+{
+    partition_set_end(p, &st->end);
+    cl_set_base_ns(&p->clog, st->base_ns);
+
+    if (p->index.loaded)
+        for (size_t i = 0; i < st->entries.length; ++i)
+            da_append(&p->index.entries, st->entries.items[i]);
+
+    da_free(&st->entries);
+    st->entries = (index_entry_array_t){0};
+}
+
+void partition_stage_drop(partition_t *p, partition_stage_t *st)
 {
-    uint64_t end = 0;
-    if (r->end == -1)
-        end = p->clog.size;
-    else if (r->end == r->start)
-        end = sizeof(uint64_t) * 3;
-    else
-        end = r->end;
+    partition_mark_t end;
+    partition_mark(p, &end);
+    truncate_files(p, &end);
 
-    return end;
+    da_free(&st->entries);
+    st->entries = (index_entry_array_t){0};
 }
 
-int partition_find(const partition_t *p, uint8_t *dst, uint64_t timestamp)
+/*
+ * Write a sorted run of points to the partition, staged and published at
+ * once.
+ */
+int partition_flush_columns(partition_t *p, const uint64_t *timestamps,
+                            const double_t *values, size_t n)
 {
-    range_t range;
-    int err = index_find(&p->index, timestamp, &range);
-    if (err < 0)
+    partition_stage_t st;
+    partition_stage_init(p, &st);
+
+    if (partition_stage_columns(p, &st, timestamps, values, n) < 0) {
+        da_free(&st.entries);
         return -1;
+    }
 
-    // TODO dynamic alloc this buffer
-    uint8_t buf[BLOCK_SIZE];
-    uint8_t *ptr = &buf[0];
+    partition_publish(p, &st);
 
-    uint64_t end = end_offset(p, &range);
+    return 0;
+}
 
-    ssize_t n    = cl_read_at(&p->clog, &ptr, range.start, end);
-    if (n < 0)
+/*
+ * Sync the commit log and the index of the partition to disk, once done the
+ * WALs of the chunks flushed into it are not needed anymore. The commit log
+ * is sealed then, a partition loaded back with an up to date meta isn't
+ * scanned.
+ */
+int partition_sync(const partition_t *p)
+{
+    if (partition_sync_files(p) < 0)
         return -1;
 
-    size_t record_len = 0;
-    uint64_t ts       = 0;
-    while (n > 0) {
-        record_len = read_i64(ptr);
-        ts         = read_i64(ptr + sizeof(uint64_t));
-        if (ts == timestamp)
+    partition_seal(p);
+
+    return 0;
+}
+
+int partition_sync_files(const partition_t *p)
+{
+    if (fdcache_sync((fdhandle_t *)&p->clog.fh) < 0 ||
+        fdcache_sync((fdhandle_t *)&p->index.fh) < 0) {
+        log_error("partition sync: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void partition_seal(const partition_t *p)
+{
+    if (cl_seal(&p->clog) < 0)
+        log_warning("partition seal: %s", strerror(errno));
+}
+
+/*
+ * Decode a commit log frame, collecting the points falling in the [t0, t1]
+ * range. Both legacy fixed size records and compressed blocks are supported,
+ * blocks completely out of range are skipped just by looking at the header.
+ */
+static size_t decode_frame(const cl_frame_t *frame, uint64_t t0, uint64_t t1,
+                           record_array_t *dst)
+{
+    if (frame->last_ts < t0 || frame->first_ts > t1)
+        return 0;
+
+    record_t record = {0};
+    size_t count    = 0;
+
+    if (frame->version == CL_FRAME_V0) {
+        record.timestamp  = frame->first_ts;
+        record.value      = read_f64(frame->payload);
+        record.tv.tv_sec  = record.timestamp / (uint64_t)1e9;
+        record.tv.tv_nsec = record.timestamp % (uint64_t)1e9;
+        da_append_in(dst, dst->arena, record);
+        return 1;
+    }
+
+    gorilla_decoder_t decoder;
+    gorilla_decoder_init(&decoder, frame->payload, frame->payload_size,
+                         frame->count);
+
+    while (gorilla_decoder_next(&decoder, &record.timestamp, &record.value) ==
+           0) {
+        if (record.timestamp > t1)
             break;
-        ptr += record_len;
-        n -= record_len;
+        if (record.timestamp < t0)
+            continue;
+        record.tv.tv_sec  = record.timestamp / (uint64_t)1e9;
+        record.tv.tv_nsec = record.timestamp % (uint64_t)1e9;
+        da_append_in(dst, dst->arena, record);
+        count++;
     }
 
-    if (n == 0 && ts != timestamp)
-        return -1;
+    return count;
+}
 
-    record_len = read_i64(ptr);
-    memcpy(dst, ptr, record_len);
+int partition_find(const partition_t *p, record_t *dst, uint64_t timestamp)
+{
+    record_array_t records = {.arena = arena_scratch_acquire()};
 
-    return 0;
+    int n = partition_range(p, &records, timestamp, timestamp);
+    if (n > 0)
+        *dst = records.items[0];
+
+    arena_scratch_release();
+
+    return n > 0 ? 0 : -1;
 }
 
-int partition_range(const partition_t *p, uint8_t *dst, uint64_t t0,
+int partition_range(const partition_t *p, record_array_t *dst, uint64_t t0,
                     uint64_t t1)
 {
-    range_t r0, r1;
-    int err = index_find(&p->index, t0, &r0);
-    if (err < 0)
+    size_t first = 0;
+    size_t last  = partition_blocks(p, t0, t1, &first);
+    size_t count = 0;
+
+    for (size_t i = first; i < last; ++i) {
+        int n = partition_block_decode(p, i, t0, t1, dst);
+        if (n < 0)
+            return -1;
+        count += n;
+    }
+
+    return count;
+}
+
+/*
+ * Decode every frame of the partition in the order they were written, reading
+ * the commit log in one go instead of going through its mapping, to be safe
+ * to call from another thread than the queries.
+ */
+int partition_read(const partition_t *p, record_array_t *dst)
+{
+    size_t size = p->clog.size;
+    if (size == 0)
+        return 0;
+
+    uint8_t *buf = malloc(size);
+    if (!buf)
         return -1;
 
-    err = index_find(&p->index, t1, &r1);
-    if (err < 0)
+    fdhandle_t *fh = (fdhandle_t *)&p->clog.fh;
+    int fd         = fdcache_acquire(fh);
+    ssize_t n      = fd < 0 ? -1 : pread(fd, buf, size, 0);
+    if (fd >= 0)
+        fdcache_release(fh);
+
+    if (n != (ssize_t)size) {
+        free(buf);
         return -1;
+    }
 
-    uint64_t end1 = end_offset(p, &r1);
+    const uint8_t *ptr = buf;
+    cl_frame_t frame;
+    ssize_t frame_size = 0;
+    size_t count       = 0;
 
-    // TODO dynamic alloc this buffer
-    uint8_t buf[BLOCK_SIZE];
-    uint8_t *ptr = &buf[0];
+    while (n > 0) {
+        frame_size = cl_frame_read(ptr, n, &frame);
+        if (frame_size < 0)
+            break;
+        count += decode_frame(&frame, 0, UINT64_MAX, dst);
+        ptr += frame_size;
+        n -= frame_size;
+    }
+
+    free(buf);
+
+    return count;
+}
+
+size_t partition_blocks(const partition_t *p, uint64_t t0, uint64_t t1,
+                        size_t *first)
+{
+    size_t i = index_upper_bound(&p->index, t0);
+
+    *first   = i == 0 ? 0 : i - 1;
+
+    return index_upper_bound(&p->index, t1);
+}
+
+const index_summary_t *partition_block_summary(const partition_t *p,
+                                               size_t i)
+{
+    const index_summary_t *s = &p->index.entries.items[i].summary;
+
+    return s->count > 0 ? s : NULL;
+}
 
-    ssize_t n    = cl_read_at(&p->clog, &ptr, r0.start, end1);
+typedef struct block_filter {
+    uint64_t t0;
+    uint64_t t1;
+    record_array_t *dst;
+    size_t count;
+} block_filter_t;
+
+static void block_filter(const uint64_t *timestamps, const double_t *values,
+                         size_t n, void *userdata)
+{
+    block_filter_t *f = userdata;
+    record_t record   = {0};
+
+    for (size_t i = 0; i < n; ++i) {
+        if (timestamps[i] < f->t0 || timestamps[i] > f->t1)
+            continue;
+        record.timestamp  = timestamps[i];
+        record.value      = values[i];
+        record.tv.tv_sec  = record.timestamp / (uint64_t)1e9;
+        record.tv.tv_nsec = record.timestamp % (uint64_t)1e9;
+        da_append_in(f->dst, f->dst->arena, record);
+        f->count++;
+    }
+}
+
+/*
+ * Decode all the frames of a block into columns, to be freed by the caller,
+ * returns the number of points or -1 on error.
+ */
+static ssize_t decode_block(const uint8_t *ptr, ssize_t n,
+                            uint64_t **timestamps, double_t **values)
+{
+    cl_frame_t frame;
+    ssize_t frame_size = 0;
+    size_t count       = 0;
+
+    for (const uint8_t *p = ptr; n - (p - ptr) > 0; p += frame_size) {
+        frame_size = cl_frame_read(p, n - (p - ptr), &frame);
+        if (frame_size < 0)
+            break;
+        count += frame.count;
+    }
+
+    *timestamps = malloc((count + 1) * sizeof(**timestamps));
+    *values     = malloc((count + 1) * sizeof(**values));
+    if (!*timestamps || !*values)
+        return -1;
+
+    size_t i = 0;
+    while (n > 0 && i < count) {
+        frame_size = cl_frame_read(ptr, n, &frame);
+        if (frame_size < 0)
+            break;
+
+        if (frame.version == CL_FRAME_V0) {
+            (*timestamps)[i] = frame.first_ts;
+            (*values)[i++]   = read_f64(frame.payload);
+        } else {
+            gorilla_decoder_t decoder;
+            gorilla_decoder_init(&decoder, frame.payload, frame.payload_size,
+                                 frame.count);
+            while (i < count && gorilla_decoder_next(&decoder,
+                                                     &(*timestamps)[i],
+                                                     &(*values)[i]) == 0)
+                i++;
+        }
+
+        ptr += frame_size;
+        n -= frame_size;
+    }
+
+    return i;
+}
+
+/*
+ * Decode the frames of a single block, from its offset to the next one, a
+ * block of a V0 commit log may span several legacy records. Whole blocks are
+ * decoded and cached, the points in range picked from the columns.
+ */
+int partition_block_decode(const partition_t *p, size_t i, uint64_t t0,
+                           uint64_t t1, record_array_t *dst)
+{
+    const index_entry_array_t *entries = &p->index.entries;
+    size_t start                       = entries->items[i].offset;
+    size_t end = i + 1 < entries->length ? entries->items[i + 1].offset
+                                         : p->clog.size;
+
+    if (end <= start)
+        return 0;
+
+    block_filter_t f = {.t0 = t0, .t1 = t1, .dst = dst};
+    if (block_cache_get(p->cache_id, start, end - start, block_filter, &f))
+        return f.count;
+
+    const uint8_t *ptr = NULL;
+    ssize_t n          = cl_read_at(&p->clog, &ptr, start, end - start);
     if (n < 0)
         return -1;
 
-    size_t record_len = 0, base_size = n;
-    size_t start = n;
-    uint64_t ts  = 0;
+    uint64_t *timestamps = NULL;
+    double_t *values     = NULL;
+    ssize_t count        = decode_block(ptr, n, &timestamps, &values);
+    if (n > 0)
+        cl_release(&p->clog);
+    if (count >= 0) {
+        block_cache_put(p->cache_id, start, end - start, timestamps, values,
+                        count);
+        block_filter(timestamps, values, count, &f);
+    }
 
-    while (n > 0) {
-        record_len = read_i64(ptr);
-        ts         = read_i64(ptr + sizeof(uint64_t));
-        if (ts == t0)
-            start = n;
-        ptr += record_len;
-        n -= record_len;
-        if (ts == t1)
-            break;
+    free(timestamps);
+    free(values);
+
+    return count < 0 ? -1 : (int)f.count;
+}
+
+/*
+ * Catalog order of a partition, its start timestamp, known once the first
+ * points are flushed, the base is used until then. Both the insertion and the
+ * search go by it, so the catalog is searched in the order it's kept in.
+ */
+static uint64_t catalog_key(const partition_t *p)
+{
+    return p->start_ts != 0 ? p->start_ts
+                            : p->clog.base_timestamp * (uint64_t)1e9;
+}
+
+/*
+ * Returns the number of partitions starting not after ts.
+ */
+static size_t catalog_upper_bound(const partition_catalog_t *pc, uint64_t ts)
+{
+    size_t left = 0, right = pc->length, middle = 0;
+
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (catalog_key(pc->items[middle]) <= ts)
+            left = middle + 1;
+        else
+            right = middle;
     }
 
-    memcpy(dst, buf + (base_size - start), start - n);
+    return left;
+}
+
+int partition_catalog_add(partition_catalog_t *pc, partition_t *p)
+{
+    // Partitions are usually added in order, the search is just for the ones
+    // loaded from disk
+    size_t i = pc->length;
+    while (i > 0 && catalog_key(pc->items[i - 1]) > catalog_key(p))
+        i--;
+
+    da_append(pc, p);
+    if (!pc->items)
+        return -1;
+
+    memmove(pc->items + i + 1, pc->items + i,
+            (pc->length - 1 - i) * sizeof(*pc->items));
+    pc->items[i] = p;
+
+    if (i == pc->length - 1) {
+        if (i > 0)
+            partition_unpin(pc->items[i - 1]);
+        partition_pin(p);
+    }
+
+    return 0;
+}
+
+size_t partition_catalog_first(const partition_catalog_t *pc, uint64_t ts)
+{
+    size_t i = catalog_upper_bound(pc, ts);
+    if (i == 0)
+        return 0;
+
+    // The last partition starting before ts only counts if it reaches it
+    return pc->items[i - 1]->end_ts >= ts ? i - 1 : i;
+}
+
+size_t partition_catalog_slot(const partition_catalog_t *pc, uint64_t ts)
+{
+    size_t i = catalog_upper_bound(pc, ts);
+
+    return i == 0 ? 0 : i - 1;
+}
+
+partition_t *partition_catalog_find(const partition_catalog_t *pc,
+                                    uint64_t ts)
+{
+    size_t i = catalog_upper_bound(pc, ts);
+
+    return i == 0 ? NULL : pc->items[i - 1];
+}
+
+partition_t *partition_catalog_last(const partition_catalog_t *pc)
+{
+    return pc->length == 0 ? NULL : pc->items[pc->length - 1];
+}
+
+size_t partition_catalog_expire(partition_catalog_t *pc, const char *path,
+                                uint64_t ts)
+{
+    // Partitions are sorted by start, an expired one past a live one is left
+    // to the next pass
+    size_t n = 0;
+    while (n < pc->length && pc->items[n]->end_ts < ts) {
+        if (partition_remove(pc->items[n], path) < 0)
+            log_error("Failed to remove partition %" PRIu64 " files: %s",
+                      pc->items[n]->clog.base_timestamp, strerror(errno));
+        free(pc->items[n]);
+        n++;
+    }
+
+    if (n == 0)
+        return 0;
+
+    memmove(pc->items, pc->items + n, (pc->length - n) * sizeof(*pc->items));
+    pc->length -= n;
+
+    return n;
+}
+
+int partition_catalog_reserve(partition_catalog_t *pc, size_t n)
+{
+    // Appends grow the array once it's one item short of full
+    if (pc->length + n < pc->capacity)
+        return 0;
+
+    size_t capacity     = (pc->length + n + 1) * 2;
+    partition_t **items = realloc(pc->items, capacity * sizeof(*items));
+    if (!items)
+        return -1;
+
+    pc->items    = items;
+    pc->capacity = capacity;
+
+    return 0;
+}
+
+void partition_catalog_replace(partition_catalog_t *pc, size_t i, size_t n,
+                               partition_t *p)
+{
+    for (size_t j = i; j < i + n; ++j) {
+        partition_close(pc->items[j]);
+        free(pc->items[j]);
+    }
+
+    pc->items[i] = p;
+    memmove(pc->items + i + 1, pc->items + i + n,
+            (pc->length - i - n) * sizeof(*pc->items));
+    pc->length -= n - 1;
+
+    if (i == pc->length - 1)
+        partition_pin(p);
+}
+
+void partition_catalog_free(partition_catalog_t *pc)
+{
+    for (size_t i = 0; i < pc->length; ++i) {
+        partition_close(pc->items[i]);
+        free(pc->items[i]);
+    }
 
-    return start - n;
+    da_free(pc);
+    pc->length   = 0;
+    pc->capacity = 0;
 }
@@ -3,27 +3,158 @@
 
 #include "commitlog.h"
 #include "index.h"
+#include <math.h>
 
-typedef struct ts_chunk ts_chunk_t;
+typedef struct record record_t;
+typedef struct record_array record_array_t;
 
 typedef struct partition {
     commitlog_t clog;
     index_t index;
     uint64_t start_ts;
     uint64_t end_ts;
+    uint64_t cache_id;
+    int pinned;
     int initialized;
 } partition_t;
 
+// End of a partition, to roll back the blocks appended past it
+typedef struct partition_mark {
+    size_t clog_size;
+    size_t points;
+    size_t blocks;
+    uint64_t first_timestamp;
+    uint64_t current_timestamp;
+    size_t index_size;
+    size_t entries;
+    int loaded;
+    uint64_t start_ts;
+    uint64_t end_ts;
+} partition_mark_t;
+
+/*
+ * Blocks written past the end of a partition out of sight of its readers, so
+ * that a writer, only one at a time, appends them without holding the lock
+ * the readers take. The end is the partition as it is once published, the
+ * index entries are added then.
+ */
+typedef struct partition_stage {
+    partition_mark_t end;
+    uint64_t base_ns;
+    index_entry_array_t entries;
+} partition_stage_t;
+
+/*
+ * Catalog of the partitions of a series, sorted by base timestamp, which
+ * follows the start timestamp of their points. Partitions are allocated one
+ * by one, so they never move while the catalog grows, lookups are binary
+ * searches. The files of the most recent partition, the one flushed into,
+ * are pinned open in the descriptors cache.
+ */
+typedef struct partition_catalog {
+    size_t length;
+    size_t capacity;
+    partition_t **items;
+} partition_catalog_t;
+
 int partition_init(partition_t *p, const char *path, uint64_t base);
 
 int partition_load(partition_t *p, const char *path, uint64_t base);
 
-int partition_flush_chunk(partition_t *p, const ts_chunk_t *tc,
-                          size_t flushsize);
+void partition_close(partition_t *p);
+
+int partition_remove(partition_t *p, const char *path);
+
+int partition_rename(const char *from, const char *to, uint64_t base);
+
+// Moves the files of an open partition to another directory
+int partition_move(partition_t *p, const char *from, const char *to);
+
+// Appends a sorted run of points, nothing is left written on failure
+int partition_flush_columns(partition_t *p, const uint64_t *timestamps,
+                            const double_t *values, size_t n);
+
+void partition_mark(const partition_t *p, partition_mark_t *m);
+
+// Drops the blocks appended past the mark, truncating the files back to it
+int partition_rewind(partition_t *p, const partition_mark_t *m);
+
+void partition_stage_init(const partition_t *p, partition_stage_t *st);
+
+// Writes a sorted run of points past the end of the stage, nothing is left
+// written on failure
+int partition_stage_columns(partition_t *p, partition_stage_t *st,
+                            const uint64_t *timestamps, const double_t *values,
+                            size_t n);
+
+// Makes the blocks staged part of the partition, to be called with the
+// readers kept out
+void partition_publish(partition_t *p, partition_stage_t *st);
+
+// Drops the blocks staged, truncating the files back to the partition
+void partition_stage_drop(partition_t *p, partition_stage_t *st);
+
+// Syncs the files of the partition to disk, the blocks staged included
+int partition_sync_files(const partition_t *p);
 
-int partition_find(const partition_t *p, uint8_t *dst, uint64_t timestamp);
+// Writes the meta of the commit log, once synced and published
+void partition_seal(const partition_t *p);
 
-int partition_range(const partition_t *p, uint8_t *dst, uint64_t t0,
+int partition_sync(const partition_t *p);
+
+int partition_find(const partition_t *p, record_t *dst, uint64_t timestamp);
+
+int partition_range(const partition_t *p, record_array_t *dst, uint64_t t0,
                     uint64_t t1);
 
+int partition_read(const partition_t *p, record_array_t *dst);
+
+// Blocks which may hold points in the [t0, t1] range, from first to last
+// excluded, in the order they were written
+size_t partition_blocks(const partition_t *p, uint64_t t0, uint64_t t1,
+                        size_t *first);
+
+// Summary of a block, NULL if it has none
+const index_summary_t *partition_block_summary(const partition_t *p,
+                                               size_t i);
+
+// Appends the points of a block within [t0, t1], the decoded block is served
+// from and kept in the block cache
+int partition_block_decode(const partition_t *p, size_t i, uint64_t t0,
+                           uint64_t t1, record_array_t *dst);
+
+// Adds a partition, the catalog takes ownership of it
+int partition_catalog_add(partition_catalog_t *pc, partition_t *p);
+
+// Position of the first partition which may hold points not older than ts,
+// the last one starting not after it, or the first one ending after it
+size_t partition_catalog_first(const partition_catalog_t *pc, uint64_t ts);
+
+// Position of the partition a point belongs to, the last one starting not
+// after ts, the first one if none
+size_t partition_catalog_slot(const partition_catalog_t *pc, uint64_t ts);
+
+// The partition which may hold ts, NULL if none
+partition_t *partition_catalog_find(const partition_catalog_t *pc,
+                                    uint64_t ts);
+
+// The most recent partition, NULL if the catalog is empty
+partition_t *partition_catalog_last(const partition_catalog_t *pc);
+
+// Drops the leading partitions ending before ts, removing their files,
+// returns the number of partitions dropped
+size_t partition_catalog_expire(partition_catalog_t *pc, const char *path,
+                                uint64_t ts);
+
+// Makes room for n more partitions, so that adding them doesn't fail
+int partition_catalog_reserve(partition_catalog_t *pc, size_t n);
+
+// Replaces the n partitions from position i with p, closing and freeing them,
+// p is pinned if it's the most recent one
+void partition_catalog_replace(partition_catalog_t *pc, size_t i, size_t n,
+                               partition_t *p);
+
+// Closes and frees all the partitions
+void partition_catalog_free(partition_catalog_t *pc);
+
 #endif
@@ -22,7 +22,8 @@ static const char *cmd_usage(const char *cmd)
         return "USE <database-name>";
 
     if (strncasecmp(cmd, "create", 6) == 0)
-        return "CREATE <timeseries-name> [<retention>] [<duplication>]";
+        return "CREATE <timeseries-name> [<retention>] [<duplication>] "
+               "[ROLLUP <interval>, ...]";
 
     if (strncasecmp(cmd, "insert", 6) == 0)
         return "INSERT INTO <timeseries-name> VALUES (<timestamp>, <value>) | "
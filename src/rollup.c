@@ -0,0 +1,319 @@
+#include "rollup.h"
+#include "darray.h"
+#include "logger.h"
+#include "timeseries.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Fields of a bucket group, in the order they're written
+enum {
+    GROUP_COUNT,
+    GROUP_SUM,
+    GROUP_MIN,
+    GROUP_MAX,
+    GROUP_FIRST,
+    GROUP_LAST,
+    GROUP_FIRST_OFFSET,
+    GROUP_LAST_OFFSET,
+    GROUP_FIELDS
+};
+
+static int rollup_partition_load(rollup_t *r, uint64_t base)
+{
+    partition_t *p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+
+    if (partition_load(p, r->pathbuf, base) < 0 ||
+        partition_catalog_add(&r->partitions, p) < 0) {
+        partition_close(p);
+        free(p);
+        return -1;
+    }
+
+    return 0;
+}
+
+int rollup_open(rollup_t *r, const char *path, uint64_t interval)
+{
+    r->interval   = interval;
+    r->tail       = 0;
+    r->partitions = (partition_catalog_t){0};
+    snprintf(r->pathbuf, sizeof(r->pathbuf), "%s/%s%" PRIu64, path,
+             ROLLUP_PREFIX, interval);
+
+    struct stat st;
+    if (stat(r->pathbuf, &st) < 0)
+        return makedir(r->pathbuf) < 0 ? -1 : 1;
+
+    struct dirent **namelist;
+    int n = scandir(r->pathbuf, &namelist, NULL, alphasort);
+    if (n < 0)
+        return -1;
+
+    int err = 0;
+    for (int i = 0; i < n; ++i) {
+        const char *dot = strrchr(namelist[i]->d_name, '.');
+        if (err == 0 && namelist[i]->d_name[0] == 'c' && dot &&
+            strcmp(dot, ".log") == 0)
+            err = rollup_partition_load(r, atoll(namelist[i]->d_name + 3));
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    // The tail is the partition reaching the furthest
+    uint64_t end = 0;
+    for (size_t i = 0; i < r->partitions.length; ++i) {
+        const partition_t *p = r->partitions.items[i];
+        if (p->end_ts >= end) {
+            end     = p->end_ts;
+            r->tail = p->clog.base_timestamp;
+        }
+    }
+
+    return err;
+}
+
+void rollup_close(rollup_t *r) { partition_catalog_free(&r->partitions); }
+
+static partition_t *rollup_partition_at(const rollup_t *r, uint64_t base)
+{
+    for (size_t i = 0; i < r->partitions.length; ++i)
+        if (r->partitions.items[i]->clog.base_timestamp == base)
+            return r->partitions.items[i];
+    return NULL;
+}
+
+static partition_t *rollup_tail(const rollup_t *r)
+{
+    return rollup_partition_at(r, r->tail);
+}
+
+/*
+ * Start a new partition, based on the second of the first group or the
+ * closest one before it not taken yet, added to the catalog once published.
+ */
+static partition_t *rollup_partition_new(const rollup_t *r, uint64_t start)
+{
+    uint64_t base = start / (uint64_t)1e9;
+    while (rollup_partition_at(r, base))
+        base--;
+
+    partition_t *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    if (partition_init(p, r->pathbuf, base) < 0) {
+        partition_close(p);
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int rollup_append(rollup_t *r, const ts_sample_t *samples, size_t n)
+{
+    rollup_stage_t rs;
+    if (rollup_stage(r, samples, n, &rs) < 0)
+        return -1;
+
+    if (rs.created && partition_catalog_reserve(&r->partitions, 1) < 0) {
+        rollup_stage_drop(r, &rs);
+        return -1;
+    }
+
+    rollup_publish(r, &rs);
+    rollup_seal(&rs);
+
+    return 0;
+}
+
+int rollup_stage(rollup_t *r, const ts_sample_t *samples, size_t n,
+                 rollup_stage_t *rs)
+{
+    *rs = (rollup_stage_t){0};
+    if (n == 0)
+        return 0;
+
+    partition_t *p = rollup_tail(r);
+    if (!p || samples[0].start < p->end_ts) {
+        p           = rollup_partition_new(r, samples[0].start);
+        rs->created = 1;
+    }
+    if (!p)
+        return -1;
+
+    rs->p = p;
+    partition_stage_init(p, &rs->st);
+
+    size_t total         = n * GROUP_FIELDS;
+    uint64_t *timestamps = malloc(total * sizeof(*timestamps));
+    double_t *values     = malloc(total * sizeof(*values));
+    if (!timestamps || !values) {
+        free(timestamps);
+        free(values);
+        rollup_stage_drop(r, rs);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        const ts_sample_t *s = &samples[i];
+        double_t *v          = values + i * GROUP_FIELDS;
+
+        for (size_t j = 0; j < GROUP_FIELDS; ++j)
+            timestamps[i * GROUP_FIELDS + j] = s->start;
+
+        v[GROUP_COUNT]        = (double_t)s->count;
+        v[GROUP_SUM]          = s->sum;
+        v[GROUP_MIN]          = s->min;
+        v[GROUP_MAX]          = s->max;
+        v[GROUP_FIRST]        = s->first;
+        v[GROUP_LAST]         = s->last;
+        v[GROUP_FIRST_OFFSET] = (double_t)(s->first_ts - s->start);
+        v[GROUP_LAST_OFFSET]  = (double_t)(s->last_ts - s->start);
+    }
+
+    int err = partition_stage_columns(p, &rs->st, timestamps, values, total);
+    if (err == 0)
+        err = partition_sync_files(p);
+
+    free(timestamps);
+    free(values);
+
+    if (err < 0)
+        rollup_stage_drop(r, rs);
+
+    return err;
+}
+
+void rollup_publish(rollup_t *r, rollup_stage_t *rs)
+{
+    if (!rs->p)
+        return;
+
+    partition_publish(rs->p, &rs->st);
+
+    if (rs->created) {
+        partition_catalog_add(&r->partitions, rs->p);
+        r->tail = rs->p->clog.base_timestamp;
+    }
+}
+
+void rollup_seal(const rollup_stage_t *rs)
+{
+    if (rs->p)
+        partition_seal(rs->p);
+}
+
+/*
+ * A partition started for the groups is removed, the tail is truncated back
+ * to its end.
+ */
+void rollup_stage_drop(rollup_t *r, rollup_stage_t *rs)
+{
+    if (!rs->p)
+        return;
+
+    if (rs->created) {
+        da_free(&rs->st.entries);
+        partition_remove(rs->p, r->pathbuf);
+        free(rs->p);
+    } else {
+        partition_stage_drop(rs->p, &rs->st);
+    }
+
+    rs->p = NULL;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+    const ts_sample_t *sa = a, *sb = b;
+    return (sa->start > sb->start) - (sa->start < sb->start);
+}
+
+/*
+ * Decode the groups of a partition in [t0, t1], a group may span blocks, so
+ * more than one can start at t0, the lookup starts just before it.
+ */
+static int rollup_partition_read(const partition_t *p, uint64_t t0,
+                                 uint64_t t1, ts_sample_array_t *out)
+{
+    record_array_t records = {0};
+    size_t first           = 0;
+    size_t last = partition_blocks(p, t0 > 0 ? t0 - 1 : 0, t1, &first);
+
+    for (size_t i = first; i < last; ++i) {
+        if (partition_block_decode(p, i, t0, t1, &records) < 0) {
+            da_free(&records);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i + GROUP_FIELDS <= records.length;) {
+        const record_t *g = records.items + i;
+        uint64_t start    = g[0].timestamp;
+
+        if (g[GROUP_FIELDS - 1].timestamp != start) {
+            log_warning("Malformed rollup group at %" PRIu64, start);
+            while (i < records.length && records.items[i].timestamp == start)
+                i++;
+            continue;
+        }
+
+        ts_sample_t s = {
+            .start    = start,
+            .count    = (size_t)g[GROUP_COUNT].value,
+            .sum      = g[GROUP_SUM].value,
+            .min      = g[GROUP_MIN].value,
+            .max      = g[GROUP_MAX].value,
+            .first    = g[GROUP_FIRST].value,
+            .last     = g[GROUP_LAST].value,
+            .first_ts = start + (uint64_t)g[GROUP_FIRST_OFFSET].value,
+            .last_ts  = start + (uint64_t)g[GROUP_LAST_OFFSET].value};
+        da_append(out, s);
+        i += GROUP_FIELDS;
+    }
+
+    da_free(&records);
+
+    return 0;
+}
+
+int rollup_read(const rollup_t *r, uint64_t t0, uint64_t t1,
+                ts_sample_array_t *out)
+{
+    ts_sample_array_t groups = {0};
+
+    for (size_t i = 0; i < r->partitions.length; ++i) {
+        const partition_t *p = r->partitions.items[i];
+        if (p->end_ts < t0 || p->start_ts > t1)
+            continue;
+        if (rollup_partition_read(p, t0, t1, &groups) < 0) {
+            da_free(&groups);
+            return -1;
+        }
+    }
+
+    // Partitions may overlap, the groups of a bucket are brought together
+    if (groups.length > 0)
+        qsort(groups.items, groups.length, sizeof(*groups.items), sample_cmp);
+
+    for (size_t i = 0; i < groups.length; ++i) {
+        if (out->length > 0 && da_back(out).start == groups.items[i].start)
+            ts_sample_merge(&da_back(out), &groups.items[i]);
+        else
+            da_append(out, groups.items[i]);
+    }
+
+    da_free(&groups);
+
+    return 0;
+}
+
+size_t rollup_expire(rollup_t *r, uint64_t ts)
+{
+    return partition_catalog_expire(&r->partitions, r->pathbuf, ts);
+}
@@ -0,0 +1,77 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "partition.h"
+#include "storage.h"
+
+#define ROLLUP_MAX    4
+#define ROLLUP_PREFIX "rollup-"
+
+typedef struct ts_sample ts_sample_t;
+typedef struct ts_sample_array ts_sample_array_t;
+
+/*
+ * Continuous rollup of a series, the aggregates of its points in buckets of
+ * a fixed interval, maintained by the flusher as the points are persisted and
+ * stored as ordinary partitions, in a directory of the series named after the
+ * interval in nanoseconds.
+ *
+ * Each bucket is stored as a group of points all at its start, one per field:
+ * count, sum, min, max, first, last and the offsets of the first and last
+ * points from the start. A bucket spanning more than a flush, or reached by
+ * late points, gets a group per flush, merged when read.
+ *
+ * Groups are appended in order to the last partition written, the tail, a
+ * group older than its last one starts a new partition, so each partition is
+ * sorted while partitions may overlap.
+ */
+typedef struct rollup {
+    uint64_t interval;
+    uint64_t tail;
+    char pathbuf[PATHBUF_SIZE];
+    partition_catalog_t partitions;
+} rollup_t;
+
+/*
+ * Groups written out of sight of the readers of the rollup, past the end of
+ * its tail or to a new partition, kept out of the catalog until published.
+ */
+typedef struct rollup_stage {
+    partition_t *p;
+    int created;
+    partition_stage_t st;
+} rollup_stage_t;
+
+// Opens the rollup of the series at path, loading its partitions, the
+// directory is created if missing. Returns 1 if it was created, 0 if it was
+// loaded, -1 on error
+int rollup_open(rollup_t *r, const char *path, uint64_t interval);
+
+void rollup_close(rollup_t *r);
+
+// Appends the aggregates of the buckets, sorted by start
+int rollup_append(rollup_t *r, const ts_sample_t *samples, size_t n);
+
+// Writes and syncs the aggregates of the buckets, sorted by start, to be
+// published, nothing is left written on failure
+int rollup_stage(rollup_t *r, const ts_sample_t *samples, size_t n,
+                 rollup_stage_t *rs);
+
+// Makes the groups staged part of the rollup, to be called with the readers
+// kept out, a new partition needs a slot reserved in the catalog
+void rollup_publish(rollup_t *r, rollup_stage_t *rs);
+
+// Writes the meta of the partition staged, once published
+void rollup_seal(const rollup_stage_t *rs);
+
+void rollup_stage_drop(rollup_t *r, rollup_stage_t *rs);
+
+// Appends to out the aggregates of the buckets starting within [t0, t1],
+// sorted by start, the groups of each bucket merged
+int rollup_read(const rollup_t *r, uint64_t t0, uint64_t t1,
+                ts_sample_array_t *out);
+
+// Drops the partitions ending before ts, returns the number dropped
+size_t rollup_expire(rollup_t *r, uint64_t ts);
+
+#endif
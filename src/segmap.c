@@ -0,0 +1,212 @@
+#include "segmap.h"
+#include "logger.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// A mapping outgrown while pinned, unmapped once the segment is unpinned
+typedef struct segmap_region {
+    const uint8_t *addr;
+    size_t size;
+    struct segmap_region *next;
+} segmap_region_t;
+
+static struct {
+    segmap_t *head;
+    segmap_t *tail;
+    size_t count;
+    size_t limit;
+    pthread_mutex_t lock;
+} lru = {NULL, NULL, 0, SEGMAP_DEFAULT_LIMIT, PTHREAD_MUTEX_INITIALIZER};
+
+static void lru_unlink(segmap_t *m)
+{
+    if (m->prev)
+        m->prev->next = m->next;
+    else
+        lru.head = m->next;
+
+    if (m->next)
+        m->next->prev = m->prev;
+    else
+        lru.tail = m->prev;
+
+    m->prev = NULL;
+    m->next = NULL;
+}
+
+static void lru_push_front(segmap_t *m)
+{
+    m->prev = NULL;
+    m->next = lru.head;
+    if (lru.head)
+        lru.head->prev = m;
+    lru.head = m;
+    if (!lru.tail)
+        lru.tail = m;
+}
+
+static void segmap_unmap(segmap_t *m)
+{
+    munmap((void *)m->addr, m->size);
+    m->addr = NULL;
+    m->size = 0;
+    lru_unlink(m);
+    lru.count--;
+}
+
+static void segmap_unmap_retired(segmap_t *m)
+{
+    while (m->retired) {
+        segmap_region_t *r = m->retired;
+        m->retired         = r->next;
+        munmap((void *)r->addr, r->size);
+        free(r);
+    }
+}
+
+// Unmaps the least recently used segments not pinned, until below limit
+static void segmap_evict(size_t limit)
+{
+    segmap_t *m = lru.tail;
+    while (lru.count > limit && m) {
+        segmap_t *prev = m->prev;
+        if (m->pins == 0)
+            segmap_unmap(m);
+        m = prev;
+    }
+}
+
+void segmap_set_limit(size_t limit)
+{
+    pthread_mutex_lock(&lru.lock);
+    lru.limit = limit < 2 ? 2 : limit;
+    segmap_evict(lru.limit);
+    pthread_mutex_unlock(&lru.lock);
+}
+
+size_t segmap_count(void)
+{
+    pthread_mutex_lock(&lru.lock);
+    size_t count = lru.count;
+    pthread_mutex_unlock(&lru.lock);
+
+    return count;
+}
+
+/*
+ * A segment grown while pinned can't be unmapped under the readers still
+ * decoding from it, the old mapping is set aside until the last one is done.
+ */
+static int segmap_retire(segmap_t *m)
+{
+    if (m->pins == 0) {
+        segmap_unmap(m);
+        return 0;
+    }
+
+    segmap_region_t *r = malloc(sizeof(*r));
+    if (!r)
+        return -1;
+
+    *r         = (segmap_region_t){m->addr, m->size, m->retired};
+    m->retired = r;
+    m->addr    = NULL;
+    m->size    = 0;
+    lru_unlink(m);
+    lru.count--;
+
+    return 0;
+}
+
+static const uint8_t *segmap_acquire_locked(segmap_t *m, int fd, size_t size)
+{
+    if (m->addr) {
+        // Still valid, just mark it as most recently used
+        if (m->size >= size) {
+            if (lru.head != m) {
+                lru_unlink(m);
+                lru_push_front(m);
+            }
+            m->pins++;
+            return m->addr;
+        }
+        // The segment grew since it was mapped
+        if (segmap_retire(m) < 0)
+            return NULL;
+    }
+
+    // Make room for the new mapping
+    segmap_evict(lru.limit - 1);
+
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        log_error("segment mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    m->addr = addr;
+    m->size = size;
+    m->pins++;
+    lru_push_front(m);
+    lru.count++;
+
+    return m->addr;
+}
+
+const uint8_t *segmap_acquire(segmap_t *m, int fd, size_t size)
+{
+    if (size == 0)
+        return NULL;
+
+    pthread_mutex_lock(&lru.lock);
+    const uint8_t *addr = segmap_acquire_locked(m, fd, size);
+    pthread_mutex_unlock(&lru.lock);
+
+    return addr;
+}
+
+const uint8_t *segmap_peek(segmap_t *m, size_t size)
+{
+    const uint8_t *addr = NULL;
+
+    pthread_mutex_lock(&lru.lock);
+    if (m->addr && m->size >= size && size > 0) {
+        if (lru.head != m) {
+            lru_unlink(m);
+            lru_push_front(m);
+        }
+        m->pins++;
+        addr = m->addr;
+    }
+    pthread_mutex_unlock(&lru.lock);
+
+    return addr;
+}
+
+void segmap_release(segmap_t *m)
+{
+    pthread_mutex_lock(&lru.lock);
+    if (m->pins > 0)
+        m->pins--;
+    if (m->pins == 0) {
+        segmap_unmap_retired(m);
+        // Pinned segments may have pushed the count past the limit
+        if (lru.count > lru.limit)
+            segmap_evict(lru.limit);
+    }
+    pthread_mutex_unlock(&lru.lock);
+}
+
+void segmap_close(segmap_t *m)
+{
+    pthread_mutex_lock(&lru.lock);
+    if (m->addr)
+        segmap_unmap(m);
+    segmap_unmap_retired(m);
+    m->pins = 0;
+    pthread_mutex_unlock(&lru.lock);
+}
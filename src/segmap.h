@@ -0,0 +1,53 @@
+#ifndef SEGMAP_H
+#define SEGMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEGMAP_DEFAULT_LIMIT 1024
+
+/*
+ * Read-only memory mapping of a segment file (commit log or index), mapped
+ * lazily on first access and tracked by a process-wide LRU list, which caps
+ * the number of live mappings, unmapping the least recently used ones.
+ *
+ * A mapping is pinned while in use, a pinned mapping is never unmapped by the
+ * LRU, the limit is exceeded if every mapping is pinned. Segments only grow by
+ * appending, a mapping smaller than the current size of the file is remapped
+ * on the next access, the old one kept until unpinned.
+ *
+ * The LRU list is guarded by a lock, segments are mapped by the background
+ * threads while queries decode from others.
+ */
+typedef struct segmap {
+    const uint8_t *addr;
+    size_t size;
+    size_t pins;
+    struct segmap_region *retired;
+    struct segmap *prev;
+    struct segmap *next;
+} segmap_t;
+
+// Sets the maximum number of live mappings, at least 2 to allow for a commit
+// log and its index to be mapped at the same time
+void segmap_set_limit(size_t limit);
+
+// Returns the current number of live mappings
+size_t segmap_count(void);
+
+// Returns a pointer to the first size bytes of the file mapped in memory,
+// pinned until released, NULL on error or on an empty file
+const uint8_t *segmap_acquire(segmap_t *m, int fd, size_t size);
+
+// Returns the pointer to the segment mapped if it covers its first size
+// bytes, marking it as most recently used and pinned until released, NULL if
+// it needs a mapping
+const uint8_t *segmap_peek(segmap_t *m, size_t size);
+
+// Unpins a segment acquired or peeked
+void segmap_release(segmap_t *m);
+
+// Unmaps the segment, whatever its pins, and removes it from the LRU
+void segmap_close(segmap_t *m);
+
+#endif
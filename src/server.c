@@ -1,9 +1,11 @@
 #include "server.h"
+#include "blockcache.h"
 #include "buffer.h"
 #include "cluster.h"
 #include "config.h"
 #include "dbcontext.h"
 #include "encoding.h"
+#include "fdcache.h"
 #include "iomux.h"
 #include "logger.h"
 #include "network.h"
@@ -39,7 +41,103 @@
 #define not_implemented(resp)                                                  \
     set_string_response((resp), 1, "Error: not supported")
 
-static response_t execute_statement(tcc_t *ctx, const stmt_t *stmt)
+/*
+ * INSERT responses held back until the WAL policy makes their points durable,
+ * at most one per client as requests are served in order, see `ts_commit`
+ */
+typedef struct pending_ack {
+    timeseries_t *ts;
+    size_t length;
+    uint8_t *response;
+} pending_ack_t;
+
+static pending_ack_t pending_acks[FD_SETSIZE] = {0};
+static size_t pending_nr                      = 0;
+
+static void ack_drop(int fd)
+{
+    if (!pending_acks[fd].ts)
+        return;
+
+    free(pending_acks[fd].response);
+    pending_acks[fd] = (pending_ack_t){0};
+    pending_nr--;
+}
+
+static int ack_park(int fd, timeseries_t *ts, const uint8_t *response,
+                    size_t length)
+{
+    uint8_t *copy = malloc(length);
+    if (!copy)
+        return -1;
+
+    memcpy(copy, response, length);
+    pending_acks[fd] = (pending_ack_t){ts, length, copy};
+    pending_nr++;
+
+    return 0;
+}
+
+// Encode the error sent in place of the response of an INSERT whose points
+// failed to commit
+static ssize_t encode_commit_error(const timeseries_t *ts, uint8_t *buf)
+{
+    log_error("Failed to commit WAL for \"%s\"", ts->name);
+    response_t rs = {0};
+    set_string_response(&rs, 1, "Error: failed to commit points");
+
+    return encode_response(&rs, buf);
+}
+
+/*
+ * Commit the points of a parked INSERT and send its response once durable,
+ * returns 1 if sent, 0 if still waiting, -1 on error.
+ */
+static int ack_commit(int fd, int force)
+{
+    pending_ack_t *ack = &pending_acks[fd];
+    int committed      = ts_commit(ack->ts, force);
+    if (committed == 0)
+        return 0;
+
+    ssize_t length               = ack->length;
+    uint8_t response_buf[BUFSIZ] = {0};
+    const uint8_t *response      = ack->response;
+    if (committed < 0) {
+        length   = encode_commit_error(ack->ts, response_buf);
+        response = response_buf;
+    }
+
+    ssize_t sent = send_nonblocking(fd, response, length);
+    ack_drop(fd);
+
+    return sent == length ? 1 : -1;
+}
+
+/*
+ * Milliseconds to wait for the first parked INSERT to become committable by
+ * its WAL policy, -1 if there's none
+ */
+static time_t acks_timeout(void)
+{
+    time_t timeout = -1;
+
+    for (int fd = 0; pending_nr > 0 && fd < FD_SETSIZE; ++fd) {
+        if (!pending_acks[fd].ts)
+            continue;
+
+        int64_t t = ts_commit_timeout(pending_acks[fd].ts);
+        if (t < 0)
+            t = 0;
+        if (timeout < 0 || t < timeout)
+            timeout = t;
+    }
+
+    return timeout;
+}
+
+static response_t execute_statement(tcc_t *ctx, const stmt_t *stmt,
+                                    timeseries_t **pending_commit)
 {
     response_t rs = {0};
     if (!stmt) {
@@ -49,6 +147,7 @@ static response_t execute_statement(tcc_t *ctx, const stmt_t *stmt)
     }
 
     execute_stmt_result_t exec_result = stmt_execute(ctx, stmt);
+    *pending_commit                   = exec_result.pending_commit;
 
     switch (exec_result.code) {
     case EXEC_SUCCESS_STRING:
@@ -79,11 +178,17 @@ static ssize_t handle_client(tcc_t *ctx)
     ssize_t bytes_written        = 0;
     uint8_t response_buf[BUFSIZ] = {0};
     stmt_t *stmt                 = NULL;
+    timeseries_t *pending_commit = NULL;
 
     int err                      = tcc_read_buffer(ctx);
     if (err < 0)
         return -1;
 
+    // A new request from a client still waiting on an INSERT, its response
+    // has to go out first
+    if (pending_acks[ctx->fd].ts && ack_commit(ctx->fd, 1) < 0)
+        return -1;
+
     bytes_read = decode_request(ctx->buffer->data, &rq);
     if (bytes_read < 0) {
         log_error("Failed to decode client request: %zd", bytes_read);
@@ -95,7 +200,7 @@ static ssize_t handle_client(tcc_t *ctx)
     // Parse into Statement
     stmt          = stmt_parse(rq.query);
     // Execute it
-    response_t rs = execute_statement(ctx, stmt);
+    response_t rs = execute_statement(ctx, stmt, &pending_commit);
 
     // Encode the response
 
@@ -109,6 +214,15 @@ static ssize_t handle_client(tcc_t *ctx)
         return -1;
     }
 
+    // Hold the response back until the points inserted are durable, if it
+    // can't be parked just commit right away
+    if (pending_commit) {
+        if (ack_park(ctx->fd, pending_commit, response_buf, bytes_written) == 0)
+            goto cleanup;
+        if (ts_commit(pending_commit, 1) < 0)
+            bytes_written = encode_commit_error(pending_commit, response_buf);
+    }
+
     // Send the response back to the client
     ssize_t sent = send_nonblocking(ctx->fd, response_buf, bytes_written);
     if (sent != bytes_written) {
@@ -121,6 +235,7 @@ static ssize_t handle_client(tcc_t *ctx)
         return -1;
     }
 
+cleanup:
     // Clean up
     if (stmt)
         stmt_free(stmt);
@@ -180,8 +295,14 @@ static int server_start(int serverfd, int clusterfd)
         log_info("init %d databases", n);
     }
 
+    // Series are replayed in the background while serving, 0 workers meaning
+    // one per core, a negative count leaves them to be opened on access
+    int recovery_workers = config_get_int("recovery_workers");
+    if (recovery_workers >= 0)
+        dbcontext_recover(recovery_workers);
+
     while (1) {
-        numevents = iomux_wait(iomux, -1);
+        numevents = iomux_wait(iomux, acks_timeout());
         if (numevents < 0)
             log_critical("iomux error: %s", strerror(errno));
 
@@ -230,6 +351,7 @@ static int server_start(int serverfd, int clusterfd)
                 buffer_clear(clientfds[fd]->buffer);
                 int err = handle_client(clientfds[fd]);
                 if (err <= 0) {
+                    ack_drop(fd);
                     tcc_free(clientfds[fd]);
                     clientfds[fd] = NULL;
                     close(fd);
@@ -248,6 +370,18 @@ static int server_start(int serverfd, int clusterfd)
                 }
             }
         }
+
+        // Group commit, every INSERT served in this round shares the sync
+        // of its series, responses go out once their points are durable
+        for (int fd = 0; pending_nr > 0 && fd < FD_SETSIZE; ++fd) {
+            if (!pending_acks[fd].ts || ack_commit(fd, 0) >= 0)
+                continue;
+
+            tcc_free(clientfds[fd]);
+            clientfds[fd] = NULL;
+            close(fd);
+            log_info("Client disconnected");
+        }
     }
 
     for (int i = 0; i < FD_SETSIZE; ++i) {
@@ -321,6 +455,20 @@ int main(int argc, char **argv)
 
     config_print();
 
+    int block_cache_mb = config_get_int("block_cache_mb");
+    if (block_cache_mb >= 0)
+        block_cache_set_budget((size_t)block_cache_mb << 20);
+
+    int fd_cache_size = config_get_int("fd_cache_size");
+    if (fd_cache_size > 0)
+        fdcache_set_limit(fd_cache_size);
+
+    // New databases share a WAL of segments of that size, 0 keeps a WAL file
+    // per chunk
+    int wal_segment_mb = config_get_int("wal_segment_mb");
+    if (wal_segment_mb > 0)
+        tsdb_set_shared_wal((size_t)wal_segment_mb << 20);
+
     if (config_get_enum("type") != NT_STANDALONE) {
 
         int nodes_num    = config_get_list("shard_leaders", node_strings);
@@ -1,4 +1,5 @@
 #include "statement_execute.h"
+#include "arena.h"
 #include "buffer.h"
 #include "darray.h"
 #include "dbcontext.h"
@@ -7,6 +8,7 @@
 #include "tcc.h"
 #include "timeutil.h"
 #include <inttypes.h>
+#include <strings.h>
 
 /**
  * Process a USE statement and generate appropriate response
@@ -31,6 +33,48 @@ static execute_stmt_result_t execute_use(const stmt_t *stmt)
     return result;
 }
 
+/**
+ * Translate the optional sync clause of a CREATEDB into a WAL policy, the
+ * interval policy takes a timespan or a number of milliseconds, the bytes
+ * policy a number of bytes.
+ */
+static int parse_wal_policy(const stmt_t *stmt, wal_policy_t *policy)
+{
+    const stmt_timeunit_t *every = &stmt->create.sync_every;
+    const char *sync             = stmt->create.sync;
+
+    if (strncasecmp(sync, "os", TS_MAXSIZE) == 0) {
+        policy->sync = WS_OS;
+    } else if (strncasecmp(sync, "always", TS_MAXSIZE) == 0) {
+        policy->sync = WS_ALWAYS;
+    } else if (strncasecmp(sync, "interval", TS_MAXSIZE) == 0) {
+        policy->sync = WS_INTERVAL;
+        if (!stmt->create.has_sync_every)
+            return -1;
+        if (every->type == TU_SPAN) {
+            int64_t ns =
+                timespan_seconds(every->timespan.value, every->timespan.unit);
+            if (ns < 0)
+                return -1;
+            policy->interval_ms = ns / (int64_t)1e6;
+        } else if (every->type == TU_VALUE && every->value >= 0) {
+            policy->interval_ms = every->value;
+        } else {
+            return -1;
+        }
+    } else if (strncasecmp(sync, "bytes", TS_MAXSIZE) == 0) {
+        policy->sync = WS_BYTES;
+        if (!stmt->create.has_sync_every || every->type != TU_VALUE ||
+            every->value <= 0)
+            return -1;
+        policy->bytes = every->value;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Process a CREATEDB statement and generate appropriate response
  *
@@ -49,6 +93,14 @@ static execute_stmt_result_t execute_createdb(const stmt_t *stmt)
         return result;
     }
 
+    wal_policy_t policy = {.sync = WS_OS};
+    if (stmt->create.has_sync && parse_wal_policy(stmt, &policy) < 0) {
+        result.code = EXEC_ERROR_INVALID_VALUE;
+        snprintf(result.message, MESSAGE_SIZE, "Invalid sync policy '%s'",
+                 stmt->create.sync);
+        return result;
+    }
+
     tsdb = dbcontext_add(stmt->create.db_name);
     if (!tsdb) {
         result.code = EXEC_ERROR_DB_NOT_CREATED;
@@ -57,7 +109,9 @@ static execute_stmt_result_t execute_createdb(const stmt_t *stmt)
         return result;
     }
 
-    result.code = EXEC_SUCCESS_STRING;
+    tsdb->wal_policy = policy;
+
+    result.code      = EXEC_SUCCESS_STRING;
     snprintf(result.message, MESSAGE_SIZE, "Database '%s' created",
              stmt->create.db_name);
 
@@ -96,7 +150,37 @@ static execute_stmt_result_t execute_create(const stmt_t *stmt)
         return result;
     }
 
-    ts_opts_t opts = {.retention = stmt->create.retention.value};
+    // Retention is kept in nanoseconds, like the timestamps
+    ts_opts_t opts                   = {0};
+    const stmt_timeunit_t *retention = &stmt->create.retention;
+    if (stmt->create.has_retention) {
+        opts.retention =
+            retention->type == TU_SPAN
+                ? timespan_seconds(retention->timespan.value,
+                                   retention->timespan.unit)
+                : retention->value;
+        if (opts.retention < 0) {
+            result.code = EXEC_ERROR_INVALID_VALUE;
+            snprintf(result.message, MESSAGE_SIZE, "Invalid retention");
+            return result;
+        }
+    }
+
+    // So are the rollup intervals
+    for (size_t i = 0; i < stmt->create.rollups_nr; ++i) {
+        const stmt_timeunit_t *rollup = &stmt->create.rollups[i];
+        int64_t interval =
+            rollup->type == TU_SPAN
+                ? timespan_seconds(rollup->timespan.value,
+                                   rollup->timespan.unit)
+                : rollup->value;
+        if (interval <= 0) {
+            result.code = EXEC_ERROR_INVALID_VALUE;
+            snprintf(result.message, MESSAGE_SIZE, "Invalid rollup interval");
+            return result;
+        }
+        opts.rollups[opts.rollups_nr++] = interval;
+    }
 
     // Create timeseries
     // TODO handle duplication policy
@@ -216,6 +300,80 @@ static int extract_timestamps(const stmt_selector_t *selector, int64_t *t0,
     return 0;
 }
 
+static record_t sample_record(uint64_t timestamp, double_t value)
+{
+    return (record_t){
+        .tv        = (struct timespec){.tv_sec  = timestamp / (uint64_t)1e9,
+                                       .tv_nsec = timestamp % (uint64_t)1e9},
+        .timestamp = timestamp,
+        .value     = value,
+        .is_set    = 1};
+}
+
+// The value of a bucket for the function selected, the average by default
+static double_t sample_value(function_t fn, const ts_sample_t *s)
+{
+    switch (fn) {
+    case FN_MIN:
+        return s->min;
+    case FN_MAX:
+        return s->max;
+    case FN_LATEST:
+        return s->last;
+    default:
+        return s->sum / (double_t)s->count;
+    }
+}
+
+/*
+ * SAMPLE BY, a single pass over the range (the whole series without one),
+ * one record per non empty bucket, labelled with its start.
+ */
+static execute_stmt_result_t execute_select_sample(const stmt_t *stmt,
+                                                   timeseries_t *ts)
+{
+    execute_stmt_result_t result = {0};
+    int64_t t0                   = 0LL;
+    int64_t t1                   = INT64_MAX;
+    int64_t interval             = 0LL;
+
+    if (stmt->select.flags & QF_RNGE &&
+        extract_timestamps(&stmt->select.selector, &t0, &t1) < 0) {
+        result.code = EXEC_ERROR_INVALID_TIMESTAMP;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Selector with invalid timestamp");
+        return result;
+    }
+
+    if (extract_timestamp(&stmt->select.sampling, &interval) < 0 ||
+        interval <= 0) {
+        result.code = EXEC_ERROR_INVALID_VALUE;
+        snprintf(result.message, MESSAGE_SIZE, "Invalid sampling interval");
+        return result;
+    }
+
+    ts_sample_array_t samples = {0};
+    if (ts_sample(ts, t0, t1, interval, &samples) < 0) {
+        result.code = EXEC_ERROR_INVALID_TIMESTAMP;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Error: failed to sample range [%" PRIu64 ", %" PRIu64 "]",
+                 t0, t1);
+        return result;
+    }
+
+    for (size_t i = 0; i < samples.length; ++i)
+        da_append(&result.result_set,
+                  sample_record(samples.items[i].start,
+                                sample_value(stmt->select.function,
+                                             &samples.items[i])));
+    da_free(&samples);
+
+    result.code = result.result_set.length == 0 ? EXEC_ERROR_EMPTY_RESULTSET
+                                                : EXEC_SUCCESS_ARRAY;
+
+    return result;
+}
+
 static execute_stmt_result_t execute_select_range(const stmt_t *stmt,
                                                   timeseries_t *ts)
 {
@@ -233,9 +391,20 @@ static execute_stmt_result_t execute_select_range(const stmt_t *stmt,
     if (stmt->select.flags & QF_FUNC) {
         record_t r = {0};
         switch (stmt->select.function) {
-        case FN_AVG:
-            // TODO
+        case FN_AVG: {
+            ts_sample_t sample = {0};
+            if (ts_aggregate(ts, t0, t1, &sample) < 0) {
+                result.code = EXEC_ERROR_INVALID_TIMESTAMP;
+                snprintf(result.message, MESSAGE_SIZE,
+                         "Error: failed to query range [%" PRIu64 ", %" PRIu64
+                         "]",
+                         t0, t1);
+            } else {
+                da_append(&result.result_set,
+                          sample_record(t0, sample.sum / sample.count));
+            }
             break;
+        }
         case FN_MIN:
             if (ts_min(ts, t0, t1, &r) < 0) {
                 result.code = EXEC_ERROR_INVALID_TIMESTAMP;
@@ -363,6 +532,15 @@ static execute_stmt_result_t execute_select(tcc_t *ctx, const stmt_t *stmt)
         return result;
     }
 
+    // Rather than stalling every client on a series still replaying its WALs
+    if (ts_recovering(tsdb, stmt->select.ts_name)) {
+        result.code = EXEC_ERROR_TS_RECOVERING;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Timeseries '%s' is recovering, retry later",
+                 stmt->select.ts_name);
+        return result;
+    }
+
     timeseries_t *ts = ts_get(tsdb, stmt->select.ts_name);
     if (!ts) {
         snprintf(result.message, MESSAGE_SIZE, "Timeseries '%s' not found",
@@ -371,7 +549,9 @@ static execute_stmt_result_t execute_select(tcc_t *ctx, const stmt_t *stmt)
     }
 
     // Query data based on select mask
-    if (stmt->select.flags & QF_RNGE) {
+    if (stmt->select.flags & QF_SMPL) {
+        return execute_select_sample(stmt, ts);
+    } else if (stmt->select.flags & QF_RNGE) {
         return execute_select_range(stmt, ts);
     } else if (stmt->select.flags & QF_BASE) {
         if (ts_stream(ts, stream_callback, ctx) < 0) {
@@ -414,6 +594,14 @@ static execute_stmt_result_t execute_insert(const stmt_t *stmt)
         return result;
     }
 
+    if (ts_recovering(tsdb, stmt->insert.ts_name)) {
+        result.code = EXEC_ERROR_TS_RECOVERING;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Timeseries '%s' is recovering, retry later",
+                 stmt->insert.ts_name);
+        return result;
+    }
+
     timeseries_t *ts = ts_get(tsdb, stmt->insert.ts_name);
     if (!ts) {
         result.code = EXEC_ERROR_TS_NOT_FOUND;
@@ -422,12 +610,24 @@ static execute_stmt_result_t execute_insert(const stmt_t *stmt)
         return result;
     }
 
+    size_t length        = stmt->insert.record_array.length;
+    arena_t *scratch     = arena_scratch_acquire();
+    uint64_t *timestamps = arena_alloc(scratch, length * sizeof(*timestamps));
+    double_t *values     = arena_alloc(scratch, length * sizeof(*values));
+    if (length > 0 && (!timestamps || !values)) {
+        arena_scratch_release();
+        result.code = EXEC_ERROR_MEMORY;
+        snprintf(result.message, MESSAGE_SIZE, "Out of memory");
+        return result;
+    }
+
     int success_count = 0;
     int error_count   = 0;
     int64_t timestamp = 0;
+    size_t n          = 0;
 
-    // Insert each record
-    for (size_t i = 0; i < stmt->insert.record_array.length; i++) {
+    // Resolve the timestamps and insert all the points as a single batch
+    for (size_t i = 0; i < length; i++) {
         stmt_record_t *record = &stmt->insert.record_array.items[i];
 
         if (extract_timestamp(&record->timeunit, &timestamp) < 0) {
@@ -435,15 +635,44 @@ static execute_stmt_result_t execute_insert(const stmt_t *stmt)
             continue;
         }
 
-        log_info("Insert (%lli, %lf)", timestamp, record->value);
-        int result = ts_insert(ts, timestamp, record->value);
-        if (result == 0) {
-            success_count++;
-        } else {
-            error_count++;
-        }
+        timestamps[n] = timestamp;
+        values[n]     = record->value;
+        n++;
     }
 
+    log_info("Insert %zu points into \"%s\"", n, stmt->insert.ts_name);
+    int inserted = ts_insert_batch(ts, timestamps, values, n);
+
+    arena_scratch_release();
+
+    // Nothing was written, the flusher is too far behind
+    if (inserted == TS_E_BACKPRESSURE) {
+        result.code = EXEC_ERROR_BACKPRESSURE;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Too many pending flushes on \"%s\", retry later",
+                 stmt->insert.ts_name);
+        return result;
+    }
+
+    if (inserted < 0) {
+        error_count += n;
+    } else {
+        success_count = inserted;
+    }
+
+    // Group commit, the response is held back until the points are durable
+    // if the WAL policy doesn't sync them right away
+    int committed = ts_commit(ts, 0);
+    if (committed < 0) {
+        result.code = EXEC_ERROR_IO;
+        snprintf(result.message, MESSAGE_SIZE,
+                 "Failed to commit %d points to the WAL", success_count);
+        return result;
+    }
+
+    if (committed == 0)
+        result.pending_commit = ts;
+
     result.code = EXEC_SUCCESS_STRING;
     // Set response based on insertion results
     if (error_count == 0) {
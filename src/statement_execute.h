@@ -16,11 +16,13 @@ typedef enum {
     EXEC_ERROR_DB_NOT_FOUND,
     EXEC_ERROR_TS_NOT_FOUND,
     EXEC_ERROR_TS_NOT_CREATED,
+    EXEC_ERROR_TS_RECOVERING,
     EXEC_ERROR_DB_NOT_CREATED,
     EXEC_ERROR_INVALID_TIMESTAMP,
     EXEC_ERROR_INVALID_VALUE,
     EXEC_ERROR_MEMORY,
     EXEC_ERROR_IO,
+    EXEC_ERROR_BACKPRESSURE,
     EXEC_ERROR_NULLPTR,
     EXEC_ERROR_UNKNOWN_STATEMENT
 } execute_result_code_t;
@@ -35,6 +37,10 @@ typedef struct {
     // Metadata about the execution
     int64_t execution_time_ns; // Execution time in nanoseconds
     int64_t records_affected;  // For INSERT/DELETE operations
+
+    // For INSERT statements still waiting for the WAL policy to make their
+    // points durable, the response must be held until ts_commit succeeds
+    timeseries_t *pending_commit;
 } execute_stmt_result_t;
 
 typedef struct tcc tcc_t;
@@ -44,8 +50,6 @@ execute_stmt_result_t stmt_execute(tcc_t *ctx, const stmt_t *stmt);
 
 // Helper functions for statement preparation
 int64_t stmt_resolve_timestamp(const stmt_timeunit_t *timeunit);
-double stmt_compute_aggregation(function_t fn, const stmt_record_t *records,
-                                size_t count);
 bool stmt_eval_where_clause(const where_clause_t *where,
                             const stmt_record_t *record);
 
@@ -106,6 +106,7 @@ typedef enum {
     TOKEN_BINARY_OP_MUL,
     TOKEN_FUNC_LATEST,
     TOKEN_BY,
+    TOKEN_ROLLUP,
     TOKEN_EOF
 } token_type_t;
 
@@ -317,6 +318,8 @@ static bool match_keyword(string_view_t *source, token_t *token,
         token->type = TOKEN_SAMPLE;
     } else if (sv_equals_cstr_ignorecase(value, "BY")) {
         token->type = TOKEN_BY;
+    } else if (sv_equals_cstr_ignorecase(value, "ROLLUP")) {
+        token->type = TOKEN_ROLLUP;
     } else if (sv_equals_cstr_ignorecase(value, "LIMIT")) {
         token->type = TOKEN_LIMIT;
     } else if (sv_equals_cstr_ignorecase(value, "VALUE")) {
@@ -725,6 +728,8 @@ err:
     return NULL;
 }
 
+static int parse_timeunit(parser_t *p, stmt_timeunit_t *tu);
+
 static stmt_t *parse_createdb(parser_t *p)
 {
     stmt_t *node = calloc(1, sizeof(*node));
@@ -742,6 +747,24 @@ static stmt_t *parse_createdb(parser_t *p)
 
     copy_identifier(node->create.db_name, tsname);
 
+    // Optional WAL sync policy, followed by its interval or size
+    if (parser_peek(p)->type != TOKEN_LITERAL)
+        return node;
+
+    char *sync = expect_literal(p);
+    if (!sync)
+        goto err;
+
+    copy_identifier(node->create.sync, sync);
+    node->create.has_sync = true;
+
+    token_t *t            = parser_peek(p);
+    if (t->type == TOKEN_TIMEUNIT || t->type == TOKEN_NUMBER) {
+        node->create.has_sync_every = true;
+        if (parse_timeunit(p, &node->create.sync_every) < 0)
+            goto err;
+    }
+
     return node;
 
 err:
@@ -914,6 +937,21 @@ static stmt_t *parse_create(parser_t *p)
         node->create.has_duplication = true;
     }
 
+    // Optional comma separated rollup intervals
+    if (parser_peek(p)->type == TOKEN_ROLLUP) {
+        if (expect(p, TOKEN_ROLLUP) < 0)
+            goto err;
+        do {
+            if (node->create.rollups_nr == ROLLUPS_LENGTH)
+                goto err;
+            stmt_timeunit_t *tu =
+                &node->create.rollups[node->create.rollups_nr++];
+            if (parse_timeunit(p, tu) < 0)
+                goto err;
+        } while (parser_peek(p)->type == TOKEN_COMMA &&
+                 expect(p, TOKEN_COMMA) == 0);
+    }
+
     return node;
 
 err:
@@ -1310,6 +1348,13 @@ void stmt_print(const stmt_t *stmt)
     case STMT_CREATEDB:
         printf("CREATEDB statement:\n");
         printf("  DB Name: %s\n", stmt->create.db_name);
+        if (stmt->create.has_sync) {
+            printf("  Sync: %s\n", stmt->create.sync);
+        }
+        if (stmt->create.has_sync_every) {
+            printf("  Sync every: ");
+            print_timeunit(&stmt->create.sync_every);
+        }
         break;
 
     case STMT_USE:
@@ -1327,6 +1372,10 @@ void stmt_print(const stmt_t *stmt)
         if (stmt->create.has_duplication) {
             printf("  Duplication: %s\n", stmt->create.duplication);
         }
+        for (size_t i = 0; i < stmt->create.rollups_nr; ++i) {
+            printf("   Rollup: ");
+            print_timeunit(&stmt->create.rollups[i]);
+        }
         break;
 
     case STMT_DELETE:
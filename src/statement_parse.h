@@ -9,6 +9,7 @@
 #define IDENTIFIER_LENGTH 64
 #define RECORDS_LENGTH    32
 #define TS_MAXSIZE        24
+#define ROLLUPS_LENGTH    4
 
 /*
  * String view APIs definition
@@ -40,6 +41,12 @@ string_view_t sv_chop_by_delim(string_view_t *view, char delim);
  **
  **     CREATEDB metrics
  **
+ ** - Create new database with a WAL sync policy, 'os' (default), 'always',
+ **   'interval' or 'bytes'
+ **
+ **     CREATEDB metrics 'interval' 50ms
+ **     CREATEDB metrics 'bytes' 65536
+ **
  ** - Set a database as active
  **
  **     USE metrics
@@ -108,9 +115,17 @@ string_view_t sv_chop_by_delim(string_view_t *view, char delim);
  **     SELECT avg(value) FROM cpu_usage BETWEEN '2023-01-01' AND '2023-01-31'
  **     SAMPLE BY 1d
  **
- ** COMMAND     ::= CREATE_CMD | INSERT_CMD | SELECT_CMD | DELETE_CMD
+ ** - Rollups, maintained as the points are persisted, sampling by a multiple
+ **   of their interval reads them instead of the points
+ **
+ **     CREATE cpu_usage 30d ROLLUP 1m, 5m, 1h
+ **
+ ** COMMAND     ::= CREATEDB_CMD | CREATE_CMD | INSERT_CMD | SELECT_CMD
+ **               | DELETE_CMD
+ **
+ ** CREATEDB_CMD ::= "CREATEDB" IDENTIFIER [SYNC [SYNC_EVERY]]
  **
- ** CREATE_CMD  ::= "CREATE" IDENTIFIER [RETENTION] [DUPLICATION]
+ ** CREATE_CMD  ::= "CREATE" IDENTIFIER [RETENTION] [DUPLICATION] [ROLLUPS]
  **
  ** INSERT_CMD  ::= "INSERT" "INTO" IDENTIFIER VALUE_LIST
  **
@@ -124,6 +139,9 @@ string_view_t sv_chop_by_delim(string_view_t *view, char delim);
  **
  ** RETENTION   ::= NUMBER
  ** DUPLICATION ::= NUMBER
+ ** ROLLUPS     ::= "ROLLUP" TIMESPAN ("," TIMESPAN)*
+ ** SYNC        ::= "'os'" | "'always'" | "'interval'" | "'bytes'"
+ ** SYNC_EVERY  ::= NUMBER | TIMESPAN
  ** COMPARATOR  ::= ">" | "<" | "=" | "<=" | ">=" | "!="
  ** AGG_FUNC    ::= "avg" | "min" | "max"
  ** VALUE_LIST  ::= (TIMESTAMP, VALUE)+
@@ -210,6 +228,12 @@ typedef struct {
     stmt_timeunit_t retention;
     bool has_duplication;
     char duplication[TS_MAXSIZE];
+    size_t rollups_nr;
+    stmt_timeunit_t rollups[ROLLUPS_LENGTH];
+    bool has_sync;
+    char sync[TS_MAXSIZE];
+    bool has_sync_every;
+    stmt_timeunit_t sync_every;
 } stmt_create_t;
 
 // Define structure for DELETE statement
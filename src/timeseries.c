@@ -1,82 +1,248 @@
 #include "timeseries.h"
+#include "aggregate.h"
 #include "binary.h"
 #include "darray.h"
+#include "gorilla.h"
 #include "hash.h"
 #include "logger.h"
+#include "timeutil.h"
 #include <dirent.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static const size_t TS_HASHTABLE_BASESIZE = 64;
-static const size_t LINEAR_THRESHOLD      = 192;
 static const size_t RECORD_BINSIZE = (sizeof(uint64_t) * 2) + sizeof(double_t);
+static const size_t CHUNK_BASE_CAPACITY   = 1 << 8;
 const char *BASEPATH               = "logdata";
 const size_t TS_MIN_FLUSHSIZE      = 256;  // 256b
 const size_t TS_FLUSHSIZE          = 4096; // 4Kb
-const size_t TS_BATCH_OFFSET       = sizeof(uint64_t) * 3;
+static const size_t TS_COMPACT_SIZE = 1 << 20; // 1Mb
+static const size_t TS_COMPACT_RUN  = 32;
+static const unsigned TS_FLUSH_RETRY_MS = 500;
+static const char *COMPACT_DIR      = "tmp";
+static const char *COMPACT_MARKER   = "compact";
+static const char *MANIFEST         = "MANIFEST";
+static const char *MANIFEST_HEADER  = "tsdb-manifest 1";
+static size_t shared_wal_segment    = 0;
+
+typedef struct ts_recovery_task {
+    timeseries_db_t *tsdb;
+    ts_entry_t *e;
+} ts_recovery_task_t;
 
-typedef struct ts_ht_entry {
-    timeseries_t *ts;
-    struct ts_ht_entry *next;
-} ts_ht_entry_t;
+/*
+ * Recovery of the series in the background, a pool of workers each one
+ * materializing a series at a time, replaying its WALs and loading its
+ * partitions. The workers exit once the queue is drained.
+ *
+ * The lock also guards the link between the entries and their series, which
+ * are materialized either by a worker or on access, whichever comes first.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    darray(ts_recovery_task_t) tasks;
+    size_t next;
+    size_t workers;
+    size_t done;
+    size_t total;
+    struct timespec started;
+    time_t reported;
+} recovery = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .cond = PTHREAD_COND_INITIALIZER};
+
+static ts_entry_t *ts_entry_new(const char *name, const ts_opts_t *opts)
+{
+    size_t len    = strlen(name);
+    ts_entry_t *e = calloc(1, sizeof(*e) + len + 1);
+    if (!e)
+        return NULL;
+
+    e->opts = *opts;
+    memcpy(e->name, name, len + 1);
 
-typedef struct ts_ht {
-    ts_ht_entry_t **buckets;
-    size_t size;
-} ts_ht_t;
+    return e;
+}
 
-static size_t hash_tsname(const char *name, size_t mapsize)
+/*
+ * Take the range of the partitions of an open series and the rollups it
+ * found on disk, to be written in the manifest.
+ */
+static void ts_entry_update(ts_entry_t *e, const timeseries_t *ts)
 {
-    uint32_t hash = murmur3_hash((const uint8_t *)name, 0);
-    return hash % mapsize;
+    const partition_catalog_t *pc = &ts->partitions;
+
+    e->partitions                 = pc->length;
+    e->start_ts                   = pc->length > 0 ? pc->items[0]->start_ts : 0;
+    e->end_ts                     = 0;
+    for (size_t i = 0; i < pc->length; ++i)
+        if (pc->items[i]->end_ts > e->end_ts)
+            e->end_ts = pc->items[i]->end_ts;
+
+    e->opts.rollups_nr = ts->rollups_nr;
+    for (size_t i = 0; i < ts->rollups_nr; ++i)
+        e->opts.rollups[i] = ts->rollups[i].interval;
 }
 
-static void tsdb_add_ts(timeseries_db_t *tsdb, timeseries_t *ts)
+static int tsdb_add_entry(timeseries_db_t *tsdb, ts_entry_t *e)
 {
-    if (!tsdb || !ts)
-        return;
+    // The key is the name held by the entry itself
+    if (hashmap_put(&tsdb->series, e->name, strlen(e->name), e) != 1) {
+        log_error("Failed to register timeseries \"%s\"", e->name);
+        return -1;
+    }
 
-    size_t bucket        = hash_tsname(ts->name, tsdb->ts_hashtable->size);
+    return 0;
+}
 
-    // Check if the timeseries already exists
-    ts_ht_entry_t *entry = tsdb->ts_hashtable->buckets[bucket];
-    while (entry) {
-        if (strncmp(entry->ts->name, ts->name, strlen(ts->name)) == 0) {
-            return;
-        }
-        entry = entry->next;
+static ts_entry_t *tsdb_get_entry(const timeseries_db_t *tsdb,
+                                  const char *name)
+{
+    if (!tsdb)
+        return NULL;
+
+    return hashmap_get(&tsdb->series, name, strlen(name));
+}
+
+static void tsdb_manifest_path(const timeseries_db_t *tsdb, char *buf,
+                               size_t size)
+{
+    snprintf(buf, size, "%s/%s/%s", BASEPATH, tsdb->datapath, MANIFEST);
+}
+
+static void tsdb_manifest_line(const char *name, size_t name_len, void *value,
+                               void *userdata)
+{
+    ts_entry_t *e = value;
+    FILE *fp      = userdata;
+
+    pthread_mutex_lock(&recovery.lock);
+    if (e->ts) {
+        pthread_mutex_lock(&e->ts->lock);
+        ts_entry_update(e, e->ts);
+        pthread_mutex_unlock(&e->ts->lock);
     }
 
-    // Create a new entry
-    ts_ht_entry_t *new_entry = malloc(sizeof(ts_ht_entry_t));
-    if (!new_entry)
-        return; // Memory allocation failed
+    fprintf(fp, "%" PRId64 " %zu %d %" PRIu64 " %" PRIu64 " %zu %zu",
+            e->opts.retention, e->opts.flushsize, (int)e->opts.policy,
+            e->start_ts, e->end_ts, e->partitions, e->opts.rollups_nr);
+    for (size_t i = 0; i < e->opts.rollups_nr; ++i)
+        fprintf(fp, " %" PRIu64, e->opts.rollups[i]);
+    fprintf(fp, " %s\n", e->name);
+    pthread_mutex_unlock(&recovery.lock);
+}
+
+/*
+ * Write the manifest aside and move it in place, a crash leaves either the
+ * previous manifest or the new one, never a partial one. A series per line,
+ * its options, the range of its partitions, its rollups and its name last,
+ * up to the end of the line.
+ */
+static int tsdb_manifest_write(const timeseries_db_t *tsdb)
+{
+    char path[PATHBUF_SIZE], tmp[PATHBUF_SIZE];
+    tsdb_manifest_path(tsdb, path, sizeof(path));
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return -1;
+
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    hashmap_foreach(&tsdb->series, tsdb_manifest_line, fp);
+
+    int err = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+    fclose(fp);
 
-    new_entry->ts                       = ts;
+    if (err == 0)
+        err = rename(tmp, path);
+    if (err < 0) {
+        log_error("Failed to write the manifest of \"%s\"", tsdb->datapath);
+        unlink(tmp);
+    }
 
-    // Add to hashtable at the beginning of the linked list
-    new_entry->next                     = tsdb->ts_hashtable->buckets[bucket];
-    tsdb->ts_hashtable->buckets[bucket] = new_entry;
+    return err;
 }
 
-static timeseries_t *tsdb_get_ts(const timeseries_db_t *tsdb, const char *name)
+// Parses a manifest line, NUL terminated, into a new entry
+static ts_entry_t *tsdb_manifest_parse(const char *line)
 {
-    if (!tsdb) {
+    ts_opts_t opts = {0};
+    uint64_t start = 0, end = 0;
+    size_t partitions = 0;
+    int policy = 0, n = 0;
+
+    if (sscanf(line, "%" SCNd64 " %zu %d %" SCNu64 " %" SCNu64 " %zu %zu%n",
+               &opts.retention, &opts.flushsize, &policy, &start, &end,
+               &partitions, &opts.rollups_nr, &n) != 7 ||
+        opts.rollups_nr > ROLLUP_MAX)
+        return NULL;
+
+    const char *ptr = line + n;
+    for (size_t i = 0; i < opts.rollups_nr; ++i) {
+        if (sscanf(ptr, " %" SCNu64 "%n", &opts.rollups[i], &n) != 1)
+            return NULL;
+        ptr += n;
+    }
+
+    if (*ptr++ != ' ' || *ptr == '\0' || strlen(ptr) >= TS_NAME_MAX_LENGTH)
+        return NULL;
+
+    opts.policy   = policy;
+    ts_entry_t *e = ts_entry_new(ptr, &opts);
+    if (!e)
         return NULL;
+
+    e->start_ts   = start;
+    e->end_ts     = end;
+    e->partitions = partitions;
+
+    return e;
+}
+
+// Registers the series listed in the manifest, -1 if there's none
+static int tsdb_manifest_read(timeseries_db_t *tsdb)
+{
+    char path[PATHBUF_SIZE];
+    tsdb_manifest_path(tsdb, path, sizeof(path));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    char line[TS_NAME_MAX_LENGTH + 256];
+    if (!fgets(line, sizeof(line), fp) ||
+        strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0) {
+        log_error("Unknown manifest format in \"%s\"", tsdb->datapath);
+        fclose(fp);
+        return -1;
     }
 
-    size_t bucket        = hash_tsname(name, tsdb->ts_hashtable->size);
-    ts_ht_entry_t *entry = tsdb->ts_hashtable->buckets[bucket];
+    int count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
 
-    while (entry) {
-        if (strncmp(entry->ts->name, name, strlen(name)) == 0) {
-            return entry->ts;
+        ts_entry_t *e = tsdb_manifest_parse(line);
+        if (!e) {
+            log_warning("Malformed manifest line in \"%s\": %s",
+                        tsdb->datapath, line);
+            continue;
         }
-        entry = entry->next;
+
+        if (tsdb_add_entry(tsdb, e) < 0)
+            free(e);
+        else
+            count++;
     }
 
-    return NULL;
+    fclose(fp);
+
+    return count;
 }
 
 timeseries_db_t *tsdb_create(const char *datapath)
@@ -84,7 +250,7 @@ timeseries_db_t *tsdb_create(const char *datapath)
     if (!datapath)
         return NULL;
 
-    if (strlen(datapath) > DATAPATH_SIZE)
+    if (strlen(datapath) >= DATAPATH_SIZE)
         return NULL;
 
     if (makedir(BASEPATH) < 0)
@@ -95,26 +261,30 @@ timeseries_db_t *tsdb_create(const char *datapath)
         return NULL;
 
     strncpy(tsdb->datapath, datapath, strlen(datapath) + 1);
+    tsdb->wal_policy = (wal_policy_t){.sync = WS_OS};
+    tsdb->recovering = 0;
+    tsdb->closing    = 0;
+
+    tsdb->wal_log    = NULL;
 
     // Create the DB path if it doesn't exist
     char pathbuf[PATHBUF_SIZE];
+    struct stat st;
     snprintf(pathbuf, sizeof(pathbuf), "%s/%s", BASEPATH, tsdb->datapath);
+    int fresh = stat(pathbuf, &st) < 0;
     if (makedir(pathbuf) < 0) {
         free(tsdb);
         return NULL;
     }
 
-    tsdb->ts_hashtable = calloc(1, sizeof(ts_ht_t));
-    if (!tsdb->ts_hashtable) {
+    if (hashmap_init(&tsdb->series, 0) < 0) {
         free(tsdb);
         return NULL;
     }
 
-    tsdb->ts_hashtable->size = TS_HASHTABLE_BASESIZE;
-    tsdb->ts_hashtable->buckets =
-        calloc(TS_HASHTABLE_BASESIZE, sizeof(ts_ht_entry_t *));
-    if (!tsdb->ts_hashtable->buckets) {
-        free(tsdb->ts_hashtable);
+    if (fresh && shared_wal_segment > 0 &&
+        tsdb_share_wal(tsdb, shared_wal_segment) < 0) {
+        hashmap_free(&tsdb->series);
         free(tsdb);
         return NULL;
     }
@@ -122,65 +292,235 @@ timeseries_db_t *tsdb_create(const char *datapath)
     return tsdb;
 }
 
-extern int tsdb_load(timeseries_db_t *tsdb)
+void tsdb_set_shared_wal(size_t segment_size)
+{
+    shared_wal_segment = segment_size;
+}
+
+/*
+ * The choice of a shared WAL sticks to the database through its directory,
+ * found again at load, the WALs of its series are never mixed with files of
+ * their own.
+ */
+int tsdb_share_wal(timeseries_db_t *tsdb, size_t segment_size)
+{
+    if (tsdb->wal_log)
+        return 0;
+
+    if (hashmap_length(&tsdb->series) > 0) {
+        log_error("Database \"%s\" has series already, can't share a WAL",
+                  tsdb->datapath);
+        return -1;
+    }
+
+    char pathbuf[PATHBUF_SIZE];
+    snprintf(pathbuf, sizeof(pathbuf), "%s/%s/%s", BASEPATH, tsdb->datapath,
+             WAL_LOG_DIR);
+    if (makedir(pathbuf) < 0)
+        return -1;
+
+    wal_log_t *log = malloc(sizeof(*log));
+    if (!log)
+        return -1;
+
+    if (wal_log_open(log, pathbuf, segment_size) < 0) {
+        log_error("Failed to open the WAL of \"%s\"", tsdb->datapath);
+        free(log);
+        return -1;
+    }
+
+    tsdb->wal_log = log;
+
+    return 0;
+}
+
+/*
+ * Register the series of the database from its manifest, none is
+ * materialized yet. A database without one is scanned for the directories of
+ * its series, registered with the default options, and the manifest written.
+ */
+int tsdb_load(timeseries_db_t *tsdb)
 {
     if (!tsdb)
         return -1;
 
-    // Scan the main data directory for already existing databases and add them
-    // to the context
+    char pathbuf[PATHBUF_SIZE];
+    struct stat st;
+    snprintf(pathbuf, sizeof(pathbuf), "%s/%s/%s", BASEPATH, tsdb->datapath,
+             WAL_LOG_DIR);
+    if (stat(pathbuf, &st) == 0 && S_ISDIR(st.st_mode) &&
+        tsdb_share_wal(tsdb, shared_wal_segment) < 0)
+        return -1;
+
+    int count = tsdb_manifest_read(tsdb);
+    if (count >= 0) {
+        log_debug("Loaded %d timeseries of \"%s\" from its manifest", count,
+                  tsdb->datapath);
+        return 0;
+    }
+
+    snprintf(pathbuf, sizeof(pathbuf), "%s/%s", BASEPATH, tsdb->datapath);
+
     struct dirent **namelist;
-    int n = scandir(tsdb->datapath, &namelist, NULL, alphasort);
+    int n = scandir(pathbuf, &namelist, NULL, alphasort);
     if (n == -1)
         return 0;
 
+    ts_opts_t opts = {.flushsize = TS_MIN_FLUSHSIZE};
     for (int i = 0; i < n; ++i) {
-        // TODO add some identifiers to db directories
-        if (namelist[i]->d_type != DT_DIR ||
-            strncmp(namelist[i]->d_name, ".", namelist[i]->d_namlen) == 0 ||
-            strncmp(namelist[i]->d_name, "..", namelist[i]->d_namlen) == 0)
-            continue;
-
-        // TODO opts file
-        timeseries_t *ts = ts_get(tsdb, namelist[i]->d_name);
-        if (!ts) {
-            free(namelist[i]);
-            continue;
+        const char *name = namelist[i]->d_name;
+        if (namelist[i]->d_type == DT_DIR && name[0] != '.' &&
+            strlen(name) < TS_NAME_MAX_LENGTH) {
+            ts_entry_t *e = ts_entry_new(name, &opts);
+            if (e && tsdb_add_entry(tsdb, e) < 0)
+                free(e);
         }
-
-        tsdb_add_ts(tsdb, ts);
-
         free(namelist[i]);
     }
-    return 0;
+    free(namelist);
+
+    return tsdb_manifest_write(tsdb) < 0 ? -1 : 0;
+}
+
+static void ts_entry_free(const char *name, size_t name_len, void *value,
+                          void *userdata)
+{
+    ts_entry_t *e = value;
+    if (e->ts)
+        ts_close(e->ts);
+    free(e);
 }
 
+/*
+ * Write the manifest with the ranges of the series open, then close them. The
+ * series queued for recovery are dropped, the ones being replayed waited for.
+ */
 void tsdb_close(timeseries_db_t *tsdb)
 {
-    for (size_t i = 0; i < tsdb->ts_hashtable->size; ++i) {
-        ts_ht_entry_t *entry = tsdb->ts_hashtable->buckets[i];
-        while (entry) {
-            ts_ht_entry_t *next = entry->next;
-            free(entry);
-            entry = next;
-        }
+    pthread_mutex_lock(&recovery.lock);
+    tsdb->closing = 1;
+    while (tsdb->recovering > 0)
+        pthread_cond_wait(&recovery.cond, &recovery.lock);
+    pthread_mutex_unlock(&recovery.lock);
+
+    tsdb_manifest_write(tsdb);
+    if (tsdb->wal_log)
+        wal_log_closing(tsdb->wal_log);
+    hashmap_foreach(&tsdb->series, ts_entry_free, NULL);
+    hashmap_free(&tsdb->series);
+    if (tsdb->wal_log) {
+        wal_log_close(tsdb->wal_log);
+        free(tsdb->wal_log);
     }
-    free(tsdb->ts_hashtable->buckets);
-    free(tsdb->ts_hashtable);
     free(tsdb);
 }
 
+/*
+ * Open the series of an entry, replaying its WALs and loading its partitions.
+ */
+static timeseries_t *ts_materialize(const timeseries_db_t *tsdb, ts_entry_t *e)
+{
+    timeseries_t *ts = calloc(1, sizeof(*ts));
+    if (!ts)
+        return NULL;
+
+    ts->opts            = e->opts;
+    ts->opts.wal_policy = tsdb->wal_policy;
+    ts->wal_log         = tsdb->wal_log;
+    ts->wal_series      = fnv1a_hash((uint8_t *)e->name, strlen(e->name));
+    ts->partitions      = (partition_catalog_t){0};
+
+    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", e->name);
+    snprintf(ts->db_datapath, DATAPATH_SIZE, "%s", tsdb->datapath);
+
+    if (ts_init(ts) < 0) {
+        ts_close(ts);
+        return NULL;
+    }
+
+    return ts;
+}
+
+// Link a series just materialized to its entry, recovery lock held
+static void ts_entry_done(ts_entry_t *e, timeseries_t *ts)
+{
+    e->recovering = 0;
+    if (ts) {
+        ts->entry = e;
+        e->ts     = ts;
+        ts_entry_update(e, ts);
+    }
+    pthread_cond_broadcast(&recovery.cond);
+}
+
+/*
+ * Returns the series of an entry, materialized here unless it's already open
+ * or being recovered by a worker, in which case it's waited for. The options
+ * given, if any, replace the ones of a series not open.
+ */
+static timeseries_t *ts_entry_open(const timeseries_db_t *tsdb, ts_entry_t *e,
+                                   const ts_opts_t *opts)
+{
+    pthread_mutex_lock(&recovery.lock);
+    while (e->recovering)
+        pthread_cond_wait(&recovery.cond, &recovery.lock);
+
+    timeseries_t *ts = e->ts;
+    if (!ts) {
+        if (opts)
+            e->opts = *opts;
+        e->recovering = 1;
+        pthread_mutex_unlock(&recovery.lock);
+
+        ts = ts_materialize(tsdb, e);
+
+        pthread_mutex_lock(&recovery.lock);
+        ts_entry_done(e, ts);
+    }
+    pthread_mutex_unlock(&recovery.lock);
+
+    return ts;
+}
+
+/*
+ * Register a new series and open it, the manifest is written once it's open.
+ */
+static timeseries_t *tsdb_add_ts(timeseries_db_t *tsdb, const char *name,
+                                 const ts_opts_t *opts)
+{
+    ts_entry_t *e = ts_entry_new(name, opts);
+    if (!e)
+        return NULL;
+
+    if (tsdb_add_entry(tsdb, e) < 0) {
+        free(e);
+        return NULL;
+    }
+
+    timeseries_t *ts = ts_entry_open(tsdb, e, NULL);
+    if (!ts) {
+        hashmap_del(&tsdb->series, e->name, strlen(e->name));
+        free(e);
+        return NULL;
+    }
+
+    tsdb_manifest_write(tsdb);
+
+    return ts;
+}
+
+/*
+ * Create a series, or open an existing one, with the given options, new
+ * rollups are declared, the ones found on disk kept. A series already open
+ * is returned as is.
+ */
 timeseries_t *ts_create(const timeseries_db_t *tsdb, const char *name,
                         ts_opts_t opts)
 {
     if (!tsdb || !name)
         return NULL;
 
-    if (strlen(name) > TS_NAME_MAX_LENGTH)
-        return NULL;
-
-    timeseries_t *ts = malloc(sizeof(*ts));
-    if (!ts)
+    if (strlen(name) >= TS_NAME_MAX_LENGTH)
         return NULL;
 
     if (opts.flushsize <= 0)
@@ -190,64 +530,192 @@ timeseries_t *ts_create(const timeseries_db_t *tsdb, const char *name,
     if (opts.flushsize < TS_MIN_FLUSHSIZE)
         opts.flushsize = TS_MIN_FLUSHSIZE;
 
-    ts->opts         = opts;
-    ts->partition_nr = 0;
-    for (int i = 0; i < TS_MAX_PARTITIONS; ++i)
-        memset(&ts->partitions[i], 0x00, sizeof(ts->partitions[i]));
-
-    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", name);
-    snprintf(ts->db_datapath, DATAPATH_SIZE, "%s", tsdb->datapath);
+    ts_entry_t *e = tsdb_get_entry(tsdb, name);
+    if (!e)
+        return tsdb_add_ts((timeseries_db_t *)tsdb, name, &opts);
 
-    if (ts_init(ts) < 0) {
-        ts_close(ts);
-        free(ts);
-        return NULL;
-    }
+    timeseries_t *ts = ts_entry_open(tsdb, e, &opts);
+    if (ts)
+        tsdb_manifest_write(tsdb);
 
     return ts;
 }
 
+/*
+ * Returns the series, materializing it on first access, a series unknown to
+ * the database is created with the default options.
+ */
 timeseries_t *ts_get(const timeseries_db_t *tsdb, const char *name)
 {
     if (!tsdb || !name)
         return NULL;
 
-    if (strlen(name) > TS_NAME_MAX_LENGTH)
+    if (strlen(name) >= TS_NAME_MAX_LENGTH)
         return NULL;
 
-    // Try to fetch it from memory
-    timeseries_t *ts = NULL;
+    ts_entry_t *e = tsdb_get_entry(tsdb, name);
+    if (e)
+        return ts_entry_open(tsdb, e, NULL);
 
-    ts               = tsdb_get_ts(tsdb, name);
-    if (ts)
-        return ts;
+    ts_opts_t opts = {.flushsize = TS_MIN_FLUSHSIZE};
 
-    // Initialize from scratch
-    ts = malloc(sizeof(*ts));
-    if (!ts)
-        return NULL;
+    return tsdb_add_ts((timeseries_db_t *)tsdb, name, &opts);
+}
 
-    ts->partition_nr   = 0;
-    // TODO read from disk meta
-    ts->opts.flushsize = TS_MIN_FLUSHSIZE;
+// Logs the progress of the recovery, once per second, recovery lock held
+static void ts_recovery_report(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (recovery.done == recovery.total) {
+        double elapsed = (now.tv_sec - recovery.started.tv_sec) +
+                         (now.tv_nsec - recovery.started.tv_nsec) / 1e9;
+        log_info("Recovered %zu timeseries in %.3f s", recovery.total,
+                 elapsed);
+    } else if (now.tv_sec != recovery.reported) {
+        log_info("Recovering timeseries %zu/%zu", recovery.done,
+                 recovery.total);
+        recovery.reported = now.tv_sec;
+    }
+}
 
-    for (int i = 0; i < TS_MAX_PARTITIONS; ++i)
-        memset(&ts->partitions[i], 0x00, sizeof(ts->partitions[i]));
+static void *ts_recovery_loop(void *arg)
+{
+    pthread_mutex_lock(&recovery.lock);
 
-    snprintf(ts->db_datapath, DATAPATH_SIZE, "%s", tsdb->datapath);
-    snprintf(ts->name, TS_NAME_MAX_LENGTH, "%s", name);
+    while (recovery.next < recovery.tasks.length) {
+        ts_recovery_task_t t = recovery.tasks.items[recovery.next++];
 
-    // TODO consider adding some metadata file which saves TS info such as the
-    // duplication policy
-    if (ts_init(ts) < 0) {
-        ts_close(ts);
-        return NULL;
+        // Skip the series already opened on access, or of a database closing
+        if (!t.tsdb->closing && !t.e->ts && !t.e->recovering) {
+            t.e->recovering = 1;
+            pthread_mutex_unlock(&recovery.lock);
+
+            timeseries_t *ts = ts_materialize(t.tsdb, t.e);
+            if (!ts)
+                log_error("Failed to recover timeseries \"%s\"", t.e->name);
+
+            pthread_mutex_lock(&recovery.lock);
+            ts_entry_done(t.e, ts);
+        }
+
+        t.tsdb->recovering--;
+        recovery.done++;
+        ts_recovery_report();
+        pthread_cond_broadcast(&recovery.cond);
     }
 
-    // Add to memory HT
-    tsdb_add_ts((timeseries_db_t *)tsdb, ts);
+    // The last one out leaves the queue empty for the next recovery
+    if (--recovery.workers == 0) {
+        da_free(&recovery.tasks);
+        recovery.tasks.length   = 0;
+        recovery.tasks.capacity = 0;
+        recovery.next           = 0;
+    }
 
-    return ts;
+    pthread_mutex_unlock(&recovery.lock);
+
+    // Worker threads are detached, their scratch arena would be leaked
+    arena_scratch_free();
+
+    return NULL;
+}
+
+static void ts_recovery_enqueue(const char *name, size_t name_len,
+                                void *value, void *userdata)
+{
+    ts_entry_t *e         = value;
+    timeseries_db_t *tsdb = userdata;
+
+    if (e->ts || e->recovering)
+        return;
+
+    da_append(&recovery.tasks, ((ts_recovery_task_t){tsdb, e}));
+    tsdb->recovering++;
+    recovery.total++;
+}
+
+/*
+ * Queue a task per series not yet materialized, the series map is only ever
+ * walked here, by the caller thread, the workers get the entries themselves.
+ * Queries on series still queued materialize them right away, the ones being
+ * replayed are reported by `ts_recovering(2)`.
+ */
+int tsdb_recover(timeseries_db_t *tsdb, size_t workers)
+{
+    if (!tsdb)
+        return -1;
+
+    if (workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers    = cores > 0 ? cores : 1;
+    }
+
+    pthread_mutex_lock(&recovery.lock);
+
+    if (recovery.workers == 0) {
+        recovery.done  = 0;
+        recovery.total = 0;
+        clock_gettime(CLOCK_MONOTONIC, &recovery.started);
+    }
+
+    size_t queued = recovery.tasks.length;
+    hashmap_foreach(&tsdb->series, ts_recovery_enqueue, tsdb);
+    queued         = recovery.tasks.length - queued;
+    size_t pending = recovery.tasks.length - recovery.next;
+
+    while (recovery.workers < workers && recovery.workers < pending) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ts_recovery_loop, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        recovery.workers++;
+    }
+
+    // No worker to hand the series over to, replay them right here
+    int inline_recovery = recovery.workers == 0 && pending > 0;
+    if (inline_recovery) {
+        log_error("Failed to start the recovery workers, recovering inline");
+        recovery.workers++;
+    }
+
+    pthread_mutex_unlock(&recovery.lock);
+
+    if (inline_recovery)
+        ts_recovery_loop(NULL);
+
+    if (queued > 0)
+        log_info("Recovering %zu timeseries of \"%s\"", queued,
+                 tsdb->datapath);
+
+    return queued;
+}
+
+void tsdb_recover_wait(timeseries_db_t *tsdb)
+{
+    pthread_mutex_lock(&recovery.lock);
+    while (tsdb->recovering > 0)
+        pthread_cond_wait(&recovery.cond, &recovery.lock);
+    pthread_mutex_unlock(&recovery.lock);
+}
+
+int ts_recovering(const timeseries_db_t *tsdb, const char *name)
+{
+    pthread_mutex_lock(&recovery.lock);
+    const ts_entry_t *e = tsdb_get_entry(tsdb, name);
+    int recovering      = e && e->recovering;
+    pthread_mutex_unlock(&recovery.lock);
+
+    return recovering;
+}
+
+void ts_recovery_progress(size_t *done, size_t *total)
+{
+    pthread_mutex_lock(&recovery.lock);
+    *done  = recovery.done;
+    *total = recovery.total;
+    pthread_mutex_unlock(&recovery.lock);
 }
 
 static void ts_chunk_zero(ts_chunk_t *tc)
@@ -256,6 +724,7 @@ static void ts_chunk_zero(ts_chunk_t *tc)
     tc->start_ts    = 0;
     tc->end_ts      = 0;
     tc->max_index   = 0;
+    tc->length      = 0;
     tc->wal.size    = 0;
 }
 
@@ -264,21 +733,22 @@ static ts_chunk_t *ts_chunk_make(void)
     ts_chunk_t *chunk = calloc(1, sizeof(*chunk));
     if (!chunk)
         return NULL;
+    arena_init(&chunk->arena, ARENA_BLOCK_SIZE);
     return chunk;
 }
 
-static int ts_chunk_init(ts_chunk_t *tc, const char *path, uint64_t base_ts,
+static int ts_chunk_init(timeseries_t *ts, ts_chunk_t *tc, uint64_t base_ts,
                          int main)
 {
     tc->base_offset = base_ts;
     tc->start_ts    = 0;
     tc->end_ts      = 0;
     tc->max_index   = 0;
+    tc->length      = 0;
+    tc->offsets[0]  = 0;
 
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i)
-        tc->points[i] = (record_array_t){0};
-
-    if (wal_init(&tc->wal, path, tc->base_offset, main) < 0)
+    wal_bind(&tc->wal, ts->wal_log, ts->wal_series);
+    if (wal_init(&tc->wal, ts->pathbuf, tc->base_offset, main) < 0)
         return TS_E_WAL_INIT_FAIL;
 
     return 0;
@@ -286,12 +756,13 @@ static int ts_chunk_init(ts_chunk_t *tc, const char *path, uint64_t base_ts,
 
 static void ts_chunk_reset(ts_chunk_t *tc)
 {
-    if (tc->base_offset != 0) {
-        for (int i = 0; i < TS_CHUNK_SIZE; ++i) {
-            da_free(&tc->points[i]);
-            tc->points[i].length = 0;
-        }
-    }
+    // Columns are given back all at once, the arena keeps its blocks for the
+    // next chunk
+    arena_reset(&tc->arena);
+    tc->timestamps = NULL;
+    tc->values     = NULL;
+    tc->capacity   = 0;
+    tc->length     = 0;
 
     wal_delete(&tc->wal);
 
@@ -301,44 +772,120 @@ static void ts_chunk_reset(ts_chunk_t *tc)
     tc->max_index   = 0;
 }
 
-static int ts_chunk_record_fit(const ts_chunk_t *tc, uint64_t sec)
+static void ts_chunk_free(ts_chunk_t *tc)
 {
-    // Relative offset inside the 2 arrays
-    ssize_t index = sec - tc->base_offset;
+    if (!tc)
+        return;
+    arena_release(&tc->arena);
+    free(tc);
+}
 
-    if (index < 0)
-        return -1;
+static int ts_chunk_grow(ts_chunk_t *tc)
+{
+    size_t capacity =
+        tc->capacity == 0 ? CHUNK_BASE_CAPACITY : tc->capacity * 2;
 
-    // Index outside of the head chunk range
-    // 1. Flush the tail chunk to persistence
-    // 2. Create a new head chunk set on the next 15 min
-    // 3. Make the current head chunk the new tail chunk
-    if (index > TS_CHUNK_SIZE - 1)
-        return 1;
+    uint64_t *timestamps = arena_realloc(
+        &tc->arena, tc->timestamps, tc->capacity * sizeof(*tc->timestamps),
+        capacity * sizeof(*tc->timestamps));
+    if (!timestamps)
+        return TS_E_OOM;
+    tc->timestamps   = timestamps;
+
+    double_t *values = arena_realloc(&tc->arena, tc->values,
+                                     tc->capacity * sizeof(*tc->values),
+                                     capacity * sizeof(*tc->values));
+    if (!values)
+        return TS_E_OOM;
+    tc->values   = values;
+
+    tc->capacity = capacity;
 
     return 0;
 }
 
 /*
- * Compare two Record structures, taking into account the timestamp of each.
- *
- * It returns an integer following the rules:
- *
- * . -1 r1 is lesser than r2
- * .  0 r1 is equal to r2
- * .  1 r1 is greater than r2
+ * Returns the position of the first point with timestamp not lesser than ts
+ * (or greater than ts if upper is set). The offsets table narrows the search
+ * to the points of a single second, which are then binary searched.
  */
-static int record_cmp(const record_t *r1, const record_t *r2)
+static size_t ts_chunk_bound(const ts_chunk_t *tc, uint64_t ts, int upper)
 {
-    if (r1->timestamp == r2->timestamp)
+    uint64_t sec = ts / (uint64_t)1e9;
+
+    if (tc->length == 0 || sec < tc->base_offset)
         return 0;
-    if (r1->timestamp > r2->timestamp)
-        return 1;
-    return -1;
+
+    size_t index = sec - tc->base_offset;
+    if (index > tc->max_index)
+        return tc->length;
+
+    size_t left  = tc->offsets[index];
+    size_t right = index == tc->max_index ? tc->length : tc->offsets[index + 1];
+    size_t middle = 0;
+
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (tc->timestamps[middle] < ts ||
+            (upper && tc->timestamps[middle] == ts))
+            left = middle + 1;
+        else
+            right = middle;
+    }
+
+    return left;
 }
 
-/*
- * Set a record in the chunk at a relative index based on the first timestamp
+static inline record_t ts_chunk_record(const ts_chunk_t *tc, size_t i)
+{
+    uint64_t timestamp = tc->timestamps[i];
+    return (record_t){
+        .value     = tc->values[i],
+        .timestamp = timestamp,
+        .tv        = (struct timespec){.tv_sec  = timestamp / (uint64_t)1e9,
+                                       .tv_nsec = timestamp % (uint64_t)1e9},
+        .is_set    = 1,
+    };
+}
+
+/*
+ * Keep the cached earliest and latest points up to date with points written,
+ * in any order, the first written wins a tie.
+ */
+static void ts_bounds_update(timeseries_t *ts, const uint64_t *timestamps,
+                             const double_t *values, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        record_t r = {
+            .value = values[i], .timestamp = timestamps[i], .is_set = 1};
+
+        if (!ts->first.is_set || r.timestamp < ts->first.timestamp)
+            ts->first = r;
+        if (!ts->last.is_set || r.timestamp > ts->last.timestamp)
+            ts->last = r;
+    }
+}
+
+static int ts_chunk_record_fit(const ts_chunk_t *tc, uint64_t sec)
+{
+    // Relative offset inside the 2 arrays
+    ssize_t index = sec - tc->base_offset;
+
+    if (index < 0)
+        return -1;
+
+    // Index outside of the head chunk range
+    // 1. Flush the tail chunk to persistence
+    // 2. Create a new head chunk set on the next 15 min
+    // 3. Make the current head chunk the new tail chunk
+    if (index > TS_CHUNK_SIZE - 1)
+        return 1;
+
+    return 0;
+}
+
+/*
+ * Set a record in the chunk at a relative index based on the first timestamp
  * stored e.g.
  *
  * Base 1782999282
@@ -357,62 +904,69 @@ static int record_cmp(const record_t *r1, const record_t *r2)
 static int ts_chunk_set_record(ts_chunk_t *tc, uint64_t sec, uint64_t nsec,
                                double_t value)
 {
-    // Relative offset inside the 2 arrays
-    size_t index   = tc->base_offset == 0 ? 0 : sec - tc->base_offset;
+    if (tc->base_offset == 0)
+        tc->base_offset = sec;
 
-    // Append to the last record in this timestamp bucket
-    record_t point = {
-        .value     = value,
-        .timestamp = sec * (uint64_t)1e9 + nsec,
-        .tv        = (struct timespec){.tv_sec = sec, .tv_nsec = nsec},
-        .is_set    = 1,
-    };
+    // Relative offset inside the offsets table
+    size_t index       = sec - tc->base_offset;
+    uint64_t timestamp = sec * (uint64_t)1e9 + nsec;
+
+    if (tc->length == tc->capacity && ts_chunk_grow(tc) < 0)
+        return TS_E_OOM;
 
-    // Check if the timestamp is ordered
-    if (tc->end_ts != 0 && tc->end_ts > point.timestamp) {
-        ssize_t i = 0;
-        da_bsearch(&tc->points[index], &point, record_cmp, &i);
-        if (i < 0)
-            return TS_E_UNKNOWN;
-        // Simple shift of existing elements, maybe worth adding a
-        // support vector for out of order (in chunk range) records and
-        // merge them when flushing, must profile NB WAL doesn't need any
-        // change as it will act as an event log, replayable to obtain
-        // the up-to-date state
-        da_insert_shift(&tc->points[index], (size_t)i, point);
+    // Check if the timestamp is ordered, late points are logged to the out
+    // of order buffer, this is only expected replaying an older WAL
+    if (tc->length > 0 && tc->end_ts > timestamp) {
+        size_t i = ts_chunk_bound(tc, timestamp, 1);
+        memmove(tc->timestamps + i + 1, tc->timestamps + i,
+                (tc->length - i) * sizeof(*tc->timestamps));
+        memmove(tc->values + i + 1, tc->values + i,
+                (tc->length - i) * sizeof(*tc->values));
+        tc->timestamps[i] = timestamp;
+        tc->values[i]     = value;
+
+        // Every following second now starts one point later
+        for (size_t j = index + 1; j <= tc->max_index; ++j)
+            tc->offsets[j]++;
     } else {
-        da_append(&tc->points[index], point);
-        tc->max_index = index > tc->max_index ? index : tc->max_index;
+        // Seconds with no points between the last one set and this one
+        // start at the end of the columns
+        size_t first = tc->length == 0 ? 0 : tc->max_index + 1;
+        for (size_t j = first; j <= index; ++j)
+            tc->offsets[j] = tc->length;
+
+        tc->timestamps[tc->length] = timestamp;
+        tc->values[tc->length]     = value;
+        tc->max_index              = index;
     }
 
-    tc->base_offset = point.timestamp < tc->base_offset || tc->base_offset == 0
-                          ? point.timestamp
-                          : tc->base_offset;
-    tc->start_ts    = tc->start_ts == 0 ? point.timestamp : tc->start_ts;
-    tc->end_ts = tc->end_ts < point.timestamp ? point.timestamp : tc->end_ts;
+    tc->length++;
+    tc->start_ts = tc->timestamps[0];
+    tc->end_ts   = tc->timestamps[tc->length - 1];
 
     return 0;
 }
 
-static int ts_chunk_load(ts_chunk_t *tc, const char *pathbuf,
+static int ts_chunk_load(timeseries_t *ts, ts_chunk_t *tc,
                          uint64_t base_timestamp, int main)
 {
-    int err = wal_load(&tc->wal, pathbuf, base_timestamp, main);
+    wal_bind(&tc->wal, ts->wal_log, ts->wal_series);
+    int err = wal_load(&tc->wal, ts->pathbuf, base_timestamp, main);
     if (err < 0)
         return TS_E_WAL_LOAD_FAIL;
 
     uint8_t *buf = malloc(tc->wal.size + 1);
     if (!buf)
         return TS_E_OOM;
-    ssize_t n = read_file(tc->wal.fp, buf);
+    ssize_t n = wal_read(&tc->wal, buf);
     if (n < 0)
         return TS_E_UNKNOWN;
 
     tc->base_offset = base_timestamp;
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i)
-        tc->points[i] = (record_array_t){0};
+    tc->length      = 0;
+    tc->max_index   = 0;
 
-    uint8_t *ptr = buf;
+    uint8_t *ptr    = buf;
     uint64_t timestamp;
     double_t value;
 
@@ -423,11 +977,19 @@ static int ts_chunk_load(ts_chunk_t *tc, const char *pathbuf,
         uint64_t sec  = timestamp / (uint64_t)1e9;
         uint64_t nsec = timestamp % (uint64_t)1e9;
 
-        if ((err = ts_chunk_set_record(tc, sec, nsec, value)) < 0)
-            return err;
-
         ptr += sizeof(uint64_t) + sizeof(double_t);
         n -= (sizeof(uint64_t) + sizeof(double_t));
+
+        // The point triggering a rotation is logged before the chunks are
+        // rotated, it belongs to the next chunk
+        if (ts_chunk_record_fit(tc, sec) != 0) {
+            log_warning("Skipping out of range WAL record %" PRIu64,
+                        timestamp);
+            continue;
+        }
+
+        if ((err = ts_chunk_set_record(tc, sec, nsec, value)) < 0)
+            return err;
     }
 
     log_debug("Successfully loaded chunk %ld", n);
@@ -437,887 +999,3656 @@ static int ts_chunk_load(ts_chunk_t *tc, const char *pathbuf,
     return 0;
 }
 
-int ts_init(timeseries_t *ts)
-{
-    snprintf(ts->pathbuf, sizeof(ts->pathbuf), "%s/%s/%s", BASEPATH,
-             ts->db_datapath, ts->name);
-
-    if (makedir(ts->pathbuf) < 0)
-        return TS_E_UNKNOWN;
+/*
+ * Point pair, used to sort the timestamp and value columns together.
+ */
+typedef struct point {
+    uint64_t timestamp;
+    double_t value;
+} point_t;
 
-    ts->head = ts_chunk_make();
-    if (!ts->head)
-        return -1;
+static int point_cmp(const void *a, const void *b)
+{
+    uint64_t ta = ((const point_t *)a)->timestamp;
+    uint64_t tb = ((const point_t *)b)->timestamp;
 
-    ts->prev = ts_chunk_make();
-    if (!ts->prev)
-        return -1;
+    return (ta > tb) - (ta < tb);
+}
 
-    ts_chunk_zero(ts->head);
-    ts_chunk_zero(ts->prev);
+/*
+ * Sort a pair of columns by timestamp, the points are paired in a temporary
+ * array allocated from the arena. Already sorted columns are left as they are.
+ */
+static int columns_sort(uint64_t *timestamps, double_t *values, size_t n,
+                        arena_t *arena)
+{
+    size_t i = 1;
+    while (i < n && timestamps[i - 1] <= timestamps[i])
+        i++;
 
-    struct dirent **namelist;
-    int err = 0, ok = 0;
-    int n = scandir(ts->pathbuf, &namelist, NULL, alphasort);
-    if (n == -1)
-        goto exit;
+    if (i >= n)
+        return 0;
 
-    log_debug("Cold start loading timeseries \"%s\"", ts->name);
+    point_t *points = arena_alloc(arena, n * sizeof(*points));
+    if (!points)
+        return TS_E_OOM;
 
-    for (int i = 0; i < n; ++i) {
-        const char *dot = strrchr(namelist[i]->d_name, '.');
-        if (strncmp(namelist[i]->d_name, "wal-", 4) == 0 &&
-            strncmp(dot, ".log", 4) == 0) {
-            uint64_t base_timestamp = atoll(namelist[i]->d_name + 6);
-            if (namelist[i]->d_name[4] == 'h') {
-                err = ts_chunk_load(ts->head, ts->pathbuf, base_timestamp, 1);
-            } else if (namelist[i]->d_name[4] == 't') {
-                err = ts_chunk_load(ts->prev, ts->pathbuf, base_timestamp, 0);
-            }
-            ok = err == 0;
-        } else if (namelist[i]->d_name[0] == 'c') {
-            // There is a log partition
-            uint64_t base_timestamp = atoll(namelist[i]->d_name + 3);
-            err = partition_load(&ts->partitions[ts->partition_nr++],
-                                 ts->pathbuf, base_timestamp);
-        }
+    for (i = 0; i < n; ++i)
+        points[i] = (point_t){timestamps[i], values[i]};
 
-        free(namelist[i]);
+    qsort(points, n, sizeof(*points), point_cmp);
 
-        if (err < 0)
-            goto exit;
+    for (i = 0; i < n; ++i) {
+        timestamps[i] = points[i].timestamp;
+        values[i]     = points[i].value;
     }
 
-    log_debug("Succesfully init timeseries \"%s\"", ts->name);
-
-    free(namelist);
+    return 0;
+}
 
-    return ok;
+/*
+ * Returns the position of the first timestamp not lesser than ts (or greater
+ * than ts if upper is set) in a sorted column.
+ */
+static size_t columns_bound(const uint64_t *timestamps, size_t n, uint64_t ts,
+                            int upper)
+{
+    size_t left = 0, right = n, middle = 0;
+
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (timestamps[middle] < ts || (upper && timestamps[middle] == ts))
+            left = middle + 1;
+        else
+            right = middle;
+    }
 
-exit:
-    free(namelist);
-    return err;
+    return left;
 }
 
-void ts_close(timeseries_t *ts)
+/*
+ * Merge-join two sorted runs of points into the output columns, on equal
+ * timestamps the points of the first run come first.
+ *
+ * Returns the number of points written.
+ */
+static size_t columns_merge(const uint64_t *a_ts, const double_t *a_vs,
+                            size_t a_n, const uint64_t *b_ts,
+                            const double_t *b_vs, size_t b_n,
+                            uint64_t *timestamps, double_t *values)
 {
-    ts_chunk_reset(ts->head);
-    ts_chunk_reset(ts->prev);
-    free(ts->head);
-    free(ts->prev);
-    free(ts);
+    size_t i = 0, j = 0, n = 0;
+
+    while (i < a_n || j < b_n) {
+        if (j == b_n || (i < a_n && a_ts[i] <= b_ts[j])) {
+            timestamps[n] = a_ts[i];
+            values[n++]   = a_vs[i++];
+        } else {
+            timestamps[n] = b_ts[j];
+            values[n++]   = b_vs[j++];
+        }
+    }
+
+    return n;
 }
 
-static void ts_deinit(timeseries_t *ts)
+/*
+ * The out of order buffer is a chunk with no offsets table, late points are
+ * appended as they come and start_ts and end_ts just bound them. Its WAL is
+ * named after a sequence number, a base second means nothing for points
+ * spread over any time range.
+ */
+static int ts_ooo_init(timeseries_t *ts, ts_chunk_t *tc)
 {
-    ts_chunk_reset(ts->head);
-    ts_chunk_reset(ts->prev);
+    if (wal_is_open(&tc->wal))
+        return 0;
+
+    wal_bind(&tc->wal, ts->wal_log, ts->wal_series);
+    if (wal_init(&tc->wal, ts->pathbuf, ts->ooo_seq++, WAL_OOO) < 0)
+        return TS_E_WAL_INIT_FAIL;
+
+    return 0;
 }
 
-static int ts_flush_prev(timeseries_t *ts, const char *path)
+static int ts_ooo_append(ts_chunk_t *tc, const uint64_t *timestamps,
+                         const double_t *values, size_t n)
 {
-    // Flush the prev chunk to persistence
-    partition_t *pt = &ts->partitions[ts->partition_nr];
+    if (n == 0)
+        return 0;
+
+    while (tc->length + n > tc->capacity)
+        if (ts_chunk_grow(tc) < 0)
+            return TS_E_OOM;
 
-    if (!pt->initialized && partition_init(pt, path, ts->head->base_offset) < 0)
-        return TS_E_FLUSH_CHUNK_FAIL;
+    memcpy(tc->timestamps + tc->length, timestamps, n * sizeof(*timestamps));
+    memcpy(tc->values + tc->length, values, n * sizeof(*values));
 
-    if (partition_flush_chunk(pt, ts->prev, ts->opts.flushsize) < 0)
-        return TS_E_FLUSH_CHUNK_FAIL;
+    if (tc->length == 0) {
+        tc->start_ts = timestamps[0];
+        tc->end_ts   = timestamps[0];
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (timestamps[i] < tc->start_ts)
+            tc->start_ts = timestamps[i];
+        if (timestamps[i] > tc->end_ts)
+            tc->end_ts = timestamps[i];
+    }
 
-    // Clean up the prev chunk and delete it's WAL
-    ts_chunk_reset(ts->prev);
+    tc->length += n;
 
     return 0;
 }
 
-/**
- * Handle insertion of a timestamp that's earlier than the current head chunk.
- *
- * @param ts Pointer to the timeseries.
- * @param pathbuf Path to the timeseries data files.
- * @param timestamp Full timestamp in nanoseconds.
- * @param sec Seconds part of the timestamp.
- * @param nsec Nanoseconds part of the timestamp.
- * @param value Value to insert.
- * @return 0 on success, error code on failure.
+/*
+ * Replay an out of order WAL into the buffer, the first one found becomes the
+ * WAL of the buffer, the points of any other one left by a crash are moved to
+ * it before dropping the file.
  */
-static int ts_handle_out_of_order_insert(timeseries_t *ts, uint64_t timestamp,
-                                         uint64_t sec, uint64_t nsec,
-                                         double_t value)
+static int ts_ooo_load(timeseries_t *ts, uint64_t seq)
 {
-    // If the chunk is empty, it also means the base offset is 0, we set
-    // it here with the first record inserted
-    if (ts->prev->base_offset == 0) {
-        ts_chunk_init(ts->prev, ts->pathbuf, sec, 0);
+    ts_chunk_t *tc = ts->ooo;
+    wal_t *other   = NULL;
+    wal_t *wal     = &tc->wal;
+
+    if (wal_is_open(&tc->wal)) {
+        other = calloc(1, sizeof(*other));
+        if (!other)
+            return TS_E_OOM;
+        wal = other;
     }
 
-    // If we successfully insert the record, we can return
-    if (ts_chunk_record_fit(ts->prev, sec) == 0) {
-        // Persist to disk for disaster recovery
-        if (wal_append(&ts->prev->wal, timestamp, value) < 0)
-            return TS_E_WAL_APPEND_FAIL;
+    int err = 0;
+    wal_bind(wal, ts->wal_log, ts->wal_series);
+    if (wal_load(wal, ts->pathbuf, seq, WAL_OOO) < 0) {
+        err = TS_E_WAL_LOAD_FAIL;
+        goto exit;
+    }
+
+    uint8_t *buf = malloc(wal->size + 1);
+    if (!buf) {
+        err = TS_E_OOM;
+        goto exit;
+    }
+
+    ssize_t n = wal_read(wal, buf);
+    if (n < 0) {
+        free(buf);
+        err = TS_E_UNKNOWN;
+        goto exit;
+    }
 
-        return ts_chunk_set_record(ts->prev, sec, nsec, value);
+    uint8_t *ptr = buf;
+    uint64_t timestamp;
+    double_t value;
+
+    while (n >= (ssize_t)(sizeof(uint64_t) + sizeof(double_t))) {
+        timestamp = read_i64(ptr);
+        value     = read_f64(ptr + sizeof(uint64_t));
+
+        ptr += sizeof(uint64_t) + sizeof(double_t);
+        n -= (sizeof(uint64_t) + sizeof(double_t));
+
+        if (other && wal_append(&tc->wal, timestamp, value) < 0) {
+            err = TS_E_WAL_APPEND_FAIL;
+            break;
+        }
+
+        if ((err = ts_ooo_append(tc, &timestamp, &value, 1)) < 0)
+            break;
     }
 
-    // Check if the record is older than the prev
-    if (ts_chunk_record_fit(ts->prev, sec) < 0) {
-        // Flush current prev to make room for a new one
-        if (ts_flush_prev(ts, ts->pathbuf) < 0)
-            return TS_E_FLUSH_CHUNK_FAIL;
+    free(buf);
 
-        // Promote a new prev chunk for the OOO insert
-        if (ts_chunk_init(ts->prev, ts->pathbuf, sec, 0) < 0)
-            return TS_E_UNKNOWN;
+    if (seq >= ts->ooo_seq)
+        ts->ooo_seq = seq + 1;
 
-        // Persist to disk for disaster recovery
-        if (wal_append(&ts->prev->wal, timestamp, value) < 0)
-            return TS_E_WAL_APPEND_FAIL;
+    if (err == 0 && other) {
+        if (wal_flush(&tc->wal, 1) < 0)
+            err = TS_E_WAL_APPEND_FAIL;
+        else
+            wal_delete(other);
+    }
 
-        return ts_chunk_set_record(ts->prev, sec, nsec, value);
+exit:
+    if (other) {
+        wal_close(other);
+        free(other);
     }
 
-    return TS_E_UNKNOWN;
+    return err;
 }
 
-/**
- * Rotate chunks when a new head chunk is needed.
- *
- * @param ts Pointer to the timeseries.
- * @param pathbuf Path to the timeseries data files.
- * @param sec Seconds part of the timestamp.
- * @return 0 on success, error code on failure.
- */
-static int ts_rotate_chunks(timeseries_t *ts, uint64_t sec)
+static int ts_partition_load(timeseries_t *ts, uint64_t base)
 {
-    // Flush current prev chunk to disk
-    if (ts_flush_prev(ts, ts->pathbuf) < 0)
-        return TS_E_FLUSH_CHUNK_FAIL;
-    // Set the current head as new prev
-    *ts->prev = *ts->head;
+    partition_t *p = calloc(1, sizeof(*p));
+    if (!p)
+        return TS_E_OOM;
 
-    // Reset the current head as new head
-    ts_chunk_reset(ts->head);
-    if (ts_chunk_init(ts->head, ts->pathbuf, sec, 1) < 0)
-        return TS_E_UNKNOWN;
+    if (partition_load(p, ts->pathbuf, base) < 0 ||
+        partition_catalog_add(&ts->partitions, p) < 0) {
+        partition_close(p);
+        free(p);
+        return TS_E_INIT_PARTITION_FAIL;
+    }
 
     return 0;
 }
 
 /*
- * Set a record in a timeseries.
- *
- * This function sets a record with the specified timestamp and value in the
- * given timeseries. The function handles the storage of records in memory and
- * on disk to ensure data integrity and efficient usage of resources.
- *
- * @param ts A pointer to the timeseries_t structure representing the
- * timeseries.
- * @param timestamp The timestamp of the record to be set, in nanoseconds.
- * @param value The value of the record to be set.
- * @return 0 on success, -1 on failure.
+ * Oldest timestamp still within the retention of the series, 0 if the series
+ * keeps its points forever.
  */
-int ts_insert(timeseries_t *ts, uint64_t timestamp, double_t value)
+static uint64_t ts_retention_cutoff(const timeseries_t *ts)
 {
-    if (!ts)
-        return TS_E_NULL_POINTER;
-
-    // Extract seconds and nanoseconds from timestamp
-    uint64_t sec  = timestamp / (uint64_t)1e9;
-    uint64_t nsec = timestamp % (uint64_t)1e9;
+    if (ts->opts.retention <= 0)
+        return 0;
 
-    // if the limit is reached we dump the chunks into disk and create 2 new
-    // ones
-    if (wal_size(&ts->head->wal) >= ts->opts.flushsize) {
-        uint64_t base       = ts->prev->base_offset > 0 ? ts->prev->base_offset
-                                                        : ts->head->base_offset;
-        size_t partition_nr = ts->partition_nr == 0 ? 0 : ts->partition_nr - 1;
-
-        partition_t *pt     = &ts->partitions[ts->partition_nr];
-        if (ts->partitions[partition_nr].clog.base_timestamp < base) {
-            if (!pt->initialized && partition_init(pt, ts->pathbuf, base) < 0) {
-                return TS_E_INIT_PARTITION_FAIL;
-            }
-            partition_nr = ts->partition_nr++;
-        }
+    int64_t now = current_nanos();
 
-        if (!pt->initialized && partition_init(pt, ts->pathbuf, base) < 0) {
-            return TS_E_INIT_PARTITION_FAIL;
-        }
+    return now > ts->opts.retention ? now - ts->opts.retention : 0;
+}
 
-        // Dump chunks into disk and create new ones
-        if (partition_flush_chunk(pt, ts->prev, ts->opts.flushsize) < 0)
-            return TS_E_FLUSH_PARTITION_FAIL;
+/*
+ * Drop the partitions wholly past the retention, unlinking their files, to be
+ * called with the series lock held. Expired points left in the chunks and in
+ * the partition straddling the cutoff are filtered out by the queries.
+ */
+static void ts_retention_sweep(timeseries_t *ts)
+{
+    uint64_t cutoff = ts_retention_cutoff(ts);
+    if (cutoff == 0)
+        return;
 
-        if (partition_flush_chunk(pt, ts->head, ts->opts.flushsize) < 0)
-            return TS_E_FLUSH_PARTITION_FAIL;
+    size_t n = partition_catalog_expire(&ts->partitions, ts->pathbuf, cutoff);
+    if (n > 0)
+        log_debug("Dropped %zu expired partitions of \"%s\"", n, ts->name);
 
-        // Reset clean both head and prev in-memory chunks
-        ts_deinit(ts);
+    // A rollup partition goes once its last bucket is wholly expired
+    for (size_t i = 0; i < ts->rollups_nr; ++i) {
+        rollup_t *r = &ts->rollups[i];
+        if (cutoff > r->interval)
+            rollup_expire(r, cutoff - r->interval);
     }
+}
 
-    // Let it crash for now if the timestamp is out of bounds in the ooo? What
-    // should we do if we receive a timestamp that is smaller than both the head
-    // base and the prev base?
-    if (sec < ts->head->base_offset) {
-        return ts_handle_out_of_order_insert(ts, timestamp, sec, nsec, value);
-    }
+/*
+ * A point being compacted, the sequence is its position in write order, to
+ * sort points sharing a timestamp the way they were written.
+ */
+typedef struct compact_point {
+    uint64_t timestamp;
+    double_t value;
+    size_t seq;
+} compact_point_t;
 
-    if (ts->head->base_offset == 0 &&
-        ts_chunk_init(ts->head, ts->pathbuf, sec, 1) < 0)
-        return TS_E_UNKNOWN;
+static int compact_point_cmp(const void *a, const void *b)
+{
+    const compact_point_t *pa = a, *pb = b;
 
-    // Persist to disk for disaster recovery
-    if (wal_append(&ts->head->wal, timestamp, value) < 0)
-        return TS_E_WAL_APPEND_FAIL;
+    if (pa->timestamp != pb->timestamp)
+        return (pa->timestamp > pb->timestamp) -
+               (pa->timestamp < pb->timestamp);
 
-    // Check if the timestamp is in range of the current chunk, otherwise
-    // create a new in-memory segment
-    if (ts_chunk_record_fit(ts->head, sec) > 0 && ts_rotate_chunks(ts, sec) < 0)
-        return TS_E_UNKNOWN;
+    return (pa->seq > pb->seq) - (pa->seq < pb->seq);
+}
 
-    // Insert it into the head chunk
-    return ts_chunk_set_record(ts->head, sec, nsec, value);
+/*
+ * Pick the first run of at least min_run adjacent partitions smaller than
+ * TS_COMPACT_SIZE, not growing past it once merged, to be called with the
+ * series lock held. The last partition is left out as the flusher may still
+ * append to it. Returns the length of the run, 0 if there's none.
+ */
+static size_t ts_compact_pick(const timeseries_t *ts, size_t min_run,
+                              size_t *first)
+{
+    const partition_catalog_t *pc = &ts->partitions;
+    size_t i                       = 0;
+
+    while (i + 1 < pc->length) {
+        size_t j = i, size = 0;
+        while (j + 1 < pc->length &&
+               pc->items[j]->clog.size < TS_COMPACT_SIZE &&
+               size + pc->items[j]->clog.size <= TS_COMPACT_SIZE)
+            size += pc->items[j++]->clog.size;
+
+        if (j - i >= min_run) {
+            *first = i;
+            return j - i;
+        }
+
+        i = j > i ? j : i + 1;
+    }
+
+    return 0;
 }
 
-static int ts_search_index(const ts_chunk_t *tc, uint64_t sec,
-                           const record_t *target, record_t *dst)
+/*
+ * Merge the points of a run of partitions into a single sorted partition,
+ * written aside, along with n more points written after them. Points sharing
+ * a timestamp are resolved following the duplication policy, the first one
+ * written is kept unless duplicates are allowed.
+ */
+static int ts_compact_merge(const timeseries_t *ts, partition_t *const run[],
+                            size_t nr, const uint64_t *more_ts,
+                            const double_t *more_vs, size_t n,
+                            partition_t *dst)
 {
-    if (tc->base_offset > sec)
-        return 1;
+    record_array_t records  = {0};
+    compact_point_t *points = NULL;
+    uint64_t *timestamps    = NULL;
+    double_t *values        = NULL;
+    int err                 = -1;
+
+    for (size_t i = 0; i < nr; ++i)
+        if (partition_read(run[i], &records) < 0)
+            goto exit;
 
-    size_t index = 0;
-    ssize_t idx  = 0;
+    for (size_t i = 0; i < n; ++i)
+        da_append(&records, ((record_t){.timestamp = more_ts[i],
+                                        .value     = more_vs[i],
+                                        .is_set    = 1}));
 
-    if ((index = sec - tc->base_offset) > TS_CHUNK_SIZE)
-        return -1;
+    points     = malloc(records.length * sizeof(*points));
+    timestamps = malloc(records.length * sizeof(*timestamps));
+    values     = malloc(records.length * sizeof(*values));
+    if (!points || !timestamps || !values)
+        goto exit;
 
-    if (tc->points[index].length < LINEAR_THRESHOLD)
-        da_search(&tc->points[index], target, record_cmp, &idx);
-    else
-        da_bsearch(&tc->points[index], target, record_cmp, &idx);
+    for (size_t i = 0; i < records.length; ++i)
+        points[i] = (compact_point_t){records.items[i].timestamp,
+                                      records.items[i].value, i};
 
-    if (idx < 0)
-        return 1;
+    qsort(points, records.length, sizeof(*points), compact_point_cmp);
+
+    size_t len = 0;
+    for (size_t i = 0; i < records.length; ++i) {
+        if (ts->opts.policy == DP_IGNORE && len > 0 &&
+            timestamps[len - 1] == points[i].timestamp)
+            continue;
+        timestamps[len] = points[i].timestamp;
+        values[len++]   = points[i].value;
+    }
 
-    *dst = da_get(tc->points[index], idx);
+    if (partition_flush_columns(dst, timestamps, values, len) < 0 ||
+        partition_sync(dst) < 0)
+        goto exit;
 
-    return 0;
+    err = 0;
+
+exit:
+    da_free(&records);
+    free(points);
+    free(timestamps);
+    free(values);
+    return err;
 }
 
 /*
- * Finds a record in a timeseries data structure.
- *
- * This function searches for a record with the specified timestamp in the
- * given timeseries data structure. It first checks the in-memory chunks
- * (head and previous) and then looks for the record on disk if not found
- * in memory.
- *
- * @param ts A pointer to the timeseries_t structure representing the
- * timeseries.
- * @param timestamp The timestamp of the record to be found, specified in
- * nanoseconds since the Unix epoch.
- * @param r A pointer to a Record structure where the found record will be
- * stored.
- * @return 0 if the record is found and successfully stored in 'r', -1 if an
- * error occurs, or a negative value indicating the result of the search:
- *         - 1 if the record is found in memory.
- *         - 0 if the record is not found in memory but found on disk.
- *         - Negative value if an error occurs during the search.
+ * Record the partitions a compaction is replacing, the merged one first, the
+ * compaction is committed once the marker is on disk and rolled forward on
+ * restart if interrupted. A partition sharing the base of the merged one is
+ * overwritten by it, it's not listed. A marker committing several merged
+ * partitions at once lists them in groups, a blank line between them.
  */
-int ts_find(const timeseries_t *ts, uint64_t timestamp, record_t *r)
+static void ts_compact_mark_group(FILE *fp, uint64_t base,
+                                  partition_t *const run[], size_t nr)
 {
-    uint64_t sec    = timestamp / (uint64_t)1e9;
-    record_t target = {.timestamp = timestamp};
-    int err         = 0;
+    fprintf(fp, "%" PRIu64 "\n", base);
+    for (size_t i = 0; i < nr; ++i)
+        if (run[i]->clog.base_timestamp != base)
+            fprintf(fp, "%" PRIu64 "\n", run[i]->clog.base_timestamp);
+}
 
-    // First check the current chunk
-    if (ts->head->base_offset > 0 && ts->head->base_offset <= sec) {
-        err = ts_search_index(ts->head, sec, &target, r);
-        if (err <= 0)
-            return err;
+static int ts_compact_mark_sync(FILE *fp)
+{
+    int err = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+    fclose(fp);
+
+    return err;
+}
+
+static int ts_compact_mark(const char *path, uint64_t base,
+                           partition_t *const run[], size_t nr)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    ts_compact_mark_group(fp, base, run, nr);
+
+    return ts_compact_mark_sync(fp);
+}
+
+/*
+ * Paths of the directory the merged partitions are written in and of the
+ * marker of a compaction, both PATHBUF_SIZE long, -1 if they don't fit.
+ */
+static int ts_compact_paths(const timeseries_t *ts, char *dir, char *marker)
+{
+    if (snprintf(dir, PATHBUF_SIZE, "%s/%s", ts->pathbuf, COMPACT_DIR) >=
+            PATHBUF_SIZE ||
+        snprintf(marker, PATHBUF_SIZE, "%s/%s", dir, COMPACT_MARKER) >=
+            PATHBUF_SIZE)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Complete a compaction interrupted after its marker was written, moving each
+ * merged partition in place and removing the ones it replaces, then clear
+ * whatever is left of the uncommitted ones.
+ */
+static void ts_compact_recover(const timeseries_t *ts)
+{
+    char dir[PATHBUF_SIZE], path[PATHBUF_SIZE];
+    if (ts_compact_paths(ts, dir, path) < 0)
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char line[32];
+        uint64_t base = 0;
+        int merged    = 1;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%" SCNu64, &base) != 1) {
+                merged = 1;
+            } else if (merged) {
+                partition_rename(dir, ts->pathbuf, base);
+                merged = 0;
+            } else {
+                cl_remove(ts->pathbuf, base);
+                index_remove(ts->pathbuf, base);
+            }
+        }
+        fclose(fp);
+        unlink(path);
+        log_info("Recovered an interrupted compaction of \"%s\"", ts->name);
     }
-    // Then check the OOO chunk
-    if (err != 1 && ts->prev->base_offset > 0) {
-        err = ts_search_index(ts->prev, sec, &target, r);
-        if (err <= 0)
-            return err;
+
+    struct dirent **namelist;
+    int n = scandir(dir, &namelist, NULL, alphasort);
+    for (int i = 0; i < n; ++i) {
+        if (namelist[i]->d_name[0] != '.' &&
+            snprintf(path, sizeof(path), "%s/%s", dir, namelist[i]->d_name) <
+                (int)sizeof(path))
+            unlink(path);
+        free(namelist[i]);
+    }
+
+    if (n >= 0)
+        free(namelist);
+}
+
+/*
+ * Swap a merged partition, written aside, in place of the run it replaces, to
+ * be called with the series lock held, queries in flight are done with the
+ * old files by then.
+ */
+static void ts_compact_swap(timeseries_t *ts, const char *dir,
+                            partition_t *const run[], size_t nr,
+                            partition_t *merged)
+{
+    uint64_t base = merged->clog.base_timestamp;
+
+    size_t i = 0;
+    while (i < ts->partitions.length && ts->partitions.items[i] != run[0])
+        i++;
+
+    for (size_t j = 0; j < nr; ++j) {
+        if (run[j]->clog.base_timestamp == base)
+            partition_close(run[j]);
+    }
+
+    if (partition_move(merged, dir, ts->pathbuf) < 0)
+        log_error("Failed to move compacted partition of \"%s\"", ts->name);
+
+    for (size_t j = 0; j < nr; ++j) {
+        if (run[j]->clog.base_timestamp != base)
+            partition_remove(run[j], ts->pathbuf);
+    }
+
+    partition_catalog_replace(&ts->partitions, i, nr, merged);
+}
+
+/*
+ * Compact the first run of at least min_run small partitions, if any, to be
+ * called with the compact lock held. The run is merged without holding the
+ * series lock, the flusher only ever appends to the last partition, which is
+ * never part of it. The merged partition is then swapped in under the lock.
+ * Returns the length of the run compacted, 0 if none, -1 on error.
+ */
+static int ts_compact_run(timeseries_t *ts, size_t min_run)
+{
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (ts_compact_paths(ts, dir, marker) < 0)
+        return -1;
+
+    pthread_mutex_lock(&ts->lock);
+    size_t first      = 0;
+    size_t nr         = ts_compact_pick(ts, min_run, &first);
+    partition_t **run = nr > 0 ? malloc(nr * sizeof(*run)) : NULL;
+    if (run)
+        memcpy(run, ts->partitions.items + first, nr * sizeof(*run));
+    pthread_mutex_unlock(&ts->lock);
+
+    if (nr == 0)
+        return 0;
+
+    if (!run)
+        return -1;
+
+    partition_t *merged = calloc(1, sizeof(*merged));
+    int err             = -1;
+
+    if (!merged || makedir(dir) < 0 ||
+        partition_init(merged, dir, run[0]->clog.base_timestamp) < 0)
+        goto exit;
+
+    if (ts_compact_merge(ts, run, nr, NULL, NULL, 0, merged) < 0 ||
+        ts_compact_mark(marker, run[0]->clog.base_timestamp, run, nr) < 0) {
+        unlink(marker);
+        partition_remove(merged, dir);
+        goto exit;
+    }
+
+    pthread_mutex_lock(&ts->lock);
+    ts_compact_swap(ts, dir, run, nr, merged);
+    merged = NULL;
+    pthread_mutex_unlock(&ts->lock);
+
+    unlink(marker);
+
+    log_debug("Compacted %zu partitions of \"%s\"", nr, ts->name);
+    err = nr;
+
+exit:
+    if (err < 0)
+        log_error("Failed to compact partitions of \"%s\"", ts->name);
+    free(merged);
+    free(run);
+    return err;
+}
+
+/*
+ * Compact every run of at least two adjacent small partitions, the flusher
+ * only does it once a run is long enough to be worth it.
+ */
+int ts_compact(timeseries_t *ts)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&ts->compact_lock);
+    while ((err = ts_compact_run(ts, 2)) > 0)
+        ;
+    pthread_mutex_unlock(&ts->compact_lock);
+
+    return err;
+}
+
+static int ts_rollup_declare(timeseries_t *ts, uint64_t interval);
+
+/*
+ * Rebuild the cached earliest and latest points, from the bounds of each
+ * partition and the points of the in-memory chunks.
+ */
+static void ts_bounds_load(timeseries_t *ts)
+{
+    ts->first = (record_t){0};
+    ts->last  = (record_t){0};
+
+    for (size_t i = 0; i < ts->partitions.length; ++i) {
+        const partition_t *p = ts->partitions.items[i];
+        record_t r;
+
+        if (partition_find(p, &r, p->start_ts) == 0)
+            ts_bounds_update(ts, &r.timestamp, &r.value, 1);
+        if (partition_find(p, &r, p->end_ts) == 0)
+            ts_bounds_update(ts, &r.timestamp, &r.value, 1);
+    }
+
+    const ts_chunk_t *chunks[] = {ts->prev, ts->head, ts->ooo};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(*chunks); ++i)
+        ts_bounds_update(ts, chunks[i]->timestamps, chunks[i]->values,
+                         chunks[i]->length);
+}
+
+static int ts_flush_partition(timeseries_t *ts, ts_sealed_t *s);
+
+/*
+ * Replay the WAL of a chunk, the WALs of chunks sealed and never flushed come
+ * first, in base order. A chunk already replayed is written to the partitions
+ * before the next one takes its place, its WAL deleted once synced.
+ */
+static int ts_chunk_replay(timeseries_t *ts, ts_chunk_t *tc, uint64_t base,
+                           int main)
+{
+    if (wal_is_open(&tc->wal)) {
+        ts_sealed_t s = {.ts     = ts,
+                         .chunks = {tc},
+                         .nr     = 1,
+                         .base   = tc->base_offset,
+                         .full   = 1};
+
+        if (tc->length > 0 && ts_flush_partition(ts, &s) < 0)
+            return TS_E_FLUSH_PARTITION_FAIL;
+        ts_chunk_reset(tc);
+    }
+
+    return ts_chunk_load(ts, tc, base, main);
+}
+
+int ts_init(timeseries_t *ts)
+{
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_mutex_init(&ts->sealed_lock, NULL);
+    pthread_cond_init(&ts->sealed_cond, NULL);
+    pthread_mutex_init(&ts->compact_lock, NULL);
+    ts->sealed_head = 0;
+    ts->sealed_nr   = 0;
+    ts->spare_nr    = 0;
+    ts->rollups_nr  = 0;
+    ts->first       = (record_t){0};
+    ts->last        = (record_t){0};
+
+    snprintf(ts->pathbuf, sizeof(ts->pathbuf), "%s/%s/%s", BASEPATH,
+             ts->db_datapath, ts->name);
+
+    if (makedir(ts->pathbuf) < 0)
+        return TS_E_UNKNOWN;
+
+    ts->head = ts_chunk_make();
+    if (!ts->head)
+        return -1;
+
+    ts->prev = ts_chunk_make();
+    if (!ts->prev)
+        return -1;
+
+    ts->ooo = ts_chunk_make();
+    if (!ts->ooo)
+        return -1;
+
+    ts_chunk_zero(ts->head);
+    ts_chunk_zero(ts->prev);
+    ts_chunk_zero(ts->ooo);
+    ts->ooo_seq = 0;
+
+    ts_compact_recover(ts);
+
+    struct dirent **namelist;
+    int err = 0, ok = 0;
+    int n = scandir(ts->pathbuf, &namelist, NULL, alphasort);
+    if (n == -1)
+        goto exit;
+
+    log_debug("Cold start loading timeseries \"%s\"", ts->name);
+
+    for (int i = 0; i < n; ++i) {
+        const char *dot = strrchr(namelist[i]->d_name, '.');
+        if (!ts->wal_log && strncmp(namelist[i]->d_name, "wal-", 4) == 0 &&
+            strncmp(dot, ".log", 4) == 0) {
+            uint64_t base_timestamp = atoll(namelist[i]->d_name + 6);
+            if (namelist[i]->d_name[4] == 'h') {
+                err = ts_chunk_replay(ts, ts->head, base_timestamp, 1);
+            } else if (namelist[i]->d_name[4] == 't') {
+                err = ts_chunk_replay(ts, ts->prev, base_timestamp, 0);
+            } else if (namelist[i]->d_name[4] == 'o') {
+                err = ts_ooo_load(ts, base_timestamp);
+            }
+            ok = err == 0;
+        } else if (namelist[i]->d_name[0] == 'c' &&
+                   strncmp(dot, ".log", 4) == 0) {
+            // There is a log partition
+            uint64_t base_timestamp = atoll(namelist[i]->d_name + 3);
+            err = ts_partition_load(ts, base_timestamp);
+        } else if (strncmp(namelist[i]->d_name, ROLLUP_PREFIX,
+                           strlen(ROLLUP_PREFIX)) == 0 &&
+                   ts->rollups_nr < ROLLUP_MAX) {
+            uint64_t interval =
+                atoll(namelist[i]->d_name + strlen(ROLLUP_PREFIX));
+            if (interval > 0) {
+                rollup_t *r = &ts->rollups[ts->rollups_nr];
+                if (rollup_open(r, ts->pathbuf, interval) < 0) {
+                    rollup_close(r);
+                    err = TS_E_UNKNOWN;
+                } else {
+                    ts->rollups_nr++;
+                }
+            }
+        }
+
+        free(namelist[i]);
+
+        if (err < 0)
+            goto exit;
+    }
+
+    // The chunks of a shared log are replayed as the WAL files would be
+    if (ts->wal_log) {
+        wal_ref_t *refs = NULL;
+        ssize_t nr      = wal_log_pending(ts->wal_log, ts->wal_series, &refs);
+        for (ssize_t i = 0; i < nr && err == 0; ++i) {
+            if (refs[i].kind == WAL_HEAD)
+                err = ts_chunk_replay(ts, ts->head, refs[i].base, 1);
+            else if (refs[i].kind == WAL_TAIL)
+                err = ts_chunk_replay(ts, ts->prev, refs[i].base, 0);
+            else
+                err = ts_ooo_load(ts, refs[i].base);
+            ok = err == 0;
+        }
+        free(refs);
+
+        if (nr < 0)
+            err = TS_E_WAL_LOAD_FAIL;
+        if (err < 0)
+            goto exit;
+    }
+
+    for (size_t i = 0; i < ts->opts.rollups_nr; ++i) {
+        err = ts_rollup_declare(ts, ts->opts.rollups[i]);
+        if (err < 0)
+            goto exit;
+    }
+
+    ts_bounds_load(ts);
+    ts_retention_sweep(ts);
+
+    log_debug("Succesfully init timeseries \"%s\"", ts->name);
+
+    free(namelist);
+
+    return ok;
+
+exit:
+    free(namelist);
+    return err;
+}
+
+static void ts_flush_inline(timeseries_t *ts);
+
+static int ts_flusher_running(void);
+
+void ts_close(timeseries_t *ts)
+{
+    // Let the flusher drain the chunks sealed so far, those failing to flush
+    // are given up, their WALs kept
+    pthread_mutex_lock(&ts->sealed_lock);
+    ts->closing = 1;
+    int sealed  = ts->sealed_nr > 0;
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    if (sealed && !ts_flusher_running())
+        ts_flush_inline(ts);
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    while (ts->sealed_nr > 0)
+        pthread_cond_wait(&ts->sealed_cond, &ts->sealed_lock);
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    // And finish the housekeeping following the last flush
+    pthread_mutex_lock(&ts->compact_lock);
+    pthread_mutex_unlock(&ts->compact_lock);
+
+    for (size_t i = 0; i < ts->spare_nr; ++i)
+        ts_chunk_free(ts->spare[i]);
+
+    // The entry keeps the range of the partitions, the series is materialized
+    // again on the next access
+    pthread_mutex_lock(&recovery.lock);
+    if (ts->entry) {
+        ts_entry_update(ts->entry, ts);
+        ts->entry->ts = NULL;
+        ts->entry     = NULL;
+    }
+    pthread_mutex_unlock(&recovery.lock);
+
+    partition_catalog_free(&ts->partitions);
+
+    for (size_t i = 0; i < ts->rollups_nr; ++i)
+        rollup_close(&ts->rollups[i]);
+
+    // Write out what's still buffered before dropping the chunks, their WALs
+    // are kept to be replayed at the next start
+    ts_chunk_t *chunks[3] = {ts->head, ts->prev, ts->ooo};
+    for (size_t i = 0; i < 3; ++i) {
+        if (!chunks[i])
+            continue;
+        wal_flush(&chunks[i]->wal, 0);
+        wal_close(&chunks[i]->wal);
+        ts_chunk_free(chunks[i]);
     }
 
-    // We have no persistence, can't stop here, no record found
-    if (ts->partitions[0].start_ts == 0)
+    pthread_cond_destroy(&ts->sealed_cond);
+    pthread_mutex_destroy(&ts->compact_lock);
+    pthread_mutex_destroy(&ts->sealed_lock);
+    pthread_mutex_destroy(&ts->lock);
+    free(ts);
+}
+
+/*
+ * Background flusher, a single thread shared by all the series, started with
+ * the first chunk sealed. Sealed chunks are queued in FIFO order, an entry is
+ * only taken once it's the oldest one of its series, so each series sees its
+ * entries flushed in the same order they were sealed. A failed entry goes
+ * back to the end of the queue with a deadline to be retried at, the series
+ * waits for it while the others go on flushing.
+ */
+static struct {
+    pthread_once_t once;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ts_sealed_t *head;
+    ts_sealed_t *tail;
+    int running;
+} flusher = {.once = PTHREAD_ONCE_INIT,
+             .lock = PTHREAD_MUTEX_INITIALIZER,
+             .cond = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Collect the chunks of a sealed entry, the out of order buffer last, if any.
+ */
+static size_t ts_sealed_chunks(const ts_sealed_t *s, ts_chunk_t *chunks[3])
+{
+    size_t nr = 0;
+
+    for (size_t i = 0; i < s->nr; ++i)
+        chunks[nr++] = s->chunks[i];
+
+    if (s->ooo)
+        chunks[nr++] = s->ooo;
+
+    return nr;
+}
+
+/*
+ * Running state of a bucketed aggregation, each point falls in the bucket
+ * starting at the multiple of the interval not past it, points come in time
+ * order so the range is aggregated in a single pass, a bucket being complete
+ * as soon as a point falls past it. An interval of 0 makes a single bucket of
+ * the whole range, left in current.
+ */
+typedef struct sampler {
+    uint64_t interval;
+    ts_sample_t current;
+    ts_sample_array_t *out;
+} sampler_t;
+
+static int sampler_columns(const uint64_t *timestamps, const double_t *values,
+                           size_t n, void *userdata);
+
+/*
+ * A partition rewritten by a flush, merged with the late points belonging to
+ * it, written aside to be swapped in its place.
+ */
+typedef struct flush_rewrite {
+    partition_t *from;
+    partition_t *to;
+} flush_rewrite_t;
+
+typedef struct flush_rewrite_array {
+    size_t length;
+    size_t capacity;
+    flush_rewrite_t *items;
+} flush_rewrite_array_t;
+
+/*
+ * Destination of a flush, the partition and a sampler per rollup, each fed
+ * the same sorted runs of points, the buckets collected in samples. The
+ * points are staged in the partition, created for the flush or not, and the
+ * buckets in the rollups, to be published at once along with the partitions
+ * rewritten.
+ */
+typedef struct flush_target {
+    partition_t *pt;
+    int created;
+    partition_stage_t stage;
+    sampler_t samplers[ROLLUP_MAX];
+    ts_sample_array_t samples[ROLLUP_MAX];
+    rollup_stage_t rollups[ROLLUP_MAX];
+    size_t rollups_nr;
+    flush_rewrite_array_t rewrites;
+} flush_target_t;
+
+static int ts_flush_columns(flush_target_t *t, const uint64_t *timestamps,
+                            const double_t *values, size_t n)
+{
+    if (partition_stage_columns(t->pt, &t->stage, timestamps, values, n) < 0)
+        return -1;
+
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        sampler_columns(timestamps, values, n, &t->samplers[i]);
+
+    return 0;
+}
+
+/*
+ * Earliest point of a sealed entry, UINT64_MAX if it's empty.
+ */
+static uint64_t ts_sealed_start(const ts_sealed_t *s)
+{
+    ts_chunk_t *chunks[3];
+    size_t nr      = ts_sealed_chunks(s, chunks);
+    uint64_t start = UINT64_MAX;
+
+    for (size_t i = 0; i < nr; ++i)
+        if (chunks[i]->length > 0 && chunks[i]->start_ts < start)
+            start = chunks[i]->start_ts;
+
+    return start;
+}
+
+/*
+ * Merge-join the sealed chunks with the sorted late points, if any, into a
+ * single sorted run. Chunks are consecutive, each one takes the late points
+ * up to its last one, the last chunk takes whatever is left. Returns the
+ * number of points, -1 on failure.
+ */
+static ssize_t ts_sealed_merge(const ts_sealed_t *s, uint64_t **timestamps,
+                               double_t **values)
+{
+    const ts_chunk_t *late = s->ooo;
+    size_t late_nr         = late ? late->length : 0;
+
+    size_t total = late_nr;
+    for (size_t i = 0; i < s->nr; ++i)
+        total += s->chunks[i]->length;
+
+    *timestamps = malloc(total * sizeof(**timestamps));
+    *values     = malloc(total * sizeof(**values));
+    if (!*timestamps || !*values) {
+        free(*timestamps);
+        free(*values);
         return -1;
+    }
 
-    // Look for the record on disk
-    uint8_t buf[RECORD_BINSIZE];
-    ssize_t partition_i = 0;
-    for (size_t n = 0; n <= ts->partition_nr; ++n) {
-        if (ts->partitions[n].clog.base_timestamp > 0 &&
-            ts->partitions[n].clog.base_timestamp <= sec) {
-            uint64_t curr_ts =
-                ts->partitions[n].clog.base_timestamp * (uint64_t)1e9 +
-                ts->partitions[n].clog.base_ns;
-            partition_i = curr_ts > timestamp ? n - 1 : n;
+    size_t n = 0, j = 0;
+    for (size_t i = 0; i < s->nr; ++i) {
+        const ts_chunk_t *tc = s->chunks[i];
+        size_t upto          = late_nr;
+
+        if (late && i < s->nr - 1) {
+            upto = columns_bound(late->timestamps, late_nr, tc->end_ts, 1);
+            if (tc->length == 0 || upto < j)
+                upto = j;
         }
-        if (ts->partitions[n].clog.base_timestamp > sec)
-            break;
+
+        n += columns_merge(tc->timestamps, tc->values, tc->length,
+                           late ? late->timestamps + j : NULL,
+                           late ? late->values + j : NULL, upto - j,
+                           *timestamps + n, *values + n);
+        j = upto;
+    }
+
+    return n;
+}
+
+/*
+ * Write the sealed chunks to the target, merge-joined with the sorted late
+ * points, if any.
+ */
+static int ts_flush_merged(flush_target_t *t, const ts_sealed_t *s)
+{
+    const ts_chunk_t *late = s->ooo;
+
+    if (!late || late->length == 0) {
+        for (size_t i = 0; i < s->nr; ++i) {
+            const ts_chunk_t *tc = s->chunks[i];
+            if (ts_flush_columns(t, tc->timestamps, tc->values, tc->length) <
+                0)
+                return -1;
+        }
+        return 0;
     }
 
-    // This shouldn't happen, but in case, we return timestamp not found
-    if (partition_i < 0)
+    uint64_t *timestamps = NULL;
+    double_t *values     = NULL;
+    ssize_t n            = ts_sealed_merge(s, &timestamps, &values);
+    if (n < 0)
         return -1;
 
-    // Fetch single record from the partition
-    err = partition_find(&ts->partitions[partition_i], buf, timestamp);
-    if (err < 0)
+    int err = ts_flush_columns(t, timestamps, values, n);
+
+    free(timestamps);
+    free(values);
+
+    return err;
+}
+
+/*
+ * Start a new partition for the flusher, added to the catalog once published.
+ */
+static partition_t *ts_partition_new(const timeseries_t *ts, uint64_t base)
+{
+    partition_t *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    if (partition_init(p, ts->pathbuf, base) < 0) {
+        partition_close(p);
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Rewrite the i-th partition merged with n sorted late points belonging to
+ * it, the way a compaction of a single partition is done, written aside in
+ * dir. The partition starts early enough to hold the points.
+ */
+static partition_t *ts_partition_rewrite(const timeseries_t *ts,
+                                         const char *dir, size_t i,
+                                         const uint64_t *timestamps,
+                                         const double_t *values, size_t n)
+{
+    partition_t *run[1] = {ts->partitions.items[i]};
+    uint64_t base       = run[0]->clog.base_timestamp;
+    if (timestamps[0] / (uint64_t)1e9 < base)
+        base = timestamps[0] / (uint64_t)1e9;
+
+    partition_t *merged = calloc(1, sizeof(*merged));
+    if (!merged || partition_init(merged, dir, base) < 0) {
+        free(merged);
+        return NULL;
+    }
+
+    if (ts_compact_merge(ts, run, 1, timestamps, values, n, merged) < 0) {
+        partition_remove(merged, dir);
+        free(merged);
+        return NULL;
+    }
+
+    return merged;
+}
+
+/*
+ * Merge the first k points, older than the end of the partitions, into the
+ * partitions they belong to, rather than appending them past newer ones.
+ * The partitions are rewritten without the series lock, swapped in when the
+ * flush is published, so queries see the points either in the sealed chunks
+ * or in the partitions, even if the flush fails half way.
+ */
+static int ts_flush_late(timeseries_t *ts, flush_target_t *t,
+                         const uint64_t *timestamps, const double_t *values,
+                         size_t k)
+{
+    const partition_catalog_t *pc = &ts->partitions;
+
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (k > 0 && (ts_compact_paths(ts, dir, marker) < 0 || makedir(dir) < 0))
+        return -1;
+
+    for (size_t i = 0, end = 0; i < k; i = end) {
+        size_t slot = partition_catalog_slot(pc, timestamps[i]);
+        end         = k;
+
+        // The points up to the start of the next partition go together
+        if (slot + 1 < pc->length) {
+            const partition_t *next = pc->items[slot + 1];
+            uint64_t start          = next->start_ts;
+            if (start == 0)
+                start = next->clog.base_timestamp * (uint64_t)1e9;
+            end = i + columns_bound(timestamps + i, k - i, start, 0);
+        }
+
+        partition_t *merged = ts_partition_rewrite(
+            ts, dir, slot, timestamps + i, values + i, end - i);
+        if (!merged)
+            return -1;
+
+        da_append(&t->rewrites,
+                  ((flush_rewrite_t){.from = pc->items[slot], .to = merged}));
+    }
+
+    return 0;
+}
+
+/*
+ * Commit the partitions rewritten by a flush, all at once, rolled forward on
+ * restart if the flush is interrupted past it.
+ */
+static int ts_flush_mark(const timeseries_t *ts, const flush_target_t *t)
+{
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (ts_compact_paths(ts, dir, marker) < 0)
+        return -1;
+
+    FILE *fp = fopen(marker, "w");
+    if (!fp)
+        return -1;
+
+    for (size_t i = 0; i < t->rewrites.length; ++i) {
+        const flush_rewrite_t *rw = &t->rewrites.items[i];
+        if (i > 0)
+            fputc('\n', fp);
+        ts_compact_mark_group(fp, rw->to->clog.base_timestamp, &rw->from, 1);
+    }
+
+    return ts_compact_mark_sync(fp);
+}
+
+/*
+ * Stage the buckets sampled by a flush in the rollups. A failure drops the
+ * ones staged so far, the flush fails as a whole to be retried, the rollups
+ * never being left short of the points flushed.
+ */
+static int ts_flush_rollups(timeseries_t *ts, flush_target_t *t)
+{
+    for (size_t i = 0; i < t->rollups_nr; ++i) {
+        sampler_t *sampler = &t->samplers[i];
+        if (sampler->current.count > 0)
+            da_append(sampler->out, sampler->current);
+
+        if (rollup_stage(&ts->rollups[i], sampler->out->items,
+                         sampler->out->length, &t->rollups[i]) < 0) {
+            log_error("Failed to update the %" PRIu64 "ns rollup of \"%s\"",
+                      ts->rollups[i].interval, ts->name);
+            while (i-- > 0)
+                rollup_stage_drop(&ts->rollups[i], &t->rollups[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pick the partition to append points starting at first to, keeping the
+ * partition selection of the inline flush: a full flush starts a new
+ * partition if its base is past the last one, a rotation appends to the
+ * current one. A new partition starts early enough to hold the first point
+ * too, the points are past the end of the last one so the catalog stays in
+ * order, one that would share its base second is appended to it instead.
+ */
+static partition_t *ts_flush_target(const timeseries_t *ts,
+                                    const flush_target_t *t,
+                                    const ts_sealed_t *s, uint64_t first,
+                                    int *created)
+{
+    partition_t *pt = partition_catalog_last(&ts->partitions);
+    uint64_t base   = s->base;
+
+    if (first / (uint64_t)1e9 < base)
+        base = first / (uint64_t)1e9;
+
+    *created = 0;
+    if (pt && !(s->full && pt->clog.base_timestamp < base)) {
+        // Rewritten by the flush, the points go to its replacement
+        for (size_t i = 0; i < t->rewrites.length; ++i)
+            if (t->rewrites.items[i].from == pt)
+                return t->rewrites.items[i].to;
+        return pt;
+    }
+
+    pt = ts_partition_new(ts, base);
+    if (pt)
+        *created = 1;
+
+    return pt;
+}
+
+/*
+ * Drop what a flush staged, a partition created for it is removed, as are
+ * the partitions rewritten and their marker.
+ */
+static void ts_flush_drop(timeseries_t *ts, flush_target_t *t)
+{
+    if (t->pt && t->created) {
+        da_free(&t->stage.entries);
+        partition_remove(t->pt, ts->pathbuf);
+        free(t->pt);
+    } else if (t->pt) {
+        partition_stage_drop(t->pt, &t->stage);
+    }
+    t->pt = NULL;
+
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        rollup_stage_drop(&ts->rollups[i], &t->rollups[i]);
+
+    // Left over otherwise, they're cleared at the next start
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (t->rewrites.length > 0 && ts_compact_paths(ts, dir, marker) == 0) {
+        unlink(marker);
+        for (size_t i = 0; i < t->rewrites.length; ++i)
+            partition_remove(t->rewrites.items[i].to, dir);
+    }
+
+    for (size_t i = 0; i < t->rewrites.length; ++i)
+        free(t->rewrites.items[i].to);
+    da_free(&t->rewrites);
+}
+
+/*
+ * Write the sealed chunks to the partitions, without the series lock, the
+ * flusher being the only writer. The points older than the end of the
+ * partitions are merged into the partitions they belong to first, the rest
+ * is staged past the end of the last one, or in a new one, and synced along
+ * with the rollups, to be published. Nothing is left staged on failure.
+ */
+static int ts_flush_stage(timeseries_t *ts, ts_sealed_t *s, flush_target_t *t)
+{
+    const partition_t *last = partition_catalog_last(&ts->partitions);
+    uint64_t cutoff         = last ? last->end_ts : 0;
+    uint64_t first          = ts_sealed_start(s);
+    uint64_t *timestamps    = NULL;
+    double_t *values        = NULL;
+    size_t k = 0, n = 0;
+    int err = 0;
+
+    *t = (flush_target_t){.rollups_nr = ts->rollups_nr};
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        t->samplers[i] = (sampler_t){.interval = ts->rollups[i].interval,
+                                     .out      = &t->samples[i]};
+
+    if (first < cutoff) {
+        ssize_t len = ts_sealed_merge(s, &timestamps, &values);
+        if (len < 0) {
+            err = TS_E_FLUSH_PARTITION_FAIL;
+            goto exit;
+        }
+
+        n = len;
+        k = columns_bound(timestamps, n, cutoff, 0);
+        if (ts_flush_late(ts, t, timestamps, values, k) < 0) {
+            err = TS_E_FLUSH_PARTITION_FAIL;
+            goto exit;
+        }
+
+        for (size_t i = 0; i < t->rollups_nr; ++i)
+            sampler_columns(timestamps, values, k, &t->samplers[i]);
+
+        if (k < n)
+            first = timestamps[k];
+    }
+
+    // Points left past the end of the partitions, unless all of them are late
+    if (!timestamps || k < n) {
+        t->pt = ts_flush_target(ts, t, s, first, &t->created);
+        if (!t->pt) {
+            err = TS_E_INIT_PARTITION_FAIL;
+            goto exit;
+        }
+        partition_stage_init(t->pt, &t->stage);
+
+        int failed = timestamps ? ts_flush_columns(t, timestamps + k,
+                                                   values + k, n - k) < 0
+                                : ts_flush_merged(t, s) < 0;
+        if (failed || partition_sync_files(t->pt) < 0) {
+            err = TS_E_FLUSH_PARTITION_FAIL;
+            goto exit;
+        }
+    }
+
+    if (ts_flush_rollups(ts, t) < 0 ||
+        (t->rewrites.length > 0 && ts_flush_mark(ts, t) < 0))
+        err = TS_E_FLUSH_PARTITION_FAIL;
+
+exit:
+    if (err < 0)
+        ts_flush_drop(ts, t);
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        da_free(&t->samples[i]);
+    free(timestamps);
+    free(values);
+
+    return err;
+}
+
+/*
+ * Publish what a flush staged, to be called with the series lock held. The
+ * catalogs get room for the partitions created first, nothing is published
+ * unless all of it can be.
+ */
+static int ts_flush_publish(timeseries_t *ts, flush_target_t *t)
+{
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (t->rewrites.length > 0 && ts_compact_paths(ts, dir, marker) < 0)
+        return -1;
+
+    if (t->pt && t->created &&
+        partition_catalog_reserve(&ts->partitions, 1) < 0)
+        return -1;
+
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        if (t->rollups[i].created &&
+            partition_catalog_reserve(&ts->rollups[i].partitions, 1) < 0)
+            return -1;
+
+    for (size_t i = 0; i < t->rewrites.length; ++i)
+        ts_compact_swap(ts, dir, &t->rewrites.items[i].from, 1,
+                        t->rewrites.items[i].to);
+
+    if (t->pt) {
+        partition_publish(t->pt, &t->stage);
+        if (t->created)
+            partition_catalog_add(&ts->partitions, t->pt);
+    }
+
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        rollup_publish(&ts->rollups[i], &t->rollups[i]);
+
+    return 0;
+}
+
+/*
+ * Write the metas of the partitions published, left behind by a failure
+ * they're just scanned at the next load, and clear the marker of the
+ * partitions rewritten, all swapped in by now.
+ */
+static void ts_flush_seal(const timeseries_t *ts, flush_target_t *t)
+{
+    if (t->pt)
+        partition_seal(t->pt);
+
+    for (size_t i = 0; i < t->rollups_nr; ++i)
+        rollup_seal(&t->rollups[i]);
+
+    char dir[PATHBUF_SIZE], marker[PATHBUF_SIZE];
+    if (t->rewrites.length > 0 && ts_compact_paths(ts, dir, marker) == 0)
+        unlink(marker);
+    da_free(&t->rewrites);
+}
+
+/*
+ * Flush the sealed chunks into a partition, staged then published under the
+ * series lock.
+ */
+static int ts_flush_partition(timeseries_t *ts, ts_sealed_t *s)
+{
+    flush_target_t t;
+    int err = ts_flush_stage(ts, s, &t);
+    if (err < 0)
+        return err;
+
+    pthread_mutex_lock(&ts->lock);
+    err = ts_flush_publish(ts, &t);
+    pthread_mutex_unlock(&ts->lock);
+
+    if (err < 0) {
+        ts_flush_drop(ts, &t);
+        return TS_E_FLUSH_PARTITION_FAIL;
+    }
+
+    ts_flush_seal(ts, &t);
+
+    return 0;
+}
+
+/*
+ * Keep a chunk, already reset, aside to be reused as a fresh one.
+ */
+static void ts_chunk_recycle(timeseries_t *ts, ts_chunk_t *tc)
+{
+    pthread_mutex_lock(&ts->sealed_lock);
+    if (ts->spare_nr < TS_MAX_SEALED * 3)
+        ts->spare[ts->spare_nr++] = tc;
+    else
+        ts_chunk_free(tc);
+    pthread_mutex_unlock(&ts->sealed_lock);
+}
+
+/*
+ * Flush a sealed entry and retire it, the points are written and synced
+ * without the series lock, the partition is then published and the entry
+ * dropped under it, so queries see the points either in the sealed chunks or
+ * in the partition, never both or none. Chunks are then reset, deleting their
+ * WAL, and kept aside to be reused as fresh ones.
+ *
+ * A failed flush leaves the entry in place, its points still served from the
+ * chunks and logged in their WALs, to be retried. Once the series is closing
+ * the entry is retired anyway, the WALs are kept to be replayed at the next
+ * start.
+ *
+ * The housekeeping of the partitions follows, past the entry retirement so
+ * that writers are not held back by it.
+ *
+ * Returns -1 if the flush is to be retried, 0 otherwise.
+ */
+static int ts_flush_sealed(ts_sealed_t *s)
+{
+    timeseries_t *ts = s->ts;
+    ts_chunk_t *chunks[3];
+    size_t nr = ts_sealed_chunks(s, chunks);
+
+    flush_target_t t;
+
+    pthread_mutex_lock(&ts->compact_lock);
+
+    int staged = ts_flush_stage(ts, s, &t) == 0;
+
+    pthread_mutex_lock(&ts->lock);
+
+    int failed = !staged || ts_flush_publish(ts, &t) < 0;
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    int retry = failed && !ts->closing;
+    if (!retry) {
+        ts->sealed_head = (ts->sealed_head + 1) % TS_MAX_SEALED;
+        ts->sealed_nr--;
+    }
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    pthread_mutex_unlock(&ts->lock);
+
+    if (staged && failed)
+        ts_flush_drop(ts, &t);
+    else if (staged)
+        ts_flush_seal(ts, &t);
+
+    if (failed)
+        log_error("Failed to flush sealed chunks of \"%s\"", ts->name);
+
+    if (retry) {
+        pthread_mutex_unlock(&ts->compact_lock);
+        return -1;
+    }
+
+    for (size_t i = 0; i < nr; ++i) {
+        if (failed) {
+            wal_close(&chunks[i]->wal);
+            ts_chunk_free(chunks[i]);
+        } else {
+            ts_chunk_reset(chunks[i]);
+            ts_chunk_recycle(ts, chunks[i]);
+        }
+    }
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    pthread_cond_broadcast(&ts->sealed_cond);
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    if (!failed) {
+        pthread_mutex_lock(&ts->lock);
+        ts_retention_sweep(ts);
+        pthread_mutex_unlock(&ts->lock);
+
+        ts_compact_run(ts, TS_COMPACT_RUN);
+    }
+
+    pthread_mutex_unlock(&ts->compact_lock);
+
+    return 0;
+}
+
+/*
+ * Take the first entry ready to flush off the queue, the oldest one of its
+ * series and past its retry deadline, unless the series is closing. Sets wake
+ * to the earliest deadline of the entries left waiting, if any. To be called
+ * with the flusher lock held.
+ */
+static ts_sealed_t *flusher_take(int64_t now, int64_t *wake)
+{
+    ts_sealed_t **link = &flusher.head, *prev = NULL;
+
+    for (ts_sealed_t *s = flusher.head; s; prev = s, s = s->next) {
+        timeseries_t *ts = s->ts;
+
+        pthread_mutex_lock(&ts->sealed_lock);
+        int oldest  = s == &ts->sealed[ts->sealed_head];
+        int waiting = s->retry_at > now && !ts->closing;
+        pthread_mutex_unlock(&ts->sealed_lock);
+
+        if (oldest && waiting && (*wake == 0 || s->retry_at < *wake))
+            *wake = s->retry_at;
+        if (!oldest || waiting) {
+            link = &s->next;
+            continue;
+        }
+
+        *link = s->next;
+        if (flusher.tail == s)
+            flusher.tail = prev;
+        s->next = NULL;
+
+        return s;
+    }
+
+    return NULL;
+}
+
+static void *flusher_loop(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&flusher.lock);
+    for (;;) {
+        int64_t wake   = 0;
+        ts_sealed_t *s = flusher_take(current_nanos(), &wake);
+        if (!s) {
+            struct timespec tv = {.tv_sec  = wake / (int64_t)1e9,
+                                  .tv_nsec = wake % (int64_t)1e9};
+            if (wake)
+                pthread_cond_timedwait(&flusher.cond, &flusher.lock, &tv);
+            else
+                pthread_cond_wait(&flusher.cond, &flusher.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&flusher.lock);
+
+        int failed = ts_flush_sealed(s) < 0;
+
+        pthread_mutex_lock(&flusher.lock);
+        if (!failed)
+            continue;
+
+        // Retried after a pause, behind the entries of the other series
+        s->retry_at = current_nanos() + TS_FLUSH_RETRY_MS * (int64_t)1e6;
+        if (flusher.tail)
+            flusher.tail->next = s;
+        else
+            flusher.head = s;
+        flusher.tail = s;
+    }
+
+    return NULL;
+}
+
+static void flusher_start(void)
+{
+    if (pthread_create(&flusher.thread, NULL, flusher_loop, NULL) != 0) {
+        log_error("Failed to start the flusher, flushing inline");
+        return;
+    }
+
+    pthread_detach(flusher.thread);
+    flusher.running = 1;
+}
+
+static int ts_flusher_running(void)
+{
+    pthread_once(&flusher.once, flusher_start);
+    return flusher.running;
+}
+
+/*
+ * Flush the entries of a series in order, without a flusher thread, up to the
+ * first one failing, retried on the next call.
+ */
+static void ts_flush_inline(timeseries_t *ts)
+{
+    for (;;) {
+        pthread_mutex_lock(&ts->sealed_lock);
+        ts_sealed_t *s =
+            ts->sealed_nr > 0 ? &ts->sealed[ts->sealed_head] : NULL;
+        pthread_mutex_unlock(&ts->sealed_lock);
+
+        if (!s || ts_flush_sealed(s) < 0)
+            return;
+    }
+}
+
+/*
+ * Refuse new writes while the flusher has TS_MAX_SEALED entries of the series
+ * still to flush, so that no write is ever half applied for lack of room.
+ */
+static int ts_backpressure(timeseries_t *ts)
+{
+    pthread_mutex_lock(&ts->sealed_lock);
+    int full = ts->sealed_nr == TS_MAX_SEALED;
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    // Only failed flushes fill the queue without a flusher, retry them
+    if (full && !ts_flusher_running()) {
+        ts_flush_inline(ts);
+        pthread_mutex_lock(&ts->sealed_lock);
+        full = ts->sealed_nr == TS_MAX_SEALED;
+        pthread_mutex_unlock(&ts->sealed_lock);
+    }
+
+    return full ? TS_E_BACKPRESSURE : 0;
+}
+
+/*
+ * Take a fresh chunk to replace a sealed one, reusing a flushed chunk if any.
+ */
+static ts_chunk_t *ts_chunk_fresh(timeseries_t *ts)
+{
+    ts_chunk_t *tc = NULL;
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    if (ts->spare_nr > 0)
+        tc = ts->spare[--ts->spare_nr];
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    if (!tc)
+        tc = ts_chunk_make();
+    if (tc)
+        ts_chunk_zero(tc);
+
+    return tc;
+}
+
+/*
+ * Hand chunks over to the flusher, their WALs are written out first, they
+ * stay on disk until the partition is synced. The caller replaces the chunks
+ * with fresh ones and must not touch them anymore.
+ *
+ * Remarks
+ *
+ * - Writes are expected to check `ts_backpressure(1)` before starting, a
+ *   single write can seal more than once though, in which case this waits
+ *   for the flusher to free a slot
+ */
+static void ts_seal(timeseries_t *ts, ts_chunk_t *chunks[], size_t nr,
+                    ts_chunk_t *ooo, uint64_t base, int full)
+{
+    for (size_t i = 0; i < nr; ++i)
+        if (wal_is_open(&chunks[i]->wal) && wal_flush(&chunks[i]->wal, 0) < 0)
+            log_error("Failed to write out the WAL of a sealed chunk");
+
+    if (ooo && wal_is_open(&ooo->wal) && wal_flush(&ooo->wal, 0) < 0)
+        log_error("Failed to write out the WAL of sealed late points");
+
+    int inline_flush = !ts_flusher_running();
+
+    // Without a flusher, the entries left by failed flushes are retried here
+    pthread_mutex_lock(&ts->sealed_lock);
+    while (ts->sealed_nr == TS_MAX_SEALED) {
+        if (!inline_flush) {
+            pthread_cond_wait(&ts->sealed_cond, &ts->sealed_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ts->sealed_lock);
+        ts_flush_inline(ts);
+        if (ts->sealed_nr == TS_MAX_SEALED)
+            usleep(TS_FLUSH_RETRY_MS * 1000);
+        pthread_mutex_lock(&ts->sealed_lock);
+    }
+
+    ts_sealed_t *s =
+        &ts->sealed[(ts->sealed_head + ts->sealed_nr) % TS_MAX_SEALED];
+    s->ts       = ts;
+    s->nr       = nr;
+    s->base     = base;
+    s->full     = full;
+    s->ooo      = ooo;
+    s->retry_at = 0;
+    s->next     = NULL;
+    for (size_t i = 0; i < nr; ++i)
+        s->chunks[i] = chunks[i];
+    ts->sealed_nr++;
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    if (inline_flush) {
+        ts_flush_inline(ts);
+        return;
+    }
+
+    pthread_mutex_lock(&flusher.lock);
+    if (flusher.tail)
+        flusher.tail->next = s;
+    else
+        flusher.head = s;
+    flusher.tail = s;
+    pthread_cond_signal(&flusher.cond);
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+/*
+ * Split the late points older than cutoff out of the out of order buffer, to
+ * be sealed along with the chunks they precede, the buffer is sorted once
+ * here. If only some of them go, both parts are copied to fresh buffers with
+ * WALs of their own, synced before the former one is dropped, so that no
+ * point is logged twice.
+ *
+ * Returns the buffer to seal, NULL if there's none, in which case the late
+ * points are all kept for a later flush.
+ */
+static ts_chunk_t *ts_ooo_split(timeseries_t *ts, uint64_t cutoff)
+{
+    ts_chunk_t *tc = ts->ooo;
+
+    if (tc->length == 0)
+        return NULL;
+
+    if (columns_sort(tc->timestamps, tc->values, tc->length, &tc->arena) < 0)
+        return NULL;
+
+    size_t k = columns_bound(tc->timestamps, tc->length, cutoff, 0);
+    if (k == 0)
+        return NULL;
+
+    ts_chunk_t *rest = ts_chunk_fresh(ts);
+    if (!rest)
+        return NULL;
+
+    if (k == tc->length) {
+        ts->ooo = rest;
+        return tc;
+    }
+
+    ts_chunk_t *sealed = ts_chunk_fresh(ts);
+    if (!sealed) {
+        ts_chunk_free(rest);
+        return NULL;
+    }
+
+    ts_chunk_t *parts[2] = {sealed, rest};
+    size_t from[2]       = {0, k};
+    size_t count[2]      = {k, tc->length - k};
+
+    for (size_t i = 0; i < 2; ++i) {
+        const uint64_t *timestamps = tc->timestamps + from[i];
+        const double_t *values     = tc->values + from[i];
+
+        if (ts_ooo_init(ts, parts[i]) < 0 ||
+            wal_append_batch(&parts[i]->wal, timestamps, values, count[i]) <
+                0 ||
+            wal_flush(&parts[i]->wal, 1) < 0 ||
+            ts_ooo_append(parts[i], timestamps, values, count[i]) < 0) {
+            log_error("Failed to split the late points of \"%s\"", ts->name);
+            ts_chunk_reset(sealed);
+            ts_chunk_reset(rest);
+            ts_chunk_free(sealed);
+            ts_chunk_free(rest);
+            return NULL;
+        }
+    }
+
+    ts_chunk_reset(tc);
+    ts_chunk_recycle(ts, tc);
+    ts->ooo = rest;
+
+    return sealed;
+}
+
+/*
+ * Length of the leading run of late points, older than the last point of the
+ * head chunk, to be logged to the out of order buffer.
+ */
+static size_t ts_late_run(const ts_chunk_t *tc, const uint64_t *timestamps,
+                          size_t n)
+{
+    if (tc->length == 0)
+        return 0;
+
+    size_t i = 0;
+    while (i < n && timestamps[i] < tc->end_ts)
+        i++;
+
+    return i;
+}
+
+/*
+ * Log late points to the out of order buffer, no matter how late they are,
+ * just an append to its WAL and to its columns.
+ */
+static int ts_insert_late(timeseries_t *ts, const uint64_t *timestamps,
+                          const double_t *values, size_t n)
+{
+    int err = ts_ooo_init(ts, ts->ooo);
+    if (err < 0)
+        return err;
+
+    // Persist to disk for disaster recovery
+    if (wal_append_batch(&ts->ooo->wal, timestamps, values, n) < 0)
+        return TS_E_WAL_APPEND_FAIL;
+
+    return ts_ooo_append(ts->ooo, timestamps, values, n);
+}
+
+/**
+ * Rotate chunks when a new head chunk is needed.
+ *
+ * @param ts Pointer to the timeseries.
+ * @param pathbuf Path to the timeseries data files.
+ * @param sec Seconds part of the timestamp.
+ * @return 0 on success, error code on failure.
+ */
+static int ts_rotate_chunks(timeseries_t *ts, uint64_t sec)
+{
+    ts_chunk_t *fresh = ts_chunk_fresh(ts);
+    if (!fresh)
+        return TS_E_OOM;
+
+    // Seal current prev chunk for the flusher, along with the late points
+    // preceding the head
+    ts_chunk_t *late = ts_ooo_split(ts, ts->head->start_ts);
+    ts_seal(ts, &ts->prev, 1, late, ts->head->base_offset, 0);
+
+    // Set the current head as new prev, the columns are moved along with the
+    // chunk, a fresh chunk becomes the new head
+    ts->prev = ts->head;
+    ts->head = fresh;
+
+    if (ts_chunk_init(ts, ts->head, sec, 1) < 0)
+        return TS_E_UNKNOWN;
+
+    return 0;
+}
+
+/*
+ * Seal both in-memory chunks and the late points for the flusher once the
+ * head or the out of order WAL has grown past the flush size.
+ */
+static int ts_flush_if_full(timeseries_t *ts)
+{
+    // if the limit is reached we hand the chunks over to the flusher and
+    // create 2 new ones
+    if (wal_size(&ts->head->wal) < ts->opts.flushsize &&
+        wal_size(&ts->ooo->wal) < ts->opts.flushsize)
+        return 0;
+
+    ts_chunk_t *prev = ts_chunk_fresh(ts);
+    ts_chunk_t *head = ts_chunk_fresh(ts);
+    if (!prev || !head) {
+        ts_chunk_free(prev);
+        ts_chunk_free(head);
+        return TS_E_OOM;
+    }
+
+    uint64_t base         = ts->prev->base_offset > 0 ? ts->prev->base_offset
+                                                      : ts->head->base_offset;
+    ts_chunk_t *chunks[2] = {ts->prev, ts->head};
+
+    ts_seal(ts, chunks, 2, ts_ooo_split(ts, UINT64_MAX), base, 1);
+    ts->prev = prev;
+    ts->head = head;
+
+    return 0;
+}
+
+static int ts_insert_point(timeseries_t *ts, uint64_t timestamp,
+                           double_t value)
+{
+    // Late points are merged at flush time
+    if (ts_late_run(ts->head, &timestamp, 1) > 0) {
+        int err = ts_insert_late(ts, &timestamp, &value, 1);
+        if (err == 0)
+            ts_bounds_update(ts, &timestamp, &value, 1);
+        return err;
+    }
+
+    // Extract seconds and nanoseconds from timestamp
+    uint64_t sec  = timestamp / (uint64_t)1e9;
+    uint64_t nsec = timestamp % (uint64_t)1e9;
+
+    if (ts->head->base_offset == 0 &&
+        ts_chunk_init(ts, ts->head, sec, 1) < 0)
+        return TS_E_UNKNOWN;
+
+    // Check if the timestamp is in range of the current chunk, otherwise
+    // create a new in-memory segment
+    if (ts_chunk_record_fit(ts->head, sec) > 0 && ts_rotate_chunks(ts, sec) < 0)
+        return TS_E_UNKNOWN;
+
+    // Persist to disk for disaster recovery, in the WAL of the chunk holding
+    // the point
+    if (wal_append(&ts->head->wal, timestamp, value) < 0)
+        return TS_E_WAL_APPEND_FAIL;
+
+    // Insert it into the head chunk
+    int err = ts_chunk_set_record(ts->head, sec, nsec, value);
+    if (err == 0)
+        ts_bounds_update(ts, &timestamp, &value, 1);
+
+    return err;
+}
+
+/*
+ * Set a record in a timeseries.
+ *
+ * This function sets a record with the specified timestamp and value in the
+ * given timeseries. The function handles the storage of records in memory and
+ * on disk to ensure data integrity and efficient usage of resources.
+ *
+ * @param ts A pointer to the timeseries_t structure representing the
+ * timeseries.
+ * @param timestamp The timestamp of the record to be set, in nanoseconds.
+ * @param value The value of the record to be set.
+ * @return 0 on success, -1 on failure.
+ */
+int ts_insert(timeseries_t *ts, uint64_t timestamp, double_t value)
+{
+    if (!ts)
+        return TS_E_NULL_POINTER;
+
+    int err = ts_backpressure(ts);
+    if (err < 0)
+        return err;
+
+    if ((err = ts_flush_if_full(ts)) < 0)
+        return err;
+
+    return ts_insert_point(ts, timestamp, value);
+}
+
+/*
+ * Length of the leading run of points that can be appended as they are to the
+ * head chunk, sorted, not older than the last point and in the chunk range.
+ */
+static size_t ts_chunk_sorted_run(const ts_chunk_t *tc,
+                                  const uint64_t *timestamps, size_t n)
+{
+    if (tc->base_offset == 0)
+        return 0;
+
+    uint64_t last = tc->length == 0 ? 0 : tc->end_ts;
+    size_t i      = 0;
+
+    for (; i < n; ++i) {
+        if (timestamps[i] < last ||
+            ts_chunk_record_fit(tc, timestamps[i] / (uint64_t)1e9) != 0)
+            break;
+        last = timestamps[i];
+    }
+
+    return i;
+}
+
+/*
+ * Append a sorted run to the chunk, the columns are grown once for the whole
+ * run and no out of order handling is needed.
+ *
+ * Remarks
+ *
+ * - The run is assumed to be validated by `ts_chunk_sorted_run(3)`
+ */
+static int ts_chunk_append_run(ts_chunk_t *tc, const uint64_t *timestamps,
+                               const double_t *values, size_t n)
+{
+    while (tc->length + n > tc->capacity)
+        if (ts_chunk_grow(tc) < 0)
+            return TS_E_OOM;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t index = timestamps[i] / (uint64_t)1e9 - tc->base_offset;
+        size_t first = tc->length == 0 ? 0 : tc->max_index + 1;
+
+        for (size_t j = first; j <= index; ++j)
+            tc->offsets[j] = tc->length;
+
+        tc->timestamps[tc->length] = timestamps[i];
+        tc->values[tc->length]     = values[i];
+        tc->max_index              = index;
+        tc->length++;
+    }
+
+    tc->start_ts = tc->timestamps[0];
+    tc->end_ts   = tc->timestamps[tc->length - 1];
+
+    return 0;
+}
+
+/*
+ * Insert a batch of points in a timeseries.
+ *
+ * The flush size is checked once for the whole batch, sorted runs landing in
+ * the head chunk are logged to the WAL as a single frame and appended to the
+ * columns in one go, as well as runs of late points to the out of order
+ * buffer, the remaining points, triggering a rotation, fall back to the single
+ * point path.
+ *
+ * @param ts A pointer to the timeseries_t structure representing the
+ * timeseries.
+ * @param timestamps The timestamps of the points, in nanoseconds.
+ * @param values The values of the points.
+ * @param n The number of points.
+ * @return The number of points inserted, < 0 on failure.
+ */
+int ts_insert_batch(timeseries_t *ts, const uint64_t *timestamps,
+                    const double_t *values, size_t n)
+{
+    if (!ts || (n > 0 && (!timestamps || !values)))
+        return TS_E_NULL_POINTER;
+
+    int err = ts_backpressure(ts);
+    if (err < 0)
+        return err;
+
+    if ((err = ts_flush_if_full(ts)) < 0)
+        return err;
+
+    size_t i = 0;
+    while (i < n) {
+        // Runs of late points are logged to the out of order buffer in one go
+        size_t late = ts_late_run(ts->head, timestamps + i, n - i);
+        if (late > 0) {
+            err = ts_insert_late(ts, timestamps + i, values + i, late);
+            if (err < 0)
+                return err;
+            ts_bounds_update(ts, timestamps + i, values + i, late);
+            i += late;
+            continue;
+        }
+
+        size_t run = ts_chunk_sorted_run(ts->head, timestamps + i, n - i);
+        if (run == 0) {
+            if ((err = ts_insert_point(ts, timestamps[i], values[i])) < 0)
+                return err;
+            i++;
+            continue;
+        }
+
+        // Persist to disk for disaster recovery
+        err = wal_append_batch(&ts->head->wal, timestamps + i, values + i, run);
+        if (err < 0)
+            return TS_E_WAL_APPEND_FAIL;
+
+        err = ts_chunk_append_run(ts->head, timestamps + i, values + i, run);
+        if (err < 0)
+            return err;
+
+        ts_bounds_update(ts, timestamps + i, values + i, run);
+        i += run;
+    }
+
+    return (int)n;
+}
+
+/*
+ * Commit the points inserted so far in the WAL of the in-memory chunks,
+ * sealed ones included until they're flushed, following the WAL policy of
+ * the series, force writes and syncs them regardless of the policy.
+ *
+ * @return 1 if all the points are durable, 0 if some are still waiting for
+ *         the policy to trigger, < 0 on failure.
+ */
+int ts_commit(timeseries_t *ts, int force)
+{
+    if (!ts)
+        return TS_E_NULL_POINTER;
+
+    int head = wal_commit(&ts->head->wal, &ts->opts.wal_policy, force);
+    int prev = wal_commit(&ts->prev->wal, &ts->opts.wal_policy, force);
+    int ooo  = wal_commit(&ts->ooo->wal, &ts->opts.wal_policy, force);
+
+    if (head < 0 || prev < 0 || ooo < 0)
+        return TS_E_WAL_APPEND_FAIL;
+
+    int committed = head && prev && ooo;
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    for (size_t i = 0; i < ts->sealed_nr; ++i) {
+        ts_chunk_t *chunks[3];
+        size_t nr = ts_sealed_chunks(
+            &ts->sealed[(ts->sealed_head + i) % TS_MAX_SEALED], chunks);
+        for (size_t j = 0; j < nr; ++j) {
+            wal_t *wal = &chunks[j]->wal;
+            if (!wal_is_open(wal))
+                continue;
+            int err = wal_commit(wal, &ts->opts.wal_policy, force);
+            if (err < 0)
+                committed = TS_E_WAL_APPEND_FAIL;
+            else if (err == 0 && committed > 0)
+                committed = 0;
+        }
+    }
+    pthread_mutex_unlock(&ts->sealed_lock);
+
+    return committed;
+}
+
+static inline int64_t min_timeout(int64_t a, int64_t b)
+{
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+
+    return a < b ? a : b;
+}
+
+/*
+ * Milliseconds before the WAL policy commits the pending points of the
+ * series, -1 if there's nothing pending.
+ */
+int64_t ts_commit_timeout(const timeseries_t *ts)
+{
+    int64_t timeout = min_timeout(
+        wal_commit_timeout(&ts->head->wal, &ts->opts.wal_policy),
+        wal_commit_timeout(&ts->prev->wal, &ts->opts.wal_policy));
+    timeout = min_timeout(
+        timeout, wal_commit_timeout(&ts->ooo->wal, &ts->opts.wal_policy));
+
+    pthread_mutex_lock((pthread_mutex_t *)&ts->sealed_lock);
+    for (size_t i = 0; i < ts->sealed_nr; ++i) {
+        ts_chunk_t *chunks[3];
+        size_t nr = ts_sealed_chunks(
+            &ts->sealed[(ts->sealed_head + i) % TS_MAX_SEALED], chunks);
+        for (size_t j = 0; j < nr; ++j)
+            if (wal_is_open(&chunks[j]->wal))
+                timeout = min_timeout(
+                    timeout, wal_commit_timeout(&chunks[j]->wal,
+                                                &ts->opts.wal_policy));
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&ts->sealed_lock);
+
+    return timeout;
+}
+
+#define TS_MEMORY_CHUNKS (TS_MAX_SEALED * 2 + 2)
+
+/*
+ * Queries hold the series lock while reading the partitions and the sealed
+ * chunks, keeping the flusher from moving points from the ones to the others
+ * in the meantime.
+ */
+static inline void ts_lock(const timeseries_t *ts)
+{
+    pthread_mutex_lock((pthread_mutex_t *)&ts->lock);
+}
+
+static inline void ts_unlock(const timeseries_t *ts)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)&ts->lock);
+}
+
+/*
+ * Collect the in-memory chunks holding some points, the sealed ones still to
+ * be flushed and the prev and head, sorted by their first timestamp.
+ *
+ * Remarks
+ *
+ * - Expects the series lock to be held
+ */
+static size_t ts_memory_chunks(const timeseries_t *ts,
+                               const ts_chunk_t *chunks[TS_MEMORY_CHUNKS])
+{
+    size_t nr = 0;
+
+    pthread_mutex_lock((pthread_mutex_t *)&ts->sealed_lock);
+    for (size_t i = 0; i < ts->sealed_nr; ++i) {
+        const ts_sealed_t *s =
+            &ts->sealed[(ts->sealed_head + i) % TS_MAX_SEALED];
+        for (size_t j = 0; j < s->nr; ++j)
+            chunks[nr++] = s->chunks[j];
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&ts->sealed_lock);
+
+    chunks[nr++] = ts->prev;
+    chunks[nr++] = ts->head;
+
+    size_t n = 0;
+    for (size_t i = 0; i < nr; ++i) {
+        if (chunks[i]->length == 0)
+            continue;
+        const ts_chunk_t *tc = chunks[i];
+        size_t j             = n++;
+        for (; j > 0 && chunks[j - 1]->start_ts > tc->start_ts; --j)
+            chunks[j] = chunks[j - 1];
+        chunks[j] = tc;
+    }
+
+    return n;
+}
+
+#define TS_LATE_BUFFERS (TS_MAX_SEALED + 1)
+
+/*
+ * Collect the out of order buffers holding some late points, the sealed ones
+ * still to be flushed, oldest first, and the live one last.
+ */
+static size_t ts_late_buffers(const timeseries_t *ts,
+                              const ts_chunk_t *buffers[TS_LATE_BUFFERS])
+{
+    size_t nr = 0;
+
+    pthread_mutex_lock((pthread_mutex_t *)&ts->sealed_lock);
+    for (size_t i = 0; i < ts->sealed_nr; ++i) {
+        const ts_sealed_t *s =
+            &ts->sealed[(ts->sealed_head + i) % TS_MAX_SEALED];
+        if (s->ooo && s->ooo->length > 0)
+            buffers[nr++] = s->ooo;
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&ts->sealed_lock);
+
+    if (ts->ooo->length > 0)
+        buffers[nr++] = ts->ooo;
+
+    return nr;
+}
+
+/*
+ * Look for a late point, the buffers are scanned from the most recent write
+ * back, so a point inserted again wins over the former one.
+ */
+static int ts_late_find(const timeseries_t *ts, uint64_t timestamp,
+                        record_t *r)
+{
+    const ts_chunk_t *buffers[TS_LATE_BUFFERS];
+    size_t nr = ts_late_buffers(ts, buffers);
+
+    while (nr-- > 0) {
+        const ts_chunk_t *tc = buffers[nr];
+        if (timestamp < tc->start_ts || timestamp > tc->end_ts)
+            continue;
+        for (size_t i = tc->length; i-- > 0;) {
+            if (tc->timestamps[i] == timestamp) {
+                *r = ts_chunk_record(tc, i);
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static int ts_search_index(const ts_chunk_t *tc, uint64_t sec,
+                           uint64_t timestamp, record_t *dst)
+{
+    if (tc->base_offset > sec)
+        return 1;
+
+    if (sec - tc->base_offset > TS_CHUNK_SIZE)
+        return -1;
+
+    size_t i = ts_chunk_bound(tc, timestamp, 0);
+    if (i == tc->length || tc->timestamps[i] != timestamp)
+        return 1;
+
+    *dst = ts_chunk_record(tc, i);
+
+    return 0;
+}
+
+/*
+ * Finds a record in a timeseries data structure.
+ *
+ * This function searches for a record with the specified timestamp in the
+ * given timeseries data structure. It first checks the in-memory chunks
+ * (head and previous) and then looks for the record on disk if not found
+ * in memory.
+ *
+ * @param ts A pointer to the timeseries_t structure representing the
+ * timeseries.
+ * @param timestamp The timestamp of the record to be found, specified in
+ * nanoseconds since the Unix epoch.
+ * @param r A pointer to a Record structure where the found record will be
+ * stored.
+ * @return 0 if the record is found and successfully stored in 'r', -1 if an
+ * error occurs, or a negative value indicating the result of the search:
+ *         - 1 if the record is found in memory.
+ *         - 0 if the record is not found in memory but found on disk.
+ *         - Negative value if an error occurs during the search.
+ */
+static int ts_find_locked(const timeseries_t *ts, uint64_t timestamp,
+                          record_t *r)
+{
+    uint64_t sec = timestamp / (uint64_t)1e9;
+    int err      = 0;
+
+    if (timestamp < ts_retention_cutoff(ts))
+        return -1;
+
+    // Late points first, they're the most recent writes
+    if (ts_late_find(ts, timestamp, r) == 0)
+        return 0;
+
+    // Then check the current chunk
+    if (ts->head->base_offset > 0 && ts->head->base_offset <= sec) {
+        err = ts_search_index(ts->head, sec, timestamp, r);
+        if (err <= 0)
+            return err;
+    }
+    // Then check the OOO chunk
+    if (err != 1 && ts->prev->base_offset > 0) {
+        err = ts_search_index(ts->prev, sec, timestamp, r);
+        if (err <= 0)
+            return err;
+    }
+
+    // Then the chunks sealed and not yet flushed
+    const ts_chunk_t *chunks[TS_MEMORY_CHUNKS];
+    size_t nr = ts_memory_chunks(ts, chunks);
+    for (size_t i = 0; i < nr; ++i) {
+        if (chunks[i]->base_offset <= sec &&
+            ts_search_index(chunks[i], sec, timestamp, r) == 0)
+            return 0;
+    }
+
+    // Look for the record on disk, in the last partition starting before it
+    const partition_t *partition =
+        partition_catalog_find(&ts->partitions, timestamp);
+    if (!partition || partition->end_ts < timestamp)
+        return -1;
+
+    // Fetch single record from the partition
+    err = partition_find(partition, r, timestamp);
+    if (err < 0)
+        return -1;
+
+    return 0;
+}
+
+int ts_find(const timeseries_t *ts, uint64_t timestamp, record_t *r)
+{
+    ts_lock(ts);
+    int err = ts_find_locked(ts, timestamp, r);
+    ts_unlock(ts);
+
+    return err;
+}
+
+/*
+ * Late points of a range, sorted in columns allocated from the arena, the
+ * ones before pos have already been merged into the walk.
+ */
+typedef struct late_points {
+    arena_t *arena;
+    uint64_t *timestamps;
+    double_t *values;
+    size_t length;
+    size_t pos;
+} late_points_t;
+
+/*
+ * Walk over the points of a time range, partitions are decoded into the
+ * records array, while in-memory chunks are handed over as slices of their
+ * columns, so they can be scanned linearly without any copy.
+ *
+ * - on_records is called with the records decoded from each partition block,
+ *   which are then dropped from the array, if not set they're just left in it
+ * - on_columns is called with the slices of the chunks in the range
+ * - on_summary, if set, is offered the summary of each partition block wholly
+ *   in the range, it returns 1 if it took it in, 0 to have the block decoded
+ *   and handed over to on_records instead
+ *
+ * Late points are merged on the fly, each source handed over carries the ones
+ * not greater than its last point, which are then copied along with it. A
+ * block with late points among its own is always decoded.
+ *
+ * The sources can be restricted to the partitions, or to the points still in
+ * memory, late ones included, the two sets being disjoint.
+ */
+typedef enum walk_sources {
+    WALK_ALL,
+    WALK_PARTITIONS,
+    WALK_MEMORY
+} walk_sources_t;
+
+typedef struct range_walk {
+    walk_sources_t sources;
+    late_points_t *late;
+    record_array_t *records;
+    int (*on_records)(const record_t *r, size_t n, void *userdata);
+    int (*on_columns)(const uint64_t *timestamps, const double_t *values,
+                      size_t n, void *userdata);
+    int (*on_summary)(const index_summary_t *s, void *userdata);
+    void *userdata;
+} range_walk_t;
+
+static int append_columns(const uint64_t *timestamps, const double_t *values,
+                          size_t n, void *userdata)
+{
+    record_array_t *out = userdata;
+    record_t record     = {.is_set = 1};
+
+    for (size_t i = 0; i < n; ++i) {
+        record.timestamp  = timestamps[i];
+        record.value      = values[i];
+        record.tv.tv_sec  = timestamps[i] / (uint64_t)1e9;
+        record.tv.tv_nsec = timestamps[i] % (uint64_t)1e9;
+        da_append_in(out, out->arena, record);
+    }
+
+    return 0;
+}
+
+/*
+ * Collect the late points in the [t0, t1] range from the out of order
+ * buffers, counted first and copied then, to be sorted once.
+ */
+static int ts_late_collect(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                           late_points_t *late)
+{
+    const ts_chunk_t *buffers[TS_LATE_BUFFERS];
+    size_t nr = ts_late_buffers(ts, buffers);
+    size_t n  = 0;
+
+    for (size_t i = 0; i < nr; ++i) {
+        const ts_chunk_t *tc = buffers[i];
+        if (tc->end_ts < t0 || tc->start_ts > t1)
+            continue;
+        for (size_t j = 0; j < tc->length; ++j)
+            n += tc->timestamps[j] >= t0 && tc->timestamps[j] <= t1;
+    }
+
+    if (n == 0)
+        return 0;
+
+    late->timestamps = arena_alloc(late->arena, n * sizeof(*late->timestamps));
+    late->values     = arena_alloc(late->arena, n * sizeof(*late->values));
+    if (!late->timestamps || !late->values)
+        return TS_E_OOM;
+
+    for (size_t i = 0; i < nr; ++i) {
+        const ts_chunk_t *tc = buffers[i];
+        if (tc->end_ts < t0 || tc->start_ts > t1)
+            continue;
+        for (size_t j = 0; j < tc->length; ++j) {
+            if (tc->timestamps[j] < t0 || tc->timestamps[j] > t1)
+                continue;
+            late->timestamps[late->length] = tc->timestamps[j];
+            late->values[late->length++]   = tc->values[j];
+        }
+    }
+
+    return columns_sort(late->timestamps, late->values, late->length,
+                        late->arena);
+}
+
+// Number of late points still to merge not greater than ts
+static inline size_t late_pending(const late_points_t *late, uint64_t ts)
+{
+    if (!late)
+        return 0;
+
+    return columns_bound(late->timestamps + late->pos,
+                         late->length - late->pos, ts, 1);
+}
+
+/*
+ * Hand a slice of sorted columns over to the walk, merged with the pending
+ * late points not greater than its last one, if any.
+ */
+static int ts_columns_walk(const uint64_t *timestamps, const double_t *values,
+                           size_t n, const range_walk_t *w)
+{
+    late_points_t *late = w->late;
+    size_t m            = late_pending(late, timestamps[n - 1]);
+
+    if (m == 0)
+        return w->on_columns(timestamps, values, n, w->userdata);
+
+    uint64_t *merged_ts =
+        arena_alloc(late->arena, (n + m) * sizeof(*merged_ts));
+    double_t *merged_vs =
+        arena_alloc(late->arena, (n + m) * sizeof(*merged_vs));
+    if (!merged_ts || !merged_vs)
+        return TS_E_OOM;
+
+    columns_merge(timestamps, values, n, late->timestamps + late->pos,
+                  late->values + late->pos, m, merged_ts, merged_vs);
+    late->pos += m;
+
+    return w->on_columns(merged_ts, merged_vs, n + m, w->userdata);
+}
+
+/*
+ * Merge the pending late points not greater than the last record decoded
+ * from a partition, the records from `from` on, in place.
+ */
+static int ts_records_merge_late(record_array_t *records, size_t from,
+                                 late_points_t *late)
+{
+    size_t n = records->length - from;
+    if (n == 0)
+        return 0;
+
+    size_t m =
+        late_pending(late, records->items[records->length - 1].timestamp);
+    if (m == 0)
+        return 0;
+
+    record_t *decoded = arena_alloc(late->arena, n * sizeof(*decoded));
+    if (!decoded)
+        return TS_E_OOM;
+
+    memcpy(decoded, records->items + from, n * sizeof(*decoded));
+    records->length            = from;
+
+    const uint64_t *timestamps = late->timestamps + late->pos;
+    const double_t *values     = late->values + late->pos;
+    size_t i = 0, j = 0;
+
+    while (i < n || j < m) {
+        if (j == m || (i < n && decoded[i].timestamp <= timestamps[j])) {
+            da_append_in(records, records->arena, decoded[i]);
+            i++;
+        } else {
+            append_columns(timestamps + j, values + j, 1, records);
+            j++;
+        }
+    }
+
+    late->pos += m;
+
+    return 0;
+}
+
+static int ts_chunk_walk(const ts_chunk_t *tc, uint64_t t0, uint64_t t1,
+                         const range_walk_t *w)
+{
+    size_t lo = ts_chunk_bound(tc, t0, 0);
+    size_t hi = ts_chunk_bound(tc, t1, 1);
+
+    if (hi <= lo)
+        return 0;
+
+    return ts_columns_walk(tc->timestamps + lo, tc->values + lo, hi - lo, w);
+}
+
+/*
+ * Hand the records decoded from a partition, from `from` on, over to the
+ * walk, with the pending late points merged in.
+ */
+static int ts_records_walk(size_t from, const range_walk_t *w)
+{
+    if (ts_records_merge_late(w->records, from, w->late) < 0)
+        return TS_E_OOM;
+
+    if (!w->on_records)
+        return 0;
+
+    int err = w->on_records(w->records->items + from,
+                            w->records->length - from, w->userdata);
+    w->records->length = from;
+
+    return err;
+}
+
+/*
+ * Try to answer a block from its summary, the late points preceding it are
+ * handed over first, those among its points require it to be decoded.
+ * Returns 1 if the summary was taken in.
+ */
+static int ts_summary_walk(const index_summary_t *s, const range_walk_t *w)
+{
+    late_points_t *late = w->late;
+    size_t before       = late_pending(late, s->first_ts - 1);
+
+    if (late_pending(late, s->last_ts) > before)
+        return 0;
+
+    if (before > 0) {
+        int err = w->on_columns(late->timestamps + late->pos,
+                                late->values + late->pos, before, w->userdata);
+        late->pos += before;
+        if (err != 0)
+            return err;
+    }
+
+    return w->on_summary(s, w->userdata);
+}
+
+/*
+ * Walk a partition block by block, so that the memory used by a walk handing
+ * the records over is bounded by the size of a block. Blocks wholly in the
+ * range are answered from their summary when possible, the others decoded.
+ */
+static int ts_partition_walk(const partition_t *partition, uint64_t start,
+                             uint64_t end, const range_walk_t *w)
+{
+    size_t first = 0;
+    size_t last  = partition_blocks(partition, start, end, &first);
+    int err      = 0;
+
+    for (size_t i = first; i < last; ++i) {
+        const index_summary_t *s = partition_block_summary(partition, i);
+        if (w->on_summary && s && s->first_ts >= start && s->last_ts <= end) {
+            err = ts_summary_walk(s, w);
+            if (err < 0)
+                return err;
+            if (err == 1)
+                continue;
+        }
+
+        size_t from = w->records->length;
+        if (partition_block_decode(partition, i, start, end, w->records) < 0)
+            return -1;
+
+        if ((err = ts_records_walk(from, w)) != 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/**
+ * Check if the requested range is within the head chunk.
+ *
+ * @param ts Pointer to the timeseries.
+ * @param sec0 Seconds part of the start timestamp.
+ * @param start Start timestamp in nanoseconds.
+ * @return true if range is in head chunk, false otherwise.
+ */
+static inline bool is_range_in_head_chunk(const timeseries_t *ts, uint64_t sec0,
+                                          uint64_t start)
+{
+    return (ts->head->base_offset > 0 && ts->head->base_offset <= sec0 &&
+            ts->head->start_ts <= start &&
+            sec0 - ts->head->base_offset <= TS_CHUNK_SIZE);
+}
+
+/**
+ * Check if the requested range is within the prev chunk.
+ *
+ * @param ts Pointer to the timeseries.
+ * @param sec0 Seconds part of the start timestamp.
+ * @param end End timestamp in nanoseconds.
+ * @return true if range is in prev chunk, false otherwise.
+ */
+static inline bool is_range_in_prev_chunk(const timeseries_t *ts, uint64_t sec0,
+                                          uint64_t end)
+{
+    return (ts->prev->base_offset > 0 && ts->prev->base_offset <= sec0 &&
+            ts->prev->start_ts <= end &&
+            sec0 - ts->prev->base_offset <= TS_CHUNK_SIZE);
+}
+
+/*
+ * Walk the sources holding the points in the [start, end] range, in time
+ * order: the partitions on disk, then the in-memory chunks, sealed ones
+ * included.
+ */
+static int ts_range_walk_sources(const timeseries_t *ts, uint64_t start,
+                                 uint64_t end, const range_walk_t *w)
+{
+    uint64_t sec0 = start / (uint64_t)1e9;
+    int ret       = 0;
+
+    if (w->sources != WALK_PARTITIONS) {
+        // Check if the range falls in the head chunk
+        if (is_range_in_head_chunk(ts, sec0, start))
+            return ts_chunk_walk(ts->head, start, end, w);
+
+        // Check if the range falls in the prev chunk
+        if (is_range_in_prev_chunk(ts, sec0, end))
+            return ts_chunk_walk(ts->prev, start, end, w);
+    }
+
+    // Search in the persistence
+    const partition_catalog_t *pc = &ts->partitions;
+    size_t partition_i            = partition_catalog_first(pc, start);
+    uint64_t current_start        = start;
+
+    if (w->sources == WALK_MEMORY)
+        partition_i = pc->length;
+
+    // Fetch records from partitions within the time range
+    while (partition_i < pc->length &&
+           pc->items[partition_i]->start_ts <= end) {
+        const partition_t *curr_p = pc->items[partition_i];
+        uint64_t part_end = (curr_p->end_ts > end) ? end : curr_p->end_ts;
+
+        if ((ret = ts_partition_walk(curr_p, current_start, part_end, w)) != 0)
+            return ret;
+
+        // Update the search start to continue after this partition
+        current_start = curr_p->end_ts + 1;
+        partition_i++;
+
+        // If we've reached the end of our range, we're done
+        if (part_end == end)
+            return 0;
+    }
+
+    if (w->sources == WALK_PARTITIONS)
+        return 0;
+
+    // If we get here, we need to check the in-memory chunks for any remaining
+    // range
+    const ts_chunk_t *chunks[TS_MEMORY_CHUNKS];
+    size_t nr = ts_memory_chunks(ts, chunks);
+
+    for (size_t i = 0; i < nr && current_start <= end; ++i) {
+        const ts_chunk_t *tc = chunks[i];
+        if (tc->end_ts < current_start || tc->start_ts > end)
+            continue;
+
+        ret = ts_chunk_walk(tc, current_start, end, w);
+        if (ret != 0)
+            return ret;
+
+        // Move start past the chunk
+        current_start = tc->end_ts + 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Walk the [start, end] range with the late points merged in, those left
+ * after every source are past all of them. Points past the retention are
+ * left out, a callback returning a positive value stops the walk.
+ */
+static int ts_range_walk_locked(const timeseries_t *ts, uint64_t start,
+                                uint64_t end, const range_walk_t *w)
+{
+    uint64_t cutoff = ts_retention_cutoff(ts);
+    if (start < cutoff)
+        start = cutoff;
+
+    if (start > end)
+        return 0;
+
+    late_points_t late = {.arena = arena_scratch_acquire()};
+    range_walk_t lw    = *w;
+
+    int err            = 0;
+    if (w->sources != WALK_PARTITIONS)
+        err = ts_late_collect(ts, start, end, &late);
+    if (err < 0)
+        goto exit;
+
+    lw.late = late.length > 0 ? &late : NULL;
+
+    err     = ts_range_walk_sources(ts, start, end, &lw);
+    if (err == 0 && late.pos < late.length)
+        err = w->on_columns(late.timestamps + late.pos, late.values + late.pos,
+                            late.length - late.pos, w->userdata);
+
+exit:
+    arena_scratch_release();
+    return err;
+}
+
+static int ts_range_walk(const timeseries_t *ts, uint64_t start, uint64_t end,
+                         const range_walk_t *w)
+{
+    ts_lock(ts);
+    int err = ts_range_walk_locked(ts, start, end, w);
+    ts_unlock(ts);
+
+    return err;
+}
+
+/**
+ * Retrieve records from a timeseries within a specified time range.
+ *
+ * This function fetches all records with timestamps between start and end
+ * from the given timeseries and stores them in the provided output array.
+ *
+ * @param ts A pointer to the timeseries to query.
+ * @param start The start timestamp of the range, in nanoseconds.
+ * @param end The end timestamp of the range, in nanoseconds.
+ * @param out Pointer to a record_array_t to store the results.
+ * @return 0 on success, error code on failure.
+ */
+int ts_range(const timeseries_t *ts, uint64_t start, uint64_t end,
+             record_array_t *out)
+{
+    if (!ts || !out)
+        return TS_E_NULL_POINTER;
+
+    if (start > end) {
+        return TS_E_INVALID_RANGE;
+    }
+
+    // Partitions are decoded straight into the output
+    range_walk_t w = {
+        .records = out, .on_columns = append_columns, .userdata = out};
+
+    return ts_range_walk(ts, start, end, &w);
+}
+
+int ts_scan(const timeseries_t *ts, record_array_t *out,
+            ts_scan_filter_t filter, void *userdata)
+{
+    if (!ts || !out)
+        return TS_E_NULL_POINTER;
+
+    // Records are collected in a scratch array only if they need to be
+    // filtered, otherwise they are handed over to the caller
+    record_array_t ra = {0};
+    if (filter && userdata)
+        ra.arena = arena_scratch_acquire();
+
+    // The whole series, oldest partition first, then the in-memory chunks
+    range_walk_t w = {
+        .records = &ra, .on_columns = append_columns, .userdata = &ra};
+
+    if (ts_range_walk(ts, 0, UINT64_MAX, &w) < 0) {
+        if (ra.arena)
+            arena_scratch_release();
+        return -1;
+    }
+
+    if (filter && userdata) {
+        for (size_t i = 0; i < ra.length; ++i) {
+            if (filter(&ra.items[i], userdata) == 0)
+                da_append(out, ra.items[i]);
+        }
+        arena_scratch_release();
+    } else {
+        *out = ra;
+    }
+
+    return 0;
+}
+
+static const size_t STREAM_BATCH_SIZE = 1000;
+
+/*
+ * Batch being filled by a cursor walk, the first points at the cursor
+ * position are skipped if already returned, the walk stops once the batch
+ * is full.
+ */
+typedef struct cursor_batch {
+    record_t *items;
+    size_t length;
+    size_t max;
+    uint64_t from;
+    size_t skip;
+    size_t same;
+} cursor_batch_t;
+
+static int cursor_take(cursor_batch_t *b, uint64_t timestamp, double_t value)
+{
+    if (b->skip > 0 && timestamp == b->from) {
+        b->skip--;
+        return 0;
+    }
+
+    if (b->length > 0 && b->items[b->length - 1].timestamp == timestamp)
+        b->same++;
+    else
+        b->same = 1;
+
+    b->items[b->length++] = (record_t){
+        .value     = value,
+        .timestamp = timestamp,
+        .tv        = (struct timespec){.tv_sec  = timestamp / (uint64_t)1e9,
+                                       .tv_nsec = timestamp % (uint64_t)1e9},
+        .is_set    = 1,
+    };
+
+    return b->length == b->max;
+}
+
+static int cursor_records(const record_t *r, size_t n, void *userdata)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (cursor_take(userdata, r[i].timestamp, r[i].value))
+            return 1;
+    return 0;
+}
+
+static int cursor_columns(const uint64_t *timestamps, const double_t *values,
+                          size_t n, void *userdata)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (cursor_take(userdata, timestamps[i], values[i]))
+            return 1;
+    return 0;
+}
+
+ts_cursor_t *ts_cursor_open(const timeseries_t *ts, uint64_t t0, uint64_t t1)
+{
+    if (!ts || t0 > t1)
+        return NULL;
+
+    ts_cursor_t *cursor = calloc(1, sizeof(*cursor));
+    if (!cursor)
+        return NULL;
+
+    cursor->ts   = ts;
+    cursor->next = t0;
+    cursor->end  = t1;
+
+    return cursor;
+}
+
+/*
+ * Fill the batch with up to max points, resuming the walk from the cursor
+ * position. Each call walks under the series lock just for the points it
+ * returns, decoding at most a block past them. Returns the number of points
+ * in the batch, 0 once the range is exhausted.
+ */
+ssize_t ts_cursor_next(ts_cursor_t *cursor, record_t *batch, size_t max)
+{
+    if (!cursor || !batch || max == 0)
+        return TS_E_NULL_POINTER;
+
+    if (cursor->done)
+        return 0;
+
+    record_array_t records = {.arena = arena_scratch_acquire()};
+    cursor_batch_t b       = {.items = batch,
+                              .max   = max,
+                              .from  = cursor->next,
+                              .skip  = cursor->skip};
+    range_walk_t w         = {.records    = &records,
+                              .on_records = cursor_records,
+                              .on_columns = cursor_columns,
+                              .userdata   = &b};
+
+    int err = ts_range_walk(cursor->ts, cursor->next, cursor->end, &w);
+    arena_scratch_release();
+
+    if (err < 0)
+        return err;
+
+    // Stopped short of the end only if the batch is full
+    cursor->done = err == 0;
+
+    if (b.length > 0) {
+        uint64_t last = batch[b.length - 1].timestamp;
+        cursor->skip  = last == cursor->next ? cursor->skip + b.same : b.same;
+        cursor->next  = last;
+    }
+
+    return b.length;
+}
+
+void ts_cursor_close(ts_cursor_t *cursor) { free(cursor); }
+
+/**
+ * Retrieves all the timespace from the paritions and both the head and prev
+ * in-memory records, late points merged in. It accepts a callback function to
+ * process the records in batches so to avoid clogging the memory by
+ * restricting the number of records for each iteration.
+ */
+int ts_stream(const timeseries_t *ts, ts_stream_callback_t callback,
+              void *userdata)
+{
+
+    if (!ts || !callback)
+        return TS_E_NULL_POINTER;
+
+    ts_cursor_t *cursor = ts_cursor_open(ts, 0, UINT64_MAX);
+    record_t *batch     = malloc(STREAM_BATCH_SIZE * sizeof(*batch));
+    int ret             = -1;
+
+    if (!cursor || !batch)
+        goto exit;
+
+    record_array_t ra = {.items = batch, .capacity = STREAM_BATCH_SIZE};
+    ssize_t n         = 0;
+
+    while ((n = ts_cursor_next(cursor, batch, STREAM_BATCH_SIZE)) > 0) {
+        ra.length = n;
+        if (callback(&ra, userdata) != 0)
+            goto exit;
+    }
+
+    ret = n < 0 ? -1 : 0;
+
+exit:
+    ts_cursor_close(cursor);
+    free(batch);
+
+    return ret;
+}
+
+static int first_records(const record_t *r, size_t n, void *userdata)
+{
+    if (n == 0)
+        return 0;
+
+    *(record_t *)userdata = r[0];
+
+    return 1;
+}
+
+static int first_columns(const uint64_t *timestamps, const double_t *values,
+                         size_t n, void *userdata)
+{
+    if (n == 0)
+        return 0;
+
+    record_t *r   = userdata;
+    r->timestamp  = timestamps[0];
+    r->value      = values[0];
+    r->tv.tv_sec  = timestamps[0] / (uint64_t)1e9;
+    r->tv.tv_nsec = timestamps[0] % (uint64_t)1e9;
+    r->is_set     = 1;
+
+    return 1;
+}
+
+/*
+ * First point still within the retention, the walk stops at the first one
+ * found.
+ */
+static int ts_first_retained(const timeseries_t *ts, uint64_t cutoff,
+                             record_t *r)
+{
+    record_array_t records = {.arena = arena_scratch_acquire()};
+    record_t first         = {0};
+    range_walk_t w         = {.records    = &records,
+                              .on_records = first_records,
+                              .on_columns = first_columns,
+                              .userdata   = &first};
+
+    int err                = ts_range_walk_locked(ts, cutoff, UINT64_MAX, &w);
+    arena_scratch_release();
+
+    if (err <= 0)
+        return -1;
+
+    *r = first;
+
+    return 0;
+}
+
+static inline void ts_record_time(record_t *r)
+{
+    r->tv.tv_sec  = r->timestamp / (uint64_t)1e9;
+    r->tv.tv_nsec = r->timestamp % (uint64_t)1e9;
+}
+
+/*
+ * The earliest point is answered from the cache, unless retention expired
+ * it, in which case the first one retained is looked up.
+ */
+int ts_first(const timeseries_t *ts, record_t *r)
+{
+    if (!ts || !r)
+        return -1;
+
+    ts_lock(ts);
+
+    int err         = -1;
+    uint64_t cutoff = ts_retention_cutoff(ts);
+
+    if (ts->first.is_set && ts->first.timestamp >= cutoff) {
+        *r = ts->first;
+        ts_record_time(r);
+        err = 0;
+    } else if (ts->first.is_set) {
+        err = ts_first_retained(ts, cutoff, r);
+    }
+
+    ts_unlock(ts);
+
+    return err;
+}
+
+int ts_last(const timeseries_t *ts, record_t *r)
+{
+    if (!ts || !r)
+        return -1;
+
+    ts_lock(ts);
+
+    // Nothing left within the retention
+    int err = ts->last.is_set && ts->last.timestamp >= ts_retention_cutoff(ts)
+                  ? 0
+                  : -1;
+    if (err == 0) {
+        *r = ts->last;
+        ts_record_time(r);
+    }
+
+    ts_unlock(ts);
+
+    return err;
+}
+
+/*
+ * Running extreme of a range, the first point holding the minimum (or the
+ * maximum) value wins.
+ */
+typedef struct extreme {
+    record_t record;
+    int found;
+    int max;
+} extreme_t;
+
+static inline void extreme_update(extreme_t *e, uint64_t timestamp,
+                                  double_t value)
+{
+    if (e->found &&
+        (e->max ? value <= e->record.value : value >= e->record.value))
+        return;
+
+    e->record = (record_t){
+        .value     = value,
+        .timestamp = timestamp,
+        .tv        = (struct timespec){.tv_sec  = timestamp / (uint64_t)1e9,
+                                       .tv_nsec = timestamp % (uint64_t)1e9},
+        .is_set    = 1,
+    };
+    e->found = 1;
+}
+
+static int extreme_records(const record_t *r, size_t n, void *userdata)
+{
+    for (size_t i = 0; i < n; ++i)
+        extreme_update(userdata, r[i].timestamp, r[i].value);
+    return 0;
+}
+
+static int extreme_columns(const uint64_t *timestamps, const double_t *values,
+                           size_t n, void *userdata)
+{
+    const extreme_t *e = userdata;
+
+    if (n == 0)
+        return 0;
+
+    size_t i = e->max ? agg_argmax(values, n) : agg_argmin(values, n);
+    extreme_update(userdata, timestamps[i], values[i]);
+
+    return 0;
+}
+
+static int extreme_summary(const index_summary_t *s, void *userdata)
+{
+    const extreme_t *e = userdata;
+
+    if (e->max)
+        extreme_update(userdata, s->max_ts, s->max);
+    else
+        extreme_update(userdata, s->min_ts, s->min);
+
+    return 1;
+}
+
+static int ts_extreme(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                      int max, record_t *r)
+{
+    if (!ts)
+        return -1;
+
+    if (t0 > t1)
+        return -1;
+
+    record_array_t records = {.arena = arena_scratch_acquire()};
+    extreme_t e            = {.max = max};
+    range_walk_t w         = {.records    = &records,
+                              .on_records = extreme_records,
+                              .on_columns = extreme_columns,
+                              .on_summary = extreme_summary,
+                              .userdata   = &e};
+
+    int err                = ts_range_walk(ts, t0, t1, &w);
+    arena_scratch_release();
+
+    if (err < 0 || !e.found)
         return -1;
 
-    // We got a match
-    ts_record_read(r, buf);
+    *r = e.record;
 
     return 0;
 }
 
-static void ts_chunk_range(const ts_chunk_t *tc, uint64_t t0, uint64_t t1,
-                           record_array_t *out)
+int ts_min(const timeseries_t *ts, uint64_t t0, uint64_t t1, record_t *r)
 {
-    uint64_t sec0 = t0 / (uint64_t)1e9;
-    uint64_t sec1 = t1 / (uint64_t)1e9;
-    ssize_t low, high, idx_low = 0, idx_high = 0;
-    // Find the low
-    low             = sec0 - tc->base_offset;
-    record_t target = {.timestamp = t0};
-
-    if (tc->points[low].length < LINEAR_THRESHOLD)
-        da_search(&tc->points[low], &target, record_cmp, &idx_low);
-    else
-        da_bsearch(&tc->points[low], &target, record_cmp, &idx_low);
-
-    // Find the high
-    // TODO let it crash on edge cases for now (can this happen now?)
-    high             = sec1 - tc->base_offset;
-    target.timestamp = t1;
-
-    if (high >= TS_CHUNK_SIZE)
-        high = TS_CHUNK_SIZE - 1;
+    return ts_extreme(ts, t0, t1, 0, r);
+}
 
-    if (tc->points[high].length < LINEAR_THRESHOLD)
-        da_search(&tc->points[high], &target, record_cmp, &idx_high);
-    else
-        da_bsearch(&tc->points[high], &target, record_cmp, &idx_high);
+int ts_max(const timeseries_t *ts, uint64_t t0, uint64_t t1, record_t *r)
+{
+    return ts_extreme(ts, t0, t1, 1, r);
+}
 
-    // Collect the records
-    for (size_t i = low; i < high + 1; ++i) {
+/*
+ * Running state of an average sampling, each bucket spans the open interval
+ * (end - interval, end) and it's labelled with its end, points come in time
+ * order so a bucket is complete as soon as a point falls past it.
+ */
+typedef struct avg_sample {
+    uint64_t t0;
+    uint64_t t1;
+    uint64_t interval;
+    uint64_t current;
+    double_t sum;
+    size_t total;
+    record_array_t *out;
+} avg_sample_t;
+
+static void avg_sample_emit(avg_sample_t *s)
+{
+    if (s->total == 0)
+        return;
 
-        size_t end = i == high ? idx_high : tc->points[i].length;
+    record_t result = {.timestamp = s->current,
+                       .value     = s->sum / (double_t)s->total};
+    da_append(s->out, result);
 
-        for (size_t j = idx_low; j < end + 1; ++j) {
-            if (tc->points[i].length == 0)
-                continue;
-            record_t r = da_get(tc->points[i], j);
-            if (r.is_set == 1)
-                da_append(out, r);
-        }
-        idx_low = 0;
-    }
+    s->sum   = 0.0;
+    s->total = 0;
 }
 
-// Helper function to fetch records from a partition within a given time range
-static int fetch_records_from_partition(const partition_t *partition,
-                                        uint64_t start, uint64_t end,
-                                        record_array_t *out)
+static inline void avg_sample_add(avg_sample_t *s, uint64_t end, double_t sum,
+                                  size_t count)
 {
-    // TODO malloc
-    uint8_t buf[4096];
-    uint8_t *ptr      = &buf[0];
-    size_t record_len = 0;
-    int n             = partition_range(partition, ptr, start, end);
-    if (n < 0)
-        return -1;
+    if (end >= s->t1)
+        return;
 
-    while (n > 0) {
-        record_t record;
-        record_len = ts_record_read(&record, ptr);
-        da_append(out, record);
-        ptr += record_len;
-        n -= record_len;
-        start = record.timestamp;
+    if (end != s->current) {
+        avg_sample_emit(s);
+        s->current = end;
     }
-    return 0;
+
+    s->sum += sum;
+    s->total += count;
 }
 
-/**
- * Check if the requested range is within the head chunk.
- *
- * @param ts Pointer to the timeseries.
- * @param sec0 Seconds part of the start timestamp.
- * @param start Start timestamp in nanoseconds.
- * @return true if range is in head chunk, false otherwise.
- */
-static inline bool is_range_in_head_chunk(const timeseries_t *ts, uint64_t sec0,
-                                          uint64_t start)
+static inline void avg_sample_update(avg_sample_t *s, uint64_t timestamp,
+                                     double_t value)
 {
-    return (ts->head->base_offset > 0 && ts->head->base_offset <= sec0 &&
-            ts->head->start_ts <= start &&
-            sec0 - ts->head->base_offset <= TS_CHUNK_SIZE);
+    // Points on the bucket boundaries are not part of any bucket
+    if (timestamp <= s->t0 || (timestamp - s->t0) % s->interval == 0)
+        return;
+
+    uint64_t end = s->t0 + ((timestamp - s->t0) / s->interval + 1) * s->interval;
+    avg_sample_add(s, end, value, 1);
 }
 
-/**
- * Check if the requested range is within the prev chunk.
- *
- * @param ts Pointer to the timeseries.
- * @param sec0 Seconds part of the start timestamp.
- * @param end End timestamp in nanoseconds.
- * @return true if range is in prev chunk, false otherwise.
- */
-static inline bool is_range_in_prev_chunk(const timeseries_t *ts, uint64_t sec0,
-                                          uint64_t end)
+static int avg_sample_records(const record_t *r, size_t n, void *userdata)
 {
-    return (ts->prev->base_offset > 0 && ts->prev->base_offset <= sec0 &&
-            ts->prev->start_ts <= end &&
-            sec0 - ts->prev->base_offset <= TS_CHUNK_SIZE);
+    for (size_t i = 0; i < n; ++i)
+        avg_sample_update(userdata, r[i].timestamp, r[i].value);
+    return 0;
 }
 
-static size_t find_starting_partition(const timeseries_t *ts, uint64_t start)
+static int avg_sample_columns(const uint64_t *timestamps,
+                              const double_t *values, size_t n, void *userdata)
 {
-    size_t partition_i = 0;
-
-    while (partition_i < ts->partition_nr &&
-           ts->partitions[partition_i].end_ts < start)
-        partition_i++;
+    avg_sample_t *s = userdata;
+    agg_bucket_t b;
+
+    for (size_t i = 0; i < n;) {
+        i += agg_bucket(timestamps + i, values + i, n - i, s->t0, s->interval,
+                        &b);
+        if (b.count > 0)
+            avg_sample_add(s, b.end, b.sum, b.count);
+    }
 
-    return partition_i;
+    return 0;
 }
 
-/**
- * Retrieve records from a timeseries within a specified time range.
- *
- * This function fetches all records with timestamps between start and end
- * from the given timeseries and stores them in the provided output array.
- *
- * @param ts A pointer to the timeseries to query.
- * @param start The start timestamp of the range, in nanoseconds.
- * @param end The end timestamp of the range, in nanoseconds.
- * @param out Pointer to a record_array_t to store the results.
- * @return 0 on success, error code on failure.
+/*
+ * A block wholly inside a bucket adds up to it as a whole, one spanning more
+ * than a bucket, or on a boundary, needs its points.
  */
-int ts_range(const timeseries_t *ts, uint64_t start, uint64_t end,
-             record_array_t *out)
+static int avg_sample_summary(const index_summary_t *s, void *userdata)
 {
-    if (!ts || !out)
-        return TS_E_NULL_POINTER;
-
-    if (start > end) {
-        return TS_E_INVALID_RANGE;
-    }
-
-    uint64_t sec0 = start / (uint64_t)1e9;
-    int ret       = 0;
+    avg_sample_t *sample = userdata;
 
-    // Check if the range falls in the head chunk
-    if (is_range_in_head_chunk(ts, sec0, start)) {
-        ts_chunk_range(ts->head, start, end, out);
+    if (s->first_ts <= sample->t0 ||
+        (s->first_ts - sample->t0) % sample->interval == 0)
         return 0;
-    }
 
-    // Check if the range falls in the prev chunk
-    if (is_range_in_prev_chunk(ts, sec0, end)) {
-        ts_chunk_range(ts->prev, start, end, out);
+    uint64_t end = sample->t0 + ((s->first_ts - sample->t0) / sample->interval +
+                                 1) * sample->interval;
+    if (s->last_ts >= end)
         return 0;
-    }
 
-    // Search in the persistence
-    size_t partition_i     = find_starting_partition(ts, start);
-    uint64_t current_start = start;
+    avg_sample_add(sample, end, s->sum, s->count);
 
-    // Fetch records from partitions within the time range
-    while (partition_i < ts->partition_nr &&
-           ts->partitions[partition_i].start_ts <= end) {
-        const partition_t *curr_p = &ts->partitions[partition_i];
-        uint64_t part_end = (curr_p->end_ts > end) ? end : curr_p->end_ts;
+    return 1;
+}
 
-        if ((ret = fetch_records_from_partition(curr_p, current_start, part_end,
-                                                out)) < 0)
-            return ret;
+int ts_avg_sample(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                  uint64_t interval_ns, record_array_t *out)
+{
+    if (!ts || !out)
+        return -1;
 
-        // Update the search start to continue after this partition
-        current_start = curr_p->end_ts + 1;
-        partition_i++;
+    if (interval_ns == 0)
+        return -1;
 
-        // If we've reached the end of our range, we're done
-        if (part_end == end)
-            return 0;
-    }
+    // Normalize to the interval
+    t0 = (t0 / interval_ns) * interval_ns;
+    if (t0 > t1)
+        return -1;
 
-    // If we get here, we need to check the in-memory chunks for any remaining
-    // range
+    record_array_t records = {.arena = arena_scratch_acquire()};
+    avg_sample_t sample    = {
+           .t0 = t0, .t1 = t1, .interval = interval_ns, .out = out};
+    range_walk_t w = {.records    = &records,
+                      .on_records = avg_sample_records,
+                      .on_columns = avg_sample_columns,
+                      .on_summary = avg_sample_summary,
+                      .userdata   = &sample};
 
-    // Check prev chunk if it might contain our range
-    if (ts->prev->base_offset != 0 && current_start <= end) {
-        uint64_t prev_end =
-            da_back(&ts->prev->points[ts->prev->max_index]).timestamp;
-        if (prev_end >= current_start) {
-            ts_chunk_range(ts->prev, current_start,
-                           (prev_end > end) ? end : prev_end, out);
+    int err        = ts_range_walk(ts, t0, t1, &w);
+    arena_scratch_release();
 
-            // Move start past the prev chunk
-            current_start = prev_end + 1;
-        }
-    }
+    if (err < 0)
+        // TODO fix error handling
+        return -1;
 
-    // Check head chunk if we still have range to cover
-    if (ts->head->base_offset != 0 && current_start <= end &&
-        ts->head->start_ts <= end) {
-        ts_chunk_range(ts->head,
-                       (ts->head->start_ts > current_start) ? ts->head->start_ts
-                                                            : current_start,
-                       end, out);
-    }
+    avg_sample_emit(&sample);
 
     return 0;
 }
 
-int ts_scan(const timeseries_t *ts, record_array_t *out,
-            ts_scan_filter_t filter, void *userdata)
+static inline uint64_t sampler_start(const sampler_t *s, uint64_t timestamp)
 {
-    if (!ts || !out)
-        return TS_E_NULL_POINTER;
+    return s->interval ? timestamp - timestamp % s->interval : 0;
+}
 
-    record_array_t ra = {0};
+// Last timestamp of the bucket starting at start, saturated
+static inline uint64_t sampler_last(const sampler_t *s, uint64_t start)
+{
+    if (!s->interval || s->interval - 1 > UINT64_MAX - start)
+        return UINT64_MAX;
+    return start + s->interval - 1;
+}
 
-    // Start with the oldest partition
-    for (size_t i = 0; i < ts->partition_nr; i++) {
-        if (fetch_records_from_partition(&ts->partitions[i],
-                                         ts->partitions[i].start_ts,
-                                         ts->partitions[i].end_ts, &ra) < 0)
-            return -1;
+/*
+ * Merge the aggregates of two sets of points of the same bucket, in any
+ * order, the first and last values follow their timestamps, the ones merged
+ * last winning ties.
+ */
+void ts_sample_merge(ts_sample_t *dst, const ts_sample_t *src)
+{
+    if (dst->count == 0) {
+        *dst = *src;
+        return;
     }
 
-    // Then add from the previous chunk if it exists
-    if (ts->prev->base_offset != 0 &&
-        ts->prev->points[ts->prev->max_index].length > 0) {
-        ts_chunk_range(
-            ts->prev, ts->prev->start_ts,
-            da_back(&ts->prev->points[ts->prev->max_index]).timestamp, &ra);
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    if (src->first_ts < dst->first_ts) {
+        dst->first    = src->first;
+        dst->first_ts = src->first_ts;
     }
-
-    // Then add from the current chunk if it exists
-    if (ts->head->base_offset != 0 &&
-        ts->head->points[ts->head->max_index].length > 0) {
-        ts_chunk_range(
-            ts->head, ts->head->start_ts,
-            da_back(&ts->head->points[ts->head->max_index]).timestamp, &ra);
+    if (src->last_ts >= dst->last_ts) {
+        dst->last    = src->last;
+        dst->last_ts = src->last_ts;
     }
+}
 
-    if (filter && userdata) {
-        for (size_t i = 0; i < ra.length; ++i) {
-            if (filter(&ra.items[i], userdata) == 0)
-                da_append(out, ra.items[i]);
-        }
-    } else {
-        *out = ra;
+// Merges the aggregates of a run of points of a bucket, buckets in order
+static void sampler_add(sampler_t *s, const ts_sample_t *run)
+{
+    ts_sample_t *c = &s->current;
+
+    if (c->count > 0 && c->start != run->start) {
+        da_append(s->out, *c);
+        c->count = 0;
     }
 
-    return 0;
+    ts_sample_merge(c, run);
 }
 
-/**
- * Retrieves all the timespace from the paritions and both the head and prev
- * in-memory records. It accepts a callback function to process the records
- * in batches so to avoid clogging the memory by restricting the number of
- * records for each iteration.
- */
-int ts_stream(const timeseries_t *ts, ts_stream_callback_t callback,
-              void *userdata)
+static int sampler_records(const record_t *r, size_t n, void *userdata)
 {
+    sampler_t *s = userdata;
+
+    for (size_t i = 0; i < n; ++i) {
+        double_t v = r[i].value;
+        uint64_t t = r[i].timestamp;
+        sampler_add(s, &(ts_sample_t){.start    = sampler_start(s, t),
+                                      .count    = 1,
+                                      .sum      = v,
+                                      .min      = v,
+                                      .max      = v,
+                                      .first    = v,
+                                      .last     = v,
+                                      .first_ts = t,
+                                      .last_ts  = t});
+    }
 
-    if (!ts || !callback)
-        return TS_E_NULL_POINTER;
-
-    // Temporary buffer for batching records
-    record_array_t batch    = {0};
-    const size_t BATCH_SIZE = 1000; // Adjust based on your expected record size
+    return 0;
+}
 
-    int ret                 = 0;
+static int sampler_columns(const uint64_t *timestamps, const double_t *values,
+                           size_t n, void *userdata)
+{
+    sampler_t *s = userdata;
+
+    for (size_t i = 0; i < n;) {
+        uint64_t start = sampler_start(s, timestamps[i]);
+        size_t run = agg_run(timestamps + i, n - i, sampler_last(s, start));
+        const double_t *v = values + i;
+
+        sampler_add(s, &(ts_sample_t){.start    = start,
+                                      .count    = run,
+                                      .sum      = agg_sum(v, run),
+                                      .min      = v[agg_argmin(v, run)],
+                                      .max      = v[agg_argmax(v, run)],
+                                      .first    = v[0],
+                                      .last     = v[run - 1],
+                                      .first_ts = timestamps[i],
+                                      .last_ts  = timestamps[i + run - 1]});
+        i += run;
+    }
 
-    // Process each partition
-    for (size_t i = 0; i < ts->partition_nr; i++) {
-        const partition_t *part = &ts->partitions[i];
+    return 0;
+}
 
-        // Fetch a batch of records from the partition
-        uint64_t endts          = part->end_ts;
-        uint64_t start_ts       = part->start_ts;
-        do {
-            da_reset(&batch);
+// A block wholly inside a bucket is merged as a whole
+static int sampler_summary(const index_summary_t *s, void *userdata)
+{
+    sampler_t *sampler = userdata;
+    uint64_t start     = sampler_start(sampler, s->first_ts);
 
-            // Fill batch with next chunk of records
-            if (fetch_records_from_partition(part, start_ts, endts, &batch) <
-                0) {
-                ret = -1;
-                goto cleanup;
-            }
+    if (s->last_ts > sampler_last(sampler, start))
+        return 0;
 
-            if (batch.length > 0) {
-                endts    = da_back(&batch).timestamp;
-                start_ts = batch.items[0].timestamp;
+    sampler_add(sampler, &(ts_sample_t){.start    = start,
+                                        .count    = s->count,
+                                        .sum      = s->sum,
+                                        .min      = s->min,
+                                        .max      = s->max,
+                                        .first    = s->first,
+                                        .last     = s->last,
+                                        .first_ts = s->first_ts,
+                                        .last_ts  = s->last_ts});
+
+    return 1;
+}
 
-                // Process each record in the batch
-                if (callback(&batch, userdata) != 0) {
-                    ret = -1;
-                    goto cleanup;
-                }
-            }
+// Expects the series lock to be held
+static int ts_sampler_walk_locked(const timeseries_t *ts, uint64_t t0,
+                                  uint64_t t1, walk_sources_t sources,
+                                  sampler_t *s)
+{
+    record_array_t records = {.arena = arena_scratch_acquire()};
+    range_walk_t w         = {.sources    = sources,
+                              .records    = &records,
+                              .on_records = sampler_records,
+                              .on_columns = sampler_columns,
+                              .on_summary = sampler_summary,
+                              .userdata   = s};
+
+    int err                = ts_range_walk_locked(ts, t0, t1, &w);
+    arena_scratch_release();
+
+    return err < 0 ? -1 : 0;
+}
 
-            if (batch.length < BATCH_SIZE) // End of partition
-                break;
-        } while (endts < part->end_ts);
-    }
+/*
+ * Fill a rollup just declared on a series with its partitions, the points
+ * still in memory get in with their flush.
+ */
+static int ts_rollup_backfill(timeseries_t *ts, rollup_t *r)
+{
+    ts_sample_array_t samples = {0};
+    sampler_t s               = {.interval = r->interval, .out = &samples};
 
-    da_reset(&batch);
+    int err = ts_sampler_walk_locked(ts, 0, UINT64_MAX, WALK_PARTITIONS, &s);
+    if (err == 0 && s.current.count > 0)
+        da_append(&samples, s.current);
+    if (err == 0)
+        err = rollup_append(r, samples.items, samples.length);
 
-    if (ts->prev->base_offset != 0 &&
-        ts->prev->points[ts->prev->max_index].length > 0) {
+    da_free(&samples);
 
-        uint64_t endts =
-            da_back(&ts->prev->points[ts->prev->max_index]).timestamp;
-        uint64_t start_ts = ts->prev->start_ts;
+    return err;
+}
 
-        do {
-            da_reset(&batch);
-            ts_chunk_range(ts->prev, start_ts, endts, &batch);
-            if (batch.length > 0) {
-                endts    = da_back(&batch).timestamp;
-                start_ts = batch.items[0].timestamp;
+/*
+ * Open the rollup of an interval declared at creation, unless already loaded,
+ * a new one is backfilled from the partitions already there.
+ */
+static int ts_rollup_declare(timeseries_t *ts, uint64_t interval)
+{
+    if (interval == 0)
+        return TS_E_UNKNOWN;
 
-                // Process each record in the batch
-                if (callback(&batch, userdata) != 0) {
-                    ret = -1;
-                    goto cleanup;
-                }
-            }
+    for (size_t i = 0; i < ts->rollups_nr; ++i)
+        if (ts->rollups[i].interval == interval)
+            return 0;
 
-            if (batch.length < BATCH_SIZE) // End of partition
-                break;
+    if (ts->rollups_nr == ROLLUP_MAX)
+        return TS_E_UNKNOWN;
 
-        } while (endts < ts->prev->end_ts);
+    rollup_t *r = &ts->rollups[ts->rollups_nr];
+    int created = rollup_open(r, ts->pathbuf, interval);
+    if (created < 0 || (created && ts->partitions.length > 0 &&
+                        ts_rollup_backfill(ts, r) < 0)) {
+        rollup_close(r);
+        return TS_E_UNKNOWN;
     }
 
-    // Then add from the current chunk if it exists
-    if (ts->head->base_offset != 0 &&
-        ts->head->points[ts->head->max_index].length > 0) {
-
-        uint64_t endts =
-            da_back(&ts->head->points[ts->head->max_index]).timestamp;
-        uint64_t start_ts = ts->head->start_ts;
-
-        do {
-            da_reset(&batch);
-            ts_chunk_range(ts->head, start_ts, endts, &batch);
-            if (batch.length > 0) {
-                endts    = da_back(&batch).timestamp;
-                start_ts = batch.items[0].timestamp;
+    ts->rollups_nr++;
 
-                // Process each record in the batch
-                if (callback(&batch, userdata) != 0) {
-                    ret = -1;
-                    goto cleanup;
-                }
-            }
+    return 0;
+}
 
-            if (batch.length < BATCH_SIZE) // End of partition
-                break;
+// The coarsest rollup whose buckets tile the ones of the interval, if any,
+// any of them tiling the single bucket of an interval of 0
+static const rollup_t *ts_rollup_pick(const timeseries_t *ts,
+                                      uint64_t interval)
+{
+    const rollup_t *best = NULL;
 
-        } while (endts < ts->head->end_ts);
+    for (size_t i = 0; i < ts->rollups_nr; ++i) {
+        const rollup_t *r = &ts->rollups[i];
+        if (interval % r->interval == 0 &&
+            (!best || r->interval > best->interval))
+            best = r;
     }
 
-cleanup:
-    da_free(&batch);
-    return ret;
+    return best;
 }
 
-int ts_first(const timeseries_t *ts, record_t *r)
+/*
+ * Sample the whole rollup buckets within [t0, t1], the rollup holding the
+ * partitions, merged by start with the points still in memory.
+ */
+static int ts_sample_rollup(const timeseries_t *ts, const rollup_t *r,
+                            uint64_t t0, uint64_t t1, sampler_t *s)
 {
-    if (!ts || !r)
-        return -1;
-
-    // Check the first partition first
-    const partition_t *part = &ts->partitions[0];
-
-    if (part->initialized == 1) {
-        uint8_t buf[RECORD_BINSIZE];
-        int err = partition_find(part, buf, part->start_ts);
-        if (err == 0) {
-            // We got a match
-            ts_record_read(r, buf);
-            return 0;
-        }
-    }
-
-    // Check the prev chunk
-    if (ts->prev->base_offset != 0) {
-        for (size_t i = 0; i < TS_CHUNK_SIZE; ++i) {
-            if (ts->prev->points[0].length > 0) {
-                *r = ts->prev->points[0].items[0];
-                return 0;
+    ts_sample_array_t stored = {0}, memory = {0};
+    sampler_t m              = {.interval = r->interval, .out = &memory};
+
+    int err = rollup_read(r, t0, t1 - r->interval + 1, &stored);
+    if (err == 0)
+        err = ts_sampler_walk_locked(ts, t0, t1, WALK_MEMORY, &m);
+    if (err == 0 && m.current.count > 0)
+        da_append(&memory, m.current);
+
+    size_t i = 0, j = 0;
+    while (err == 0 && (i < stored.length || j < memory.length)) {
+        const ts_sample_t *x = i < stored.length ? &stored.items[i] : NULL;
+        const ts_sample_t *y = j < memory.length ? &memory.items[j] : NULL;
+        ts_sample_t bucket;
+
+        if (x && (!y || x->start <= y->start)) {
+            bucket = *x;
+            i++;
+            if (y && y->start == bucket.start) {
+                ts_sample_merge(&bucket, y);
+                j++;
             }
+        } else {
+            bucket = *y;
+            j++;
         }
-    }
 
-    // Check the head
-    if (ts->head->base_offset != 0) {
-        for (size_t i = 0; i < TS_CHUNK_SIZE; ++i) {
-            if (ts->head->points[0].length > 0) {
-                *r = ts->head->points[0].items[0];
-                return 0;
-            }
-        }
+        bucket.start = sampler_start(s, bucket.start);
+        sampler_add(s, &bucket);
     }
 
-    return -1;
+    da_free(&stored);
+    da_free(&memory);
+
+    return err;
 }
 
-int ts_last(const timeseries_t *ts, record_t *r)
+/*
+ * Sample a range reading the rollup of the coarsest interval dividing the
+ * sampling one for its whole buckets, the edges of the range being walked
+ * point by point, to be called with the series lock held.
+ */
+static int ts_sample_locked(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                            sampler_t *s)
 {
-    if (!ts || !r)
-        return -1;
+    const rollup_t *r = ts_rollup_pick(ts, s->interval);
+    uint64_t cutoff   = ts_retention_cutoff(ts);
 
-    // Check the first partition first
-    const partition_t *part = &ts->partitions[0];
-
-    if (part->initialized == 1) {
-        uint8_t buf[RECORD_BINSIZE];
-        int err = partition_find(part, buf, part->end_ts);
-        if (err == 0) {
-            // We got a match
-            ts_record_read(r, buf);
-            return 0;
-        }
-    }
+    if (t0 < cutoff)
+        t0 = cutoff;
 
-    // Check the prev chunk
-    if (ts->prev->base_offset != 0 &&
-        ts->prev->points[ts->prev->max_index].length > 0) {
-        record_array_t *ra = &ts->prev->points[ts->prev->max_index];
-        *r                 = da_back(ra);
-        return 0;
-    }
+    if (!r || t0 > t1 || t0 > UINT64_MAX - r->interval)
+        return ts_sampler_walk_locked(ts, t0, t1, WALK_ALL, s);
 
-    // Check the head
-    if (ts->head->base_offset != 0 &&
-        ts->head->points[ts->head->max_index].length > 0) {
-        record_array_t *ra = &ts->head->points[ts->head->max_index];
-        *r                 = da_back(ra);
-        return 0;
-    }
+    // Whole buckets span [a, b], the first starting at or after t0, the last
+    // ending at or before t1
+    uint64_t R   = r->interval;
+    uint64_t a   = t0 % R ? t0 - t0 % R + R : t0;
+    bool b_whole = t1 % R == R - 1;
+    uint64_t b   = b_whole ? t1 : t1 - t1 % R - 1;
 
-    return 0;
-}
+    if ((!b_whole && t1 < R) || b < a)
+        return ts_sampler_walk_locked(ts, t0, t1, WALK_ALL, s);
 
-int ts_min(const timeseries_t *ts, uint64_t t0, uint64_t t1, record_t *r)
-{
-    if (!ts)
+    if (t0 < a && ts_sampler_walk_locked(ts, t0, a - 1, WALK_ALL, s) < 0)
         return -1;
 
-    record_array_t out = {0};
-
-    if (ts_range(ts, t0, t1, &out) < 0)
+    if (ts_sample_rollup(ts, r, a, b, s) < 0)
         return -1;
 
-    if (out.length == 0)
+    if (b < t1 && ts_sampler_walk_locked(ts, b + 1, t1, WALK_ALL, s) < 0)
         return -1;
 
-    *r = out.items[0];
-
-    for (size_t i = 0; i < out.length; ++i)
-        if (out.items[i].value < r->value)
-            *r = out.items[i];
-
-    da_free(&out);
-
     return 0;
 }
 
-int ts_max(const timeseries_t *ts, uint64_t t0, uint64_t t1, record_t *r)
+/*
+ * Aggregates the points of a range in buckets of interval_ns, appending the
+ * non empty ones to out in time order.
+ */
+int ts_sample(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+              uint64_t interval_ns, ts_sample_array_t *out)
 {
-    if (!ts)
+    if (!ts || !out || interval_ns == 0 || t0 > t1)
         return -1;
 
-    record_array_t out = {0};
+    sampler_t s = {.interval = interval_ns, .out = out};
 
-    if (ts_range(ts, t0, t1, &out) < 0)
-        return -1;
+    ts_lock(ts);
+    int err = ts_sample_locked(ts, t0, t1, &s);
+    ts_unlock(ts);
 
-    if (out.length == 0)
+    if (err < 0)
         return -1;
 
-    *r = out.items[0];
-
-    for (size_t i = 0; i < out.length; ++i)
-        if (out.items[i].value > r->value)
-            *r = out.items[i];
-
-    da_free(&out);
+    if (s.current.count > 0)
+        da_append(out, s.current);
 
     return 0;
 }
 
-int ts_avg_sample(const timeseries_t *ts, uint64_t t0, uint64_t t1,
-                  uint64_t interval_ns, record_array_t *out)
+/*
+ * Aggregates the points of a range as a single bucket, labelled with t0,
+ * -1 if there is none.
+ */
+int ts_aggregate(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                 ts_sample_t *out)
 {
-    if (!ts || !out)
-        return -1;
-
-    record_array_t partial = {0};
-    // Normalize to the interval
-    t0                     = (t0 / interval_ns) * interval_ns;
-    if (ts_range(ts, t0, t1, &partial) < 0)
-        // TODO fix error handling
+    if (!ts || !out || t0 > t1)
         return -1;
 
-    uint64_t current = t0 + interval_ns;
-    double_t sum     = 0.0;
-    size_t total     = 0;
+    sampler_t s = {0};
 
-    if (partial.length == 0)
-        return 0;
-
-    while (current < t1) {
-        sum   = 0.0;
-        total = 0;
-
-        for (size_t i = 0; i < partial.length; ++i) {
-            if (partial.items[i].timestamp > current - interval_ns &&
-                partial.items[i].timestamp < current) {
-                sum += partial.items[i].value;
-                total++;
-            }
-        }
+    ts_lock(ts);
+    int err = ts_sample_locked(ts, t0, t1, &s);
+    ts_unlock(ts);
 
-        double_t value = sum / (double_t)total;
-        if (!isnan(value)) {
-            record_t result = {.timestamp = current, .value = value};
-            da_append(out, result);
-        }
-        current += interval_ns;
-    }
+    if (err < 0 || s.current.count == 0)
+        return -1;
 
-    da_free(&partial);
+    *out       = s.current;
+    out->start = t0;
 
     return 0;
 }
 
 void ts_print(const timeseries_t *ts)
 {
-    for (int i = 0; i < TS_CHUNK_SIZE; ++i) {
-        record_array_t p = ts->head->points[i];
-        for (size_t j = 0; j < p.length; ++j) {
-            record_t r = da_get(p, j);
-            if (!r.is_set)
-                continue;
-            log_info("%" PRIu64 " {.sec: %lu, .nsec: %lu, .value: %.02f}",
-                     r.timestamp, r.tv.tv_sec, r.tv.tv_nsec, r.value);
-        }
+    for (size_t i = 0; i < ts->head->length; ++i) {
+        record_t r = ts_chunk_record(ts->head, i);
+        log_info("%" PRIu64 " {.sec: %lu, .nsec: %lu, .value: %.02f}",
+                 r.timestamp, r.tv.tv_sec, r.tv.tv_nsec, r.value);
     }
 }
 
@@ -1356,16 +4687,30 @@ size_t ts_record_read(record_t *r, const uint8_t *buf)
     return record_size;
 }
 
-size_t ts_record_batch_write(const record_t *r[], uint8_t *buf, size_t count)
+/*
+ * Write a batch of points as a compressed commit log block, a fixed size
+ * header followed by the gorilla encoded points. The buffer is expected to
+ * hold at least CL_BLOCK_HEADER_SIZE + GORILLA_MAX_SIZE(count) bytes.
+ *
+ * Returns the total size of the block in bytes.
+ */
+size_t ts_record_batch_write(const uint64_t *timestamps,
+                             const double_t *values, uint8_t *buf,
+                             size_t count)
 {
-    uint64_t last_timestamp = r[count - 1]->timestamp;
-    // For now we assume fixed size of records
-    uint64_t batch_size = count * ((sizeof(uint64_t) * 2) + sizeof(double_t));
-    write_i64(buf, batch_size);
-    write_i64(buf + sizeof(uint64_t), last_timestamp);
-    size_t offset = sizeof(uint64_t) * 2;
-    for (size_t i = 0; i < count; ++i) {
-        offset += ts_record_write(r[i], buf + offset);
-    }
-    return batch_size;
+    gorilla_encoder_t encoder;
+    gorilla_encoder_init(&encoder, buf + CL_BLOCK_HEADER_SIZE);
+
+    for (size_t i = 0; i < count; ++i)
+        gorilla_encoder_append(&encoder, timestamps[i], values[i]);
+
+    cl_frame_t block = {
+        .version      = CL_BLOCK_V1,
+        .count        = count,
+        .first_ts     = timestamps[0],
+        .last_ts      = timestamps[count - 1],
+        .payload_size = gorilla_encoder_size(&encoder),
+    };
+
+    return cl_block_header_write(buf, &block) + block.payload_size;
 }
@@ -1,17 +1,22 @@
 #ifndef TIMESERIES_H
 #define TIMESERIES_H
 
+#include "arena.h"
+#include "hashmap.h"
 #include "partition.h"
+#include "rollup.h"
 #include "storage.h"
 #include "wal.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 
 #define TS_NAME_MAX_LENGTH        (1 << 9)
 #define TS_CHUNK_SIZE             900 // 15 min
-#define TS_MAX_PARTITIONS         16
+#define TS_MAX_SEALED             4
 #define DATAPATH_SIZE             (1 << 8)
 
 // Errors
@@ -25,11 +30,11 @@
 #define TS_E_WAL_APPEND_FAIL      -8
 #define TS_E_FLUSH_CHUNK_FAIL     -9
 #define TS_E_INVALID_RANGE        -10
+#define TS_E_BACKPRESSURE         -11
 
 extern const char *BASEPATH;
 extern const size_t TS_FLUSHSIZE;
 extern const size_t TS_MIN_FLUSHSIZE;
-extern const size_t TS_BATCH_OFFSET;
 
 /*
  * Enum defining the rules to apply when a duplicate point is
@@ -60,63 +65,229 @@ extern size_t ts_record_write(const record_t *r, uint8_t *buf);
 
 extern size_t ts_record_read(record_t *r, const uint8_t *buf);
 
-extern size_t ts_record_batch_write(const record_t *r[], uint8_t *buf,
+extern size_t ts_record_batch_write(const uint64_t *timestamps,
+                                    const double_t *values, uint8_t *buf,
                                     size_t count);
 
+/*
+ * Array of records, optionally backed by an arena, see `da_append_in`; query
+ * paths use it for their transient arrays, NULL means the heap.
+ */
 typedef struct record_array {
     size_t length;
     size_t capacity;
     record_t *items;
+    arena_t *arena;
 } record_array_t;
 
 /*
  * Time series chunk, main data structure to handle the time-series, it carries
  * a base offset which represents the 1st timestamp inserted and the
- * columns data. Data are stored in a single array, using a base_offset as a
- * strating timestamp, resulting in the timestamps fitting in the allocated
- * space.
+ * columns data. Data are stored in two contiguous arrays, timestamps and
+ * values, sorted by timestamp, using a base_offset as a starting second.
+ *
+ * The offsets table maps each second of the chunk to the position of its
+ * first point in the columns, a second spans up to the start of the next one
+ * or to the end of the columns for the last second set (max_index), entries
+ * past max_index are not meaningful.
+ *
+ * The columns are allocated from the chunk arena, which is rewound in one
+ * shot when the chunk is reset, keeping its memory for the next one.
  */
 typedef struct ts_chunk {
     wal_t wal;
+    arena_t arena;
     uint64_t base_offset;
     uint64_t start_ts;
     uint64_t end_ts;
     size_t max_index;
-    record_array_t points[TS_CHUNK_SIZE];
+    size_t length;
+    size_t capacity;
+    uint64_t *timestamps;
+    double_t *values;
+    uint32_t offsets[TS_CHUNK_SIZE];
 } ts_chunk_t;
 
 typedef struct ts_opts {
     int64_t retention;
     size_t flushsize;
     duplication_policy_t policy;
+    wal_policy_t wal_policy;
+    uint64_t rollups[ROLLUP_MAX];
+    size_t rollups_nr;
 } ts_opts_t;
 
+typedef struct timeseries timeseries_t;
+
+/*
+ * Series known to a database, listed in its manifest. The series itself is
+ * materialized on first access, chunks allocated, WALs replayed and files
+ * opened, until then only its options and the range of its partitions, as of
+ * the last manifest written, are kept in memory. An entry is recovering while
+ * its series is being materialized, by a recovery worker or on access.
+ */
+typedef struct ts_entry {
+    timeseries_t *ts;
+    int recovering;
+    ts_opts_t opts;
+    uint64_t start_ts;
+    uint64_t end_ts;
+    size_t partitions;
+    char name[];
+} ts_entry_t;
+
+/*
+ * Chunks sealed for the background flusher, either the prev chunk alone on a
+ * rotation or both the prev and head chunks once the flush size is reached,
+ * in which case they may start a new partition. The base is the one to
+ * initialize the partition with, if needed.
+ *
+ * The late points preceding the sealed chunks are sealed along with them in a
+ * sorted out of order buffer, if any, merge-joined with the chunks by the
+ * flusher. Those older than the end of the partitions are merged into the
+ * partitions they belong to. A failed flush is retried, not before retry_at,
+ * in nanoseconds.
+ */
+typedef struct ts_sealed {
+    timeseries_t *ts;
+    ts_chunk_t *chunks[2];
+    size_t nr;
+    ts_chunk_t *ooo;
+    uint64_t base;
+    int full;
+    int64_t retry_at;
+    struct ts_sealed *next;
+} ts_sealed_t;
+
 /*
  * Time series, main data structure to handle the time-series, it carries some
  * basic informations like the name of the series and the retention time. Data
  * are stored in 2 timeseries_chunk_t, a current and latest timestamp one and
- * one to account for out of order points that will be merged later when
- * flushing on disk.
+ * the previous one.
+ *
+ * Late points, older than the last one of the head chunk, are appended as
+ * they come to an out of order buffer, a chunk used as an unsorted log with a
+ * WAL of its own. Queries merge it on the fly, it's sorted once when sealed
+ * and merged with the chunks it's flushed along with.
+ *
+ * Chunks are not flushed inline, they're sealed and queued to a background
+ * flusher while new points go to fresh chunks, sealed chunks keep being
+ * served to queries until their partition is synced to disk. At most
+ * TS_MAX_SEALED can be waiting, past that inserts needing a flush fail with
+ * TS_E_BACKPRESSURE.
+ *
+ * With a retention set, in nanoseconds, the flusher drops the partitions
+ * wholly past it after each flush and queries leave out the expired points
+ * still around.
+ *
+ * After each flush, runs of adjacent small partitions are compacted into a
+ * single sorted one, written aside and swapped in under the lock, so queries
+ * keep reading the old files until they're done.
+ *
+ * Rollups, declared at creation, are published with each flush under the
+ * lock along with the partitions, so a point is either in memory or in both
+ * the partitions and the rollups. Sampling reads the rollup of the coarsest
+ * interval dividing its own for the whole buckets of the range, adding the
+ * points still in memory, and the partitions for the edges.
+ *
+ * The earliest and latest points are cached, updated by each write, a point
+ * sharing the timestamp of the cached one not replacing it, and rebuilt when
+ * the series is loaded, so first and last are answered from memory.
+ *
+ * The lock guards the partitions, read by queries and written by the flusher,
+ * which writes and syncs the blocks of a flush past the end of the partitions
+ * without it, then takes it only to publish them. The sealed lock guards the
+ * sealed queue and the spare chunks, recycled from the flushed ones. The
+ * compact lock serializes the writers of the partitions, the flusher and the
+ * housekeeping, retention and compaction, done off the lock.
  */
-typedef struct timeseries {
+struct timeseries {
     char name[TS_NAME_MAX_LENGTH];
     char db_datapath[DATAPATH_SIZE];
     char pathbuf[PATHBUF_SIZE];
     ts_chunk_t *head;
     ts_chunk_t *prev;
-    partition_t partitions[TS_MAX_PARTITIONS];
-    size_t partition_nr;
+    ts_chunk_t *ooo;
+    uint64_t ooo_seq;
+    ts_sealed_t sealed[TS_MAX_SEALED];
+    size_t sealed_head;
+    size_t sealed_nr;
+    int closing;
+    ts_chunk_t *spare[TS_MAX_SEALED * 3];
+    size_t spare_nr;
+    pthread_mutex_t lock;
+    pthread_mutex_t sealed_lock;
+    pthread_cond_t sealed_cond;
+    pthread_mutex_t compact_lock;
+    partition_catalog_t partitions;
+    rollup_t rollups[ROLLUP_MAX];
+    size_t rollups_nr;
+    record_t first;
+    record_t last;
     ts_opts_t opts;
-} timeseries_t;
+    ts_entry_t *entry;
+    wal_log_t *wal_log;
+    uint64_t wal_series;
+};
 
 typedef int (*ts_stream_callback_t)(const record_array_t *ra, void *userdata);
 
+/*
+ * Cursor over a time range of a series, pulling its points in batches. Only
+ * the position is kept between batches, each one resumes the walk from there
+ * under the series lock, so the memory used is bounded by the batch size and
+ * the series can be written and flushed in between.
+ *
+ * The position is the timestamp of the last point returned, along with the
+ * number of points sharing it already returned, to resume past them.
+ */
+typedef struct ts_cursor {
+    const timeseries_t *ts;
+    uint64_t next;
+    uint64_t end;
+    size_t skip;
+    int done;
+} ts_cursor_t;
+
+/*
+ * Aggregates of the points of a bucket, spanning [start, start + interval),
+ * start being a multiple of the interval. First and last are the values of
+ * the earliest and latest points, at first_ts and last_ts, the average is
+ * sum / count.
+ */
+typedef struct ts_sample {
+    uint64_t start;
+    size_t count;
+    double_t sum;
+    double_t min;
+    double_t max;
+    double_t first;
+    double_t last;
+    uint64_t first_ts;
+    uint64_t last_ts;
+} ts_sample_t;
+
+typedef struct ts_sample_array {
+    size_t length;
+    size_t capacity;
+    ts_sample_t *items;
+} ts_sample_array_t;
+
 extern int ts_init(timeseries_t *ts);
 
 extern void ts_close(timeseries_t *ts);
 
 extern int ts_insert(timeseries_t *ts, uint64_t timestamp, double_t value);
 
+extern int ts_insert_batch(timeseries_t *ts, const uint64_t *timestamps,
+                           const double_t *values, size_t n);
+
+extern int ts_commit(timeseries_t *ts, int force);
+
+extern int64_t ts_commit_timeout(const timeseries_t *ts);
+
+extern int ts_compact(timeseries_t *ts);
+
 extern int ts_find(const timeseries_t *ts, uint64_t timestamp, record_t *r);
 
 extern int ts_range(const timeseries_t *ts, uint64_t t0, uint64_t t1,
@@ -130,6 +301,14 @@ extern int ts_scan(const timeseries_t *ts, record_array_t *out,
 extern int ts_stream(const timeseries_t *ts, ts_stream_callback_t callback,
                      void *userdata);
 
+extern ts_cursor_t *ts_cursor_open(const timeseries_t *ts, uint64_t t0,
+                                   uint64_t t1);
+
+extern ssize_t ts_cursor_next(ts_cursor_t *cursor, record_t *batch,
+                              size_t max);
+
+extern void ts_cursor_close(ts_cursor_t *cursor);
+
 extern int ts_first(const timeseries_t *ts, record_t *r);
 
 extern int ts_last(const timeseries_t *ts, record_t *r);
@@ -143,20 +322,54 @@ extern int ts_max(const timeseries_t *ts, uint64_t t0, uint64_t t1,
 extern int ts_avg_sample(const timeseries_t *ts, uint64_t t0, uint64_t t1,
                          uint64_t interval_ns, record_array_t *out);
 
-extern void ts_print(const timeseries_t *ts);
+extern int ts_sample(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                     uint64_t interval_ns, ts_sample_array_t *out);
+
+extern int ts_aggregate(const timeseries_t *ts, uint64_t t0, uint64_t t1,
+                        ts_sample_t *out);
 
-typedef struct ts_ht ts_ht_t;
-typedef struct ts_ht_entry ts_ht_entry_t;
+extern void ts_sample_merge(ts_sample_t *dst, const ts_sample_t *src);
 
+extern void ts_print(const timeseries_t *ts);
+
+/*
+ * The WAL policy is set per database and inherited by each of its
+ * time series, series are looked up by name in the series map, which holds
+ * an entry for each series of the database, materialized or not.
+ *
+ * The series are listed in the MANIFEST file of the database, along with
+ * their options and the range of their partitions, rewritten aside and
+ * renamed in place each time a series is created and when the database is
+ * closed. A database written before manifests is scanned once and gets one.
+ *
+ * After a restart the series can be recovered in the background, spread over
+ * a pool of workers, `recovering` counts the series of the database still
+ * queued or being replayed.
+ *
+ * A database can log the points of all its series to a single shared WAL,
+ * in its WAL_LOG_DIR directory, rather than to a WAL file per chunk, chosen
+ * when it's created and kept for its lifetime.
+ */
 typedef struct timeseries_db {
     char datapath[DATAPATH_SIZE];
-    ts_ht_t *ts_hashtable;
+    hashmap_t series;
+    wal_policy_t wal_policy;
+    size_t recovering;
+    int closing;
+    wal_log_t *wal_log;
 } timeseries_db_t;
 
 extern timeseries_db_t *tsdb_create(const char *datapath);
 
 extern int tsdb_load(timeseries_db_t *tsdb);
 
+// Databases created from now on share a WAL of segments of the given size, 0
+// going back to a WAL file per chunk
+extern void tsdb_set_shared_wal(size_t segment_size);
+
+// Switches a database with no series yet to a shared WAL
+extern int tsdb_share_wal(timeseries_db_t *tsdb, size_t segment_size);
+
 extern void tsdb_close(timeseries_db_t *tsdb);
 
 extern timeseries_t *ts_create(const timeseries_db_t *tsdb, const char *name,
@@ -164,4 +377,17 @@ extern timeseries_t *ts_create(const timeseries_db_t *tsdb, const char *name,
 
 extern timeseries_t *ts_get(const timeseries_db_t *tsdb, const char *name);
 
+// Queues the series of the database not materialized yet for recovery, on up
+// to workers threads, 0 meaning one per core, returns the number queued
+extern int tsdb_recover(timeseries_db_t *tsdb, size_t workers);
+
+// Waits for the series of the database queued for recovery to be done
+extern void tsdb_recover_wait(timeseries_db_t *tsdb);
+
+// Tells if the series is being replayed, ts_get would block until it's done
+extern int ts_recovering(const timeseries_db_t *tsdb, const char *name);
+
+// Series recovered so far out of the ones queued, since the pool was idle
+extern void ts_recovery_progress(size_t *done, size_t *total);
+
 #endif
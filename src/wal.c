@@ -1,28 +1,582 @@
 #include "wal.h"
 #include "binary.h"
+#include "hash.h"
 #include "logger.h"
 #include "storage.h"
+#include "timeutil.h"
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define WAL_RECORDSIZE sizeof(uint64_t) + sizeof(double_t)
 
-static const char t[2] = {'t', 'h'};
+// Payload length, checksum of the rest, series, chunk id, kind and base
+#define WAL_FRAME_HEADER (sizeof(uint32_t) + sizeof(uint64_t) * 4 + 1)
+#define WAL_FRAME_DROP   0x80
+#define WAL_NO_SEGMENT   UINT64_MAX
 
-int wal_init(wal_t *w, const char *path, uint64_t base_timestamp, int main)
+static const char t[3] = {'t', 'h', 'o'};
+
+typedef struct wal_frame {
+    uint64_t series;
+    uint64_t id;
+    int kind;
+    uint64_t base;
+    const uint8_t *payload;
+    size_t length;
+} wal_frame_t;
+
+typedef void (*wal_frame_fn)(wal_log_t *log, uint64_t seq,
+                             const wal_frame_t *f, void *userdata);
+
+static int wal_datasync(int fd)
+{
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+static void log_segment_path(const wal_log_t *log, uint64_t seq, char *buf,
+                             size_t size)
+{
+    snprintf(buf, size, "%s/seg-%.20" PRIu64 ".log", log->path, seq);
+}
+
+static wal_segment_t *log_segment(wal_log_t *log, uint64_t seq)
+{
+    for (size_t i = 0; i < log->segments.length; ++i)
+        if (log->segments.items[i].seq == seq)
+            return &log->segments.items[i];
+
+    return NULL;
+}
+
+static int log_segment_open(wal_log_t *log, uint64_t seq)
+{
+    char path[WAL_PATHSIZE + 32];
+    log_segment_path(log, seq, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("WAL segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    log->fd     = fd;
+    log->seq    = seq;
+    log->size   = 0;
+    log->synced = 0;
+    da_append(&log->segments, ((wal_segment_t){.seq = seq, .refs = 0}));
+
+    return 0;
+}
+
+/*
+ * Segments left behind are synced first, so that a WAL with frames in a
+ * segment other than the last one can take them for durable.
+ */
+static int log_rotate(wal_log_t *log)
+{
+    if (wal_datasync(log->fd) < 0) {
+        log_error("WAL segment sync: %s", strerror(errno));
+        return -1;
+    }
+
+    close(log->fd);
+    log->fd = -1;
+
+    return log_segment_open(log, log->seq + 1);
+}
+
+// Removes the oldest segments no chunk starts in, the last one is kept
+static void log_truncate(wal_log_t *log)
+{
+    char path[WAL_PATHSIZE + 32];
+    size_t n = 0;
+
+    while (n + 1 < log->segments.length && log->segments.items[n].refs == 0) {
+        log_segment_path(log, log->segments.items[n].seq, path, sizeof(path));
+        if (unlink(path) < 0 && errno != ENOENT)
+            log_warning("WAL segment remove %s: %s", path, strerror(errno));
+        n++;
+    }
+
+    if (n == 0)
+        return;
+
+    memmove(log->segments.items, log->segments.items + n,
+            (log->segments.length - n) * sizeof(*log->segments.items));
+    log->segments.length -= n;
+}
+
+/*
+ * Append a frame of the WAL, its payload already in place past the room left
+ * for the header, log lock held. A frame partially written is cut off, the
+ * following ones have to be readable.
+ */
+static int log_append(wal_log_t *log, wal_t *w, int kind, uint8_t *frame,
+                      size_t length)
+{
+    size_t size = WAL_FRAME_HEADER + length;
+
+    if (log->size > 0 && log->size + size > log->segment_size &&
+        log_rotate(log) < 0)
+        return -1;
+
+    if (w->id == 0)
+        w->id = log->next_id++;
+
+    uint8_t *ptr = frame + sizeof(uint32_t) + sizeof(uint64_t);
+    write_i64(ptr, w->series);
+    write_i64(ptr + sizeof(uint64_t), w->id);
+    write_u8(ptr + sizeof(uint64_t) * 2, kind);
+    write_i64(ptr + sizeof(uint64_t) * 2 + 1, w->base);
+    write_u32(frame, length);
+    write_i64(frame + sizeof(uint32_t),
+              fnv1a_hash(ptr, size - sizeof(uint32_t) - sizeof(uint64_t)));
+
+    ssize_t n = pwrite(log->fd, frame, size, log->size);
+    if (n < 0 || (size_t)n != size) {
+        log_error("WAL segment write: %s", strerror(errno));
+        if (ftruncate(log->fd, log->size) < 0)
+            log_error("WAL segment truncate: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!(kind & WAL_FRAME_DROP) && w->segment == WAL_NO_SEGMENT) {
+        w->segment = log->seq;
+        log_segment(log, log->seq)->refs++;
+    }
+
+    w->last_seq = log->seq;
+    w->last_end = log->size + size;
+    log->size += size;
+
+    return 0;
+}
+
+/*
+ * Walk the frames of a segment, up to the first one torn or failing its
+ * checksum, the tail of a segment written during a crash.
+ */
+static int log_scan(wal_log_t *log, uint64_t seq, wal_frame_fn fn,
+                    void *userdata)
+{
+    char path[WAL_PATHSIZE + 32];
+    log_segment_path(log, seq, path, sizeof(path));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        log_error("WAL segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    ssize_t size = filesize(fp, 0);
+    uint8_t *buf = malloc(size + 1);
+    if (!buf) {
+        fclose(fp);
+        return -1;
+    }
+
+    ssize_t n = read_file(fp, buf);
+    fclose(fp);
+    if (n < 0) {
+        free(buf);
+        return -1;
+    }
+
+    const uint8_t *ptr = buf;
+    while ((size_t)n >= WAL_FRAME_HEADER) {
+        size_t length      = read_u32(ptr);
+        const uint8_t *hdr = ptr + sizeof(uint32_t) + sizeof(uint64_t);
+        if (length > (size_t)n - WAL_FRAME_HEADER ||
+            (uint64_t)read_i64(ptr + sizeof(uint32_t)) !=
+                fnv1a_hash(hdr, WAL_FRAME_HEADER - sizeof(uint32_t) -
+                                    sizeof(uint64_t) + length)) {
+            log_warning("WAL segment %s torn at %zd", path, ptr - buf);
+            break;
+        }
+
+        wal_frame_t f = {.series  = read_i64(hdr),
+                         .id      = read_i64(hdr + sizeof(uint64_t)),
+                         .kind    = read_u8(hdr + sizeof(uint64_t) * 2),
+                         .base    = read_i64(hdr + sizeof(uint64_t) * 2 + 1),
+                         .payload = ptr + WAL_FRAME_HEADER,
+                         .length  = length};
+        fn(log, seq, &f, userdata);
+
+        ptr += WAL_FRAME_HEADER + length;
+        n -= WAL_FRAME_HEADER + length;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int chunk_append(wal_chunk_t *c, const uint8_t *data, size_t length)
+{
+    if (c->size + length > c->capacity) {
+        size_t capacity = (c->size + length) * 2;
+        uint8_t *ptr    = realloc(c->data, capacity);
+        if (!ptr)
+            return -1;
+        c->data     = ptr;
+        c->capacity = capacity;
+    }
+
+    memcpy(c->data + c->size, data, length);
+    c->size += length;
+
+    return 0;
+}
+
+static void pending_add(wal_log_t *log, wal_chunk_t *c)
+{
+    wal_pending_t *p = hashmap_get(&log->pending, (const char *)&c->series,
+                                   sizeof(c->series));
+    if (!p) {
+        p = calloc(1, sizeof(*p));
+        if (!p)
+            log_critical("Out of memory replaying the WAL");
+        p->series = c->series;
+        hashmap_put(&log->pending, (const char *)&p->series,
+                    sizeof(p->series), p);
+    }
+
+    da_append(&p->chunks, c);
+}
+
+static void pending_remove(wal_log_t *log, const wal_chunk_t *c)
+{
+    wal_pending_t *p = hashmap_get(&log->pending, (const char *)&c->series,
+                                   sizeof(c->series));
+    if (!p)
+        return;
+
+    for (size_t i = 0; i < p->chunks.length; ++i) {
+        if (p->chunks.items[i] != c)
+            continue;
+        p->chunks.items[i] = p->chunks.items[--p->chunks.length];
+        break;
+    }
+
+    if (p->chunks.length == 0) {
+        hashmap_del(&log->pending, (const char *)&p->series,
+                    sizeof(p->series));
+        da_free(&p->chunks);
+        free(p);
+    }
+}
+
+static void chunk_free(wal_chunk_t *c)
+{
+    free(c->data);
+    free(c);
+}
+
+static wal_chunk_t *chunk_new(uint64_t seq, const wal_frame_t *f)
+{
+    wal_chunk_t *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+
+    c->id      = f->id;
+    c->series  = f->series;
+    c->kind    = f->kind;
+    c->base    = f->base;
+    c->segment = seq;
+
+    return c;
+}
+
+static void replay_frame(wal_log_t *log, uint64_t seq, const wal_frame_t *f,
+                         void *userdata)
+{
+    hashmap_t *chunks = userdata;
+    const char *key   = (const char *)&f->id;
+
+    if (f->id >= log->next_id)
+        log->next_id = f->id + 1;
+
+    wal_chunk_t *c = hashmap_get(chunks, key, sizeof(f->id));
+    if (f->kind & WAL_FRAME_DROP) {
+        if (c) {
+            hashmap_del(chunks, key, sizeof(f->id));
+            pending_remove(log, c);
+            chunk_free(c);
+        }
+        return;
+    }
+
+    if (!c) {
+        c = chunk_new(seq, f);
+        if (!c || hashmap_put(chunks, (const char *)&c->id, sizeof(c->id), c) <
+                      0)
+            log_critical("Out of memory replaying the WAL");
+        pending_add(log, c);
+    }
+
+    if (chunk_append(c, f->payload, f->length) < 0)
+        log_critical("Out of memory replaying the WAL");
+}
+
+static void replay_ref(const char *key, size_t key_len, void *value,
+                       void *userdata)
+{
+    wal_chunk_t *c   = value;
+    wal_segment_t *s = log_segment(userdata, c->segment);
+    if (s)
+        s->refs++;
+}
+
+static int segment_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Replay every segment in order, the chunks dropped are forgotten as their
+ * drop frame comes, the ones left are kept pending, each one counted a
+ * reference of the segment it starts in. Appends go to a new segment, the
+ * last one may end with a torn frame.
+ */
+int wal_log_open(wal_log_t *log, const char *path, size_t segment_size)
+{
+    *log = (wal_log_t){.fd = -1, .next_id = 1};
+    snprintf(log->path, sizeof(log->path), "%s", path);
+    log->segment_size = segment_size > 0 ? segment_size : WAL_SEGMENT_SIZE;
+    pthread_mutex_init(&log->lock, NULL);
+
+    hashmap_t chunks;
+    if (hashmap_init(&log->pending, 0) < 0 || hashmap_init(&chunks, 0) < 0)
+        return -1;
+
+    struct dirent **namelist;
+    int n = scandir(path, &namelist, NULL, alphasort);
+    if (n < 0) {
+        log_error("WAL log %s: %s", path, strerror(errno));
+        hashmap_free(&chunks);
+        return -1;
+    }
+
+    darray(uint64_t) seqs = {0};
+    for (int i = 0; i < n; ++i) {
+        const char *name = namelist[i]->d_name;
+        if (strncmp(name, "seg-", 4) == 0)
+            da_append(&seqs, (uint64_t)strtoull(name + 4, NULL, 10));
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    if (seqs.length > 0)
+        qsort(seqs.items, seqs.length, sizeof(*seqs.items), segment_cmp);
+
+    int err = 0;
+    for (size_t i = 0; i < seqs.length && err == 0; ++i) {
+        da_append(&log->segments,
+                  ((wal_segment_t){.seq = seqs.items[i], .refs = 0}));
+        err = log_scan(log, seqs.items[i], replay_frame, &chunks);
+    }
+
+    hashmap_foreach(&chunks, replay_ref, log);
+    size_t replayed = hashmap_length(&chunks);
+    hashmap_free(&chunks);
+
+    uint64_t seq = seqs.length > 0 ? seqs.items[seqs.length - 1] + 1 : 0;
+    da_free(&seqs);
+
+    if (err < 0 || log_segment_open(log, seq) < 0)
+        return -1;
+
+    log_truncate(log);
+
+    log_debug("Replayed WAL log %s, %zu chunks pending", path, replayed);
+
+    return 0;
+}
+
+static void pending_free(const char *key, size_t key_len, void *value,
+                         void *userdata)
+{
+    wal_pending_t *p = value;
+    for (size_t i = 0; i < p->chunks.length; ++i)
+        chunk_free(p->chunks.items[i]);
+    da_free(&p->chunks);
+    free(p);
+}
+
+void wal_log_closing(wal_log_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->closing = 1;
+    pthread_mutex_unlock(&log->lock);
+}
+
+void wal_log_close(wal_log_t *log)
 {
+    if (log->fd >= 0) {
+        wal_datasync(log->fd);
+        close(log->fd);
+        log->fd = -1;
+    }
+
+    hashmap_foreach(&log->pending, pending_free, NULL);
+    hashmap_free(&log->pending);
+    da_free(&log->segments);
+    pthread_mutex_destroy(&log->lock);
+}
+
+// WAL files are loaded by name, head first, then the late points and the tail
+static int ref_rank(int kind)
+{
+    return kind == WAL_HEAD ? 0 : kind == WAL_OOO ? 1 : 2;
+}
+
+static int ref_cmp(const void *a, const void *b)
+{
+    const wal_ref_t *x = a, *y = b;
+    if (ref_rank(x->kind) != ref_rank(y->kind))
+        return ref_rank(x->kind) - ref_rank(y->kind);
+    return x->base < y->base ? -1 : x->base > y->base;
+}
+
+ssize_t wal_log_pending(wal_log_t *log, uint64_t series, wal_ref_t **refs)
+{
+    *refs = NULL;
+
+    pthread_mutex_lock(&log->lock);
+
+    wal_pending_t *p =
+        hashmap_get(&log->pending, (const char *)&series, sizeof(series));
+    size_t n = p ? p->chunks.length : 0;
+    if (n > 0) {
+        *refs = malloc(n * sizeof(**refs));
+        for (size_t i = 0; *refs && i < n; ++i)
+            (*refs)[i] = (wal_ref_t){.kind = p->chunks.items[i]->kind,
+                                     .base = p->chunks.items[i]->base};
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    if (n > 0 && !*refs)
+        return -1;
+
+    if (n > 1)
+        qsort(*refs, n, sizeof(**refs), ref_cmp);
+
+    return n;
+}
+
+void wal_bind(wal_t *w, wal_log_t *log, uint64_t series)
+{
+    w->log    = log;
+    w->series = series;
+}
+
+static void wal_reset(wal_t *w)
+{
+    w->size         = 0;
+    w->written      = 0;
+    w->synced       = 0;
+    w->synced_at_ms = 0;
+    w->id           = 0;
+    w->segment      = WAL_NO_SEGMENT;
+    w->last_seq     = 0;
+    w->last_end     = 0;
+    w->replay       = NULL;
+}
+
+static void collect_frame(wal_log_t *log, uint64_t seq, const wal_frame_t *f,
+                          void *userdata)
+{
+    wal_chunk_t **c = userdata;
+
+    if (f->id != (*c)->id || (f->kind & WAL_FRAME_DROP))
+        return;
+
+    if (chunk_append(*c, f->payload, f->length) < 0)
+        log_critical("Out of memory collecting the WAL");
+}
+
+/*
+ * Gather the frames of a WAL closed back into a chunk pending, to be loaded
+ * again if the series is, its reference on the segment handed over.
+ */
+static int log_collect(wal_log_t *log, const wal_t *w)
+{
+    wal_frame_t f  = {.series = w->series, .id = w->id, .kind = w->kind,
+                      .base = w->base};
+    wal_chunk_t *c = chunk_new(w->segment, &f);
+    if (!c)
+        return -1;
+
+    for (size_t i = 0; i < log->segments.length; ++i) {
+        if (log->segments.items[i].seq < w->segment)
+            continue;
+        if (log_scan(log, log->segments.items[i].seq, collect_frame, &c) < 0) {
+            chunk_free(c);
+            return -1;
+        }
+    }
+
+    pending_add(log, c);
+
+    return 0;
+}
+
+// Takes the chunk pending with the lowest id, matching the kind and base
+static wal_chunk_t *log_claim(wal_log_t *log, uint64_t series, int kind,
+                              uint64_t base)
+{
+    wal_pending_t *p =
+        hashmap_get(&log->pending, (const char *)&series, sizeof(series));
+    if (!p)
+        return NULL;
+
+    wal_chunk_t *c = NULL;
+    for (size_t i = 0; i < p->chunks.length; ++i) {
+        wal_chunk_t *cur = p->chunks.items[i];
+        if (cur->kind == kind && cur->base == base && (!c || cur->id < c->id))
+            c = cur;
+    }
+
+    if (c)
+        pending_remove(log, c);
+
+    return c;
+}
+
+int wal_init(wal_t *w, const char *path, uint64_t base_timestamp, int kind)
+{
+    if (w->log) {
+        wal_reset(w);
+        w->kind = kind;
+        w->base = base_timestamp;
+        w->open = 1;
+        return 0;
+    }
+
     snprintf(w->path, sizeof(w->path), "%s/wal-%c-%.20" PRIu64 ".log", path,
-             t[main], base_timestamp);
+             t[kind], base_timestamp);
     w->fp = fopen(w->path, "w+");
     if (!w->fp)
         goto errdefer;
 
-    w->size = 0;
+    w->size         = 0;
+    w->written      = 0;
+    w->synced       = 0;
+    w->synced_at_ms = 0;
 
     log_debug("Successfully init WAL %s", w->path);
 
@@ -33,32 +587,115 @@ errdefer:
     return -1;
 }
 
+/*
+ * Close the WAL keeping the file on disk, to be replayed at the next start,
+ * anything still buffered is expected to be flushed before.
+ */
+int wal_close(wal_t *w)
+{
+    if (w->log) {
+        if (!w->open)
+            return 0;
+
+        int err = 0;
+        pthread_mutex_lock(&w->log->lock);
+        // Collected only if the series may be loaded again before the log
+        // is, its frames are durable once the log is closed
+        if (w->segment != WAL_NO_SEGMENT && !w->log->closing)
+            err = log_collect(w->log, w);
+        pthread_mutex_unlock(&w->log->lock);
+
+        free(w->replay);
+        wal_reset(w);
+        w->open = 0;
+
+        return err;
+    }
+
+    if (!w->fp)
+        return 0;
+    int err = fclose(w->fp);
+    w->fp   = NULL;
+
+    return err;
+}
+
 int wal_delete(wal_t *w)
 {
+    if (w->log) {
+        if (!w->open)
+            return -1;
+
+        int err = 0;
+        pthread_mutex_lock(&w->log->lock);
+        if (w->segment != WAL_NO_SEGMENT) {
+            uint8_t frame[WAL_FRAME_HEADER];
+            err              = log_append(w->log, w, w->kind | WAL_FRAME_DROP,
+                                          frame, 0);
+            wal_segment_t *s = log_segment(w->log, w->segment);
+            if (s && s->refs > 0)
+                s->refs--;
+            log_truncate(w->log);
+        }
+        pthread_mutex_unlock(&w->log->lock);
+
+        free(w->replay);
+        wal_reset(w);
+        w->open = 0;
+
+        return err;
+    }
+
     if (!w->fp)
         return -1;
     int err = fclose(w->fp);
+    w->fp   = NULL;
     if (err < 0)
         return -1;
-    w->size = 0;
-    char tmp[WAL_PATHSIZE + 5];
-    snprintf(tmp, sizeof(tmp), "%s.log", w->path);
+    // Anything still buffered belongs to a dropped chunk
+    w->size    = 0;
+    w->written = 0;
+    w->synced  = 0;
 
-    return remove(tmp);
+    return remove(w->path);
 }
 
-int wal_load(wal_t *w, const char *path, uint64_t base_timestamp, int main)
+int wal_load(wal_t *w, const char *path, uint64_t base_timestamp, int kind)
 {
-    char path_buf[PATHBUF_SIZE];
-    snprintf(path_buf, sizeof(path_buf), "%s/wal-%c-%.20" PRIu64 ".log", path,
-             t[main], base_timestamp);
-    w->fp = fopen(path_buf, "a+");
+    if (w->log) {
+        wal_init(w, path, base_timestamp, kind);
+
+        pthread_mutex_lock(&w->log->lock);
+        wal_chunk_t *c = log_claim(w->log, w->series, kind, base_timestamp);
+        pthread_mutex_unlock(&w->log->lock);
+
+        // Its frames are all durable already, the segment reference is the
+        // one counted at replay
+        if (c) {
+            w->id      = c->id;
+            w->segment = c->segment;
+            w->size    = c->size;
+            w->written = c->size;
+            w->synced  = c->size;
+            w->replay  = c->data;
+            free(c);
+        }
+
+        return 0;
+    }
+
+    snprintf(w->path, sizeof(w->path), "%s/wal-%c-%.20" PRIu64 ".log", path,
+             t[kind], base_timestamp);
+    w->fp = fopen(w->path, "a+");
     if (!w->fp)
         goto errdefer;
 
-    w->size = filesize(w->fp, 0);
+    w->size         = filesize(w->fp, 0);
+    w->written      = w->size;
+    w->synced       = w->size;
+    w->synced_at_ms = 0;
 
-    log_debug("Successfully loaded WAL %s (%ld)", path_buf, w->size);
+    log_debug("Successfully loaded WAL %s (%ld)", w->path, w->size);
 
     return 0;
 
@@ -67,19 +704,198 @@ errdefer:
     return -1;
 }
 
-int wal_append(wal_t *wal, uint64_t ts, double_t value)
+ssize_t wal_read(wal_t *w, uint8_t *buf)
+{
+    if (!w->log)
+        return read_file(w->fp, buf);
+
+    if (w->replay) {
+        memcpy(buf, w->replay, w->size);
+        free(w->replay);
+        w->replay = NULL;
+    }
+
+    return w->size;
+}
+
+int wal_is_open(const wal_t *w) { return w->log ? w->open : w->fp != NULL; }
+
+static void ring_copy(wal_t *w, const uint8_t *buf, size_t len)
+{
+    size_t pos   = w->size % WAL_RINGSIZE;
+    size_t first = MIN(WAL_RINGSIZE - pos, len);
+
+    memcpy(w->ring + pos, buf, first);
+    memcpy(w->ring, buf + first, len - first);
+}
+
+/*
+ * Append a run of points as a single frame, encoded straight into the ring,
+ * which is drained only when the run doesn't fit in what's left of it.
+ */
+int wal_append_batch(wal_t *wal, const uint64_t *timestamps,
+                     const double_t *values, size_t n)
 {
     uint8_t buf[WAL_RECORDSIZE];
 
-    write_i64(buf, ts);
-    write_f64(buf + sizeof(uint64_t), value);
+    for (size_t i = 0; i < n; ++i) {
+        if (wal->size - wal->written + WAL_RECORDSIZE > WAL_RINGSIZE &&
+            wal_flush(wal, 0) < 0)
+            return -1;
 
+        write_i64(buf, timestamps[i]);
+        write_f64(buf + sizeof(uint64_t), values[i]);
+        ring_copy(wal, buf, WAL_RECORDSIZE);
+
+        wal->size += WAL_RECORDSIZE;
+    }
+
+    return 0;
+}
+
+int wal_append(wal_t *wal, uint64_t ts, double_t value)
+{
     // TODO Fix to handle multiple points in the same timestamp
-    if (pwrite(fileno(wal->fp), buf, WAL_RECORDSIZE, wal->size) < 0)
-        return -1;
+    return wal_append_batch(wal, &ts, &value, 1);
+}
+
+/*
+ * Append the pending bytes, unwrapped from the ring, as a single frame at the
+ * end of the current segment of the shared log. A sync is skipped if the one
+ * of another WAL, or a rotation, already covered the frame.
+ */
+static int wal_flush_shared(wal_t *w, int sync)
+{
+    wal_log_t *log = w->log;
+    size_t pending = w->size - w->written;
+    int err        = 0;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (pending > 0) {
+        uint8_t frame[WAL_FRAME_HEADER + WAL_RINGSIZE];
+        size_t pos   = w->written % WAL_RINGSIZE;
+        size_t first = MIN(WAL_RINGSIZE - pos, pending);
+
+        memcpy(frame + WAL_FRAME_HEADER, w->ring + pos, first);
+        memcpy(frame + WAL_FRAME_HEADER + first, w->ring, pending - first);
+
+        err = log_append(log, w, w->kind, frame, pending);
+        if (err == 0)
+            w->written += pending;
+    }
+
+    if (err == 0 && sync && w->synced < w->written) {
+        if (w->last_seq == log->seq && log->synced < w->last_end) {
+            err = wal_datasync(log->fd);
+            if (err == 0)
+                log->synced = log->size;
+            else
+                log_error("WAL sync %s: %s", log->path, strerror(errno));
+        }
+
+        if (err == 0) {
+            w->synced       = w->written;
+            w->synced_at_ms = current_micros() / 1000;
+        }
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    return err;
+}
+
+int wal_flush(wal_t *w, int sync)
+{
+    if (w->log)
+        return w->open ? wal_flush_shared(w, sync) : 0;
+
+    if (!w->fp)
+        return 0;
+
+    size_t pending = w->size - w->written;
+    if (pending > 0) {
+        size_t pos          = w->written % WAL_RINGSIZE;
+        size_t first        = MIN(WAL_RINGSIZE - pos, pending);
+        struct iovec iov[2] = {{w->ring + pos, first},
+                               {w->ring, pending - first}};
+
+        ssize_t n           = pwritev(fileno(w->fp), iov,
+                                      pending > first ? 2 : 1, w->written);
+        if (n < 0 || (size_t)n != pending) {
+            log_error("WAL write %s: %s", w->path, strerror(errno));
+            return -1;
+        }
+
+        w->written += pending;
+    }
+
+    if (sync && w->synced < w->written) {
+        if (wal_datasync(fileno(w->fp)) < 0) {
+            log_error("WAL sync %s: %s", w->path, strerror(errno));
+            return -1;
+        }
+
+        w->synced       = w->written;
+        w->synced_at_ms = current_micros() / 1000;
+    }
 
-    wal->size += WAL_RECORDSIZE;
     return 0;
 }
 
+static int64_t policy_delay_ms(const wal_policy_t *policy)
+{
+    switch (policy->sync) {
+    case WS_INTERVAL:
+        return policy->interval_ms;
+    case WS_BYTES:
+        return policy->interval_ms > 0 ? policy->interval_ms : WAL_MAX_DELAY_MS;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Apply the durability policy to the pending bytes, force writes and syncs
+ * them anyway. Returns 1 if every byte appended is durable according to the
+ * policy, 0 if some are waiting for the policy to trigger, -1 on error.
+ */
+int wal_commit(wal_t *w, const wal_policy_t *policy, int force)
+{
+    if (!wal_is_open(w))
+        return 1;
+
+    if (policy->sync == WS_OS)
+        return wal_flush(w, 0) < 0 ? -1 : 1;
+
+    if (w->synced == w->size)
+        return 1;
+
+    if (!force && policy->sync != WS_ALWAYS) {
+        int64_t now = current_micros() / 1000;
+        int due     = now - w->synced_at_ms >= policy_delay_ms(policy);
+        if (policy->sync == WS_BYTES)
+            due = due || w->size - w->synced >= policy->bytes;
+        if (!due)
+            return 0;
+    }
+
+    return wal_flush(w, 1) < 0 ? -1 : 1;
+}
+
+/*
+ * Milliseconds before the policy syncs the pending bytes, -1 if there's
+ * nothing waiting.
+ */
+int64_t wal_commit_timeout(const wal_t *w, const wal_policy_t *policy)
+{
+    if (!wal_is_open(w) || w->synced == w->size || policy->sync == WS_OS)
+        return -1;
+
+    int64_t elapsed = current_micros() / 1000 - w->synced_at_ms;
+    int64_t delay   = policy_delay_ms(policy);
+
+    return elapsed >= delay ? 0 : delay - elapsed;
+}
+
 size_t wal_size(const wal_t *wal) { return wal->size; }
@@ -1,27 +1,177 @@
 #ifndef WAL_H
 #define WAL_H
 
+#include "darray.h"
+#include "hashmap.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
-#define WAL_PATHSIZE 512
+#define WAL_PATHSIZE     512
+#define WAL_RINGSIZE     (1 << 14)
+#define WAL_MAX_DELAY_MS 1000
+#define WAL_SEGMENT_SIZE (64 << 20)
+#define WAL_LOG_DIR      ".wal"
 
+/*
+ * WAL kinds, selecting the prefix of the file, the tail (prev) and head chunks
+ * and the out of order buffer of a time series.
+ */
+#define WAL_TAIL         0
+#define WAL_HEAD         1
+#define WAL_OOO          2
+
+/*
+ * Durability policy of a WAL, points are buffered in memory and written in
+ * groups, the policy tells when a group has to hit the disk
+ *
+ * - OS       writes at every commit, syncing is left to the OS
+ * - ALWAYS   writes and syncs at every commit
+ * - INTERVAL writes and syncs at most once every interval_ms
+ * - BYTES    writes and syncs once `bytes` are pending, waiting interval_ms at
+ *            most (WAL_MAX_DELAY_MS if not set)
+ */
+typedef enum wal_sync { WS_OS, WS_ALWAYS, WS_INTERVAL, WS_BYTES } wal_sync_t;
+
+typedef struct wal_policy {
+    wal_sync_t sync;
+    uint32_t interval_ms;
+    size_t bytes;
+} wal_policy_t;
+
+typedef struct wal_segment {
+    uint64_t seq;
+    size_t refs;
+} wal_segment_t;
+
+/*
+ * Chunk replayed from a shared log, its bytes waiting for the series to be
+ * materialized and to load it.
+ */
+typedef struct wal_chunk {
+    uint64_t id;
+    uint64_t series;
+    int kind;
+    uint64_t base;
+    uint64_t segment;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} wal_chunk_t;
+
+typedef struct wal_pending {
+    uint64_t series;
+    darray(wal_chunk_t *) chunks;
+} wal_pending_t;
+
+/*
+ * Log shared by the WALs of all the series of a database, instead of a file
+ * per chunk, one sequential stream of writes. The WALs append frames to the
+ * last segment, each one tagged by the series and the chunk it belongs to,
+ * a chunk dropped once flushed is marked by an empty frame.
+ *
+ * A segment is counted a reference by each chunk starting in it, the oldest
+ * segments are removed once no chunk starts in them, the chunks still live
+ * only ever having frames in the segments that follow.
+ *
+ * At open the segments are replayed and demultiplexed by series, the chunks
+ * left are kept in memory until their series loads them.
+ */
+typedef struct wal_log {
+    pthread_mutex_t lock;
+    char path[WAL_PATHSIZE];
+    int fd;
+    uint64_t seq;
+    size_t size;
+    size_t synced;
+    size_t segment_size;
+    uint64_t next_id;
+    darray(wal_segment_t) segments;
+    hashmap_t pending;
+    int closing;
+} wal_log_t;
+
+// Kind and base of a chunk replayed, the name of a WAL file
+typedef struct wal_ref {
+    int kind;
+    uint64_t base;
+} wal_ref_t;
+
+/*
+ * The ring holds the bytes appended and not yet written, positions in the ring
+ * follow the file offsets, so the pending bytes are always in
+ * [written, size) modulo WAL_RINGSIZE.
+ *
+ * A WAL bound to a shared log has no file of its own, its bytes are written as
+ * frames of the log, the position of the last one kept to tell if a sync of
+ * the log covered it already.
+ */
 typedef struct wal {
     FILE *fp;
     char path[WAL_PATHSIZE];
     size_t size;
+    size_t written;
+    size_t synced;
+    int64_t synced_at_ms;
+    wal_log_t *log;
+    uint64_t series;
+    uint64_t id;
+    int kind;
+    uint64_t base;
+    int open;
+    uint64_t segment;
+    uint64_t last_seq;
+    size_t last_end;
+    uint8_t *replay;
+    uint8_t ring[WAL_RINGSIZE];
 } wal_t;
 
-int wal_init(wal_t *w, const char *path, uint64_t base_timestamp, int main);
+// Opens the shared log in the directory path, replaying its segments
+int wal_log_open(wal_log_t *log, const char *path, size_t segment_size);
+
+// Marks the log as closing, the WALs closed from then on leave their frames
+// in the segments to be replayed at the next open, rather than collected
+void wal_log_closing(wal_log_t *log);
 
-int wal_load(wal_t *w, const char *path, uint64_t base_timestamp, int main);
+// Closes the log, the chunks replayed and never loaded stay in its segments
+void wal_log_close(wal_log_t *log);
+
+// Kinds and bases of the chunks replayed for a series and not loaded yet, in
+// the order the WAL files of a series are loaded, returns their number and
+// the array to free in refs, -1 on error
+ssize_t wal_log_pending(wal_log_t *log, uint64_t series, wal_ref_t **refs);
+
+// Binds the WAL to the shared log, as a WAL of the series, NULL meaning a
+// file of its own, to be called before wal_init or wal_load
+void wal_bind(wal_t *w, wal_log_t *log, uint64_t series);
+
+int wal_init(wal_t *w, const char *path, uint64_t base_timestamp, int kind);
+
+int wal_load(wal_t *w, const char *path, uint64_t base_timestamp, int kind);
+
+// Reads the content of a WAL just loaded, buf sized to hold wal_size bytes
+ssize_t wal_read(wal_t *w, uint8_t *buf);
+
+int wal_is_open(const wal_t *w);
+
+int wal_close(wal_t *w);
 
 int wal_delete(wal_t *w);
 
 int wal_append(wal_t *wal, uint64_t ts, double_t value);
 
+int wal_append_batch(wal_t *wal, const uint64_t *timestamps,
+                     const double_t *values, size_t n);
+
+int wal_flush(wal_t *w, int sync);
+
+int wal_commit(wal_t *w, const wal_policy_t *policy, int force);
+
+int64_t wal_commit_timeout(const wal_t *w, const wal_policy_t *policy);
+
 size_t wal_size(const wal_t *wal);
 
 #endif
@@ -0,0 +1,180 @@
+/*
+ * Throughput of the aggregation kernels against the plain loops over records
+ * they replace, in points per second.
+ *
+ * Build it without sanitizers to get meaningful figures, e.g.
+ *
+ *     make bench CFLAGS="-O2 -pthread -Ilib"
+ */
+#include "../src/aggregate.h"
+#include "../src/timeseries.h"
+#include "../src/timeutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POINTSNR (1 << 20)
+#define ROUNDS   64
+#define INTERVAL 1000
+
+// Keeps the results alive, out of reach of the optimizer
+static volatile double_t sink;
+
+typedef void (*bench_fn)(const record_t *records, const uint64_t *timestamps,
+                         const double_t *values, size_t n);
+
+static void loop_min(const record_t *records, const uint64_t *timestamps,
+                     const double_t *values, size_t n)
+{
+    record_t min = records[0];
+    for (size_t i = 0; i < n; ++i)
+        if (records[i].value < min.value)
+            min = records[i];
+    sink = min.value;
+}
+
+static void kernel_min(const record_t *records, const uint64_t *timestamps,
+                       const double_t *values, size_t n)
+{
+    sink = values[agg_argmin(values, n)];
+}
+
+static void loop_max(const record_t *records, const uint64_t *timestamps,
+                     const double_t *values, size_t n)
+{
+    record_t max = records[0];
+    for (size_t i = 0; i < n; ++i)
+        if (records[i].value > max.value)
+            max = records[i];
+    sink = max.value;
+}
+
+static void kernel_max(const record_t *records, const uint64_t *timestamps,
+                       const double_t *values, size_t n)
+{
+    sink = values[agg_argmax(values, n)];
+}
+
+static void loop_sum(const record_t *records, const uint64_t *timestamps,
+                     const double_t *values, size_t n)
+{
+    double_t sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+        sum += records[i].value;
+    sink = sum;
+}
+
+static void kernel_sum(const record_t *records, const uint64_t *timestamps,
+                       const double_t *values, size_t n)
+{
+    sink = agg_sum(values, n);
+}
+
+static void loop_count(const record_t *records, const uint64_t *timestamps,
+                       const double_t *values, size_t n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+        count += records[i].timestamp >= n / 4 && records[i].timestamp <= n;
+    sink = count;
+}
+
+static void kernel_count(const record_t *records, const uint64_t *timestamps,
+                         const double_t *values, size_t n)
+{
+    sink = agg_count(timestamps, n, n / 4, n);
+}
+
+static void loop_bucket(const record_t *records, const uint64_t *timestamps,
+                        const double_t *values, size_t n)
+{
+    uint64_t current = 0;
+    double_t sum     = 0.0;
+    size_t total     = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t t = records[i].timestamp;
+        if (t == 0 || t % INTERVAL == 0)
+            continue;
+        uint64_t end = (t / INTERVAL + 1) * INTERVAL;
+        if (end != current) {
+            sink += total ? sum / total : 0.0;
+            sum     = 0.0;
+            total   = 0;
+            current = end;
+        }
+        sum += records[i].value;
+        total++;
+    }
+    sink += total ? sum / total : 0.0;
+}
+
+static void kernel_bucket(const record_t *records, const uint64_t *timestamps,
+                          const double_t *values, size_t n)
+{
+    agg_bucket_t b;
+    for (size_t i = 0; i < n;) {
+        i += agg_bucket(timestamps + i, values + i, n - i, 0, INTERVAL, &b);
+        if (b.count > 0)
+            sink += b.sum / b.count;
+    }
+}
+
+static double bench(bench_fn fn, const record_t *records,
+                    const uint64_t *timestamps, const double_t *values,
+                    size_t n)
+{
+    int64_t start = current_nanos();
+    for (int i = 0; i < ROUNDS; ++i)
+        fn(records, timestamps, values, n);
+    int64_t elapsed = current_nanos() - start;
+
+    return (double)n * ROUNDS / ((double)elapsed / 1e9);
+}
+
+int main(void)
+{
+    const struct {
+        const char *name;
+        bench_fn loop;
+        bench_fn kernel;
+    } cases[] = {
+        {"min", loop_min, kernel_min},
+        {"max", loop_max, kernel_max},
+        {"sum", loop_sum, kernel_sum},
+        {"count", loop_count, kernel_count},
+        {"bucket", loop_bucket, kernel_bucket},
+    };
+
+    size_t n             = POINTSNR;
+    record_t *records    = malloc(n * sizeof(*records));
+    uint64_t *timestamps = malloc(n * sizeof(*timestamps));
+    double_t *values     = malloc(n * sizeof(*values));
+    if (!records || !timestamps || !values)
+        return -1;
+
+    srand(42);
+    for (size_t i = 0; i < n; ++i) {
+        timestamps[i] = i + 1;
+        values[i]     = (double_t)rand() / RAND_MAX * 100.0;
+        records[i]    = (record_t){
+               .timestamp = timestamps[i], .value = values[i], .is_set = 1};
+    }
+
+    printf("Aggregation kernels (%s), %zu points x %d rounds\n\n", agg_isa(),
+           n, ROUNDS);
+    printf("%-8s %16s %16s %8s\n", "kernel", "loop pts/s", "kernel pts/s",
+           "speedup");
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        double loop   = bench(cases[i].loop, records, timestamps, values, n);
+        double kernel = bench(cases[i].kernel, records, timestamps, values, n);
+        printf("%-8s %16.0f %16.0f %7.2fx\n", cases[i].name, loop, kernel,
+               kernel / loop);
+    }
+
+    free(records);
+    free(timestamps);
+    free(values);
+
+    return 0;
+}
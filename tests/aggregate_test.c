@@ -0,0 +1,117 @@
+#include "../src/aggregate.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <math.h>
+#include <stdio.h>
+
+#define POINTSNR 131
+
+static int aggregate_kernels_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t timestamps[POINTSNR];
+    double_t values[POINTSNR];
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = (i + 1) * 10;
+        values[i]     = (double_t)((i * 37) % 101) - 50.0;
+    }
+    // Repeated extremes, the first one is expected
+    values[17] = -60.0;
+    values[90] = -60.0;
+    values[33] = 70.0;
+    values[34] = 70.0;
+
+    // Every length, to go through the vector bodies and the scalar tails
+    for (size_t n = 1; n <= POINTSNR; ++n) {
+        size_t min = 0, max = 0;
+        double_t sum = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            if (values[i] < values[min])
+                min = i;
+            if (values[i] > values[max])
+                max = i;
+            sum += values[i];
+        }
+
+        ASSERT_EQ(agg_argmin(values, n), min);
+        ASSERT_EQ(agg_argmax(values, n), max);
+        ASSERT_FEQ(agg_sum(values, n), sum);
+        ASSERT_EQ(agg_count(timestamps, n, 0, UINT64_MAX), n);
+        ASSERT_EQ(agg_count(timestamps, n, 15, 200), n < 20 ? n - 1 : 19);
+    }
+
+    ASSERT_FEQ(agg_sum(values, 0), 0.0);
+
+    // Timestamps past the sign bit compare as unsigned
+    uint64_t high[5] = {1ULL << 63, (1ULL << 63) + 1, UINT64_MAX, 1, 0};
+    ASSERT_EQ(agg_count(high, 5, 1, UINT64_MAX), 4);
+    ASSERT_EQ(agg_count(high, 5, 1ULL << 63, UINT64_MAX - 1), 2);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int aggregate_bucket_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t timestamps[POINTSNR];
+    double_t values[POINTSNR];
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = i * 5;
+        values[i]     = (double_t)i;
+    }
+
+    // Buckets of 100 starting at 0, points on multiples of 100 are skipped
+    agg_bucket_t b;
+    size_t buckets = 0;
+    for (size_t i = 0; i < POINTSNR;) {
+        i += agg_bucket(timestamps + i, values + i, POINTSNR - i, 0, 100, &b);
+        if (b.count == 0)
+            continue;
+
+        size_t first = (b.end - 100) / 5 + 1;
+        size_t last  = POINTSNR - 1 < b.end / 5 - 1 ? POINTSNR - 1
+                                                    : b.end / 5 - 1;
+        double_t sum = 0.0;
+        for (size_t j = first; j <= last; ++j)
+            sum += values[j];
+
+        ASSERT_EQ(b.end, (buckets + 1) * 100);
+        ASSERT_EQ(b.count, last - first + 1);
+        ASSERT_FEQ(b.sum, sum);
+        buckets++;
+    }
+    ASSERT_EQ(buckets, 7);
+
+    // Only boundaries, or points before the start
+    uint64_t boundaries[3] = {100, 200, 300};
+    ASSERT_EQ(agg_bucket(boundaries, values, 3, 0, 100, &b), 3);
+    ASSERT_EQ(b.count, 0);
+    ASSERT_EQ(agg_bucket(boundaries, values, 3, 400, 100, &b), 3);
+    ASSERT_EQ(b.count, 0);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int aggregate_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 2;
+    int success = cases;
+
+    success += aggregate_kernels_test();
+    success += aggregate_bucket_test();
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
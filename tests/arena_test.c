@@ -0,0 +1,94 @@
+#include "../src/arena.h"
+#include "../src/darray.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POINTSNR 4096
+
+static int arena_realloc_test(void)
+{
+    TEST_HEADER;
+
+    arena_t arena;
+    arena_init(&arena, 1 << 10);
+
+    // The last allocation grows in place while there is room in the block
+    uint64_t *a = arena_alloc(&arena, 16 * sizeof(uint64_t));
+    ASSERT_TRUE(a != NULL, " FAIL: arena_alloc failed\n");
+    for (size_t i = 0; i < 16; ++i)
+        a[i] = i;
+
+    uint64_t *b = arena_realloc(&arena, a, 16 * sizeof(uint64_t),
+                                32 * sizeof(uint64_t));
+    ASSERT_TRUE(a == b, " FAIL: last allocation not grown in place\n");
+
+    // Not the last one anymore, the content is moved
+    uint64_t *c = arena_alloc(&arena, sizeof(uint64_t));
+    ASSERT_TRUE(c != NULL, " FAIL: arena_alloc failed\n");
+    uint64_t *d = arena_realloc(&arena, b, 32 * sizeof(uint64_t),
+                                256 * sizeof(uint64_t));
+    ASSERT_TRUE(d != NULL && d != b, " FAIL: allocation not moved\n");
+    for (size_t i = 0; i < 16; ++i)
+        ASSERT_EQ(d[i], i);
+
+    arena_release(&arena);
+    ASSERT_EQ(arena.size, 0);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int arena_darray_reset_test(void)
+{
+    TEST_HEADER;
+
+    arena_t arena;
+    arena_init(&arena, 1 << 12);
+
+    arena_t *a              = &arena;
+    darray(uint64_t) values = {0};
+    for (uint64_t i = 0; i < POINTSNR; ++i)
+        da_append_in(&values, a, i);
+
+    ASSERT_EQ(values.length, POINTSNR);
+    for (uint64_t i = 0; i < POINTSNR; ++i)
+        ASSERT_EQ(values.items[i], i);
+
+    // A reset arena serves the same array again with no new blocks
+    size_t size = arena.size;
+    arena_reset(&arena);
+
+    values.items    = NULL;
+    values.length   = 0;
+    values.capacity = 0;
+    for (uint64_t i = 0; i < POINTSNR; ++i)
+        da_append_in(&values, a, i);
+
+    ASSERT_EQ(arena.size, size);
+    ASSERT_EQ(values.items[POINTSNR - 1], POINTSNR - 1);
+
+    arena_release(&arena);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int arena_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 2;
+    int success = cases;
+
+    success += arena_realloc_test();
+    success += arena_darray_reset_test();
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
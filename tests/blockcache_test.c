@@ -0,0 +1,160 @@
+#include "../src/blockcache.h"
+#include "../src/darray.h"
+#include "../src/partition.h"
+#include "../src/storage.h"
+#include "../src/timeseries.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <stdio.h>
+
+#define TESTDIR  "logdata/blockcachetest"
+#define BASE_TS  1743000000
+#define POINTSNR 1000
+#define BLOCKNR  8
+
+static uint64_t timestamps[POINTSNR];
+static double_t values[POINTSNR];
+
+static void sum_block(const uint64_t *timestamps, const double_t *values,
+                      size_t n, void *userdata)
+{
+    double_t *sum = userdata;
+    for (size_t i = 0; i < n; ++i)
+        *sum += values[i] + (double_t)(timestamps[i] - timestamps[0]);
+}
+
+static int block_cache_lru_test(void)
+{
+    TEST_HEADER;
+
+    block_cache_reset();
+
+    size_t n      = 64;
+    size_t cost   = 0;
+    double_t sum  = 0.0;
+    uint64_t page = block_cache_owner();
+    block_cache_stats_t stats;
+
+    ASSERT_EQ(block_cache_get(page, 0, 100, sum_block, &sum), 0);
+    ASSERT_EQ(block_cache_put(page, 0, 100, timestamps, values, n), 0);
+    block_cache_stats(&stats);
+    cost = stats.used;
+
+    // Room for BLOCKNR blocks, the least recently used are evicted past it
+    block_cache_set_budget(cost * BLOCKNR);
+    for (uint64_t i = 1; i < BLOCKNR; ++i)
+        ASSERT_EQ(
+            block_cache_put(page, i * 100, 100, timestamps, values, n), 0);
+
+    ASSERT_EQ(block_cache_get(page, 0, 100, sum_block, &sum), 1);
+    ASSERT_FEQ(sum, 63.0 * 32.0 + 63.0 * 32.0 * 1e6);
+
+    ASSERT_EQ(
+        block_cache_put(page, BLOCKNR * 100, 100, timestamps, values, n), 0);
+    ASSERT_EQ(block_cache_get(page, 0, 100, sum_block, &sum), 1);
+    ASSERT_EQ(block_cache_get(page, 100, 100, sum_block, &sum), 0);
+    ASSERT_EQ(block_cache_get(page, 200, 100, sum_block, &sum), 1);
+
+    // Another owner doesn't see the blocks, a block of another size is stale
+    ASSERT_EQ(block_cache_get(block_cache_owner(), 0, 100, sum_block, &sum),
+              0);
+    ASSERT_EQ(block_cache_get(page, 200, 120, sum_block, &sum), 0);
+    ASSERT_EQ(block_cache_get(page, 200, 100, sum_block, &sum), 0);
+
+    block_cache_stats(&stats);
+    ASSERT_EQ(stats.hits, 3);
+    ASSERT_EQ(stats.misses, 5);
+    ASSERT_EQ(stats.evictions, 1);
+    ASSERT_EQ(stats.blocks, BLOCKNR - 1);
+    ASSERT_EQ(stats.used, cost * (BLOCKNR - 1));
+
+    // A block past the whole budget is not cached
+    ASSERT_EQ(block_cache_put(page, 0, 100, timestamps, values, POINTSNR),
+              -1);
+
+    block_cache_set_budget(BLOCK_CACHE_BUDGET);
+    block_cache_reset();
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int block_cache_partition_test(void)
+{
+    TEST_HEADER;
+
+    block_cache_reset();
+
+    partition_t p = {0};
+    ASSERT_EQ(partition_init(&p, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps, values, POINTSNR), 0);
+
+    uint64_t t0 = timestamps[100], t1 = timestamps[900];
+    record_array_t cold = {0}, hot = {0};
+
+    // The first read decodes and caches the blocks, the second one is served
+    // from memory
+    ASSERT_EQ(partition_range(&p, &cold, t0, t1), 801);
+    block_cache_stats_t stats;
+    block_cache_stats(&stats);
+    ASSERT_EQ(stats.hits, 0);
+    ASSERT_EQ(stats.blocks, stats.misses);
+
+    ASSERT_EQ(partition_range(&p, &hot, t0, t1), 801);
+    block_cache_stats(&stats);
+    ASSERT_EQ(stats.hits, stats.misses);
+
+    for (size_t i = 0; i < hot.length; ++i) {
+        ASSERT_EQ(hot.items[i].timestamp, cold.items[i].timestamp);
+        ASSERT_EQ(hot.items[i].tv.tv_sec, cold.items[i].tv.tv_sec);
+        ASSERT_FEQ(hot.items[i].value, cold.items[i].value);
+    }
+
+    record_t r = {0};
+    ASSERT_EQ(partition_find(&p, &r, timestamps[500]), 0);
+    ASSERT_FEQ(r.value, values[500]);
+
+    // Reloaded, the partition gets blocks of its own
+    size_t misses = stats.misses;
+    partition_close(&p);
+    ASSERT_EQ(partition_load(&p, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(partition_find(&p, &r, timestamps[500]), 0);
+    ASSERT_FEQ(r.value, values[500]);
+    block_cache_stats(&stats);
+    ASSERT_EQ(stats.misses, misses + 1);
+
+    da_free(&cold);
+    da_free(&hot);
+    partition_close(&p);
+    block_cache_reset();
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int block_cache_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 2;
+    int success = cases;
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = BASE_TS * (uint64_t)1e9 + i * (uint64_t)1e6;
+        values[i]     = (double_t)(i % 64);
+    }
+
+    makedir(TESTDIR);
+
+    success += block_cache_lru_test();
+    success += block_cache_partition_test();
+
+    rm_recursive(TESTDIR);
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
@@ -0,0 +1,272 @@
+#include "../src/darray.h"
+#include "../src/fdcache.h"
+#include "../src/partition.h"
+#include "../src/segmap.h"
+#include "../src/storage.h"
+#include "../src/timeseries.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TESTDIR     "logdata/fdcachetest"
+#define BASE_TS     1743000000
+#define HANDLESNR   8
+#define PARTITIONNR 6
+#define POINTSNR    200
+
+static uint64_t timestamps[POINTSNR];
+static double_t values[POINTSNR];
+
+static int fdcache_lru_test(void)
+{
+    TEST_HEADER;
+
+    fdhandle_t handles[HANDLESNR];
+    char path[PATHBUF_SIZE];
+    fdcache_stats_t stats;
+
+    fdcache_set_limit(4);
+    fdcache_reset_stats();
+
+    for (size_t i = 0; i < HANDLESNR; ++i) {
+        snprintf(path, sizeof(path), "%s/f-%zu", TESTDIR, i);
+        ASSERT_EQ(fdcache_open(&handles[i], path, O_RDWR | O_CREAT), 0);
+    }
+
+    // Only the most recently opened are left open
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.opens, HANDLESNR);
+    ASSERT_EQ(stats.closes, HANDLESNR - 4);
+    ASSERT_EQ(stats.open, 4);
+    ASSERT_TRUE(handles[0].fd < 0, " FAIL: least recently used left open\n");
+    ASSERT_TRUE(handles[HANDLESNR - 1].fd >= 0, " FAIL: handle closed\n");
+
+    // A handle closed is reopened on access, writes land in the same file
+    int fd = fdcache_acquire(&handles[0]);
+    ASSERT_TRUE(fd >= 0, " FAIL: handle not reopened\n");
+    ASSERT_EQ(pwrite(fd, "abcd", 4, 0), 4);
+    fdcache_release(&handles[0]);
+    fd = fdcache_acquire(&handles[HANDLESNR - 1]);
+    ASSERT_TRUE(fd >= 0, " FAIL: handle not open\n");
+    fdcache_release(&handles[HANDLESNR - 1]);
+
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.hits, 1);
+    ASSERT_EQ(stats.misses, 1);
+    ASSERT_EQ(stats.open, 4);
+
+    // Pinned handles stay open, the limit is exceeded rather than closing them
+    for (size_t i = 0; i < HANDLESNR; ++i)
+        ASSERT_TRUE(fdcache_acquire(&handles[i]) >= 0,
+                    " FAIL: handle not acquired\n");
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.open, HANDLESNR);
+
+    for (size_t i = 0; i < HANDLESNR; ++i)
+        fdcache_release(&handles[i]);
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.open, 4);
+
+    // A file moved is reopened from its new path
+    char moved[PATHBUF_SIZE];
+    snprintf(path, sizeof(path), "%s/f-0", TESTDIR);
+    snprintf(moved, sizeof(moved), "%s/moved", TESTDIR);
+    ASSERT_EQ(rename(path, moved), 0);
+    ASSERT_EQ(fdcache_rename(&handles[0], moved), 0);
+    fdcache_set_limit(2);
+    ASSERT_TRUE(handles[0].fd < 0, " FAIL: handle left open\n");
+
+    char buf[4] = {0};
+    fd          = fdcache_acquire(&handles[0]);
+    ASSERT_TRUE(fd >= 0, " FAIL: moved handle not reopened\n");
+    ASSERT_EQ(pread(fd, buf, 4, 0), 4);
+    ASSERT_EQ(memcmp(buf, "abcd", 4), 0);
+    fdcache_release(&handles[0]);
+
+    for (size_t i = 0; i < HANDLESNR; ++i)
+        fdcache_close(&handles[i]);
+
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.open, 0);
+    ASSERT_EQ(stats.opens, stats.closes);
+
+    fdcache_set_limit(FDCACHE_DEFAULT_LIMIT);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int fdcache_partition_test(void)
+{
+    TEST_HEADER;
+
+    partition_catalog_t pc = {0};
+    fdcache_stats_t stats;
+
+    // Room for two partitions, each one a commit log and an index
+    fdcache_set_limit(4);
+    fdcache_reset_stats();
+
+    for (size_t i = 0; i < PARTITIONNR; ++i) {
+        partition_t *p = calloc(1, sizeof(*p));
+        ASSERT_TRUE(p != NULL, " FAIL: out of memory\n");
+        ASSERT_EQ(partition_init(p, TESTDIR, BASE_TS + i * 10), 0);
+        ASSERT_EQ(partition_catalog_add(&pc, p), 0);
+
+        for (size_t j = 0; j < POINTSNR; ++j)
+            timestamps[j] = (BASE_TS + i * 10) * (uint64_t)1e9 + j * 1000;
+        ASSERT_EQ(partition_flush_columns(p, timestamps, values, POINTSNR), 0);
+        ASSERT_EQ(partition_sync(p), 0);
+    }
+
+    fdcache_stats(&stats);
+    ASSERT_TRUE(stats.open <= 4, " FAIL: limit exceeded\n");
+
+    // The most recent partition is pinned, the others reopened as needed
+    partition_t *last = partition_catalog_last(&pc);
+    ASSERT_TRUE(last->pinned, " FAIL: last partition not pinned\n");
+    ASSERT_TRUE(last->clog.fh.fd >= 0 && last->index.fh.fd >= 0,
+                " FAIL: last partition closed\n");
+    ASSERT_TRUE(pc.items[0]->clog.fh.fd < 0, " FAIL: partition left open\n");
+
+    for (size_t i = 0; i < PARTITIONNR; ++i) {
+        record_array_t records = {0};
+        ASSERT_EQ(partition_read(pc.items[i], &records), POINTSNR);
+        ASSERT_EQ(records.items[POINTSNR - 1].timestamp,
+                  (BASE_TS + i * 10) * (uint64_t)1e9 + (POINTSNR - 1) * 1000);
+        ASSERT_FEQ(records.items[7].value, values[7]);
+        da_free(&records);
+    }
+
+    fdcache_stats(&stats);
+    ASSERT_TRUE(stats.misses >= PARTITIONNR - 2,
+                " FAIL: closed partitions not reopened\n");
+    ASSERT_TRUE(stats.open <= 4, " FAIL: limit exceeded\n");
+    ASSERT_TRUE(last->clog.fh.fd >= 0, " FAIL: last partition closed\n");
+
+    // Loaded back, the tail is pinned again
+    partition_catalog_free(&pc);
+    for (size_t i = 0; i < PARTITIONNR; ++i) {
+        partition_t *p = calloc(1, sizeof(*p));
+        ASSERT_TRUE(p != NULL, " FAIL: out of memory\n");
+        ASSERT_EQ(partition_load(p, TESTDIR, BASE_TS + i * 10), 0);
+        ASSERT_EQ(partition_catalog_add(&pc, p), 0);
+    }
+
+    ASSERT_TRUE(partition_catalog_last(&pc)->pinned,
+                " FAIL: last partition not pinned\n");
+    ASSERT_EQ(pc.items[PARTITIONNR - 2]->pinned, 0);
+
+    record_t r = {0};
+    ASSERT_EQ(partition_find(pc.items[0], &r, BASE_TS * (uint64_t)1e9), 0);
+    ASSERT_FEQ(r.value, values[0]);
+
+    partition_catalog_free(&pc);
+
+    fdcache_stats(&stats);
+    ASSERT_EQ(stats.open, 0);
+
+    fdcache_set_limit(FDCACHE_DEFAULT_LIMIT);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int segmap_pin_test(void)
+{
+    TEST_HEADER;
+
+    partition_t parts[PARTITIONNR] = {0};
+    char path[PATHBUF_SIZE];
+    snprintf(path, sizeof(path), "%s/segmap", TESTDIR);
+    ASSERT_EQ(makedir(path), 0);
+
+    for (size_t i = 0; i < PARTITIONNR; ++i) {
+        for (size_t j = 0; j < POINTSNR; ++j)
+            timestamps[j] = (BASE_TS + i * 10) * (uint64_t)1e9 + j * 1000;
+        ASSERT_EQ(partition_init(&parts[i], path, BASE_TS + i * 10), 0);
+        ASSERT_EQ(partition_flush_columns(&parts[i], timestamps, values,
+                                          POINTSNR),
+                  0);
+    }
+
+    segmap_set_limit(2);
+
+    // A region being read stays mapped while the others are mapped around it
+    const commitlog_t *cl = &parts[0].clog;
+    const uint8_t *pinned = NULL;
+    ASSERT_EQ(cl_read_at(cl, &pinned, 0, cl->size), (ssize_t)cl->size);
+
+    uint8_t *copy = malloc(cl->size);
+    ASSERT_TRUE(copy != NULL, " FAIL: out of memory\n");
+    memcpy(copy, pinned, cl->size);
+
+    for (size_t i = 1; i < PARTITIONNR; ++i) {
+        const uint8_t *ptr = NULL;
+        ASSERT_TRUE(cl_read_at(&parts[i].clog, &ptr, 0, 1) == 1,
+                    " FAIL: read failed\n");
+        cl_release(&parts[i].clog);
+    }
+
+    ASSERT_TRUE(cl->map.addr == pinned, " FAIL: pinned segment unmapped\n");
+    ASSERT_EQ(memcmp(copy, pinned, cl->size), 0);
+
+    // Grown while pinned, the old mapping is kept until released
+    size_t size = cl->size;
+    for (size_t j = 0; j < POINTSNR; ++j)
+        timestamps[j] = BASE_TS * (uint64_t)1e9 + (POINTSNR + j) * 1000;
+    ASSERT_EQ(partition_flush_columns(&parts[0], timestamps, values,
+                                      POINTSNR),
+              0);
+
+    const uint8_t *grown = NULL;
+    ASSERT_EQ(cl_read_at(cl, &grown, 0, cl->size), (ssize_t)cl->size);
+    ASSERT_EQ(memcmp(copy, pinned, size), 0);
+    ASSERT_EQ(memcmp(copy, grown, size), 0);
+    ASSERT_TRUE(cl->map.retired != NULL, " FAIL: old mapping dropped\n");
+
+    cl_release(cl);
+    cl_release(cl);
+    ASSERT_TRUE(cl->map.retired == NULL, " FAIL: old mapping kept\n");
+    ASSERT_TRUE(segmap_count() <= 2, " FAIL: limit exceeded\n");
+
+    free(copy);
+    for (size_t i = 0; i < PARTITIONNR; ++i)
+        partition_close(&parts[i]);
+
+    ASSERT_EQ(segmap_count(), 0);
+    segmap_set_limit(SEGMAP_DEFAULT_LIMIT);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int fdcache_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 3;
+    int success = cases;
+
+    for (size_t i = 0; i < POINTSNR; ++i)
+        values[i] = (double_t)i * 1.5;
+
+    makedir(TESTDIR);
+
+    success += fdcache_lru_test();
+    success += fdcache_partition_test();
+    success += segmap_pin_test();
+
+    rm_recursive(TESTDIR);
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
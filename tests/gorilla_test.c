@@ -0,0 +1,197 @@
+#include "../src/binary.h"
+#include "../src/commitlog.h"
+#include "../src/gorilla.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POINTSNR 512
+
+static int roundtrip(const uint64_t *timestamps, const double_t *values,
+                     size_t count, uint8_t *buf, size_t *size)
+{
+    gorilla_encoder_t encoder;
+    gorilla_encoder_init(&encoder, buf);
+
+    for (size_t i = 0; i < count; ++i)
+        gorilla_encoder_append(&encoder, timestamps[i], values[i]);
+
+    *size = gorilla_encoder_size(&encoder);
+
+    gorilla_decoder_t decoder;
+    gorilla_decoder_init(&decoder, buf, *size, count);
+
+    uint64_t ts    = 0;
+    double_t value = 0.0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (gorilla_decoder_next(&decoder, &ts, &value) < 0)
+            return -1;
+        if (ts != timestamps[i] || value != values[i])
+            return -1;
+    }
+
+    // Exhausted stream
+    if (gorilla_decoder_next(&decoder, &ts, &value) == 0)
+        return -1;
+
+    return 0;
+}
+
+static int gorilla_regular_interval_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t timestamps[POINTSNR];
+    double_t values[POINTSNR];
+    uint8_t buf[GORILLA_MAX_SIZE(POINTSNR)];
+    size_t size = 0;
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = 1743000000 * (uint64_t)1e9 + i * (uint64_t)1e9;
+        values[i]     = 21.5;
+    }
+
+    ASSERT_EQ(roundtrip(timestamps, values, POINTSNR, buf, &size), 0);
+
+    // A regular series of constant values should take just a couple of bits
+    // per point, against the 24 bytes of the fixed size records
+    ASSERT_TRUE(size * 10 < POINTSNR * 24,
+                " FAIL: regular series not compressed enough\n");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int gorilla_irregular_interval_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t timestamps[POINTSNR];
+    double_t values[POINTSNR];
+    uint8_t buf[GORILLA_MAX_SIZE(POINTSNR)];
+    size_t size = 0;
+
+    srand(47);
+
+    uint64_t ts = 1743000000 * (uint64_t)1e9;
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        // Mix of nanoseconds jitter and big gaps, to exercise all the
+        // delta-of-delta buckets
+        ts += (i % 64 == 0) ? (uint64_t)rand() * 1000 : rand() % 115000;
+        timestamps[i] = ts;
+        values[i]     = (i % 3 == 0) ? -(double_t)rand() / RAND_MAX
+                                     : (double_t)(rand() % 100);
+    }
+
+    ASSERT_EQ(roundtrip(timestamps, values, POINTSNR, buf, &size), 0);
+    ASSERT_TRUE(size <= GORILLA_MAX_SIZE(POINTSNR),
+                " FAIL: encoded size over the upper bound\n");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int gorilla_truncated_stream_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t timestamps[POINTSNR];
+    double_t values[POINTSNR];
+    uint8_t buf[GORILLA_MAX_SIZE(POINTSNR)];
+    size_t size = 0;
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = 1743000000 * (uint64_t)1e9 + i * 15000;
+        values[i]     = (double_t)i * 0.5;
+    }
+
+    ASSERT_EQ(roundtrip(timestamps, values, POINTSNR, buf, &size), 0);
+
+    gorilla_decoder_t decoder;
+    gorilla_decoder_init(&decoder, buf, size / 2, POINTSNR);
+
+    uint64_t ts    = 0;
+    double_t value = 0.0;
+    size_t decoded = 0;
+
+    while (gorilla_decoder_next(&decoder, &ts, &value) == 0)
+        decoded++;
+
+    ASSERT_TRUE(decoded < POINTSNR,
+                " FAIL: decoded more points than the truncated stream\n");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int cl_frame_read_test(void)
+{
+    TEST_HEADER;
+
+    uint8_t buf[CL_BLOCK_HEADER_SIZE + GORILLA_MAX_SIZE(2)];
+    cl_frame_t frame = {0};
+
+    // Legacy fixed size record
+    write_i64(buf, sizeof(uint64_t) * 3);
+    write_i64(buf + sizeof(uint64_t), 1743000000123456789);
+    write_f64(buf + sizeof(uint64_t) * 2, 12.5);
+
+    ASSERT_EQ(cl_frame_read(buf, sizeof(uint64_t) * 3, &frame),
+              sizeof(uint64_t) * 3);
+    ASSERT_EQ(frame.version, CL_FRAME_V0);
+    ASSERT_EQ(frame.count, 1);
+    ASSERT_EQ(frame.first_ts, 1743000000123456789);
+    ASSERT_FEQ(read_f64(frame.payload), 12.5);
+
+    // Compressed block
+    gorilla_encoder_t encoder;
+    gorilla_encoder_init(&encoder, buf + CL_BLOCK_HEADER_SIZE);
+    gorilla_encoder_append(&encoder, 1743000000000000000, 1.0);
+    gorilla_encoder_append(&encoder, 1743000001000000000, 2.0);
+
+    cl_frame_t block = {.count        = 2,
+                        .first_ts     = 1743000000000000000,
+                        .last_ts      = 1743000001000000000,
+                        .payload_size = gorilla_encoder_size(&encoder)};
+    size_t len = cl_block_header_write(buf, &block) + block.payload_size;
+
+    ASSERT_EQ(cl_frame_read(buf, len, &frame), len);
+    ASSERT_EQ(frame.version, CL_BLOCK_V1);
+    ASSERT_EQ(frame.count, 2);
+    ASSERT_EQ(frame.first_ts, block.first_ts);
+    ASSERT_EQ(frame.last_ts, block.last_ts);
+
+    // Truncated block
+    ASSERT_EQ(cl_frame_read(buf, len - 1, &frame), -1);
+
+    // Unknown version
+    buf[0] = 0x7F;
+    ASSERT_EQ(cl_frame_read(buf, len, &frame), -1);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int gorilla_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 4;
+    int success = cases;
+
+    success += gorilla_regular_interval_test();
+    success += gorilla_irregular_interval_test();
+    success += gorilla_truncated_stream_test();
+    success += cl_frame_read_test();
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Lookups per second of the hash table against the fixed 64 buckets chained
+ * table it replaced, with 1M series names.
+ *
+ * Build it without sanitizers to get meaningful figures, e.g.
+ *
+ *     make bench CFLAGS="-O2 -pthread -Ilib"
+ */
+#include "../src/hash.h"
+#include "../src/hashmap.h"
+#include "../src/timeutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYSNR   (1 << 20)
+#define KEY_SIZE 32
+#define LOOKUPS  (1 << 22)
+#define BUCKETS  64
+// The chained table walks chains thousands of entries long, fewer lookups
+#define CHAINED_LOOKUPS (1 << 12)
+
+// Keeps the results alive, out of reach of the optimizer
+static volatile size_t sink;
+
+typedef struct chained_entry {
+    const char *key;
+    struct chained_entry *next;
+} chained_entry_t;
+
+static chained_entry_t *chained_get(chained_entry_t **buckets,
+                                    const char *key)
+{
+    size_t bucket = murmur3_hash((const uint8_t *)key, 0) % BUCKETS;
+    for (chained_entry_t *e = buckets[bucket]; e; e = e->next)
+        if (strcmp(e->key, key) == 0)
+            return e;
+    return NULL;
+}
+
+int main(void)
+{
+    char(*keys)[KEY_SIZE]     = malloc(KEYSNR * sizeof(*keys));
+    size_t *order             = malloc(LOOKUPS * sizeof(*order));
+    chained_entry_t *entries  = malloc(KEYSNR * sizeof(*entries));
+    chained_entry_t **buckets = calloc(BUCKETS, sizeof(*buckets));
+    if (!keys || !order || !entries || !buckets)
+        return -1;
+
+    srand(42);
+    for (size_t i = 0; i < KEYSNR; ++i)
+        snprintf(keys[i], KEY_SIZE, "host-%zu.cpu.usage", i);
+    for (size_t i = 0; i < LOOKUPS; ++i)
+        order[i] = (size_t)rand() % KEYSNR;
+
+    hashmap_t hm;
+    if (hashmap_init(&hm, 0) < 0)
+        return -1;
+
+    int64_t start = current_nanos();
+    for (size_t i = 0; i < KEYSNR; ++i)
+        hashmap_put(&hm, keys[i], strlen(keys[i]), keys[i]);
+    int64_t insert = current_nanos() - start;
+
+    start          = current_nanos();
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        const char *key = keys[order[i]];
+        sink += hashmap_get(&hm, key, strlen(key)) != NULL;
+    }
+    int64_t lookup = current_nanos() - start;
+
+    for (size_t i = 0; i < KEYSNR; ++i) {
+        size_t bucket = murmur3_hash((const uint8_t *)keys[i], 0) % BUCKETS;
+        entries[i]    = (chained_entry_t){.key  = keys[i],
+                                          .next = buckets[bucket]};
+        buckets[bucket] = &entries[i];
+    }
+
+    start = current_nanos();
+    for (size_t i = 0; i < CHAINED_LOOKUPS; ++i)
+        sink += chained_get(buckets, keys[order[i]]) != NULL;
+    int64_t chained = current_nanos() - start;
+
+    printf("Hash table, %d keys\n\n", KEYSNR);
+    printf("%-24s %16.0f\n", "inserts/s", KEYSNR / ((double)insert / 1e9));
+    printf("%-24s %16.0f\n", "lookups/s", LOOKUPS / ((double)lookup / 1e9));
+    printf("%-24s %16.0f\n", "chained lookups/s",
+           CHAINED_LOOKUPS / ((double)chained / 1e9));
+
+    hashmap_free(&hm);
+    free(keys);
+    free(order);
+    free(entries);
+    free(buckets);
+
+    return 0;
+}
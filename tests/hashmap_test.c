@@ -0,0 +1,122 @@
+#include "../src/hashmap.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KEYSNR   100000
+#define KEY_SIZE 16
+
+static char keys[KEYSNR][KEY_SIZE];
+
+static int hashmap_exact_key_test(void)
+{
+    TEST_HEADER;
+
+    hashmap_t hm;
+    ASSERT_EQ(hashmap_init(&hm, 0), 0);
+
+    // Keys sharing a prefix are told apart by their length
+    int cpu = 1, cpu_usage = 2;
+    ASSERT_EQ(hashmap_put(&hm, "cpu_usage", 9, &cpu_usage), 1);
+    ASSERT_TRUE(hashmap_get(&hm, "cpu", 3) == NULL,
+                " FAIL: prefix of a key found\n");
+    ASSERT_EQ(hashmap_put(&hm, "cpu", 3, &cpu), 1);
+    ASSERT_TRUE(hashmap_get(&hm, "cpu", 3) == &cpu, " FAIL: wrong value\n");
+    ASSERT_TRUE(hashmap_get(&hm, "cpu_usage", 9) == &cpu_usage,
+                " FAIL: wrong value\n");
+    ASSERT_TRUE(hashmap_get(&hm, "cpu_usage_total", 15) == NULL,
+                " FAIL: missing key found\n");
+
+    // Keys aren't required to be NUL terminated
+    ASSERT_TRUE(hashmap_get(&hm, "cpu_usage", 3) == &cpu,
+                " FAIL: key not bound by its length\n");
+
+    // Existing keys keep their value
+    ASSERT_EQ(hashmap_put(&hm, "cpu", 3, &cpu_usage), 0);
+    ASSERT_TRUE(hashmap_get(&hm, "cpu", 3) == &cpu, " FAIL: value replaced\n");
+
+    ASSERT_TRUE(hashmap_del(&hm, "cpu", 3) == &cpu, " FAIL: wrong value\n");
+    ASSERT_TRUE(hashmap_get(&hm, "cpu", 3) == NULL, " FAIL: key not removed\n");
+    ASSERT_TRUE(hashmap_del(&hm, "cpu", 3) == NULL,
+                " FAIL: key removed twice\n");
+    ASSERT_EQ(hashmap_length(&hm), 1);
+
+    hashmap_free(&hm);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static void count_entries(const char *key, size_t key_len, void *value,
+                          void *userdata)
+{
+    size_t *count = userdata;
+    if ((char *)value == key)
+        (*count)++;
+}
+
+static int hashmap_resize_test(void)
+{
+    TEST_HEADER;
+
+    hashmap_t hm;
+    ASSERT_EQ(hashmap_init(&hm, 0), 0);
+
+    // Every key stays reachable while the entries move across resizes
+    for (size_t i = 0; i < KEYSNR; ++i) {
+        ASSERT_EQ(hashmap_put(&hm, keys[i], strlen(keys[i]), keys[i]), 1);
+        if (i % 997 == 0) {
+            for (size_t j = 0; j <= i; j += 101)
+                ASSERT_TRUE(hashmap_get(&hm, keys[j], strlen(keys[j])) ==
+                                keys[j],
+                            " FAIL: key lost while resizing\n");
+        }
+    }
+
+    ASSERT_EQ(hashmap_length(&hm), KEYSNR);
+    ASSERT_TRUE(hm.table.capacity * 3 >= KEYSNR * 4,
+                " FAIL: table not grown\n");
+
+    // Half removed, the tombstones left are swept by later resizes
+    for (size_t i = 0; i < KEYSNR; i += 2)
+        ASSERT_TRUE(hashmap_del(&hm, keys[i], strlen(keys[i])) == keys[i],
+                    " FAIL: wrong value\n");
+    for (size_t i = 0; i < KEYSNR; i += 2)
+        ASSERT_EQ(hashmap_put(&hm, keys[i], strlen(keys[i]), keys[i]), 1);
+
+    size_t count = 0;
+    hashmap_foreach(&hm, count_entries, &count);
+    ASSERT_EQ(count, KEYSNR);
+    ASSERT_EQ(hashmap_length(&hm), KEYSNR);
+
+    for (size_t i = 0; i < KEYSNR; ++i)
+        ASSERT_TRUE(hashmap_get(&hm, keys[i], strlen(keys[i])) == keys[i],
+                    " FAIL: key lost\n");
+
+    hashmap_free(&hm);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int hashmap_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 2;
+    int success = cases;
+
+    for (size_t i = 0; i < KEYSNR; ++i)
+        snprintf(keys[i], KEY_SIZE, "series-%zu", i);
+
+    success += hashmap_exact_key_test();
+    success += hashmap_resize_test();
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
@@ -0,0 +1,180 @@
+#include "../src/binary.h"
+#include "../src/index.h"
+#include "../src/storage.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <stdio.h>
+
+#define TESTDIR  "logdata/indextest"
+#define BASE_TS  1743000000
+#define ENTRYNR  1024
+#define INTERVAL (uint64_t)1e9
+
+static uint64_t entry_ts(size_t i)
+{
+    return BASE_TS * (uint64_t)1e9 + i * INTERVAL;
+}
+
+static int check_ranges(const index_t *pi)
+{
+    range_t r = {0};
+
+    // Exact match on every entry, the range covers the whole block
+    for (size_t i = 0; i < ENTRYNR; ++i) {
+        ASSERT_EQ(index_find(pi, entry_ts(i), &r), 0);
+        ASSERT_EQ(r.start, i * 100);
+        ASSERT_EQ(r.end, i == ENTRYNR - 1 ? -1 : (int64_t)(i + 1) * 100);
+    }
+
+    // In between two entries
+    ASSERT_EQ(index_find(pi, entry_ts(300) + INTERVAL / 2, &r), 0);
+    ASSERT_EQ(r.start, 300 * 100);
+    ASSERT_EQ(r.end, 301 * 100);
+
+    // Before the first entry
+    ASSERT_EQ(index_find(pi, entry_ts(0) - 1, &r), 0);
+    ASSERT_EQ(r.start, 0);
+    ASSERT_EQ(r.end, 0);
+
+    // Past the last entry
+    ASSERT_EQ(index_find(pi, entry_ts(ENTRYNR) + 1, &r), 0);
+    ASSERT_EQ(r.start, (ENTRYNR - 1) * 100);
+    ASSERT_EQ(r.end, -1);
+
+    return 0;
+}
+
+static int index_find_test(void)
+{
+    TEST_HEADER;
+
+    index_t index = {0};
+
+    ASSERT_EQ(index_init(&index, TESTDIR, BASE_TS), 0);
+
+    for (size_t i = 0; i < ENTRYNR; ++i)
+        ASSERT_EQ(index_append(&index, entry_ts(i), i * 100, NULL), 0);
+
+    ASSERT_EQ(index.entries.length, ENTRYNR);
+    ASSERT_EQ(check_ranges(&index), 0);
+
+    index_close(&index);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int index_load_test(void)
+{
+    TEST_HEADER;
+
+    index_t index = {0};
+
+    // Reload the index written by the previous test, well over the 4 KB
+    // that used to be read on each lookup
+    ASSERT_EQ(index_load(&index, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(index.entries.length, ENTRYNR);
+    ASSERT_EQ(check_ranges(&index), 0);
+
+    // Appends after a load keep memory and file in sync
+    ASSERT_EQ(
+        index_append(&index, entry_ts(ENTRYNR), ENTRYNR * 100, NULL), 0);
+    index_close(&index);
+
+    ASSERT_EQ(index_load(&index, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(index.entries.length, ENTRYNR + 1);
+    ASSERT_EQ(index.entries.items[ENTRYNR].offset, ENTRYNR * 100);
+    index_close(&index);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int index_summary_test(void)
+{
+    TEST_HEADER;
+
+    index_t index = {0};
+
+    ASSERT_EQ(index_init(&index, TESTDIR, BASE_TS + 1), 0);
+
+    index_summary_t summary = {.first_ts = entry_ts(10),
+                               .last_ts  = entry_ts(12),
+                               .count    = 3,
+                               .min_ts   = entry_ts(11),
+                               .max_ts   = entry_ts(12),
+                               .sum      = 6.0,
+                               .min      = 1.0,
+                               .max      = 3.0,
+                               .first    = 2.0,
+                               .last     = 3.0};
+    ASSERT_EQ(index_append(&index, entry_ts(10), 0, &summary), 0);
+    index_close(&index);
+
+    // Summaries survive a reload
+    ASSERT_EQ(index_load(&index, TESTDIR, BASE_TS + 1), 0);
+    ASSERT_EQ(index.version, INDEX_V1);
+    ASSERT_EQ(index.entries.length, 1);
+    const index_summary_t *s = &index.entries.items[0].summary;
+    ASSERT_EQ(s->first_ts, entry_ts(10));
+    ASSERT_EQ(s->last_ts, entry_ts(12));
+    ASSERT_EQ(s->count, 3);
+    ASSERT_EQ(s->min_ts, entry_ts(11));
+    ASSERT_EQ(s->max_ts, entry_ts(12));
+    ASSERT_FEQ(s->sum, 6.0);
+    ASSERT_FEQ(s->min, 1.0);
+    ASSERT_FEQ(s->max, 3.0);
+    ASSERT_FEQ(s->first, 2.0);
+    ASSERT_FEQ(s->last, 3.0);
+    index_close(&index);
+
+    // A legacy index, bare entries with no header, loads with no summaries
+    char path[256];
+    snprintf(path, sizeof(path), "%s/i-%.20llu.index", TESTDIR,
+             (unsigned long long)BASE_TS + 2);
+    FILE *fp = fopen(path, "w");
+    ASSERT_TRUE(fp != NULL, " FAIL: fopen failed\n");
+    uint8_t buf[16];
+    write_i64(buf, 0);
+    write_i64(buf + 8, 0);
+    fwrite(buf, sizeof(buf), 1, fp);
+    fclose(fp);
+
+    ASSERT_EQ(index_load(&index, TESTDIR, BASE_TS + 2), 0);
+    ASSERT_EQ(index.version, INDEX_V0);
+    ASSERT_EQ(index.entries.length, 1);
+    ASSERT_EQ(index.entries.items[0].summary.count, 0);
+
+    // And stays legacy when appended to
+    ASSERT_EQ(index_append(&index, entry_ts(1), 100, &summary), 0);
+    ASSERT_EQ(index.size, 32);
+    index_close(&index);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int index_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 3;
+    int success = cases;
+
+    makedir("logdata");
+    makedir(TESTDIR);
+
+    success += index_find_test();
+    success += index_load_test();
+    success += index_summary_test();
+
+    rm_recursive(TESTDIR);
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
@@ -0,0 +1,240 @@
+#include "../src/darray.h"
+#include "../src/partition.h"
+#include "../src/storage.h"
+#include "../src/timeseries.h"
+#include "test_helpers.h"
+#include "tests.h"
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define TESTDIR  "logdata/partitiontest"
+#define BASE_TS  1743000000
+#define POINTSNR 1000
+
+static uint64_t timestamps[POINTSNR];
+static double_t values[POINTSNR];
+
+static int check_loaded(size_t points, uint64_t last_ts, int scanned)
+{
+    partition_t p = {0};
+    ASSERT_EQ(partition_load(&p, TESTDIR, BASE_TS), 0);
+
+    // A log loaded from its meta is never mapped, nor its index read
+    ASSERT_EQ(p.clog.map.addr != NULL, scanned);
+    ASSERT_EQ(p.index.loaded, 0);
+    ASSERT_EQ(p.clog.points, points);
+    ASSERT_EQ(p.clog.blocks, p.index.size / (sizeof(uint64_t) * 11));
+    ASSERT_EQ(p.start_ts, timestamps[0]);
+    ASSERT_EQ(p.end_ts, last_ts);
+
+    record_array_t records = {0};
+    ASSERT_EQ(partition_range(&p, &records, 0, UINT64_MAX), points);
+    ASSERT_EQ(p.index.loaded, 1);
+    ASSERT_EQ(records.items[points - 1].timestamp, last_ts);
+
+    da_free(&records);
+    partition_close(&p);
+
+    return 0;
+}
+
+static int partition_meta_test(void)
+{
+    TEST_HEADER;
+
+    char meta[PATHBUF_SIZE];
+    snprintf(meta, sizeof(meta), "%s/m-%.20llu.meta", TESTDIR,
+             (unsigned long long)BASE_TS);
+
+    partition_t p = {0};
+    ASSERT_EQ(partition_init(&p, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps, values, POINTSNR / 2),
+              0);
+    ASSERT_EQ(partition_sync(&p), 0);
+
+    struct stat st;
+    ASSERT_EQ(stat(meta, &st), 0);
+    partition_close(&p);
+
+    // Sealed, the partition loads from its meta
+    ASSERT_EQ(check_loaded(POINTSNR / 2, timestamps[POINTSNR / 2 - 1], 0), 0);
+
+    // Appended to after the seal, the log is scanned
+    ASSERT_EQ(partition_load(&p, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps + POINTSNR / 2,
+                                      values + POINTSNR / 2, POINTSNR / 2),
+              0);
+    partition_close(&p);
+    ASSERT_EQ(check_loaded(POINTSNR, timestamps[POINTSNR - 1], 1), 0);
+
+    // A torn meta is ignored
+    ASSERT_EQ(partition_load(&p, TESTDIR, BASE_TS), 0);
+    ASSERT_EQ(partition_sync(&p), 0);
+    partition_close(&p);
+    ASSERT_EQ(check_loaded(POINTSNR, timestamps[POINTSNR - 1], 0), 0);
+
+    FILE *fp = fopen(meta, "r+");
+    ASSERT_TRUE(fp != NULL, " FAIL: fopen failed\n");
+    fseek(fp, 20, SEEK_SET);
+    fputc(0xff, fp);
+    fclose(fp);
+    ASSERT_EQ(check_loaded(POINTSNR, timestamps[POINTSNR - 1], 1), 0);
+
+    // Moved, the meta follows the log, the one left behind is dropped
+    ASSERT_EQ(makedir(TESTDIR "/tmp"), 0);
+    ASSERT_EQ(partition_init(&p, TESTDIR "/tmp", BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps, values, POINTSNR / 4),
+              0);
+    ASSERT_EQ(partition_move(&p, TESTDIR "/tmp", TESTDIR), 0);
+    ASSERT_TRUE(stat(meta, &st) < 0, " FAIL: stale meta left\n");
+    ASSERT_EQ(partition_sync(&p), 0);
+    ASSERT_EQ(stat(meta, &st), 0);
+    partition_close(&p);
+    ASSERT_EQ(check_loaded(POINTSNR / 4, timestamps[POINTSNR / 4 - 1], 0), 0);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int partition_rewind_test(void)
+{
+    TEST_HEADER;
+
+    char path[PATHBUF_SIZE];
+    snprintf(path, sizeof(path), "%s/c-%.20llu.log", TESTDIR "/rewind",
+             (unsigned long long)BASE_TS);
+
+    partition_t p = {0};
+    ASSERT_EQ(makedir(TESTDIR "/rewind"), 0);
+    ASSERT_EQ(partition_init(&p, TESTDIR "/rewind", BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps, values, POINTSNR / 2),
+              0);
+    ASSERT_EQ(partition_sync(&p), 0);
+
+    partition_mark_t mark;
+    partition_mark(&p, &mark);
+
+    // The file size limit lets a block or two through, then fails the write
+    struct rlimit old, limit;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old), 0);
+    limit          = old;
+    limit.rlim_cur = mark.clog_size + 2 * mark.clog_size / mark.blocks;
+    signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+    int err = partition_flush_columns(&p, timestamps + POINTSNR / 2,
+                                      values + POINTSNR / 2, POINTSNR / 2);
+
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &old), 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    // Nothing is left of the failed write, neither in memory nor on disk
+    ASSERT_EQ(err, -1);
+    ASSERT_EQ(p.clog.size, mark.clog_size);
+    ASSERT_EQ(p.clog.points, POINTSNR / 2);
+    ASSERT_EQ(p.clog.blocks, mark.blocks);
+    ASSERT_EQ(p.index.size, mark.index_size);
+    ASSERT_EQ(p.index.entries.length, mark.blocks);
+    ASSERT_EQ(p.end_ts, timestamps[POINTSNR / 2 - 1]);
+
+    struct stat st;
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ((size_t)st.st_size, mark.clog_size);
+
+    // Retried, the points are written once
+    ASSERT_EQ(partition_flush_columns(&p, timestamps + POINTSNR / 2,
+                                      values + POINTSNR / 2, POINTSNR / 2),
+              0);
+    ASSERT_EQ(partition_sync(&p), 0);
+    partition_close(&p);
+
+    ASSERT_EQ(partition_load(&p, TESTDIR "/rewind", BASE_TS), 0);
+    record_array_t records = {0};
+    ASSERT_EQ(partition_range(&p, &records, 0, UINT64_MAX), POINTSNR);
+    for (size_t i = 0; i < POINTSNR; ++i)
+        ASSERT_EQ(records.items[i].timestamp, timestamps[i]);
+
+    da_free(&records);
+    partition_close(&p);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int partition_torn_test(void)
+{
+    TEST_HEADER;
+
+    char path[PATHBUF_SIZE];
+    snprintf(path, sizeof(path), "%s/c-%.20llu.log", TESTDIR "/torn",
+             (unsigned long long)BASE_TS);
+
+    partition_t p = {0};
+    ASSERT_EQ(makedir(TESTDIR "/torn"), 0);
+    ASSERT_EQ(partition_init(&p, TESTDIR "/torn", BASE_TS), 0);
+    ASSERT_EQ(partition_flush_columns(&p, timestamps, values, POINTSNR), 0);
+    ASSERT_EQ(partition_sync(&p), 0);
+
+    size_t size = p.clog.size, blocks = p.clog.blocks;
+    partition_close(&p);
+
+    // A crash in the middle of the last block, its index entry made it
+    ASSERT_EQ(truncate(path, size - 3), 0);
+
+    ASSERT_EQ(partition_load(&p, TESTDIR "/torn", BASE_TS), 0);
+    ASSERT_EQ(p.clog.blocks, blocks - 1);
+    ASSERT_EQ(p.index.entries.length, blocks - 1);
+
+    struct stat st;
+    ASSERT_EQ(stat(path, &st), 0);
+    ASSERT_EQ((size_t)st.st_size, p.clog.size);
+
+    record_array_t records = {0};
+    ASSERT_EQ(partition_range(&p, &records, 0, UINT64_MAX), p.clog.points);
+    for (size_t i = 0; i < records.length; ++i)
+        ASSERT_EQ(records.items[i].timestamp, timestamps[i]);
+    ASSERT_EQ(p.end_ts, timestamps[records.length - 1]);
+    partition_close(&p);
+
+    // Cut and sealed, it loads from its meta next time
+    ASSERT_EQ(partition_load(&p, TESTDIR "/torn", BASE_TS), 0);
+    ASSERT_TRUE(p.clog.map.addr == NULL, " FAIL: log scanned again\n");
+    ASSERT_EQ(p.clog.points, records.length);
+
+    da_free(&records);
+    partition_close(&p);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+int partition_test(void)
+{
+    printf("* %s\n\n", __FUNCTION__);
+
+    int cases   = 3;
+    int success = cases;
+
+    for (size_t i = 0; i < POINTSNR; ++i) {
+        timestamps[i] = BASE_TS * (uint64_t)1e9 + 123 + i * (uint64_t)1e6;
+        values[i]     = (double_t)i;
+    }
+
+    makedir(TESTDIR);
+
+    success += partition_meta_test();
+    success += partition_rewind_test();
+    success += partition_torn_test();
+
+    rm_recursive(TESTDIR);
+
+    printf("\n Test suite summary: %d passed, %d failed\n", success,
+           cases - success);
+
+    return success < cases ? -1 : 0;
+}
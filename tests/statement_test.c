@@ -18,6 +18,34 @@ static int parse_create_db_test(void)
     return 0;
 }
 
+static int parse_createdb_sync_test(void)
+{
+    TEST_HEADER;
+
+    stmt_t *stmt = stmt_parse("CREATEDB test-db 'interval' 50ms");
+
+    ASSERT_EQ(stmt->type, STMT_CREATEDB);
+    ASSERT_SEQ(stmt->create.db_name, "test-db");
+    ASSERT_TRUE(stmt->create.has_sync, " FAIL: has_sync should be true\n");
+    ASSERT_SEQ(stmt->create.sync, "interval");
+    ASSERT_TRUE(stmt->create.has_sync_every,
+                " FAIL: has_sync_every should be true\n");
+    ASSERT_EQ(stmt->create.sync_every.timespan.value, 50);
+    ASSERT_SEQ(stmt->create.sync_every.timespan.unit, "ms");
+
+    stmt_free(stmt);
+
+    stmt = stmt_parse("CREATEDB test-db 'bytes' 65536");
+
+    ASSERT_SEQ(stmt->create.sync, "bytes");
+    ASSERT_EQ(stmt->create.sync_every.value, 65536);
+
+    stmt_free(stmt);
+
+    TEST_FOOTER;
+    return 0;
+}
+
 static int parse_create_ts_test(void)
 {
     TEST_HEADER;
@@ -55,6 +83,37 @@ static int parse_create_ts_retention_duplication_test(void)
     return 0;
 }
 
+static int parse_create_ts_rollup_test(void)
+{
+    TEST_HEADER;
+
+    stmt_t *stmt = stmt_parse("CREATE ts-test 30d ROLLUP 1m, 5m, 1h");
+
+    ASSERT_EQ(stmt->type, STMT_CREATE);
+    ASSERT_SEQ(stmt->create.ts_name, "ts-test");
+    ASSERT_TRUE(stmt->create.has_retention,
+                " FAIL: has_retention should be true\n");
+    ASSERT_EQ(stmt->create.rollups_nr, 3);
+    ASSERT_EQ(stmt->create.rollups[0].timespan.value, 1);
+    ASSERT_SEQ(stmt->create.rollups[0].timespan.unit, "m");
+    ASSERT_EQ(stmt->create.rollups[1].timespan.value, 5);
+    ASSERT_SEQ(stmt->create.rollups[1].timespan.unit, "m");
+    ASSERT_EQ(stmt->create.rollups[2].timespan.value, 1);
+    ASSERT_SEQ(stmt->create.rollups[2].timespan.unit, "h");
+
+    stmt_free(stmt);
+
+    // A rollup list must not be empty nor past its capacity
+    ASSERT_TRUE(stmt_parse("CREATE ts-test ROLLUP") == NULL,
+                " FAIL: empty rollup list should not parse\n");
+    ASSERT_TRUE(stmt_parse("CREATE ts-test ROLLUP 1s, 2s, 3s, 4s, 5s") ==
+                    NULL,
+                " FAIL: too many rollups should not parse\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
 static int parse_insert_test(void)
 {
     TEST_HEADER;
@@ -423,10 +482,11 @@ int parser_test(void)
 {
     printf("* %s\n\n", __FUNCTION__);
 
-    int cases   = 16;
+    int cases   = 18;
     int success = cases;
 
     success += parse_create_db_test();
+    success += parse_createdb_sync_test();
     success += parse_create_ts_test();
     success += parse_delete_ts_test();
     success += parse_insert_test();
@@ -442,6 +502,7 @@ int parser_test(void)
     success += parse_insert_multi_auto_ts_test();
     success += parse_insert_single_test();
     success += parse_create_ts_retention_duplication_test();
+    success += parse_create_ts_rollup_test();
 
     printf("\n Test suite summary: %d passed, %d failed\n", success,
            cases - success);
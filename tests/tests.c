@@ -3,7 +3,7 @@
 
 int main(void)
 {
-    int testsuites = 3;
+    int testsuites = 11;
     int outcomes   = 0;
 
     printf("\n");
@@ -13,6 +13,22 @@ int main(void)
     printf("\n");
     outcomes += encoding_test();
     printf("\n");
+    outcomes += gorilla_test();
+    printf("\n");
+    outcomes += index_test();
+    printf("\n");
+    outcomes += arena_test();
+    printf("\n");
+    outcomes += aggregate_test();
+    printf("\n");
+    outcomes += block_cache_test();
+    printf("\n");
+    outcomes += hashmap_test();
+    printf("\n");
+    outcomes += fdcache_test();
+    printf("\n");
+    outcomes += partition_test();
+    printf("\n");
 
     printf("\nTests summary: %d passed, %d failed\n", testsuites + outcomes,
            outcomes == 0 ? 0 : (outcomes * -1));
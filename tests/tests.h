@@ -4,5 +4,13 @@
 int parser_test(void);
 int encoding_test(void);
 int timeseries_test(void);
+int gorilla_test(void);
+int index_test(void);
+int arena_test(void);
+int aggregate_test(void);
+int block_cache_test(void);
+int hashmap_test(void);
+int fdcache_test(void);
+int partition_test(void);
 
 #endif
@@ -1,6 +1,10 @@
 #include "../src/darray.h"
+#include "../src/rollup.h"
 #include "../src/timeseries.h"
 #include "test_helpers.h"
+#include <dirent.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -11,6 +15,44 @@
 
 static uint64_t timestamps[POINTSNR] = {0};
 
+static void wait_flushed(timeseries_t *ts)
+{
+    pthread_mutex_lock(&ts->sealed_lock);
+    while (ts->sealed_nr > 0)
+        pthread_cond_wait(&ts->sealed_cond, &ts->sealed_lock);
+    pthread_mutex_unlock(&ts->sealed_lock);
+}
+
+// Insert a point, waiting for the flusher to catch up if needed
+static int insert_flushing(timeseries_t *ts, uint64_t timestamp,
+                           double_t value)
+{
+    int err = ts_insert(ts, timestamp, value);
+    if (err == TS_E_BACKPRESSURE) {
+        wait_flushed(ts);
+        err = ts_insert(ts, timestamp, value);
+    }
+
+    return err;
+}
+
+static size_t count_files(const char *path, char prefix)
+{
+    struct dirent **namelist;
+    int n = scandir(path, &namelist, NULL, alphasort);
+    if (n < 0)
+        return 0;
+
+    size_t count = 0;
+    for (int i = 0; i < n; ++i) {
+        count += namelist[i]->d_name[0] == prefix;
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    return count;
+}
+
 static int min_timeseries_test(timeseries_t *ts)
 {
     TEST_HEADER;
@@ -399,11 +441,1337 @@ static int insert_out_of_bounds_test(timeseries_t *ts)
     return 0;
 }
 
+static int commit_timeseries_test(timeseries_t *ts)
+{
+    TEST_HEADER;
+
+    wal_t *wal = &ts->head->wal;
+
+    ts->opts.wal_policy =
+        (wal_policy_t){.sync = WS_INTERVAL, .interval_ms = 60000};
+
+    // Points go past the last one of the head chunk, not to be logged as
+    // late, the first commit after an idle period syncs right away
+    ASSERT_EQ(ts_insert(ts, ts->head->end_ts + 1, 1.0), 0);
+    ASSERT_EQ(ts_commit(ts, 0), 1);
+    ASSERT_EQ(wal->synced, wal->size);
+
+    // Within the interval the points are held in the ring
+    ASSERT_EQ(ts_insert(ts, ts->head->end_ts + 1, 2.0), 0);
+    ASSERT_EQ(ts_commit(ts, 0), 0);
+    ASSERT_TRUE(ts_commit_timeout(ts) > 0,
+                " FAIL: commit timeout should be pending\n");
+    ASSERT_TRUE(wal->written < wal->size,
+                " FAIL: points should still be buffered\n");
+
+    // Forcing syncs them regardless of the policy
+    ASSERT_EQ(ts_commit(ts, 1), 1);
+    ASSERT_EQ(wal->synced, wal->size);
+    ASSERT_EQ(ts_commit_timeout(ts), -1);
+
+    // OS managed, written at each commit and never synced
+    ts->opts.wal_policy = (wal_policy_t){.sync = WS_OS};
+    ASSERT_EQ(ts_insert(ts, ts->head->end_ts + 1, 3.0), 0);
+    ASSERT_EQ(ts_commit(ts, 0), 1);
+    ASSERT_EQ(wal->written, wal->size);
+    ASSERT_TRUE(wal->synced < wal->size, " FAIL: points should not be synced\n");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int insert_batch_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    timeseries_t *ts = ts_create(db, "batch", (ts_opts_t){0});
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    uint64_t batch_ts[POINTSNR] = {0};
+    double_t values[POINTSNR]   = {0};
+    struct timespec tv          = {0};
+
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+
+    // A sorted run spanning multiple seconds, with a point out of order in
+    // the middle breaking it
+    for (int i = 0; i < POINTSNR; ++i) {
+        batch_ts[i] = base + i * INTERVAL * 100;
+        values[i]   = (double_t)i;
+    }
+    batch_ts[POINTSNR / 2] = base + INTERVAL;
+
+    // The point out of order is logged to the out of order buffer
+    ASSERT_EQ(ts_insert_batch(ts, batch_ts, values, POINTSNR), POINTSNR);
+    ASSERT_EQ(ts->head->length, POINTSNR - 1);
+    ASSERT_EQ(ts->ooo->length, 1);
+    ASSERT_EQ(wal_size(&ts->head->wal),
+              (POINTSNR - 1) * (sizeof(uint64_t) + sizeof(double_t)));
+    ASSERT_EQ(wal_size(&ts->ooo->wal), sizeof(uint64_t) + sizeof(double_t));
+
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, base + POINTSNR * INTERVAL * 100, &records),
+              0);
+    ASSERT_EQ(records.length, POINTSNR);
+    for (size_t i = 1; i < records.length; ++i)
+        ASSERT_TRUE(records.items[i - 1].timestamp <= records.items[i].timestamp,
+                    " FAIL: records out of order\n");
+
+    for (int i = 0; i < POINTSNR; ++i) {
+        record_t r = {0};
+        ASSERT_EQ(ts_find(ts, batch_ts[i], &r), 0);
+        ASSERT_FEQ(r.value, values[i]);
+    }
+
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int sealed_chunks_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "sealed", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    uint64_t sealed_ts[POINTSNR] = {0};
+    struct timespec tv           = {0};
+
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+
+    // Each WAL flush size worth of points seals the chunks, inserts are
+    // retried while the flusher is behind
+    for (int i = 0; i < POINTSNR; ++i) {
+        sealed_ts[i] = base + i * (uint64_t)1e9;
+        int err      = 0;
+        while ((err = ts_insert(ts, sealed_ts[i], (double_t)i)) ==
+               TS_E_BACKPRESSURE)
+            usleep(100);
+        ASSERT_EQ(err, 0);
+    }
+
+    // Points are served while sealed and once flushed alike
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, sealed_ts[0], sealed_ts[POINTSNR - 1], &records),
+              0);
+    ASSERT_EQ(records.length, POINTSNR);
+    for (size_t i = 0; i < records.length; ++i)
+        ASSERT_EQ(records.items[i].timestamp, sealed_ts[i]);
+
+    for (int i = 0; i < POINTSNR; ++i) {
+        record_t r = {0};
+        ASSERT_EQ(ts_find(ts, sealed_ts[i], &r), 0);
+        ASSERT_FEQ(r.value, (double_t)i);
+    }
+
+    da_free(&records);
+
+    // Closing waits for the flusher to drain the sealed chunks
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int out_of_order_buffer_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "late", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base            = tv.tv_sec * (uint64_t)1e9;
+
+    uint64_t late_ts[10]     = {0};
+    double_t late_values[10] = {0};
+
+    // The head chunk gets the newest points, the older ones come late and in
+    // reverse order
+    for (int i = 10; i < 20; ++i)
+        ASSERT_EQ(ts_insert(ts, base + i * (uint64_t)1e9, (double_t)i), 0);
+
+    for (int i = 0; i < 10; ++i) {
+        late_ts[i]     = base + (9 - i) * (uint64_t)1e9;
+        late_values[i] = (double_t)(9 - i);
+    }
+
+    ASSERT_EQ(ts_insert_batch(ts, late_ts, late_values, 10), 10);
+    ASSERT_EQ(ts->head->length, 10);
+    ASSERT_EQ(ts->ooo->length, 10);
+
+    // Queries merge the late points on the fly
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, base + 19 * (uint64_t)1e9, &records), 0);
+    ASSERT_EQ(records.length, 20);
+    for (size_t i = 0; i < records.length; ++i) {
+        ASSERT_EQ(records.items[i].timestamp, base + i * (uint64_t)1e9);
+        ASSERT_FEQ(records.items[i].value, (double_t)i);
+    }
+
+    record_t r = {0};
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base);
+    ASSERT_EQ(ts_find(ts, base + 5 * (uint64_t)1e9, &r), 0);
+    ASSERT_FEQ(r.value, 5.0);
+
+    // Filling the head chunk flushes the late points merged with it
+    for (int i = 20; i < 30; ++i)
+        ASSERT_EQ(ts_insert(ts, base + i * (uint64_t)1e9, (double_t)i), 0);
+
+    ASSERT_EQ(ts->ooo->length, 0);
+
+    wait_flushed(ts);
+
+    da_reset(&records);
+    ASSERT_EQ(ts_range(ts, base, base + 29 * (uint64_t)1e9, &records), 0);
+    ASSERT_EQ(records.length, 30);
+    for (size_t i = 0; i < records.length; ++i) {
+        ASSERT_EQ(records.items[i].timestamp, base + i * (uint64_t)1e9);
+        ASSERT_FEQ(records.items[i].value, (double_t)i);
+    }
+
+    ASSERT_EQ(ts_find(ts, base + 3 * (uint64_t)1e9, &r), 0);
+    ASSERT_FEQ(r.value, 3.0);
+
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int many_partitions_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "partitions", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+    int points    = 1000;
+
+    // Every full flush starts a new partition, one every few points, runs of
+    // them are compacted along the way
+    for (int i = 0; i < points; ++i) {
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, (double_t)i),
+                  0);
+    }
+
+    wait_flushed(ts);
+
+    ASSERT_TRUE(ts->partitions.length > 1,
+                " FAIL: expected more than a partition\n");
+
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, base + (points - 1) * (uint64_t)1e9,
+                       &records),
+              0);
+    ASSERT_EQ(records.length, points);
+    for (size_t i = 0; i < records.length; ++i) {
+        ASSERT_EQ(records.items[i].timestamp, base + i * (uint64_t)1e9);
+        ASSERT_FEQ(records.items[i].value, (double_t)i);
+    }
+
+    record_t r = {0};
+    for (int i = 0; i < points; i += 37) {
+        ASSERT_EQ(ts_find(ts, base + i * (uint64_t)1e9, &r), 0);
+        ASSERT_FEQ(r.value, (double_t)i);
+    }
+
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base);
+
+    // Aggregates answered from the block summaries, but for the edges
+    uint64_t t0 = base + 5 * (uint64_t)1e9, t1 = base + 900 * (uint64_t)1e9;
+    ASSERT_EQ(ts_min(ts, t0, t1, &r), 0);
+    ASSERT_EQ(r.timestamp, t0);
+    ASSERT_FEQ(r.value, 5.0);
+    ASSERT_EQ(ts_max(ts, t0, t1, &r), 0);
+    ASSERT_EQ(r.timestamp, t1);
+    ASSERT_FEQ(r.value, 900.0);
+
+    uint64_t interval      = 100 * (uint64_t)1e9;
+    record_array_t samples = {0};
+    ASSERT_EQ(ts_avg_sample(ts, t0, t1, interval, &samples), 0);
+    ASSERT_TRUE(samples.length > 0, " FAIL: no samples\n");
+    for (size_t i = 0; i < samples.length; ++i) {
+        // Buckets are open intervals, checked against the decoded points
+        uint64_t end = samples.items[i].timestamp;
+        double_t sum = 0.0;
+        size_t count = 0;
+        for (size_t j = 0; j < records.length; ++j) {
+            if (records.items[j].timestamp > end - interval &&
+                records.items[j].timestamp < end) {
+                sum += records.items[j].value;
+                count++;
+            }
+        }
+        ASSERT_FEQ(samples.items[i].value, sum / count);
+    }
+    da_free(&samples);
+
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+// Count the points of a series, checking they come in order
+static int count_ordered(timeseries_t *ts, size_t *count)
+{
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, 0, UINT64_MAX, &records), 0);
+    for (size_t i = 1; i < records.length; ++i)
+        ASSERT_TRUE(records.items[i - 1].timestamp <
+                        records.items[i].timestamp,
+                    " FAIL: points out of order\n");
+
+    *count = records.length;
+    da_free(&records);
+
+    return 0;
+}
+
+static int late_partition_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    uint64_t sec     = (uint64_t)1e9;
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "latepartitions", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * sec;
+    size_t i      = 0;
+
+    for (; i < 261; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec, (double_t)i), 0);
+    wait_flushed(ts);
+
+    // A late point far older than the base of the last partition, flushed
+    // with the next full chunk
+    ASSERT_EQ(ts_insert(ts, base + 5 * sec + sec / 2, -1.0), 0);
+    ASSERT_EQ(ts->ooo->length, 1);
+    for (; ts->ooo->length > 0; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec, (double_t)i), 0);
+    wait_flushed(ts);
+
+    // The catalog is kept, and searched, in time order
+    const partition_catalog_t *pc = &ts->partitions;
+    for (size_t j = 1; j < pc->length; ++j)
+        ASSERT_TRUE(pc->items[j - 1]->end_ts < pc->items[j]->start_ts,
+                    " FAIL: partitions out of order\n");
+
+    record_t r = {0};
+    ASSERT_EQ(ts_find(ts, base + 5 * sec + sec / 2, &r), 0);
+    ASSERT_FEQ(r.value, -1.0);
+    ASSERT_EQ(ts_find(ts, base + 177 * sec, &r), 0);
+    ASSERT_FEQ(r.value, 177.0);
+
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, base + 260 * sec, &records), 0);
+    ASSERT_EQ(records.length, 262);
+    ASSERT_FEQ(records.items[6].value, -1.0);
+    da_free(&records);
+
+    size_t count = 0;
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, i + 1);
+
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int retention_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE,
+                        .retention = 60 * (uint64_t)1e9};
+    timeseries_t *ts = ts_create(db, "retention", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t now  = tv.tv_sec * (uint64_t)1e9;
+    int points    = 600;
+    uint64_t base = now - points * (uint64_t)1e9;
+
+    // Ten minutes of points, only the last one is within the retention
+    for (int i = 0; i < points; ++i) {
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, (double_t)i),
+                  0);
+    }
+
+    wait_flushed(ts);
+
+    uint64_t cutoff = now - 60 * (uint64_t)1e9;
+
+    // Expired partitions are gone along with their files
+    ASSERT_TRUE(ts->partitions.length > 0, " FAIL: no partitions left\n");
+    ASSERT_TRUE(ts->partitions.items[0]->end_ts >= cutoff,
+                " FAIL: expired partition not dropped\n");
+
+    ASSERT_EQ(count_files(ts->pathbuf, 'c'), ts->partitions.length);
+    ASSERT_EQ(count_files(ts->pathbuf, 'i'), ts->partitions.length);
+
+    // Queries only see the points within the retention
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, now, &records), 0);
+    ASSERT_TRUE(records.length > 0 && records.length <= 60,
+                " FAIL: expired points returned\n");
+    for (size_t i = 0; i < records.length; ++i)
+        ASSERT_TRUE(records.items[i].timestamp >= cutoff,
+                    " FAIL: expired point returned\n");
+
+    record_t r = {0};
+    ASSERT_EQ(ts_find(ts, base, &r), -1);
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_TRUE(r.timestamp >= cutoff, " FAIL: expired first point\n");
+
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int compaction_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE, .policy = DP_IGNORE};
+    timeseries_t *ts = ts_create(db, "compaction", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+    int points    = 200;
+
+    for (int i = 0; i < points; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, (double_t)i),
+                  0);
+
+    // Duplicates of the oldest points come late and land in a later
+    // partition, followed by a few more to push it past the last one
+    for (int i = 0; i < 10; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, -1.0), 0);
+
+    for (int i = points; i < points + 50; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, (double_t)i),
+                  0);
+
+    wait_flushed(ts);
+
+    size_t before = ts->partitions.length;
+    ASSERT_TRUE(before > 2, " FAIL: expected several partitions\n");
+    ASSERT_EQ(ts_compact(ts), 0);
+    ASSERT_TRUE(ts->partitions.length < before,
+                " FAIL: partitions not compacted\n");
+
+    // The old files are gone, nothing is left aside
+    ASSERT_EQ(count_files(ts->pathbuf, 'c'), ts->partitions.length);
+    ASSERT_EQ(count_files(ts->pathbuf, 'i'), ts->partitions.length);
+
+    char tmp[PATHBUF_SIZE];
+    snprintf(tmp, sizeof(tmp), "%s/tmp", ts->pathbuf);
+    ASSERT_EQ(count_files(tmp, 'c'), 0);
+
+    // Sorted, with the first value written kept for the duplicates
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, base, base + (points + 49) * (uint64_t)1e9,
+                       &records),
+              0);
+    ASSERT_EQ(records.length, points + 50);
+    for (size_t i = 0; i < records.length; ++i) {
+        ASSERT_EQ(records.items[i].timestamp, base + i * (uint64_t)1e9);
+        ASSERT_FEQ(records.items[i].value, (double_t)i);
+    }
+
+    record_t r = {0};
+    ASSERT_EQ(ts_find(ts, base + 5 * (uint64_t)1e9, &r), 0);
+    ASSERT_FEQ(r.value, 5.0);
+
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int cursor_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE, .policy = DP_INSERT};
+    timeseries_t *ts = ts_create(db, "cursor", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+    int points    = 300;
+
+    // Points on disk and in memory, late points and duplicates among them
+    for (int i = 0; i < points; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9, (double_t)i),
+                  0);
+
+    for (int i = 0; i < 5; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + (points - 3) * (uint64_t)1e9 +
+                                          i * (uint64_t)1e8,
+                                  -1.0),
+                  0);
+
+    wait_flushed(ts);
+
+    record_array_t expected = {0};
+    ASSERT_EQ(ts_range(ts, base, base + points * (uint64_t)1e9, &expected),
+              0);
+    ASSERT_EQ(expected.length, points + 5);
+
+    // Batches smaller than a block resume where the previous one stopped
+    ts_cursor_t *cursor =
+        ts_cursor_open(ts, base, base + points * (uint64_t)1e9);
+    ASSERT_TRUE(cursor != NULL, " FAIL: ts_cursor_open failed\n");
+
+    record_t batch[7];
+    size_t total = 0;
+    ssize_t n    = 0;
+    while ((n = ts_cursor_next(cursor, batch, 7)) > 0) {
+        ASSERT_TRUE(total + n <= expected.length, " FAIL: too many points\n");
+        for (ssize_t i = 0; i < n; ++i) {
+            ASSERT_EQ(batch[i].timestamp, expected.items[total + i].timestamp);
+            ASSERT_FEQ(batch[i].value, expected.items[total + i].value);
+        }
+        total += n;
+    }
+    ASSERT_EQ(n, 0);
+    ASSERT_EQ(total, expected.length);
+    ASSERT_EQ(ts_cursor_next(cursor, batch, 7), 0);
+    ts_cursor_close(cursor);
+
+    // Duplicates split across batches are not lost nor repeated
+    uint64_t dup = base + 10 * (uint64_t)1e9;
+    for (int i = 0; i < 3; ++i)
+        ASSERT_EQ(ts_insert(ts, dup, 100.0 + i), 0);
+
+    cursor = ts_cursor_open(ts, dup, dup);
+    ASSERT_TRUE(cursor != NULL, " FAIL: ts_cursor_open failed\n");
+    total = 0;
+    while ((n = ts_cursor_next(cursor, batch, 1)) > 0)
+        total += n;
+    ASSERT_EQ(total, 4);
+    ts_cursor_close(cursor);
+
+    da_free(&expected);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+// Check each bucket sampled against the points of the range
+static int samples_check(const record_array_t *records,
+                         const ts_sample_array_t *samples, uint64_t interval)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < samples->length; ++i) {
+        const ts_sample_t *s = &samples->items[i];
+        ASSERT_EQ(s->start % interval, 0);
+        ASSERT_EQ(records->items[j].timestamp - s->start < interval, 1);
+
+        double_t sum = 0.0, min = records->items[j].value,
+                 max = records->items[j].value;
+        size_t count = 0;
+        ASSERT_FEQ(s->first, records->items[j].value);
+        for (; j < records->length &&
+               records->items[j].timestamp < s->start + interval;
+             ++j, ++count) {
+            sum += records->items[j].value;
+            min = records->items[j].value < min ? records->items[j].value : min;
+            max = records->items[j].value > max ? records->items[j].value : max;
+        }
+        ASSERT_EQ(s->count, count);
+        ASSERT_FEQ(s->sum, sum);
+        ASSERT_FEQ(s->min, min);
+        ASSERT_FEQ(s->max, max);
+        ASSERT_FEQ(s->last, records->items[j - 1].value);
+    }
+    ASSERT_EQ(j, records->length);
+
+    return 0;
+}
+
+static int sample_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "sample", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * (uint64_t)1e9;
+    int points    = 1000;
+
+    for (int i = 0; i < points; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * (uint64_t)1e9,
+                                  (double_t)(i % 97)),
+                  0);
+
+    // Late points among the flushed ones
+    for (int i = 0; i < 10; ++i)
+        ASSERT_EQ(insert_flushing(ts,
+                                  base + (i * 90 + 5) * (uint64_t)1e9 +
+                                      (uint64_t)5e8,
+                                  -1.0 * i),
+                  0);
+
+    wait_flushed(ts);
+
+    uint64_t t0 = base + 5 * (uint64_t)1e9, t1 = base + 990 * (uint64_t)1e9;
+    record_array_t records = {0};
+    ASSERT_EQ(ts_range(ts, t0, t1, &records), 0);
+
+    // Every bucket checked against the decoded points
+    uint64_t interval         = 60 * (uint64_t)1e9;
+    ts_sample_array_t samples = {0};
+    ASSERT_EQ(ts_sample(ts, t0, t1, interval, &samples), 0);
+    ASSERT_EQ(samples_check(&records, &samples, interval), 0);
+
+    // A single bucket over the whole range
+    ts_sample_t all = {0};
+    double_t sum    = 0.0;
+    for (size_t i = 0; i < records.length; ++i)
+        sum += records.items[i].value;
+    ASSERT_EQ(ts_aggregate(ts, t0, t1, &all), 0);
+    ASSERT_EQ(all.start, t0);
+    ASSERT_EQ(all.count, records.length);
+    ASSERT_FEQ(all.sum, sum);
+    ASSERT_FEQ(all.first, records.items[0].value);
+    ASSERT_FEQ(all.last, records.items[records.length - 1].value);
+
+    ASSERT_EQ(ts_sample(ts, t0, t1, 0, &samples), -1);
+    ASSERT_EQ(ts_aggregate(ts, base - 10, base - 1, &all), -1);
+
+    da_free(&samples);
+    da_free(&records);
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+// Sample the range through the rollups, checked against the points
+static int rollup_sample_check(const timeseries_t *ts, uint64_t t0,
+                               uint64_t t1, uint64_t interval)
+{
+    record_array_t records    = {0};
+    ts_sample_array_t samples = {0};
+    ASSERT_EQ(ts_range(ts, t0, t1, &records), 0);
+    ASSERT_EQ(ts_sample(ts, t0, t1, interval, &samples), 0);
+    int err = samples_check(&records, &samples, interval);
+
+    // And as a single bucket
+    ts_sample_t all = {0};
+    double_t sum    = 0.0;
+    for (size_t i = 0; i < records.length; ++i)
+        sum += records.items[i].value;
+    if (err == 0 && (ts_aggregate(ts, t0, t1, &all) < 0 ||
+                     all.count != records.length || !(fequals(all.sum, sum))))
+        err = -1;
+
+    da_free(&samples);
+    da_free(&records);
+
+    return err;
+}
+
+static int rollup_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    uint64_t sec     = (uint64_t)1e9;
+    ts_opts_t opts   = {.flushsize  = TS_MIN_FLUSHSIZE,
+                        .rollups    = {10 * sec, 60 * sec},
+                        .rollups_nr = 2};
+    timeseries_t *ts = ts_create(db, "rollup", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+    ASSERT_EQ(ts->rollups_nr, 2);
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - tv.tv_sec % 60) * sec;
+    int points    = 2000;
+
+    // Late points, each one right past a flush so that it goes to the out of
+    // order buffer, then flushed into buckets already rolled up
+    int late = 0;
+    for (int i = 0; i < points; ++i) {
+        ASSERT_EQ(insert_flushing(ts, base + i * sec / 2, (double_t)(i % 89)),
+                  0);
+        if (i > 200 && i < points / 2 && late < 10 && ts->head->length == 1) {
+            uint64_t t = base + (i - 150 - late) * sec / 2 + sec / 4;
+            ASSERT_EQ(insert_flushing(ts, t, -1.0 * late++), 0);
+        }
+    }
+    ASSERT_EQ(late, 10);
+
+    wait_flushed(ts);
+    ASSERT_EQ(ts_compact(ts), 0);
+
+    // Another one left in memory, along with the tail of the points
+    for (int i = points; i == points || ts->head->length != 1; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec / 2, 0.0), 0);
+    ASSERT_EQ(insert_flushing(ts, base + 123 * sec + sec / 4, 1000.0), 0);
+    ASSERT_EQ(ts->ooo->length, 1);
+
+    ASSERT_EQ(ts->rollups[0].partitions.length > 0, 1);
+    ASSERT_EQ(ts->rollups[1].partitions.length > 0, 1);
+    ASSERT_EQ(count_files(ts->rollups[1].pathbuf, 'c'),
+              ts->rollups[1].partitions.length);
+
+    // Aligned and unaligned ranges, read from the rollups and the edges
+    uint64_t t0 = base + 7 * sec + 1, t1 = base + 950 * sec + 3;
+    ASSERT_EQ(rollup_sample_check(ts, base, base + points * sec, 60 * sec), 0);
+    ASSERT_EQ(rollup_sample_check(ts, t0, t1, 120 * sec), 0);
+    ASSERT_EQ(rollup_sample_check(ts, t0, t1, 30 * sec), 0);
+    ASSERT_EQ(rollup_sample_check(ts, t0, t0 + 5 * sec, 10 * sec), 0);
+    // No rollup to use
+    ASSERT_EQ(rollup_sample_check(ts, t0, t1, 45 * sec), 0);
+
+    ts_close(ts);
+
+    // Rollups are found again at reopen, a new one is backfilled
+    opts.rollups[0]  = 30 * sec;
+    opts.rollups_nr  = 1;
+    ts               = ts_create(db, "rollup", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+    ASSERT_EQ(ts->rollups_nr, 3);
+    ASSERT_EQ(rollup_sample_check(ts, t0, t1, 120 * sec), 0);
+    ASSERT_EQ(rollup_sample_check(ts, t0, t1, 90 * sec), 0);
+
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int rollup_stage_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec              = (uint64_t)1e9;
+    rollup_t r                = {0};
+    rollup_stage_t rs         = {0};
+    ts_sample_array_t samples = {0};
+    ts_sample_t groups[4]     = {0};
+    for (size_t i = 0; i < 4; ++i)
+        groups[i] = (ts_sample_t){.start    = (100 + i * 10) * sec,
+                                  .count    = 1,
+                                  .sum      = (double_t)i,
+                                  .first_ts = (100 + i * 10) * sec,
+                                  .last_ts  = (100 + i * 10) * sec};
+
+    ASSERT_EQ(rollup_open(&r, TESTDIR, 10 * sec), 1);
+    ASSERT_EQ(rollup_append(&r, groups + 1, 2), 0);
+    ASSERT_EQ(r.partitions.length, 1);
+
+    // Staged past the tail, then truncated back
+    ASSERT_EQ(rollup_stage(&r, groups + 3, 1, &rs), 0);
+    rollup_stage_drop(&r, &rs);
+    ASSERT_EQ(rollup_read(&r, 0, 200 * sec, &samples), 0);
+    ASSERT_EQ(samples.length, 2);
+
+    // An older group starts a partition, removed with it
+    ASSERT_EQ(rollup_stage(&r, groups, 1, &rs), 0);
+    ASSERT_EQ(rs.created, 1);
+    ASSERT_EQ(count_files(r.pathbuf, 'c'), 2);
+    rollup_stage_drop(&r, &rs);
+    ASSERT_EQ(r.partitions.length, 1);
+    ASSERT_EQ(count_files(r.pathbuf, 'c'), 1);
+
+    // Out of sight until published, appended to the tail in order
+    ASSERT_EQ(rollup_stage(&r, groups + 3, 1, &rs), 0);
+    samples.length = 0;
+    ASSERT_EQ(rollup_read(&r, 0, 200 * sec, &samples), 0);
+    ASSERT_EQ(samples.length, 2);
+    rollup_publish(&r, &rs);
+    rollup_seal(&rs);
+    ASSERT_EQ(r.partitions.length, 1);
+    samples.length = 0;
+    ASSERT_EQ(rollup_read(&r, 0, 200 * sec, &samples), 0);
+    ASSERT_EQ(samples.length, 3);
+    for (size_t i = 0; i < samples.length; ++i)
+        ASSERT_EQ(samples.items[i].start, groups[i + 1].start);
+
+    da_free(&samples);
+    rollup_close(&r);
+    rm_recursive(r.pathbuf);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int bounds_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    uint64_t sec     = (uint64_t)1e9;
+    ts_opts_t opts   = {.flushsize = TS_MIN_FLUSHSIZE};
+    timeseries_t *ts = ts_create(db, "bounds", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    record_t r = {0};
+    ASSERT_EQ(ts_first(ts, &r), -1);
+    ASSERT_EQ(ts_last(ts, &r), -1);
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = tv.tv_sec * sec;
+
+    for (int i = 10; i < 20; ++i)
+        ASSERT_EQ(ts_insert(ts, base + i * sec, (double_t)i), 0);
+
+    // Late points move the first one back, a tie keeps the first written
+    uint64_t late_ts[3]     = {base + 5 * sec, base + 2 * sec, base + 2 * sec};
+    double_t late_values[3] = {5.0, 2.0, -2.0};
+    ASSERT_EQ(ts_insert_batch(ts, late_ts, late_values, 3), 3);
+
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + 2 * sec);
+    ASSERT_FEQ(r.value, 2.0);
+    ASSERT_EQ(r.tv.tv_sec, (time_t)(base / sec + 2));
+    ASSERT_EQ(ts_last(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + 19 * sec);
+
+    // Enough points to be flushed to partitions, the last one moving along
+    int points = 1000;
+    for (int i = 20; i < points; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec, (double_t)i), 0);
+    wait_flushed(ts);
+    ASSERT_EQ(ts->partitions.length > 0, 1);
+
+    ASSERT_EQ(ts_last(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + (points - 1) * sec);
+    ASSERT_FEQ(r.value, (double_t)(points - 1));
+
+    ts_close(ts);
+
+    // Both are rebuilt from the partitions and the WALs at reopen
+    ts = ts_create(db, "bounds", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + 2 * sec);
+    ASSERT_EQ(ts_last(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + (points - 1) * sec);
+    ASSERT_FEQ(r.value, (double_t)(points - 1));
+
+    ts_close(ts);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int registry_test(timeseries_db_t *db)
+{
+    TEST_HEADER;
+
+    // A name prefix of another one is a different series
+    timeseries_t *usage = ts_get(db, "cpu_usage");
+    ASSERT_TRUE(usage != NULL, " FAIL: ts_get failed\n");
+    timeseries_t *cpu = ts_get(db, "cpu");
+    ASSERT_TRUE(cpu != NULL, " FAIL: ts_get failed\n");
+    ASSERT_TRUE(cpu != usage, " FAIL: prefix matched another series\n");
+    ASSERT_SEQ(cpu->name, "cpu");
+
+    // Loaded series are served from the registry
+    ASSERT_TRUE(ts_get(db, "cpu") == cpu, " FAIL: series loaded twice\n");
+    ASSERT_TRUE(ts_get(db, "cpu_usage") == usage,
+                " FAIL: series loaded twice\n");
+
+    ts_close(cpu);
+    ts_close(usage);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int manifest_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec   = (uint64_t)1e9;
+    ts_opts_t opts = {.flushsize  = TS_MIN_FLUSHSIZE,
+                      .retention  = 24 * 3600 * sec,
+                      .rollups    = {60 * sec},
+                      .rollups_nr = 1};
+
+    timeseries_db_t *db = tsdb_create("manifestdb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    timeseries_t *ts = ts_create(db, "sensor 1", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+    ASSERT_TRUE(ts_get(db, "idle") != NULL, " FAIL: ts_get failed\n");
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - 3600) * sec;
+    int points    = 1000;
+    for (int i = 0; i < points; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec, (double_t)i), 0);
+    wait_flushed(ts);
+    ASSERT_EQ(ts->partitions.length > 0, 1);
+
+    // Series still open are closed along with the database
+    tsdb_close(db);
+
+    // Loaded from the manifest, the series are registered but not open
+    db = tsdb_create("manifestdb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_EQ(hashmap_length(&db->series), 2);
+
+    ts_entry_t *e = hashmap_get(&db->series, "sensor 1", 8);
+    ASSERT_TRUE(e != NULL, " FAIL: series not registered\n");
+    ASSERT_TRUE(e->ts == NULL, " FAIL: series open at load\n");
+    ASSERT_EQ(e->opts.retention, opts.retention);
+    ASSERT_EQ(e->opts.rollups_nr, 1);
+    ASSERT_EQ(e->opts.rollups[0], 60 * sec);
+    ASSERT_EQ(e->partitions > 0, 1);
+    ASSERT_EQ(e->start_ts >= base, 1);
+    ASSERT_EQ(e->end_ts <= base + (points - 1) * sec, 1);
+
+    // Opened on first access, with its points and options
+    ts = ts_get(db, "sensor 1");
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+    ASSERT_TRUE(e->ts == ts, " FAIL: series not linked to its entry\n");
+    ASSERT_EQ(ts->opts.retention, opts.retention);
+    ASSERT_EQ(ts->rollups_nr, 1);
+
+    record_t r = {0};
+    ASSERT_EQ(ts_last(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + (points - 1) * sec);
+    ASSERT_EQ(ts_first(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base);
+
+    ts_close(ts);
+    ASSERT_TRUE(e->ts == NULL, " FAIL: closed series left linked\n");
+    tsdb_close(db);
+
+    // Without a manifest, the series are found on disk and one is written
+    ASSERT_EQ(unlink("logdata/manifestdb/MANIFEST"), 0);
+    db = tsdb_create("manifestdb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_EQ(hashmap_length(&db->series), 2);
+    ASSERT_EQ(access("logdata/manifestdb/MANIFEST", F_OK), 0);
+
+    ts = ts_get(db, "sensor 1");
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+    ASSERT_EQ(ts_last(ts, &r), 0);
+    ASSERT_EQ(r.timestamp, base + (points - 1) * sec);
+
+    tsdb_close(db);
+
+    rm_recursive("logdata/manifestdb");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int recovery_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec   = (uint64_t)1e9;
+    ts_opts_t opts = {.flushsize = TS_MIN_FLUSHSIZE};
+    char name[16];
+    int series = 8, points = 300;
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - 3600) * sec;
+
+    timeseries_db_t *db = tsdb_create("recoverydb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    for (int i = 0; i < series; ++i) {
+        snprintf(name, sizeof(name), "series-%d", i);
+        timeseries_t *ts = ts_create(db, name, opts);
+        ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+        for (int j = 0; j < points + i; ++j)
+            ASSERT_EQ(insert_flushing(ts, base + j * sec, (double_t)j), 0);
+    }
+    tsdb_close(db);
+
+    // Replayed by the workers, a series accessed meanwhile is opened once
+    db = tsdb_create("recoverydb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_EQ(tsdb_recover(db, 4), series);
+
+    timeseries_t *ts = ts_get(db, "series-5");
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+    tsdb_recover_wait(db);
+    ASSERT_EQ(db->recovering, 0);
+
+    size_t done = 0, total = 0;
+    ts_recovery_progress(&done, &total);
+    ASSERT_EQ(done, series);
+    ASSERT_EQ(total, series);
+
+    for (int i = 0; i < series; ++i) {
+        snprintf(name, sizeof(name), "series-%d", i);
+        ts_entry_t *e = hashmap_get(&db->series, name, strlen(name));
+        ASSERT_TRUE(e != NULL && e->ts != NULL, " FAIL: series not open\n");
+        ASSERT_EQ(ts_recovering(db, name), 0);
+        ASSERT_TRUE(ts_get(db, name) == e->ts, " FAIL: series opened twice\n");
+
+        record_t r = {0};
+        ASSERT_EQ(ts_last(e->ts, &r), 0);
+        ASSERT_EQ(r.timestamp, base + (points + i - 1) * sec);
+    }
+
+    // Nothing left to recover
+    ASSERT_EQ(tsdb_recover(db, 4), 0);
+    tsdb_close(db);
+
+    // Closed while recovering, the series still queued are dropped
+    db = tsdb_create("recoverydb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_EQ(tsdb_recover(db, 2), series);
+    tsdb_close(db);
+
+    rm_recursive("logdata/recoverydb");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+// Every series reads back the same points as before
+static int shared_wal_check(timeseries_db_t *db, record_array_t *expected,
+                            size_t series)
+{
+    char name[16];
+
+    for (size_t i = 0; i < series; ++i) {
+        snprintf(name, sizeof(name), "series-%zu", i);
+        timeseries_t *ts = ts_get(db, name);
+        ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+
+        record_array_t records = {0};
+        ASSERT_EQ(ts_range(ts, 0, UINT64_MAX, &records), 0);
+        ASSERT_EQ(records.length, expected[i].length);
+        for (size_t j = 0; j < records.length; ++j) {
+            ASSERT_EQ(records.items[j].timestamp,
+                      expected[i].items[j].timestamp);
+            ASSERT_FEQ(records.items[j].value, expected[i].items[j].value);
+        }
+        da_free(&records);
+    }
+
+    return 0;
+}
+
+static int shared_wal_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec   = (uint64_t)1e9;
+    ts_opts_t opts = {.flushsize = TS_MIN_FLUSHSIZE};
+    record_array_t expected[4] = {0};
+    timeseries_t *series[4];
+    char name[16], path[PATHBUF_SIZE];
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - 3600) * sec;
+
+    // Small segments, rolled over every few frames
+    tsdb_set_shared_wal(4096);
+    timeseries_db_t *db = tsdb_create("sharedwaldb");
+    tsdb_set_shared_wal(0);
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_TRUE(db->wal_log != NULL, " FAIL: WAL not shared\n");
+
+    for (int i = 0; i < 4; ++i) {
+        snprintf(name, sizeof(name), "series-%d", i);
+        series[i] = ts_create(db, name, opts);
+        ASSERT_TRUE(series[i] != NULL, " FAIL: ts_create failed\n");
+    }
+
+    // Interleaved writes, along with late points
+    for (int j = 0; j < 500; ++j) {
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_EQ(insert_flushing(series[i], base + j * sec,
+                                      (double_t)(j + i)),
+                      0);
+            if (j % 50 == 45)
+                ASSERT_EQ(insert_flushing(series[i],
+                                          base + (j - 6) * sec + sec / 2, -1.0),
+                          0);
+        }
+    }
+
+    // Nothing is logged per chunk, the segments of the chunks flushed are gone
+    for (int i = 0; i < 4; ++i) {
+        wait_flushed(series[i]);
+        ASSERT_EQ(count_files(series[i]->pathbuf, 'w'), 0);
+        ASSERT_EQ(ts_range(series[i], 0, UINT64_MAX, &expected[i]), 0);
+        ASSERT_TRUE(expected[i].length >= 500, " FAIL: points missing\n");
+    }
+
+    wal_log_t *log = db->wal_log;
+    ASSERT_TRUE(log->seq > 4, " FAIL: segments not rolled over\n");
+    ASSERT_TRUE(log->segments.length < log->seq + 1,
+                " FAIL: segments not truncated\n");
+    ASSERT_TRUE(access("logdata/sharedwaldb/.wal/seg-00000000000000000000.log",
+                       F_OK) < 0,
+                " FAIL: first segment left\n");
+    tsdb_close(db);
+
+    // Replayed from the segments, demultiplexed by series
+    db = tsdb_create("sharedwaldb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_TRUE(db->wal_log != NULL, " FAIL: WAL not shared\n");
+    ASSERT_EQ(shared_wal_check(db, expected, 4), 0);
+
+    snprintf(path, sizeof(path), "logdata/sharedwaldb/.wal/seg-%.20" PRIu64
+             ".log", db->wal_log->seq);
+    tsdb_close(db);
+
+    // A torn frame at the end of the last segment is left out
+    FILE *fp = fopen(path, "a");
+    ASSERT_TRUE(fp != NULL, " FAIL: fopen failed\n");
+    fwrite("\x40\x00\x00\x00torn", 1, 8, fp);
+    fclose(fp);
+
+    db = tsdb_create("sharedwaldb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ASSERT_EQ(shared_wal_check(db, expected, 4), 0);
+    tsdb_close(db);
+
+    for (int i = 0; i < 4; ++i)
+        da_free(&expected[i]);
+
+    rm_recursive("logdata/sharedwaldb");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+// Caps the size of the files written to the one of the last partition
+static int limit_files(timeseries_t *ts, struct rlimit *old)
+{
+    struct rlimit limit;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, old), 0);
+
+    pthread_mutex_lock(&ts->lock);
+    limit          = *old;
+    limit.rlim_cur = partition_catalog_last(&ts->partitions)->clog.size;
+    pthread_mutex_unlock(&ts->lock);
+
+    signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+    return 0;
+}
+
+static int flush_retry_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec   = (uint64_t)1e9;
+    ts_opts_t opts = {.flushsize = 1 << 20};
+    struct rlimit old;
+    size_t count = 0;
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - 86400) / 900 * 900 * sec;
+
+    timeseries_db_t *db = tsdb_create("flushretrydb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    timeseries_t *ts = ts_create(db, "series", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    // Chunks are flushed on rotation only, all to the same partition, which
+    // outgrows the WALs of the chunks
+    size_t n = 0;
+    for (; n < 900 * 10; ++n)
+        ASSERT_EQ(insert_flushing(ts, base + n * sec, (double_t)rand()), 0);
+    wait_flushed(ts);
+
+    // No room left for the partition to grow, the sealed chunk stays queued,
+    // served from memory, its WAL kept
+    ASSERT_EQ(limit_files(ts, &old), 0);
+    for (size_t end = n + 900; n < end; ++n)
+        ASSERT_EQ(ts_insert(ts, base + n * sec, (double_t)rand()), 0);
+    usleep(100 * 1000);
+
+    pthread_mutex_lock(&ts->sealed_lock);
+    size_t sealed = ts->sealed_nr;
+    pthread_mutex_unlock(&ts->sealed_lock);
+    ASSERT_TRUE(sealed > 0, " FAIL: failed flush retired\n");
+    ASSERT_EQ(count_files(ts->pathbuf, 'w'), 3);
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, n);
+
+    // Other series, with files small enough, keep being flushed meanwhile
+    timeseries_t *other = ts_create(db, "other", opts);
+    ASSERT_TRUE(other != NULL, " FAIL: ts_create failed\n");
+    for (size_t i = 0; i < 900 * 3; ++i)
+        ASSERT_EQ(insert_flushing(other, base + i * sec, 1.0), 0);
+    wait_flushed(other);
+    ASSERT_EQ(other->partitions.length > 0, 1);
+
+    // Retried once there is room again, each point written once
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &old), 0);
+    wait_flushed(ts);
+    ASSERT_EQ(count_files(ts->pathbuf, 'w'), 2);
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, n);
+
+    // Given up on close, the WALs are replayed at the next start
+    ASSERT_EQ(limit_files(ts, &old), 0);
+    for (size_t end = n + 900; n < end; ++n)
+        ASSERT_EQ(ts_insert(ts, base + n * sec, (double_t)rand()), 0);
+    tsdb_close(db);
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &old), 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    db = tsdb_create("flushretrydb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ts = ts_get(db, "series");
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, n);
+    tsdb_close(db);
+
+    rm_recursive("logdata/flushretrydb");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static int late_flush_test(void)
+{
+    TEST_HEADER;
+
+    uint64_t sec   = (uint64_t)1e9;
+    ts_opts_t opts = {.flushsize = 1 << 20};
+    record_array_t records = {0};
+    record_t r             = {0};
+    size_t count           = 0;
+
+    struct timespec tv = {0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    uint64_t base = (tv.tv_sec - 86400) / 900 * 900 * sec;
+
+    timeseries_db_t *db = tsdb_create("lateflushdb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    timeseries_t *ts = ts_create(db, "series", opts);
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_create failed\n");
+
+    // Three chunks, the first one flushed on rotation
+    for (size_t i = 0; i < 2700; ++i)
+        ASSERT_EQ(insert_flushing(ts, base + i * sec, (double_t)i), 0);
+    wait_flushed(ts);
+    ASSERT_EQ(ts->partitions.length, 1);
+
+    // Sealed along with the second chunk, though older than the blocks of
+    // the first one already in the partition
+    ASSERT_EQ(ts_insert(ts, base + 15 * sec + sec / 2, -1.0), 0);
+    ASSERT_EQ(insert_flushing(ts, base + 2700 * sec, 2700.0), 0);
+    wait_flushed(ts);
+
+    const index_entry_array_t *entries =
+        &partition_catalog_last(&ts->partitions)->index.entries;
+    for (size_t i = 1; i < entries->length; ++i)
+        ASSERT_TRUE(entries->items[i - 1].relative_ts <
+                        entries->items[i].relative_ts,
+                    " FAIL: index out of order\n");
+
+    ASSERT_EQ(ts_find(ts, base + 15 * sec + sec / 2, &r), 0);
+    ASSERT_FEQ(r.value, -1.0);
+    ASSERT_EQ(ts_find(ts, base + 16 * sec, &r), 0);
+    ASSERT_FEQ(r.value, 16.0);
+
+    ASSERT_EQ(ts_range(ts, base + 15 * sec, base + 16 * sec, &records), 0);
+    ASSERT_EQ(records.length, 3);
+    ASSERT_FEQ(records.items[1].value, -1.0);
+    da_free(&records);
+
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, 2702);
+
+    // Same once loaded back
+    tsdb_close(db);
+    db = tsdb_create("lateflushdb");
+    ASSERT_TRUE(db != NULL, " FAIL: tsdb_create failed\n");
+    ASSERT_EQ(tsdb_load(db), 0);
+    ts = ts_get(db, "series");
+    ASSERT_TRUE(ts != NULL, " FAIL: ts_get failed\n");
+    ASSERT_EQ(ts_find(ts, base + 15 * sec + sec / 2, &r), 0);
+    ASSERT_FEQ(r.value, -1.0);
+    ASSERT_EQ(count_ordered(ts, &count), 0);
+    ASSERT_EQ(count, 2702);
+    tsdb_close(db);
+
+    rm_recursive("logdata/lateflushdb");
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
 int timeseries_test(void)
 {
     printf("* %s\n\n", __FUNCTION__);
 
-    int cases   = 14;
+    int cases   = 33;
     int success = cases;
 
     srand(47);
@@ -442,10 +1810,30 @@ int timeseries_test(void)
     success += insert_out_of_order_test(ts);
     success += insert_out_of_bounds_test(ts);
     success += scan_entire_timeseries_out_of_order_test(ts);
+    success += commit_timeseries_test(ts);
+    success += insert_batch_test(db);
+    success += sealed_chunks_test(db);
+    success += out_of_order_buffer_test(db);
+    success += many_partitions_test(db);
+    success += late_partition_test(db);
+    success += retention_test(db);
+    success += compaction_test(db);
+    success += cursor_test(db);
+    success += sample_test(db);
+    success += rollup_test(db);
+    success += rollup_stage_test();
+    success += bounds_test(db);
+    success += registry_test(db);
 
     ts_close(ts);
     tsdb_close(db);
 
+    success += manifest_test();
+    success += recovery_test();
+    success += shared_wal_test();
+    success += flush_retry_test();
+    success += late_flush_test();
+
     rm_recursive(TESTDIR);
 
     printf("\n Test suite summary: %d passed, %d failed\n", success,